@@ -0,0 +1,543 @@
+#include "tracerz.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <unordered_set>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+/** The number of calls to any form of the global operator new since the program started */
+static std::atomic<std::size_t> allocationCount(0);
+
+// Every replaceable form of the global operator new and delete is replaced below, so that each allocation is counted,
+// including the nothrow and aligned forms, and is freed by the function matching the one that allocated it.
+
+/**
+ * Allocates and counts memory with at least the given alignment, or returns nullptr. Over-aligned memory is carved out
+ * of a larger malloc'd block, with the block's address stored just before the memory handed out.
+ */
+static void* countedAllocate(std::size_t size, std::size_t alignment) noexcept {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  if (size == 0) size = 1;
+  if (alignment <= alignof(std::max_align_t)) return std::malloc(size);
+
+  void* block = std::malloc(size + alignment + sizeof(void*));
+  if (block == nullptr) return nullptr;
+  std::uintptr_t start = reinterpret_cast<std::uintptr_t>(block) + sizeof(void*);
+  void* ptr = reinterpret_cast<void*>((start + alignment - 1) & ~(std::uintptr_t(alignment) - 1));
+  static_cast<void**>(ptr)[-1] = block;
+  return ptr;
+}
+
+/**
+ * Frees memory from countedAllocate with the given alignment
+ */
+static void countedFree(void* ptr, std::size_t alignment) noexcept {
+  if (ptr == nullptr) return;
+  std::free(alignment <= alignof(std::max_align_t) ? ptr : static_cast<void**>(ptr)[-1]);
+}
+
+/**
+ * Allocates and counts memory, throwing std::bad_alloc if there is none
+ */
+static void* countedAllocateOrThrow(std::size_t size, std::size_t alignment) {
+  if (void* ptr = countedAllocate(size, alignment)) return ptr;
+  throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size) { return countedAllocateOrThrow(size, 0); }
+
+void* operator new[](std::size_t size) { return countedAllocateOrThrow(size, 0); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return countedAllocate(size, 0); }
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return countedAllocate(size, 0); }
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return countedAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+  return countedAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return countedAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return countedAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept { countedFree(ptr, 0); }
+
+void operator delete[](void* ptr) noexcept { countedFree(ptr, 0); }
+
+void operator delete(void* ptr, std::size_t) noexcept { countedFree(ptr, 0); }
+
+void operator delete[](void* ptr, std::size_t) noexcept { countedFree(ptr, 0); }
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { countedFree(ptr, 0); }
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { countedFree(ptr, 0); }
+
+void operator delete(void* ptr, std::align_val_t alignment) noexcept {
+  countedFree(ptr, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment) noexcept {
+  countedFree(ptr, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t alignment) noexcept {
+  countedFree(ptr, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t alignment) noexcept {
+  countedFree(ptr, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  countedFree(ptr, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  countedFree(ptr, static_cast<std::size_t>(alignment));
+}
+
+/** The minimum time each benchmark is run for, in seconds */
+static double minSeconds = 0.25;
+
+/** Keeps the compiler from optimizing away the results of benchmarked code */
+static std::size_t sink = 0;
+
+/**
+ * Runs the given function repeatedly for at least minSeconds, then prints the time, throughput and allocations per
+ * call
+ *
+ * @tparam F the type of the function
+ * @param name the name of the benchmark
+ * @param unit what one call of the function produces, eg. "op" or "sample"
+ * @param fun the function to benchmark
+ */
+template<typename F>
+void benchmark(const char* name, const char* unit, F fun) {
+  using clock = std::chrono::steady_clock;
+
+  // Warm up caches and any lazily built state
+  fun();
+
+  std::size_t calls = 0;
+  std::size_t batch = 1;
+  std::size_t allocations = allocationCount.load();
+  auto start = clock::now();
+  double elapsed = 0;
+  while (elapsed < minSeconds) {
+    for (std::size_t i = 0; i < batch; i++) fun();
+    calls += batch;
+    batch *= 2;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  }
+  allocations = allocationCount.load() - allocations;
+
+  std::printf("%-48s %12.1f ns/%-6s %12.0f %s/s %10.1f allocs/%s\n",
+              name,
+              elapsed * 1e9 / calls,
+              unit,
+              calls / elapsed,
+              unit,
+              static_cast<double>(allocations) / calls,
+              unit);
+}
+
+/**
+ * Returns the "Complex grammar" grammar used by the tests
+ */
+nlohmann::json complexGrammar() {
+  return {
+    {"name", {"Arjun", "Yuuma", "Darcy", "Mia", "Chiaki", "Izzi", "Azra", "Lina"}},
+    {"animal", {"unicorn", "raven", "sparrow", "scorpion", "coyote", "eagle", "owl", "lizard", "zebra", "duck",
+                "kitten"}},
+    {"occupationBase", {"wizard", "witch", "detective", "ballerina", "criminal", "pirate", "lumberjack", "spy",
+                        "doctor", "scientist", "captain", "priest"}},
+    {"occupationMod", {"occult ", "space ", "professional ", "gentleman ", "erotic ", "time ", "cyber", "paleo",
+                       "techno", "super"}},
+    {"strange", {"mysterious", "portentous", "enchanting", "strange", "eerie"}},
+    {"tale", {"story", "saga", "tale", "legend"}},
+    {"occupation", {"#occupationMod##occupationBase#"}},
+    {"mood", {"vexed", "indignant", "impassioned", "wistful", "astute", "courteous"}},
+    {"setPronouns", {"[heroThey:they][heroThem:them][heroTheir:their][heroTheirs:theirs]",
+                     "[heroThey:she][heroThem:her][heroTheir:her][heroTheirs:hers]",
+                     "[heroThey:he][heroThem:him][heroTheir:his][heroTheirs:his]"}},
+    {"setSailForAdventure", {"set sail for adventure", "left #heroTheir# home", "set out for adventure",
+                             "went to seek #heroTheir# forture"}},
+    {"setCharacter", {"[#setPronouns#][hero:#name#][heroJob:#occupation#]"}},
+    {"openBook", {"An old #occupation# told #hero# a story. 'Listen well' she said to #hero#, 'to this #strange# #tale#. ' #origin#'",
+                  "#hero# went home.",
+                  "#hero# found an ancient book and opened it.  As #hero# read, the book told #strange.a# #tale#: #origin#"}},
+    {"story", {"#hero# the #heroJob# #setSailForAdventure#. #openBook#"}},
+    {"origin", {"Once upon a time, #[#setCharacter#]story#"}}
+  };
+}
+
+/**
+ * Returns a grammar whose origin is a chain of the given number of nested rules
+ */
+nlohmann::json deepGrammar(int depth) {
+  nlohmann::json grammar;
+  for (int i = 0; i < depth; i++) {
+    std::string next = "#rule" + std::to_string(i + 1) + "#";
+    grammar["rule" + std::to_string(i)] = {"a" + next, "b" + next};
+  }
+  grammar["rule" + std::to_string(depth)] = "end";
+  grammar["origin"] = "#rule0#";
+  return grammar;
+}
+
+/**
+ * Returns a grammar whose origin selects from a rule with the given number of alternatives many times
+ */
+nlohmann::json wideGrammar(int width) {
+  nlohmann::json grammar;
+  for (int i = 0; i < width; i++) {
+    grammar["word"].push_back("word" + std::to_string(i));
+  }
+  std::string origin;
+  for (int i = 0; i < 50; i++) origin += "#word.capitalize# ";
+  grammar["origin"] = origin;
+  return grammar;
+}
+
+/**
+ * Returns a grammar whose origin sets, reads and pops many keys
+ */
+nlohmann::json actionGrammar() {
+  nlohmann::json grammar = {
+      {"animal", {"dog", "cat", "owl", "eel", "yak"}},
+      {"set",    "[pet:#animal#][pets:#animal#,#animal#,#animal#]"},
+      {"use",    "#pet# and #pets.s# [#pet.pop!!#][#pets.pop!!#]"}
+  };
+  std::string origin;
+  for (int i = 0; i < 20; i++) origin += "#[#set#]use# ";
+  grammar["origin"] = origin;
+  return grammar;
+}
+
+/**
+ * Benchmarks expanding #origin# of the given grammar into a string, and into a tree which is then flattened
+ */
+void benchmarkGrammar(const char* name, const nlohmann::json& grammar) {
+  tracerz::Grammar<std::mt19937, std::uniform_int_distribution<>> zgr(grammar, std::mt19937(1));
+  zgr.addModifiers(tracerz::getBaseEngModifiers());
+  zgr.addModifiers(tracerz::getBaseExtendedModifiers());
+
+  std::string label = std::string(name) + " generate";
+  std::string output;
+  benchmark(label.c_str(), "sample", [&]() {
+    output.clear();
+    zgr.generate("#origin#", output);
+    sink += output.size();
+  });
+
+  tracerz::Grammar defaultGrammar(grammar, tracerz::Xoshiro256StarStar(1));
+  defaultGrammar.addModifiers(tracerz::getBaseEngModifiers());
+  defaultGrammar.addModifiers(tracerz::getBaseExtendedModifiers());
+  label = std::string(name) + " generate (default RNG)";
+  benchmark(label.c_str(), "sample", [&]() {
+    output.clear();
+    defaultGrammar.generate("#origin#", output);
+    sink += output.size();
+  });
+
+  // Reusing a generator keeps its memory from one sample to the next
+  auto generator = zgr.getGenerator(std::mt19937(1));
+  label = std::string(name) + " reused generator";
+  benchmark(label.c_str(), "sample", [&]() {
+    output.clear();
+    generator.generate("#origin#", output);
+    sink += output.size();
+  });
+
+  // Time to the first byte of a streamed sample, abandoning the rest of the expansion
+  label = std::string(name) + " first streamed chunk";
+  benchmark(label.c_str(), "sample", [&]() {
+    auto stream = generator.stream("#origin#");
+    std::string_view chunk;
+    stream.next(chunk);
+    sink += chunk.size();
+  });
+
+  label = std::string(name) + " tree";
+  benchmark(label.c_str(), "sample", [&]() {
+    auto tree = zgr.getExpandedTree("#origin#");
+    sink += tree->flatten(zgr.getModifierFunctions()).size();
+  });
+
+  // Flattening after every step, as a live preview of the expansion would
+  label = std::string(name) + " flatten each step";
+  benchmark(label.c_str(), "sample", [&]() {
+    auto tree = zgr.getTree("#origin#");
+    while (tree->template expand<std::mt19937, std::uniform_int_distribution<>>(zgr.getModifierFunctions(),
+                                                                                zgr.getRNG())) {
+      sink += tree->flatten(zgr.getModifierFunctions()).size();
+    }
+    sink += tree->flatten(zgr.getModifierFunctions()).size();
+  });
+
+  label = std::string(name) + " flatten each BF step";
+  benchmark(label.c_str(), "sample", [&]() {
+    auto tree = zgr.getTree("#origin#");
+    while (tree->template expandBF<std::mt19937, std::uniform_int_distribution<>>(zgr.getRNG())) {
+      sink += tree->flatten(zgr.getModifierFunctions()).size();
+    }
+  });
+
+  label = std::string(name) + " batch of 1000";
+  benchmark(label.c_str(), "batch", [&]() {
+    sink += zgr.generateBatch("#origin#", 1000, 1).size();
+  });
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) minSeconds = std::atof(argv[1]);
+
+  std::printf("Microbenchmarks\n");
+
+  benchmark("compileNode", "op", []() {
+    auto node = tracerz::details::compileNode("the #hero.capitalize# [pet:#animal#] met #animal.a# #[k:v]story#");
+    sink += node->children.size();
+  });
+
+  {
+    // Compiling a grammar declared as constant data, which needs no json, from the same rules as the json grammar
+    static constexpr std::string_view animals[] = {"dog", "cat", "owl", "eel", "yak"};
+    static constexpr std::string_view names[] = {"Arjun", "Yuuma", "Darcy", "Mia"};
+    static constexpr tracerz::StaticRule rules[] = {
+        {"animal", animals}, {"name", names}, {"origin", "#[hero:#name#]story#"}, {"story", "#hero# met #animal.a#"}
+    };
+    static_assert(tracerz::checkStaticGrammar(rules), "the static grammar is valid");
+    nlohmann::json grammar = {
+        {"animal", {"dog", "cat", "owl", "eel", "yak"}}, {"name", {"Arjun", "Yuuma", "Darcy", "Mia"}},
+        {"origin", "#[hero:#name#]story#"}, {"story", "#hero# met #animal.a#"}
+    };
+    benchmark("CompiledGrammar (small json)", "op", [&]() {
+      tracerz::CompiledGrammar compiled(grammar);
+      sink += compiled.getDivergingRules().size();
+    });
+    benchmark("CompiledGrammar (small static)", "op", [&]() {
+      tracerz::CompiledGrammar compiled{tracerz::StaticGrammarSource(rules)};
+      sink += compiled.getDivergingRules().size();
+    });
+  }
+
+  {
+    // Compiling includes analyzing the rules and the sizes of their expansions
+    nlohmann::json grammar = complexGrammar();
+    benchmark("CompiledGrammar (complex)", "op", [&]() {
+      tracerz::CompiledGrammar compiled(grammar);
+      sink += compiled.getDivergingRules().size();
+    });
+    std::string binary = tracerz::CompiledGrammar(grammar).toBinary();
+    benchmark("CompiledGrammar::fromBinary (complex)", "op", [&]() {
+      sink += tracerz::CompiledGrammar::fromBinary(binary.data(), binary.size()).getDivergingRules().size();
+    });
+    tracerz::CompiledGrammar compiled(grammar);
+    benchmark("CompiledGrammar::estimateSize", "op", [&]() {
+      sink += compiled.estimateSize("#origin# #story#").maxBytes;
+    });
+  }
+
+  {
+    tracerz::Grammar<std::mt19937, std::uniform_int_distribution<>> zgr(complexGrammar(), std::mt19937(1));
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    auto tree = zgr.getExpandedTree("#origin#");
+    benchmark("TreeNode::flatten", "op", [&]() {
+      sink += tree->flatten(zgr.getModifierFunctions()).size();
+    });
+  }
+
+  {
+    const auto& mods = tracerz::getBaseEngModifiers();
+    auto a = tracerz::details::parseModifier("a");
+    auto replace = tracerz::details::parseModifier("replace(a,o)");
+    auto replaceLiteral = tracerz::details::parseModifier("replaceLiteral(a,o)");
+    const std::string input = "albatross";
+    benchmark("modifier dispatch a", "op", [&]() {
+      sink += mods.get(a.id)->callVec(input, a.params).size();
+    });
+    benchmark("modifier dispatch replace(a,o)", "op", [&]() {
+      sink += mods.get(replace.id)->callVec(input, replace.params).size();
+    });
+    benchmark("modifier dispatch replaceLiteral(a,o)", "op", [&]() {
+      sink += mods.get(replaceLiteral.id)->callVec(input, replaceLiteral.params).size();
+    });
+
+    // A long generated paragraph, modified with a copy and in place
+    auto capitalizeAll = tracerz::details::parseModifier("capitalizeAll");
+    auto s = tracerz::details::parseModifier("s");
+    std::string paragraph;
+    while (paragraph.size() < 4096) paragraph += "the albatross, who was 42 years old, ate a fish-finger. ";
+    std::string buffer;
+    benchmark("capitalizeAll 4KiB copy", "op", [&]() {
+      sink += mods.get(capitalizeAll.id)->callVec(paragraph, capitalizeAll.params).size();
+    });
+    benchmark("capitalizeAll.s 4KiB in place", "op", [&]() {
+      buffer = paragraph;
+      mods.get(capitalizeAll.id)->callInPlace(buffer, capitalizeAll.params);
+      mods.get(s.id)->callInPlace(buffer, s.params);
+      sink += buffer.size();
+    });
+  }
+
+  {
+    nlohmann::json grammar = {
+        {"animal", {"albatross", "fox", "pony", "moth", "eel"}},
+        {"sentence", "the #animal# and the #animal# went out to look for #animal.a# at the edge of the sea"},
+        {"paragraph", "#sentence# #sentence# #sentence# #sentence# #sentence# #sentence# #sentence# #sentence#"},
+        {"origin", "#paragraph.capitalizeAll.s# #paragraph.capitalize.ed#"}
+    };
+    tracerz::Grammar<std::mt19937, std::uniform_int_distribution<>> zgr(grammar, std::mt19937(1));
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    benchmark("flatten chained modifiers", "op", [&]() {
+      sink += zgr.flatten("#origin#").size();
+    });
+  }
+
+  {
+    // Picking an alternative of a rule, with the distribution given the range of each pick as tracerz does
+    std::mt19937 mt(1);
+    tracerz::details::IndexPicker<std::mt19937, std::uniform_int_distribution<>> mtPicker;
+    benchmark("pick std::mt19937", "op", [&]() {
+      sink += mtPicker(mt, 11);
+    });
+    tracerz::Xoshiro256StarStar xoshiro(1);
+    tracerz::details::IndexPicker<tracerz::Xoshiro256StarStar, tracerz::BoundedIntDistribution<>> xoshiroPicker;
+    benchmark("pick Xoshiro256StarStar", "op", [&]() {
+      sink += xoshiroPicker(xoshiro, 11);
+    });
+    benchmark("copy std::mt19937", "op", [&]() {
+      std::mt19937 copy = mt;
+      sink += copy();
+    });
+    benchmark("copy Xoshiro256StarStar", "op", [&]() {
+      tracerz::Xoshiro256StarStar copy = xoshiro;
+      sink += copy();
+    });
+  }
+
+  {
+    tracerz::details::runtime_dictionary_t runtimeDictionary;
+    const std::size_t key = tracerz::details::internRuleName("key");
+    benchmark("runtime dictionary push/pop", "op", [&]() {
+      runtimeDictionary.push(key, "value");
+      runtimeDictionary.push(key, "value");
+      runtimeDictionary.pop(key);
+      runtimeDictionary.pop(key);
+      runtimeDictionary.clear();
+    });
+  }
+
+  {
+    // Expanding variations of a story after a common setup, from scratch or from a fork of the expanded setup
+    tracerz::Grammar zgr(complexGrammar(), tracerz::Xoshiro256StarStar(1));
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    typedef tracerz::Xoshiro256StarStar rng_t;
+    typedef tracerz::BoundedIntDistribution<> dist_t;
+    const auto& mods = zgr.getModifierFunctions();
+    const std::string input = "#[#setCharacter#]openBook# #[#setCharacter#]openBook#";
+    auto expandSetup = [&](const std::shared_ptr<tracerz::Tree>& tree, rng_t& rng) {
+      while (!tree->getRuntimeDictionary().contains("heroJob")) tree->template expand<rng_t, dist_t>(mods, rng);
+    };
+    std::uint64_t seed = 0;
+    benchmark("variation from scratch", "sample", [&]() {
+      rng_t rng(1);
+      auto tree = zgr.getTree(input);
+      expandSetup(tree, rng);
+      rng.seed(++seed);
+      while (tree->template expand<rng_t, dist_t>(mods, rng));
+      sink += tree->flatten(mods).size();
+    });
+    rng_t setupRng(1);
+    auto setup = zgr.getTree(input);
+    expandSetup(setup, setupRng);
+    benchmark("variation from fork", "sample", [&]() {
+      auto tree = setup->fork();
+      rng_t rng(++seed);
+      while (tree->template expand<rng_t, dist_t>(mods, rng));
+      sink += tree->flatten(mods).size();
+    });
+  }
+
+  {
+    // Drawing distinct samples from an output space of 10000, deduplicating the output strings or the picks
+    tracerz::Grammar zgr(wideGrammar(100), tracerz::Xoshiro256StarStar(1));
+    const std::string input = "#word# and #word#";
+    benchmark("1000 unique by output", "batch", [&]() {
+      std::unordered_set<std::string> seen;
+      while (seen.size() < 1000) seen.insert(zgr.flatten(input));
+      sink += seen.size();
+    });
+    benchmark("generateUnique 1000", "batch", [&]() {
+      sink += zgr.generateUnique(input, 1000).size();
+    });
+    auto enumerator = zgr.getEnumerator(input);
+    std::uint64_t index = 0;
+    std::string output;
+    benchmark("Enumerator::generate", "sample", [&]() {
+      output.clear();
+      enumerator.generate(index++ % enumerator.size(), output);
+      sink += output.size();
+    });
+  }
+
+  {
+    // Expanding a huge tree level by level, one leaf at a time or a level at a time on every hardware thread
+    tracerz::Grammar zgr(complexGrammar(), tracerz::Xoshiro256StarStar(1));
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    typedef tracerz::Xoshiro256StarStar rng_t;
+    typedef tracerz::BoundedIntDistribution<> dist_t;
+    const auto& mods = zgr.getModifierFunctions();
+    std::string input;
+    for (int i = 0; i < 1000; i++) input += "#origin# ";
+    auto tree = zgr.getTree(input);
+    rng_t rng(1);
+    benchmark("huge tree BF", "tree", [&]() {
+      tree->reset(input);
+      while (tree->template expandBF<rng_t, dist_t>(rng));
+      sink += tree->flatten(mods).size();
+    });
+    benchmark("huge tree BF parallel", "tree", [&]() {
+      tree->reset(input);
+      while (tree->template expandBFParallel<rng_t, dist_t>(rng));
+      sink += tree->flatten(mods).size();
+    });
+  }
+
+  std::printf("\nMacrobenchmarks\n");
+  benchmarkGrammar("complex", complexGrammar());
+  benchmarkGrammar("deep (depth 200)", deepGrammar(200));
+  benchmarkGrammar("wide (10000 alternatives)", wideGrammar(10000));
+  benchmarkGrammar("actions", actionGrammar());
+
+#if defined(__unix__) || defined(__APPLE__)
+  struct rusage usage {};
+  getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+  // Reported in bytes on macOS
+  long peakKilobytes = usage.ru_maxrss / 1024;
+#else
+  // Reported in kilobytes on Linux
+  long peakKilobytes = usage.ru_maxrss;
+#endif
+  std::printf("\nPeak RSS: %ld KiB\n", peakKilobytes);
+#endif
+
+  return sink == 0 ? 1 : 0;
+}
@@ -4,6 +4,8 @@
 
 #include "catch.hpp"
 
+#include <thread>
+
 /**
  * Test class satisfying UniformRandomBitGenerator. Returns the value
  * it was constructed with
@@ -23,11 +25,11 @@ public:
       , flippy(t.flippy) {
   }
 
-  static result_type min() {
+  static constexpr result_type min() {
     return MIN;
   }
 
-  static result_type max() {
+  static constexpr result_type max() {
     return MAX;
   }
 
@@ -73,11 +75,1696 @@ TEST_CASE("Tree", "[tracerz]") {
   while (tree->template expand<decltype(zgr)::rng_t, decltype(zgr)::uniform_distribution_t>(zgr.getModifierFunctions(),
                                                                                             zgr.getRNG()));
   REQUIRE("abc" + tree->flatten(zgr.getModifierFunctions()) == "abcoutput");
+  // Test flattening into an existing string
+  std::string output = "abc";
+  tree->getRoot()->flattenInto(output, zgr.getModifierFunctions(), tree);
+  REQUIRE(output == "abcoutput");
+
+  SECTION("Trees share the grammar") {
+    // Trees refer to the grammar's compiled grammar rather than copying it
+    auto compiled = zgr.getCompiledGrammar();
+    long uses = compiled.use_count();
+    auto other = zgr.getExpandedTree("#rule#");
+    REQUIRE(other->getCompiledGrammar() == compiled);
+    REQUIRE(tree->getCompiledGrammar() == compiled);
+    REQUIRE(compiled.use_count() == uses + 1);
+    REQUIRE(compiled->getRule("rule") == other->getCompiledGrammar()->getRule("rule"));
+  }
 }
 
 TEST_CASE("TreeNode", "[tracerz]") {
   tracerz::Grammar zgr("{}"_json);
   REQUIRE(zgr.getTree("blah")->getRoot()->getLastExpandableChild() == nullptr);
+
+  SECTION("Child bookkeeping") {
+    auto tree = zgr.getTree("#rule#");
+    auto root = tree->getRoot();
+    root->addChild("text");
+    REQUIRE(root->areChildrenComplete());
+    REQUIRE(root->getLastExpandableChild() == nullptr);
+
+    root->addChild("#first#");
+    root->addChild("more text");
+    root->addChild("#second#");
+    root->addChild("the end");
+    REQUIRE_FALSE(root->areChildrenComplete());
+    REQUIRE(root->getLastExpandableChild()->getInput() == "#second#");
+
+    // The unexpanded leaves are linked in order
+    auto first = tree->getFirstUnexpandedLeaf();
+    REQUIRE(first->getInput() == "#first#");
+    REQUIRE(first->getNextUnexpandedLeaf()->getInput() == "#second#");
+    REQUIRE(first->getNextUnexpandedLeaf()->getNextUnexpandedLeaf() == nullptr);
+  }
+
+  SECTION("Wide nodes") {
+    nlohmann::json wide = {{"word", "w"}};
+    std::string origin;
+    for (int i = 0; i < 2000; i++) origin += "#word#.";
+    wide["origin"] = origin;
+    tracerz::Grammar wideZgr(wide);
+    std::string expected;
+    for (int i = 0; i < 2000; i++) expected += "w.";
+    REQUIRE(wideZgr.getExpandedTree("#origin#")->flatten(wideZgr.getModifierFunctions()) == expected);
+  }
+}
+
+TEST_CASE("Compiled grammar", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"text",   "output"},
+      {"list",   {"one", "#text.capitalize.replace(a,b)#"}},
+      {"action", "#[key:#text#][key2:a,b]list#"}
+  };
+  tracerz::CompiledGrammar compiled(grammar);
+  REQUIRE(compiled.getRule("missing") == nullptr);
+
+  auto text = compiled.getRule("text");
+  REQUIRE(!text->isList);
+  REQUIRE(text->alternatives.size() == 1);
+  REQUIRE(text->alternatives[0]->isComplete());
+
+  auto list = compiled.getRule("list");
+  REQUIRE(list->isList);
+  REQUIRE(list->alternatives.size() == 2);
+  auto rule = list->alternatives[1];
+  REQUIRE(rule->type == tracerz::details::NodeType::Rule);
+  REQUIRE(rule->name == "text");
+  REQUIRE(rule->modifiers.size() == 2);
+  REQUIRE(rule->modifiers[0].name == "capitalize");
+  REQUIRE(rule->modifiers[1].name == "replace");
+  REQUIRE(rule->modifiers[1].params == std::vector<std::string>{"a", "b"});
+
+  auto action = compiled.getRule("action")->alternatives[0];
+  REQUIRE(action->type == tracerz::details::NodeType::RuleWithActions);
+  REQUIRE(action->children.size() == 2);
+  auto actions = action->children[0];
+  REQUIRE(actions->type == tracerz::details::NodeType::Actions);
+  REQUIRE(actions->children[0]->type == tracerz::details::NodeType::KeyWithRuleAction);
+  REQUIRE(actions->children[0]->name == "key");
+  REQUIRE(actions->children[1]->type == tracerz::details::NodeType::KeyWithTextAction);
+  REQUIRE(actions->children[1]->values == std::vector<std::string>{"a", "b"});
+  REQUIRE(action->children[1]->type == tracerz::details::NodeType::Rule);
+  REQUIRE(action->children[1]->name == "list");
+
+  // Compiled nodes refer to rules by their interned names, also in copies of the grammar
+  REQUIRE(compiled.getRule(rule->nameId) == text);
+  REQUIRE(compiled.getRule(tracerz::details::internRuleName("missing")) == nullptr);
+  REQUIRE(compiled.getRule(tracerz::details::internRuleName("")) == nullptr);
+  tracerz::CompiledGrammar copy = compiled;
+  REQUIRE(copy.getRule(rule->nameId) == copy.getRule("text"));
+  REQUIRE(copy.getRule(rule->nameId) != text);
+
+  SECTION("Deterministic rules") {
+    nlohmann::json rules = {
+        {"text",      "output"},
+        {"greeting",  "hello #text.capitalize# #missing#"},
+        {"list",      {"one"}},
+        {"usesList",  "#list#"},
+        {"action",    "[key:value]#text#"},
+        {"cycle",     "#cycle#"},
+        {"usesCycle", "#text# #cycle#"}
+    };
+    tracerz::CompiledGrammar deterministic(rules);
+    REQUIRE(deterministic.getRule("text")->isDeterministic);
+    REQUIRE(deterministic.getRule("greeting")->isDeterministic);
+    REQUIRE(deterministic.getRule("greeting")->reachableRules == std::set<std::string>{"greeting", "missing", "text"});
+    REQUIRE_FALSE(deterministic.getRule("list")->isDeterministic);
+    REQUIRE_FALSE(deterministic.getRule("usesList")->isDeterministic);
+    REQUIRE_FALSE(deterministic.getRule("action")->isDeterministic);
+    REQUIRE_FALSE(deterministic.getRule("cycle")->isDeterministic);
+    REQUIRE_FALSE(deterministic.getRule("usesCycle")->isDeterministic);
+  }
+}
+
+/**
+ * Returns true if the two compiled nodes, and all of their compiled children, are identical
+ */
+bool compiledNodesEqual(const tracerz::details::CompiledNode& a, const tracerz::details::CompiledNode& b) {
+  if (a.type != b.type || a.input != b.input || a.name != b.name || a.values != b.values) return false;
+  if (a.modifiers.size() != b.modifiers.size() || a.children.size() != b.children.size()) return false;
+  for (std::size_t i = 0; i < a.modifiers.size(); i++) {
+    if (a.modifiers[i].name != b.modifiers[i].name || a.modifiers[i].params != b.modifiers[i].params) return false;
+  }
+  for (std::size_t i = 0; i < a.children.size(); i++) {
+    if (!compiledNodesEqual(*a.children[i], *b.children[i])) return false;
+  }
+  return true;
+}
+
+TEST_CASE("Scanner", "[tracerz]") {
+  std::vector<std::string> inputs = {
+      "", "plain text", "#rule#", "#rule.s.replace(a,b)#", "#rule.eris()#", "#rule.f(a,)#", "#rule.f(,a)#",
+      "#[key:value]rule.a#", "#[a]b.c]d#", "#[key:#other#][k2:a,b]rule#", "[#rule.pop!!#]", "[key:#rule.s#]",
+      "[key:a,b,,c,]", "[k1:a][k2:#b#][#c#]", "[nokey]", "a #b [c:d] #e#f #.g# ## [] [k:v]#x#",
+      "#[\n#[k:v]a#", "#rule.a.#", "#a..b#", "[k:#a#]]", "#[x:#y#]z.w(1.2,3)# and #q#"
+  };
+  for (auto& input : inputs) {
+    INFO(input);
+    REQUIRE(compiledNodesEqual(*tracerz::details::compileNode(input, true),
+                               *tracerz::details::compileNode(input, false)));
+  }
+
+  REQUIRE(tracerz::details::splitCommas("").size() == 1);
+  REQUIRE(tracerz::details::splitCommas("a,b,") == std::vector<std::string>{"a", "b"});
+  REQUIRE(tracerz::details::splitCommas(",a") == std::vector<std::string>{"", "a"});
+}
+
+TEST_CASE("Node storage", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"animal", {"dog", "cat", "owl"}},
+      {"origin", "#[pet:#animal#]story#"},
+      {"story",  "the #pet# met #animal.a# and the #pet# left"}
+  };
+  tracerz::Grammar heapGrammar(grammar, std::mt19937(42));
+  tracerz::Grammar arenaGrammar(grammar, std::mt19937(42));
+  arenaGrammar.setNodeStorage(tracerz::NodeStorage::Arena);
+  heapGrammar.addModifiers(tracerz::getBaseEngModifiers());
+  arenaGrammar.addModifiers(tracerz::getBaseEngModifiers());
+  for (int i = 0; i < 10; i++) {
+    REQUIRE(arenaGrammar.flatten("#origin#") == heapGrammar.flatten("#origin#"));
+  }
+
+  SECTION("Deep trees are destroyed without recursion") {
+    for (auto storage : {tracerz::NodeStorage::Heap, tracerz::NodeStorage::Arena}) {
+      arenaGrammar.setNodeStorage(storage);
+      auto tree = arenaGrammar.getTree("#animal#");
+      auto node = tree->getRoot();
+      for (int i = 0; i < 200000; i++) {
+        node->addChild("x#animal#");
+        node = node->getLastExpandableChild();
+      }
+      node.reset();
+      tree.reset();
+    }
+
+    // Sub-trees kept after their tree is destroyed are released without recursion too
+    arenaGrammar.setNodeStorage(tracerz::NodeStorage::Heap);
+    auto tree = arenaGrammar.getTree("#animal#");
+    auto top = tree->getRoot();
+    auto node = top;
+    for (int i = 0; i < 200000; i++) {
+      node->addChild("x#animal#");
+      node = node->getLastExpandableChild();
+    }
+    node.reset();
+    tree.reset();
+    top.reset();
+  }
+
+  SECTION("Deep trees are flattened without recursion") {
+    nlohmann::json chain = {
+        {"deep", {{"options", {"#deep.capitalize#", "end"}}, {"weights", {1, 0}}}}
+    };
+    tracerz::Grammar deepGrammar(chain);
+    deepGrammar.addModifiers(tracerz::getBaseEngModifiers());
+    tracerz::ExpansionLimits limits;
+    limits.maxDepth = 100000;
+    limits.policy = tracerz::LimitPolicy::Shortest;
+    deepGrammar.setExpansionLimits(limits);
+    for (auto storage : {tracerz::NodeStorage::Heap, tracerz::NodeStorage::Arena}) {
+      deepGrammar.setNodeStorage(storage);
+      REQUIRE(deepGrammar.getExpandedTree("#deep#")->flatten(deepGrammar.getModifierFunctions()) == "End");
+    }
+    REQUIRE(deepGrammar.flatten("#deep#") == "End");
+  }
+
+  SECTION("Reset trees match new trees") {
+    for (auto storage : {tracerz::NodeStorage::Heap, tracerz::NodeStorage::Arena}) {
+      arenaGrammar.setNodeStorage(storage);
+      auto tree = arenaGrammar.getTree("#origin#");
+      for (int i = 0; i < 10; i++) {
+        // Partly expanded trees can be reset too
+        for (int j = 0; j < i; j++) {
+          tree->template expand<decltype(arenaGrammar)::rng_t, decltype(arenaGrammar)::uniform_distribution_t>(
+              arenaGrammar.getModifierFunctions(), arenaGrammar.getRNG());
+        }
+        tree->reset("#origin#");
+        REQUIRE(tree->getFirstUnexpandedLeaf() == tree->getRoot());
+        REQUIRE(tree->getRuntimeDictionary().empty());
+        arenaGrammar.getRNG().seed(i);
+        heapGrammar.getRNG().seed(i);
+        while (tree->template expand<decltype(arenaGrammar)::rng_t, decltype(arenaGrammar)::uniform_distribution_t>(
+            arenaGrammar.getModifierFunctions(), arenaGrammar.getRNG()));
+        std::string expected = heapGrammar.flatten("#origin#");
+        REQUIRE(tree->flatten(arenaGrammar.getModifierFunctions()) == expected);
+      }
+      tree->reset("plain text");
+      REQUIRE(tree->getFirstUnexpandedLeaf() == nullptr);
+      REQUIRE(tree->flatten(arenaGrammar.getModifierFunctions()) == "plain text");
+    }
+  }
+
+  SECTION("Nodes outlive the tree that allocated them") {
+    for (auto storage : {tracerz::NodeStorage::Heap, tracerz::NodeStorage::Arena}) {
+      arenaGrammar.setNodeStorage(storage);
+      auto tree = arenaGrammar.getExpandedTree("#origin#");
+      auto root = tree->getRoot();
+      std::string output = tree->flatten(arenaGrammar.getModifierFunctions());
+
+      // Nodes held across a reset keep their memory, and the tree expands into new nodes
+      tree->reset("#origin#");
+      while (tree->template expand<decltype(arenaGrammar)::rng_t, decltype(arenaGrammar)::uniform_distribution_t>(
+          arenaGrammar.getModifierFunctions(), arenaGrammar.getRNG()));
+      REQUIRE(root->getInput() == "#origin#");
+      REQUIRE(root->flatten(arenaGrammar.getModifierFunctions(), nullptr) == output);
+
+      // And after the tree is destroyed
+      auto resetRoot = tree->getRoot();
+      std::string resetOutput = tree->flatten(arenaGrammar.getModifierFunctions());
+      tree.reset();
+      REQUIRE(root->flatten(arenaGrammar.getModifierFunctions(), nullptr) == output);
+      REQUIRE(resetRoot->getInput() == "#origin#");
+      REQUIRE(resetRoot->flatten(arenaGrammar.getModifierFunctions(), nullptr) == resetOutput);
+    }
+  }
+}
+
+TEST_CASE("Streaming generation", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"animal",      {"dog", "cat", "owl"}},
+      {"setPronouns", {"[they:they][their:their]", "[they:she][their:her]"}},
+      {"origin",      "#[#setPronouns#][pet:#animal#]story#"},
+      {"story",       "#they# met #animal.a#, and #their# #pet.s# left [#pet#] [k:v]"},
+      {"popPet",      "[pet:dog]#pet# #[pet:#animal#]pet# [#pet.pop!!#]#pet#"}
+  };
+
+  // Builds a tree for the given input with the given seed, and flattens it
+  auto flattenTree = [&grammar](const std::string& input, unsigned seed) {
+    tracerz::Grammar zgr(grammar, std::mt19937(seed));
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    zgr.addModifiers(tracerz::getBaseExtendedModifiers());
+    auto tree = zgr.getExpandedTree(input);
+    return tree->flatten(zgr.getModifierFunctions());
+  };
+
+  for (unsigned seed = 0; seed < 20; seed++) {
+    // Tree modifiers cannot be reached from #origin#, so it is expanded without a tree. #popPet# needs one for pop!!
+    for (std::string input : {"#origin#", "#popPet#"}) {
+      tracerz::Grammar zgr(grammar, std::mt19937(seed));
+      zgr.addModifiers(tracerz::getBaseEngModifiers());
+      zgr.addModifiers(tracerz::getBaseExtendedModifiers());
+      REQUIRE(zgr.generate(input) == flattenTree(input, seed));
+    }
+  }
+
+  SECTION("Output is appended to the sink") {
+    struct CountingSink {
+      std::string output;
+      int appends = 0;
+      void append(std::string_view str) {
+        this->output.append(str);
+        this->appends++;
+      }
+    };
+
+    tracerz::Grammar zgr(grammar, std::mt19937(3));
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    CountingSink sink;
+    zgr.generate("#origin#", sink);
+    REQUIRE(sink.output == flattenTree("#origin#", 3));
+    REQUIRE(sink.appends > 1);
+
+    std::string buffer = "> ";
+    zgr.generate("#animal.capitalize#", buffer);
+    REQUIRE((buffer == "> Dog" || buffer == "> Cat" || buffer == "> Owl"));
+  }
+
+  SECTION("Output can be pulled chunk by chunk") {
+    tracerz::Grammar zgr(grammar, std::mt19937(0));
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    zgr.addModifiers(tracerz::getBaseExtendedModifiers());
+    for (unsigned seed = 0; seed < 20; seed++) {
+      for (std::string input : {"#origin#", "#popPet#"}) {
+        auto generator = zgr.getGenerator(std::mt19937(seed));
+        auto streamed = zgr.getGenerator(std::mt19937(seed));
+        std::string output;
+        int chunks = 0;
+        for (std::string_view chunk : streamed.stream(input)) {
+          REQUIRE(!chunk.empty());
+          output.append(chunk);
+          chunks++;
+        }
+        REQUIRE(output == generator.generate(input));
+
+        // Trees are flattened at once, so #popPet# is a single chunk
+        if (input == "#popPet#") {
+          REQUIRE(chunks == 1);
+        } else {
+          REQUIRE(chunks > 1);
+        }
+      }
+    }
+
+    // The prefix is output before the rules after it are expanded, the output of modified rules once it is modified
+    auto generator = zgr.getGenerator(std::mt19937(1));
+    auto stream = generator.stream("> #animal.capitalize# and #origin#");
+    std::string_view chunk;
+    REQUIRE(stream.next(chunk));
+    REQUIRE(chunk == "> ");
+    REQUIRE(stream.next(chunk));
+    REQUIRE((chunk == "Dog" || chunk == "Cat" || chunk == "Owl"));
+    REQUIRE(stream.next(chunk));
+    REQUIRE(chunk == " and ");
+    REQUIRE(!stream.isFinished());
+
+    // Abandoning a stream leaves the generator ready for the next expansion
+    auto other = zgr.getGenerator(generator.getRNG());
+    REQUIRE(generator.generate("#origin#") == other.generate("#origin#"));
+  }
+
+  SECTION("Deterministic rules are memoized") {
+    nlohmann::json fixed = {
+        {"name",   "bob"},
+        {"animal", {"dog", "cat", "owl"}},
+        {"greet",  "hi #name.count#"},
+        {"origin", "#greet# #greet.capitalize# #[name:#animal#]greet# #greet#"}
+    };
+
+    tracerz::Grammar zgr(fixed, std::mt19937(5));
+    int calls = 0;
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    zgr.addModifier("count", std::function<std::string(std::string)>([&calls](std::string str) {
+      calls++;
+      return str;
+    }));
+
+    auto generator = zgr.getGenerator(std::mt19937(5));
+    for (int i = 0; i < 10; i++) {
+      // A runtime definition of a rule reached from greet replaces its memoized output
+      std::string output = generator.generate("#origin#");
+      std::string animal = output.substr(output.size() - 3);
+      REQUIRE(output == "hi bob Hi bob hi " + animal + " hi " + animal);
+    }
+
+    // The expansion of name with count is memoized the first time, only the shadowed expansions call it again
+    REQUIRE(calls == 21);
+  }
+
+  SECTION("Grammars keep their expander between samples") {
+    nlohmann::json fixed = {
+        {"name",   "bob"},
+        {"greet",  "hi #name.count#"}
+    };
+
+    tracerz::Grammar zgr(fixed, std::mt19937(5));
+    int calls = 0;
+    zgr.addModifier("count", std::function<std::string(std::string)>([&calls](std::string str) {
+      calls++;
+      return str;
+    }));
+    for (int i = 0; i < 5; i++) REQUIRE(zgr.flatten("#greet#") == "hi bob");
+    REQUIRE(calls == 1);
+
+    // Changing the modifiers, directly or through the modifier map, starts over with a new expander
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    REQUIRE(zgr.flatten("#greet.capitalize#") == "Hi bob");
+    REQUIRE(calls == 2);
+    zgr.getModifierFunctions()["count"] = tracerz::details::makeStringModifier([](const std::string& str) {
+      return str + "!";
+    });
+    REQUIRE(zgr.flatten("#greet#") == "hi bob!");
+
+    // A copy of a grammar uses its own modifiers and random number generator, also once the original is gone
+    auto copy = std::make_unique<decltype(zgr)>(zgr);
+    auto moved = std::move(zgr);
+    copy->addModifier("count", std::function<std::string(std::string)>([](std::string str) { return str + "?"; }));
+    REQUIRE(copy->flatten("#greet#") == "hi bob?");
+    REQUIRE(moved.flatten("#greet#") == "hi bob!");
+    copy.reset();
+    REQUIRE(moved.flatten("#greet#") == "hi bob!");
+  }
+}
+
+TEST_CASE("Shared grammar", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"animal", {"dog", "cat", "owl", "eel"}},
+      {"mood",   {"glum", "merry", "sly"}},
+      {"origin", {"#[pet:#animal#]story#", "#mood.capitalize# #animal.s#"}},
+      {"story",  "the #mood# #pet# met #animal.a# [#pet.pop!!#]and left"}
+  };
+  tracerz::Grammar zgr(grammar);
+  zgr.addModifiers(tracerz::getBaseEngModifiers());
+  zgr.addModifiers(tracerz::getBaseExtendedModifiers());
+  auto core = zgr.share();
+
+  // Expand with one generator per seed, one after another
+  const int numThreads = 4;
+  std::vector<std::vector<std::string>> expected(numThreads);
+  for (int i = 0; i < numThreads; i++) {
+    tracerz::Generator<> generator(core, tracerz::Xoshiro256StarStar(i));
+    for (int j = 0; j < 50; j++) expected[i].push_back(generator.generate("#origin#"));
+  }
+
+  // Then with the same seeds, on separate threads at once
+  std::vector<std::vector<std::string>> actual(numThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < numThreads; i++) {
+    threads.emplace_back([&core, &actual, i]() {
+      tracerz::Generator<> generator(core, tracerz::Xoshiro256StarStar(i));
+      for (int j = 0; j < 50; j++) actual[i].push_back(generator.generate("#origin#"));
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  REQUIRE(actual == expected);
+
+  // A generator produces the same output as a grammar with the same seed
+  tracerz::Grammar seeded(grammar, tracerz::Xoshiro256StarStar(2));
+  seeded.addModifiers(tracerz::getBaseEngModifiers());
+  seeded.addModifiers(tracerz::getBaseExtendedModifiers());
+  for (int j = 0; j < 50; j++) {
+    REQUIRE(seeded.flatten("#origin#") == expected[2][j]);
+  }
+  auto generator = zgr.getGenerator(tracerz::Xoshiro256StarStar(1));
+  REQUIRE(generator.generate("#origin#") == expected[1][0]);
+
+  // Modifiers added after sharing do not affect the shared core
+  std::function<std::string(const std::string&)> eris = [](const std::string&) { return "hail eris"; };
+  zgr.addModifier("eris", eris);
+  REQUIRE(zgr.flatten("#animal.eris#") == "hail eris");
+  REQUIRE(core->getModifierFunctions().find("eris") == core->getModifierFunctions().end());
+}
+
+TEST_CASE("Batch generation", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"animal", {"dog", "cat", "owl", "eel", "yak"}},
+      {"mood",   {"glum", "merry", "sly"}},
+      {"origin", {"#[pet:#animal#]story#", "#mood.capitalize# #animal.s#"}},
+      {"story",  "the #mood# #pet# met #animal.a#"}
+  };
+  tracerz::Grammar zgr(grammar);
+  zgr.addModifiers(tracerz::getBaseEngModifiers());
+
+  // The output is the same for any number of threads
+  auto samples = zgr.generateBatch("#origin#", 500, 1234, 1);
+  REQUIRE(samples.size() == 500);
+  REQUIRE(zgr.generateBatch("#origin#", 500, 1234, 4) == samples);
+  REQUIRE(zgr.generateBatch("#origin#", 500, 1234) == samples);
+  REQUIRE(zgr.generateBatch("#origin#", 500, 4321, 4) != samples);
+
+  // Each block of samples is expanded in order with its own random number generator
+  auto core = zgr.share();
+  for (std::size_t block : {0, 2, 7}) {
+    tracerz::Generator<> generator(core, tracerz::details::makeBatchRNG<tracerz::Xoshiro256StarStar>(1234, block));
+    std::size_t end = std::min<std::size_t>(500, (block + 1) * tracerz::details::batchBlockSize);
+    for (std::size_t i = block * tracerz::details::batchBlockSize; i < end; i++) {
+      REQUIRE(generator.generate("#origin#") == samples[i]);
+    }
+  }
+
+  // Samples can be written to an existing range
+  std::vector<std::string> range(10, "stale");
+  zgr.generateBatch("#origin#", range.begin(), range.end(), 1234, 3);
+  REQUIRE(std::equal(range.begin(), range.end(), samples.begin()));
+  REQUIRE(zgr.generateBatch("#origin#", 0, 1234).empty());
+
+  // Random number generators that cannot be seeded from a seed sequence are seeded from an integer
+  REQUIRE(tracerz::details::makeBatchRNG<TestRNG<0, 4>>(3, 0)() == 3);
+}
+
+TEST_CASE("Weighted rules", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"weighted", {{"options", {"a", "b", "c"}}, {"weights", {1, 0, 3}}}},
+      {"uniform",  {{"options", {"x", "y"}}}},
+      {"origin",   "#weighted##uniform#"}
+  };
+
+  SECTION("Alternatives are selected by weight") {
+    tracerz::Grammar zgr(grammar, std::mt19937(7));
+    std::map<std::string, int> counts;
+    for (int i = 0; i < 4000; i++) counts[zgr.generate("#weighted#")]++;
+    REQUIRE(counts["b"] == 0);
+    REQUIRE(counts["a"] + counts["c"] == 4000);
+    REQUIRE(counts["a"] > 800);
+    REQUIRE(counts["a"] < 1200);
+  }
+
+  SECTION("Options without weights are equally likely") {
+    tracerz::CompiledGrammar compiled(grammar);
+    auto rule = compiled.getRule("uniform");
+    REQUIRE(rule->isList);
+    REQUIRE(rule->weights.empty());
+    REQUIRE(rule->alternatives.size() == 2);
+  }
+
+  SECTION("Streaming and trees select the same alternatives") {
+    for (unsigned seed = 0; seed < 20; seed++) {
+      tracerz::Grammar zgr(grammar, std::mt19937(seed));
+      tracerz::Grammar tgr(grammar, std::mt19937(seed));
+      REQUIRE(zgr.generate("#origin# #origin#") ==
+              tgr.getExpandedTree("#origin# #origin#")->flatten(tgr.getModifierFunctions()));
+    }
+  }
+
+  SECTION("Alias table") {
+    tracerz::details::AliasTable table(std::vector<double>{1, 3});
+    REQUIRE(table.select(0) == 0);
+    REQUIRE(table.select(table.range() - 1) == 1);
+
+    // Sample draws evenly across the whole range
+    std::size_t first = 0;
+    for (std::size_t i = 0; i < 1000; i++) {
+      if (table.select(i * (table.range() / 1000)) == 0) first++;
+    }
+    REQUIRE(first >= 249);
+    REQUIRE(first <= 251);
+  }
+
+  SECTION("Invalid weights") {
+    nlohmann::json mismatched = {{"rule", {{"options", {"a", "b"}}, {"weights", {1}}}}};
+    REQUIRE_THROWS_AS(tracerz::CompiledGrammar(mismatched), std::invalid_argument);
+    nlohmann::json zero = {{"rule", {{"options", {"a", "b"}}, {"weights", {0, 0}}}}};
+    REQUIRE_THROWS_AS(tracerz::CompiledGrammar(zero), std::invalid_argument);
+    nlohmann::json negative = {{"rule", {{"options", {"a", "b"}}, {"weights", {2, -1}}}}};
+    REQUIRE_THROWS_AS(tracerz::CompiledGrammar(negative), std::invalid_argument);
+  }
+}
+
+/**
+ * Grammar source defining every rule as a list
+ */
+struct ListGrammarSource {
+  std::map<std::string, std::vector<std::string>> rules;
+
+  template<typename Visitor>
+  void forEachRule(Visitor&& visitor) const {
+    for (auto& [name, options] : this->rules) {
+      tracerz::RuleDefinition definition;
+      definition.options = options;
+      definition.isList = true;
+      visitor(name, definition);
+    }
+  }
+};
+
+TEST_CASE("Grammar sources", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"animal",   {"dog", "cat", "owl"}},
+      {"weighted", {{"options", {"a", "b"}}, {"weights", {1, 3}}}},
+      {"fixed",    "the #animal.capitalize# [#animal#]"},
+      {"greeting", "hello #name.s#"},
+      {"name",     "bob"},
+      {"origin",   "#[pet:#animal#][kind:x,y]fixed# #pet.a# #weighted# #kind# #greeting.capitalize#"}
+  };
+
+  SECTION("Custom grammar source") {
+    ListGrammarSource source;
+    source.rules["origin"] = {"#pet#"};
+    source.rules["pet"] = {"dog"};
+    auto compiled = std::make_shared<const tracerz::CompiledGrammar>(source);
+    REQUIRE(compiled->getRule("pet")->isList);
+
+    tracerz::Grammar zgr(compiled, std::mt19937(1));
+    REQUIRE(zgr.generate("#origin#") == "dog");
+    REQUIRE(zgr.getCompiledGrammar() == compiled);
+  }
+
+  SECTION("Binary grammars") {
+    tracerz::CompiledGrammar compiled(grammar);
+    std::string binary = compiled.toBinary();
+    auto loaded = std::make_shared<const tracerz::CompiledGrammar>(
+        tracerz::CompiledGrammar::fromBinary(binary.data(), binary.size()));
+
+    // Loading and saving again writes the same bytes
+    REQUIRE(loaded->toBinary() == binary);
+    REQUIRE(loaded->getRule("greeting")->isDeterministic);
+    REQUIRE(loaded->getModifierNames() == compiled.getModifierNames());
+
+    auto fixed = loaded->getRule("fixed")->alternatives[0];
+    REQUIRE(compiledNodesEqual(*fixed, *compiled.getRule("fixed")->alternatives[0]));
+    REQUIRE(fixed->children[1]->nameId == tracerz::details::internRuleName("animal"));
+    REQUIRE(fixed->children[1]->modifiers[0].id == tracerz::details::internModifierName("capitalize"));
+
+    for (unsigned seed = 0; seed < 20; seed++) {
+      tracerz::Grammar fromJson(grammar, std::mt19937(seed));
+      fromJson.addModifiers(tracerz::getBaseEngModifiers());
+      tracerz::Grammar fromBinary(loaded, std::mt19937(seed));
+      fromBinary.addModifiers(tracerz::getBaseEngModifiers());
+      REQUIRE(fromBinary.generate("#origin#") == fromJson.generate("#origin#"));
+    }
+  }
+
+  SECTION("Invalid binary grammars") {
+    std::string binary = tracerz::CompiledGrammar(grammar).toBinary();
+    REQUIRE_THROWS_AS(tracerz::CompiledGrammar::fromBinary(binary.data(), 0), std::invalid_argument);
+    REQUIRE_THROWS_AS(tracerz::CompiledGrammar::fromBinary(binary.data(), binary.size() - 1), std::invalid_argument);
+
+    std::string badMagic = binary;
+    badMagic[0] = 'X';
+    REQUIRE_THROWS_AS(tracerz::CompiledGrammar::fromBinary(badMagic.data(), badMagic.size()), std::invalid_argument);
+
+    // A huge string count must not overflow the layout
+    std::string badCount = binary;
+    std::uint32_t count = 0xffffffff;
+    std::memcpy(&badCount[2 * sizeof(std::uint32_t)], &count, sizeof(count));
+    REQUIRE_THROWS_AS(tracerz::CompiledGrammar::fromBinary(badCount.data(), badCount.size()), std::invalid_argument);
+  }
+}
+
+TEST_CASE("Runtime dictionary", "[tracerz]") {
+  tracerz::details::RuntimeDictionary dictionary;
+  std::size_t key = tracerz::details::internRuleName("key");
+  REQUIRE(dictionary.empty());
+  REQUIRE(dictionary.top(key) == nullptr);
+
+  dictionary.push(key, "one");
+  dictionary.pushList(key, {"a", "#b#"});
+  REQUIRE(dictionary.contains("key"));
+  REQUIRE_FALSE(dictionary.empty());
+
+  auto list = dictionary.top(key);
+  REQUIRE(list->isList);
+  REQUIRE(list->count == 2);
+  REQUIRE(dictionary.getValue(list->first) == "a");
+  REQUIRE(dictionary.getCompiledValue(list->first + 1)->type == tracerz::details::NodeType::Rule);
+
+  dictionary.pop("key");
+  REQUIRE_FALSE(dictionary.top(key)->isList);
+  REQUIRE(dictionary.getValue(dictionary.top(key)->first) == "one");
+  dictionary.pop(key);
+  REQUIRE(dictionary.empty());
+  dictionary.pop(key);
+
+  dictionary.push("other", "two");
+  dictionary.clear();
+  REQUIRE(dictionary.empty());
+  REQUIRE_FALSE(dictionary.contains("other"));
+
+  // Names that are only looked up aren't interned
+  dictionary.pop("unknownRule");
+  REQUIRE_FALSE(dictionary.contains("unknownRule"));
+  REQUIRE(tracerz::details::getRuleNames().find("unknownRule") == tracerz::details::NameTable::npos);
+
+  SECTION("Forks share rule stacks until they change them") {
+    std::size_t other = tracerz::details::internRuleName("other");
+    dictionary.push(key, "one");
+    dictionary.pushList(other, {"x", "#y#"});
+    auto forked = dictionary.fork();
+    REQUIRE(forked.getValue(forked.top(key)->first) == "one");
+    REQUIRE(forked.getCompiledValue(forked.top(other)->first + 1)->type == tracerz::details::NodeType::Rule);
+
+    // Changes to either dictionary don't show in the other
+    forked.pop(key);
+    forked.push(other, "two");
+    REQUIRE_FALSE(forked.contains(key));
+    REQUIRE(forked.getValue(forked.top(other)->first) == "two");
+    REQUIRE(dictionary.getValue(dictionary.top(key)->first) == "one");
+    REQUIRE(dictionary.top(other)->isList);
+    dictionary.push(key, "three");
+    REQUIRE(dictionary.getValue(dictionary.top(key)->first) == "three");
+    REQUIRE_FALSE(forked.contains(key));
+
+    // Forks of forks see the changes made before they were forked
+    auto again = forked.fork();
+    REQUIRE(again.getValue(again.top(other)->first) == "two");
+    again.pop(other);
+    REQUIRE(again.getValue(again.top(other)->first) == "x");
+    REQUIRE(forked.getValue(forked.top(other)->first) == "two");
+
+    forked.clear();
+    REQUIRE(forked.empty());
+    REQUIRE_FALSE(forked.contains(other));
+    REQUIRE(again.contains(other));
+  }
+
+  SECTION("Ids are kept sparsely") {
+    tracerz::details::IdMap<std::vector<int>> map;
+    REQUIRE(map.find(0) == nullptr);
+    for (std::size_t i = 0; i < 1000; i++) map[i << 20].push_back(static_cast<int>(i));
+    REQUIRE(map.size() == 1000);
+    for (std::size_t i = 0; i < 1000; i++) REQUIRE(map.find(i << 20)->front() == static_cast<int>(i));
+    REQUIRE(map.find(1) == nullptr);
+    REQUIRE(map.find(tracerz::details::IdMap<std::vector<int>>::npos) == nullptr);
+
+    // Stacks with ids far beyond the other rules are found too
+    std::size_t far = std::size_t(1) << 40;
+    dictionary.push(far, "far");
+    REQUIRE(dictionary.getValue(dictionary.top(far)->first) == "far");
+    auto forked = dictionary.fork();
+    REQUIRE(forked.getValue(forked.top(far)->first) == "far");
+  }
+
+  SECTION("Tree modifiers can define rules") {
+    tracerz::Grammar zgr(R"({"key": "cat", "origin": "#[#key.set!!#]key# #key.a#"})"_json);
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    zgr.addModifier("set!!", std::function<std::string(const std::shared_ptr<tracerz::Tree>&, const std::string&)>(
+        [](const std::shared_ptr<tracerz::Tree>& tree, const std::string& ruleName) {
+          tree->getRuntimeDictionary().push(ruleName, "owl");
+          return "";
+        }));
+    REQUIRE(zgr.generate("#origin#") == "owl an owl");
+  }
+}
+
+TEST_CASE("Expansion limits", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"tree",   {"#tree##tree#", "x"}},
+      {"deep",   "a#deep#"},
+      {"text",   "abcdef #end#"},
+      {"end",    "ghi"},
+      {"twice",  "#end##end#"},
+      {"thrice", "#twice# #twice# #twice#"},
+      {"origin", "#[pet:#end#]tree# [k:dog,cat]#k# #pet#"}
+  };
+  tracerz::Grammar zgr(grammar, std::mt19937(7));
+  zgr.addModifiers(tracerz::getBaseEngModifiers());
+  auto treeFlatten = [&](const std::string& input) {
+    return zgr.getExpandedTree(input)->flatten(zgr.getModifierFunctions());
+  };
+
+  // Rules that can only recurse have no shortest alternative
+  REQUIRE(zgr.getCompiledGrammar()->getRule("tree")->height == 1);
+  REQUIRE(zgr.getCompiledGrammar()->getRule("tree")->shortestAlternative == 1);
+  REQUIRE(zgr.getCompiledGrammar()->getRule("deep")->height == std::numeric_limits<std::size_t>::max());
+  REQUIRE(zgr.getCompiledGrammar()->getRule("thrice")->height == 3);
+
+  tracerz::ExpansionLimits limits;
+  SECTION("Depth") {
+    limits.maxDepth = 5;
+    for (auto policy : {tracerz::LimitPolicy::Truncate, tracerz::LimitPolicy::Shortest}) {
+      limits.policy = policy;
+      zgr.setExpansionLimits(limits);
+      REQUIRE(zgr.flatten("#deep#") == "aaaaa");
+      REQUIRE(treeFlatten("#deep#") == "aaaaa");
+    }
+
+    limits.policy = tracerz::LimitPolicy::Error;
+    zgr.setExpansionLimits(limits);
+    REQUIRE_THROWS_AS(zgr.flatten("#deep#"), std::length_error);
+    REQUIRE_THROWS_AS(treeFlatten("#deep#"), std::length_error);
+    REQUIRE(zgr.flatten("#thrice#") == "ghighi ghighi ghighi");
+  }
+
+  SECTION("Nodes") {
+    limits.maxNodes = 50;
+    limits.policy = tracerz::LimitPolicy::Shortest;
+    zgr.setExpansionLimits(limits);
+    for (int i = 0; i < 100; i++) {
+      std::string output = zgr.flatten("#tree#");
+      REQUIRE(output.find_first_not_of('x') == std::string::npos);
+      REQUIRE(output.size() <= 51);
+    }
+
+    // A memoized rule is only used if it fits in the budget
+    limits.maxNodes = 6;
+    limits.policy = tracerz::LimitPolicy::Truncate;
+    zgr.setExpansionLimits(limits);
+    REQUIRE(zgr.flatten("#thrice# #thrice#") == "ghighi ghi  ");
+    REQUIRE(treeFlatten("#thrice# #thrice#") == "ghighi ghi  ");
+
+    limits.policy = tracerz::LimitPolicy::Error;
+    zgr.setExpansionLimits(limits);
+    REQUIRE_THROWS_AS(zgr.flatten("#thrice# #thrice#"), std::length_error);
+  }
+
+  SECTION("Output bytes") {
+    limits.maxOutputBytes = 4;
+    zgr.setExpansionLimits(limits);
+    REQUIRE(zgr.flatten("#text#") == "abcd");
+    REQUIRE(treeFlatten("#text#") == "abcd");
+
+    limits.policy = tracerz::LimitPolicy::Shortest;
+    zgr.setExpansionLimits(limits);
+    REQUIRE(zgr.flatten("#text#") == "abcdef ghi");
+
+    limits.policy = tracerz::LimitPolicy::Error;
+    zgr.setExpansionLimits(limits);
+    REQUIRE_THROWS_AS(zgr.flatten("#text#"), std::length_error);
+    REQUIRE(zgr.flatten("#end#") == "ghi");
+  }
+
+  SECTION("Streaming and trees reach the same limits") {
+    limits.maxDepth = 6;
+    limits.maxNodes = 40;
+    limits.maxOutputBytes = 30;
+    for (auto policy : {tracerz::LimitPolicy::Truncate, tracerz::LimitPolicy::Shortest}) {
+      limits.policy = policy;
+      zgr.setExpansionLimits(limits);
+      for (int seed = 0; seed < 50; seed++) {
+        zgr.getRNG().seed(seed);
+        std::string streamed = zgr.flatten("#origin# #origin#");
+        zgr.getRNG().seed(seed);
+        REQUIRE(treeFlatten("#origin# #origin#") == streamed);
+      }
+    }
+  }
+
+  SECTION("Generators and reset trees start with a new budget") {
+    limits.maxDepth = 3;
+    zgr.setExpansionLimits(limits);
+    auto generator = zgr.getGenerator(std::mt19937(1));
+    REQUIRE(generator.generate("#deep#") == "aaa");
+    REQUIRE(generator.generate("#deep#") == "aaa");
+
+    auto tree = zgr.getTree("#deep#");
+    REQUIRE(tree->getExpansionLimits().maxDepth == 3);
+    for (int i = 0; i < 2; i++) {
+      tree->reset("#deep#");
+      while (tree->template expand<decltype(zgr)::rng_t, decltype(zgr)::uniform_distribution_t>(
+          zgr.getModifierFunctions(), zgr.getRNG()));
+      REQUIRE(tree->flatten(zgr.getModifierFunctions()) == "aaa");
+    }
+  }
+}
+
+TEST_CASE("Incremental flatten", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"animal", {"dog", "cat", "owl"}},
+      {"word",   {"a", "b"}},
+      {"origin", "#[pet:#animal#]story# #word.count# #word.count.capitalize#"},
+      {"story",  "the #pet# met #animal.a# and the #pet.capitalize# left"}
+  };
+  nlohmann::json words = {{"word", {"a", "b"}}};
+  typedef tracerz::Grammar<>::rng_t rng_t;
+  typedef tracerz::Grammar<>::uniform_distribution_t dist_t;
+  std::size_t calls = 0;
+  std::function<std::string(const std::string&)> count = [&calls](const std::string& input) {
+    calls++;
+    return input;
+  };
+
+  SECTION("Flattening after each step matches flattening from scratch") {
+    for (bool breadthFirst : {false, true}) {
+      for (int seed = 0; seed < 20; seed++) {
+        tracerz::Grammar zgr(grammar);
+        zgr.addModifiers(tracerz::getBaseEngModifiers());
+        zgr.addModifier("count", count);
+        const auto& mods = zgr.getModifierFunctions();
+        std::mt19937 rng(seed);
+        std::mt19937 sameRng(seed);
+        auto tree = zgr.getTree("#origin#");
+        auto fresh = zgr.getTree("#origin#");
+        bool expanding = true;
+        while (expanding) {
+          if (breadthFirst) {
+            expanding = tree->expandBF<std::mt19937, dist_t>(rng);
+            fresh->expandBF<std::mt19937, dist_t>(sameRng);
+          } else {
+            expanding = tree->expand<std::mt19937, dist_t>(mods, rng);
+            fresh->expand<std::mt19937, dist_t>(mods, sameRng);
+          }
+
+          // Flattening a node of the fresh tree doesn't keep any output
+          REQUIRE(tree->flatten(mods) == fresh->getRoot()->flatten(mods, fresh));
+        }
+      }
+    }
+  }
+
+  SECTION("Only changed nodes are flattened again") {
+    tracerz::Grammar zgr(words);
+    zgr.addModifier("count", count);
+    auto tree = zgr.getTree("#word.count# #word.count# #word.count#");
+    std::string output;
+    while (tree->expand<rng_t, dist_t>(zgr.getModifierFunctions(), zgr.getRNG())) {
+      output = tree->flatten(zgr.getModifierFunctions());
+    }
+    output = tree->flatten(zgr.getModifierFunctions());
+    REQUIRE(output.size() == 5);
+    REQUIRE(calls == 3);
+
+    // Changing the modifiers flattens the tree again
+    std::function<std::string(const std::string&)> shout = [](const std::string& input) { return input + "!"; };
+    zgr.addModifier("count", shout);
+    REQUIRE(tree->flatten(zgr.getModifierFunctions()) == output.substr(0, 1) + "! " + output.substr(2, 1) + "! " +
+                                                         output.substr(4, 1) + "!");
+  }
+
+  SECTION("Only setting a modifier changes the revision") {
+    tracerz::details::ModifierTable mods;
+    mods["count"] = tracerz::details::makeStringModifier(count);
+    std::size_t revision = mods.getRevision();
+
+    // Reading doesn't add the modifier or change the revision
+    REQUIRE(mods["missing"].get() == nullptr);
+    REQUIRE(mods["count"]->callVec("a", {}) == "a");
+    REQUIRE(mods.find("count") != mods.end());
+    REQUIRE(mods.find("unknownModifier") == mods.end());
+    for (auto iter = mods.begin(); iter != mods.end(); ++iter) REQUIRE(iter->first == "count");
+    REQUIRE(mods.size() == 1);
+    REQUIRE(mods.getRevision() == revision);
+
+    // Names that are only looked up aren't interned
+    REQUIRE(tracerz::details::getModifierNames().find("unknownModifier") == tracerz::details::NameTable::npos);
+
+    mods["count"] = tracerz::details::makeStringModifier(count);
+    REQUIRE(mods.getRevision() != revision);
+    REQUIRE(mods.size() == 1);
+  }
+
+  SECTION("Output of tree node modifiers is not kept") {
+    tracerz::Grammar zgr(words);
+    std::function<std::string(const std::shared_ptr<tracerz::TreeNode>&, const std::string&)> countNode = [&calls](
+        const std::shared_ptr<tracerz::TreeNode>&, const std::string& rule) {
+      calls++;
+      return rule;
+    };
+    zgr.addModifier("countNode!", countNode);
+    auto tree = zgr.getTree("#word.countNode!# #word#");
+    while (tree->expand<rng_t, dist_t>(zgr.getModifierFunctions(), zgr.getRNG())) {
+      tree->flatten(zgr.getModifierFunctions());
+    }
+    std::size_t before = calls;
+    REQUIRE(tree->flatten(zgr.getModifierFunctions()).substr(0, 5) == "word ");
+    REQUIRE(calls == before + 1);
+  }
+}
+
+TEST_CASE("Regex cache", "[tracerz]") {
+  tracerz::details::RegexCache cache(2);
+  auto a = cache.get("a+");
+  REQUIRE(std::regex_match("aaa", *a));
+  REQUIRE(cache.get("a+") == a);
+
+  // The least recently used pattern is dropped once the cache is full
+  auto b = cache.get("b+");
+  REQUIRE(cache.get("a+") == a);
+  cache.get("c+");
+  REQUIRE(cache.size() == 2);
+  REQUIRE(cache.get("a+") == a);
+  REQUIRE(cache.get("b+") != b);
+  REQUIRE(std::regex_match("bb", *b));
+
+  REQUIRE_THROWS_AS(cache.get("("), std::regex_error);
+  REQUIRE(cache.size() == 2);
+
+  SECTION("Grammars precompile the patterns of replace modifiers") {
+    nlohmann::json grammar = {
+        {"origin", "#word.replace(precompiled pattern,x)# #word.replace((,x)#"},
+        {"word",   "precompiled pattern"}
+    };
+    std::size_t before = tracerz::details::getRegexCache().size();
+    tracerz::Grammar zgr(grammar);
+    REQUIRE(tracerz::details::getRegexCache().size() == before + 1);
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    REQUIRE(zgr.flatten("#word.replace(precompiled pattern,x)#") == "x");
+    REQUIRE(tracerz::details::getRegexCache().size() == before + 1);
+    REQUIRE_THROWS_AS(zgr.flatten("#origin#"), std::regex_error);
+  }
+}
+
+TEST_CASE("Instrumentation", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"animal", {"dog", "cat", "owl"}},
+      {"origin", "#[pet:#animal#]story#"},
+      {"story",  "the #pet.capitalize# met #animal.a#"},
+      {"popPet", "[#pet.pop!!#]"}
+  };
+  tracerz::Grammar<std::mt19937, std::uniform_int_distribution<>, tracerz::Profiler> zgr(grammar, std::mt19937(3));
+  zgr.addModifiers(tracerz::getBaseEngModifiers());
+  zgr.addModifiers(tracerz::getBaseExtendedModifiers());
+  REQUIRE(std::is_same_v<tracerz::Grammar<>::instrumentation_t, tracerz::NoInstrumentation>);
+
+  SECTION("Streaming") {
+    std::size_t bytes = 0;
+    for (int i = 0; i < 10; i++) bytes += zgr.generate("#origin#").size();
+    const tracerz::Profiler& profiler = zgr.getInstrumentation();
+    REQUIRE(profiler.getSamples() == 10);
+    REQUIRE(profiler.getBytes() == bytes);
+    REQUIRE(profiler.getRules().at("origin").calls == 10);
+    REQUIRE(profiler.getRules().at("animal").calls == 20);
+    REQUIRE(profiler.getRules().at("story").calls == 10);
+    REQUIRE(profiler.getRules().at("pet").calls == 10);
+    REQUIRE(profiler.getModifiers().at("capitalize").calls == 10);
+    REQUIRE(profiler.getModifiers().at("a").calls == 10);
+    REQUIRE(profiler.getPushes() == 10);
+    REQUIRE(profiler.getPops() == 0);
+
+    std::size_t samples = 0;
+    for (auto& [bucket, count] : profiler.getNodeHistogram()) samples += count;
+    REQUIRE(samples == 10);
+
+    std::string report = profiler.report();
+    REQUIRE(report.find("samples: 10") != std::string::npos);
+    REQUIRE(report.find("animal") != std::string::npos);
+    REQUIRE(report.find("capitalize") != std::string::npos);
+
+    zgr.getInstrumentation().reset();
+    REQUIRE(zgr.getInstrumentation().getSamples() == 0);
+    REQUIRE(zgr.getInstrumentation().getRules().empty());
+  }
+
+  SECTION("Trees") {
+    // pop!! is a tree modifier, so these samples are expanded into trees
+    std::size_t bytes = 0;
+    for (int i = 0; i < 10; i++) bytes += zgr.generate("#origin##popPet#").size();
+    const tracerz::Profiler& profiler = zgr.getInstrumentation();
+    REQUIRE(profiler.getSamples() == 10);
+    REQUIRE(profiler.getBytes() == bytes);
+    REQUIRE(profiler.getRules().at("origin").calls == 10);
+    REQUIRE(profiler.getRules().at("animal").calls == 20);
+    REQUIRE(profiler.getRules().at("pet").calls == 20);
+    REQUIRE(profiler.getRules().at("popPet").calls == 10);
+    REQUIRE(profiler.getModifiers().at("a").calls == 10);
+    REQUIRE(profiler.getModifiers().count("pop!!") == 1);
+    REQUIRE(profiler.getPushes() == 10);
+    REQUIRE(profiler.getPops() == 10);
+    REQUIRE(profiler.getNodes() > 10 * profiler.getRules().size());
+  }
+}
+
+TEST_CASE("Default random number generator", "[tracerz]") {
+  typedef tracerz::Xoshiro256StarStar rng_t;
+  REQUIRE(std::is_same_v<tracerz::Grammar<>::rng_t, rng_t>);
+  REQUIRE(std::is_same_v<tracerz::Grammar<>::uniform_distribution_t, tracerz::BoundedIntDistribution<>>);
+  REQUIRE(rng_t::min() == 0);
+  REQUIRE(rng_t::max() == std::numeric_limits<std::uint64_t>::max());
+
+  SECTION("Xoshiro256StarStar") {
+    // Checked against the reference implementation seeded with splitmix64, and the jumps against the transition matrix
+    rng_t rng(42);
+    REQUIRE(rng() == 1546998764402558742ull);
+    REQUIRE(rng() == 6990951692964543102ull);
+    REQUIRE(rng() == 12544586762248559009ull);
+    rng_t jumped(42);
+    jumped.jump();
+    REQUIRE(jumped() == 5766981335298035530ull);
+    rng_t longJumped(42);
+    longJumped.longJump();
+    REQUIRE(longJumped() == 11575600654643926073ull);
+
+    // Reseeding starts the sequence again
+    rng.seed(42);
+    REQUIRE(rng() == 1546998764402558742ull);
+    rng_t skipped(42);
+    skipped.discard(3);
+    rng.discard(2);
+    REQUIRE(skipped == rng);
+
+    // Splitting returns the generator as it was, and jumps it past the returned stream
+    rng_t original(7);
+    rng_t split = original;
+    REQUIRE(split.split() == original);
+    original.jump();
+    REQUIRE(split == original);
+    REQUIRE(split != rng_t(7));
+  }
+
+  SECTION("BoundedIntDistribution") {
+    rng_t rng(1);
+    std::mt19937 mt(1);
+    std::minstd_rand minstd(1);
+    auto check = [](auto& urbg, auto a, auto b) {
+      tracerz::BoundedIntDistribution<decltype(a)> dist(a, b);
+      for (int i = 0; i < 1000; i++) {
+        auto value = dist(urbg);
+        REQUIRE(value >= a);
+        REQUIRE(value <= b);
+      }
+    };
+    check(rng, 0, 0);
+    check(rng, -5, 5);
+    check(rng, std::numeric_limits<int>::min(), std::numeric_limits<int>::max());
+    check(rng, std::uint64_t(10), std::numeric_limits<std::uint64_t>::max() - 10);
+    check(mt, -5, 5);
+    check(mt, std::int64_t(0), std::int64_t(1) << 40);
+    check(minstd, 3, 9);
+
+    // Every index of a small range is about as likely
+    for (std::size_t size : {3, 6, 7}) {
+      tracerz::BoundedIntDistribution<> dist;
+      std::vector<int> counts(size);
+      const int draws = 7000;
+      for (int i = 0; i < draws; i++) {
+        counts[dist(rng, tracerz::BoundedIntDistribution<>::param_type(0, static_cast<int>(size) - 1))]++;
+      }
+      for (int count : counts) {
+        REQUIRE(count > 0.8 * draws / size);
+        REQUIRE(count < 1.2 * draws / size);
+      }
+    }
+
+    tracerz::BoundedIntDistribution<> dist(2, 4);
+    REQUIRE(dist.a() == 2);
+    REQUIRE(dist.b() == 4);
+    REQUIRE(dist.param() == tracerz::BoundedIntDistribution<>::param_type(2, 4));
+    REQUIRE(dist != tracerz::BoundedIntDistribution<>(2, 5));
+  }
+
+  SECTION("Seeds and streams") {
+    // Grammars created at the same time are seeded differently
+    tracerz::Grammar first;
+    tracerz::Grammar second;
+    REQUIRE(first.getRNG() != second.getRNG());
+
+    // Generators split off a grammar draw from consecutive streams
+    rng_t expected = first.getRNG();
+    auto generator = first.getGenerator();
+    REQUIRE(generator.getRNG() == expected);
+    expected.jump();
+    REQUIRE(first.getRNG() == expected);
+    REQUIRE(first.getGenerator().getRNG() == expected);
+
+    // The generator of each block of a batch is jumped once per block
+    rng_t block = tracerz::details::makeBatchRNG<rng_t>(1234, 0);
+    REQUIRE(block == rng_t(1234));
+    tracerz::details::advanceBatchRNG(block, 1234, 0, 3);
+    REQUIRE(block == tracerz::details::makeBatchRNG<rng_t>(1234, 3));
+    block.jump();
+    REQUIRE(block == tracerz::details::makeBatchRNG<rng_t>(1234, 4));
+  }
+}
+
+TEST_CASE("Forking trees", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"name",   {"Arjun", "Yuuma", "Darcy", "Mia"}},
+      {"animal", {"dog", "cat", "owl", "eel", "yak"}},
+      {"mood",   {"glum", "merry", "sly"}},
+      {"setup",  "[hero:#name#][pet:#animal#][friend:#name#]"},
+      {"popPet", "[#pet.pop!!#]"},
+      {"seen",   "#pet.a#"},
+      {"story",  {"#hero# met #pet.a# and #friend#. #popPet##pet.capitalize# left",
+                  "#mood.capitalize#, #hero# and the #pet# saw #[pet:#animal#]seen#",
+                  "#hero.capitalize# and #hero# #[hero:#name#]story#"}},
+      {"origin", "#[#setup#]story# #friend#"}
+  };
+  typedef tracerz::Grammar<>::rng_t rng_t;
+  typedef tracerz::Grammar<>::uniform_distribution_t dist_t;
+
+  SECTION("A fork expands like the tree it was forked from") {
+    for (auto storage : {tracerz::NodeStorage::Heap, tracerz::NodeStorage::Arena}) {
+      for (bool breadthFirst : {false, true}) {
+        for (std::uint64_t seed = 0; seed < 10; seed++) {
+          tracerz::Grammar zgr(grammar);
+          zgr.addModifiers(tracerz::getBaseEngModifiers());
+          zgr.addModifiers(tracerz::getBaseExtendedModifiers());
+          zgr.setNodeStorage(storage);
+          const auto& mods = zgr.getModifierFunctions();
+          auto expand = [&](const std::shared_ptr<tracerz::Tree>& tree, rng_t& rng) {
+            return breadthFirst ? tree->expandBF<rng_t, dist_t>(rng) : tree->expand<rng_t, dist_t>(mods, rng);
+          };
+
+          // Expand from scratch for the expected output
+          rng_t rng(seed);
+          auto expected = zgr.getTree("#origin#");
+          std::size_t steps = 0;
+          while (expand(expected, rng)) steps++;
+
+          // Fork after each step, and finish expanding both the tree and the fork with the same draws
+          for (std::size_t forkAt = 0; forkAt <= steps; forkAt += 3) {
+            rng_t treeRng(seed);
+            auto tree = zgr.getTree("#origin#");
+            for (std::size_t step = 0; step < forkAt; step++) expand(tree, treeRng);
+            tree->flatten(mods);
+            auto forked = tree->fork();
+            rng_t forkRng = treeRng;
+            while (expand(forked, forkRng));
+            while (expand(tree, treeRng));
+            REQUIRE(forked->flatten(mods) == expected->flatten(mods));
+            REQUIRE(tree->flatten(mods) == expected->flatten(mods));
+          }
+        }
+      }
+    }
+  }
+
+  tracerz::Grammar zgr(grammar);
+  zgr.addModifiers(tracerz::getBaseEngModifiers());
+  zgr.addModifiers(tracerz::getBaseExtendedModifiers());
+  const auto& mods = zgr.getModifierFunctions();
+
+  // Expand the setup of the story, then fork it
+  auto setUp = [&]() {
+    rng_t rng(3);
+    auto tree = zgr.getTree("#origin#");
+    while (!tree->getRuntimeDictionary().contains("friend")) tree->expand<rng_t, dist_t>(mods, rng);
+    return tree;
+  };
+
+  SECTION("Forks share fully expanded sub-trees") {
+    auto tree = setUp();
+    auto forked = tree->fork();
+    REQUIRE(forked->getRoot() != tree->getRoot());
+    REQUIRE_FALSE(forked->getRoot()->isNodeShared());
+    REQUIRE(tree->getFirstLeaf()->getInput() == tree->getRuntimeDictionary().getValue(
+        tree->getRuntimeDictionary().top(tracerz::details::internRuleName("hero"))->first));
+    REQUIRE(tree->getFirstLeaf()->isNodeShared());
+    REQUIRE(forked->getFirstUnexpandedLeaf() != tree->getFirstUnexpandedLeaf());
+    REQUIRE(forked->getFirstUnexpandedLeaf()->getInput() == tree->getFirstUnexpandedLeaf()->getInput());
+
+    // Each fork draws its own variation of the story, with the same characters
+    std::set<std::string> stories;
+    for (std::uint64_t seed = 0; seed < 20; seed++) {
+      auto variation = tree->fork();
+      rng_t rng(seed);
+      while (variation->expand<rng_t, dist_t>(mods, rng));
+      std::string story = variation->flatten(mods);
+      REQUIRE(story.substr(story.rfind(' ') + 1) == tree->getRuntimeDictionary().getValue(
+          tree->getRuntimeDictionary().top(tracerz::details::internRuleName("friend"))->first));
+      stories.insert(story);
+    }
+    REQUIRE(stories.size() > 1);
+
+    // A fully expanded tree is shared whole
+    rng_t rng(1);
+    while (tree->expand<rng_t, dist_t>(mods, rng));
+    auto done = tree->fork();
+    REQUIRE(done->getRoot() == tree->getRoot());
+    REQUIRE(done->flatten(mods) == tree->flatten(mods));
+    REQUIRE_FALSE(done->expand<rng_t, dist_t>(mods, rng));
+  }
+
+  SECTION("Forks outlive the tree they were forked from") {
+    for (auto storage : {tracerz::NodeStorage::Heap, tracerz::NodeStorage::Arena}) {
+      zgr.setNodeStorage(storage);
+      auto tree = setUp();
+      auto forked = tree->fork();
+      auto forkedAgain = forked->fork();
+      rng_t rng(5);
+      rng_t sameRng(5);
+      tree->reset("#origin#");
+      while (tree->expand<rng_t, dist_t>(mods, rng));
+      tree.reset();
+      while (forked->expand<rng_t, dist_t>(mods, sameRng));
+      rng = rng_t(5);
+      while (forkedAgain->expand<rng_t, dist_t>(mods, rng));
+      REQUIRE(forkedAgain->flatten(mods) == forked->flatten(mods));
+    }
+  }
+
+  SECTION("Forks can be expanded on different threads") {
+    auto tree = setUp();
+    std::vector<std::string> expected(4);
+    std::vector<std::string> actual(4);
+    for (std::size_t i = 0; i < expected.size(); i++) {
+      auto forked = tree->fork();
+      rng_t rng(i);
+      while (forked->expand<rng_t, dist_t>(mods, rng));
+      expected[i] = forked->flatten(mods);
+    }
+    std::vector<std::shared_ptr<tracerz::Tree>> forks;
+    for (std::size_t i = 0; i < actual.size(); i++) forks.push_back(tree->fork());
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < actual.size(); i++) {
+      threads.emplace_back([&, i]() {
+        rng_t rng(i);
+        while (forks[i]->expand<rng_t, dist_t>(mods, rng));
+        actual[i] = forks[i]->flatten(mods);
+      });
+    }
+    for (auto& thread : threads) thread.join();
+    REQUIRE(actual == expected);
+  }
+}
+
+TEST_CASE("Expansion size estimates", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"name",     {"Arjun", "Yuuma", "Darcy", "Mia"}},
+      {"origin",   "#[hero:#name#]story#"},
+      {"story",    "#hero# said hi"},
+      {"rec",      {"a#rec#", "b"}},
+      {"tree",     {"(#tree# #tree#)", "x", "y"}},
+      {"critical", {"(#critical# #critical#)", "x"}},
+      {"loop",     "#loop#"},
+      {"ping",     "#pong#-"},
+      {"pong",     {"#ping#", "+#ping#"}},
+      {"slow",     {{"options", {"(#slow# #slow#)", "x"}}, {"weights", {9999, 10001}}}},
+      {"weighted", {{"options", {"aaaa", "b"}}, {"weights", {3, 1}}}}
+  };
+  tracerz::CompiledGrammar compiled(grammar);
+  const std::size_t unbounded = std::numeric_limits<std::size_t>::max();
+
+  SECTION("Alternatives are combined by their probabilities") {
+    auto name = compiled.getRule("name")->size;
+    REQUIRE(name.minBytes == 3);
+    REQUIRE(name.expectedBytes == Approx(4.5));
+    REQUIRE(name.maxBytes == 5);
+    REQUIRE(name.minNodes == 1);
+    REQUIRE(name.maxNodes == 1);
+
+    auto weighted = compiled.estimateSize("#weighted#");
+    REQUIRE(weighted.minBytes == 1);
+    REQUIRE(weighted.expectedBytes == Approx(3.25));
+    REQUIRE(weighted.maxBytes == 4);
+    REQUIRE(weighted.expectedNodes == Approx(2));
+
+    // Undefined rules expand to an empty node, keys to the values set by actions
+    auto undefined = compiled.estimateSize("x #undefined# y");
+    REQUIRE(undefined.expectedBytes == Approx(4));
+    REQUIRE(undefined.maxBytes == 4);
+    REQUIRE(compiled.estimateSize("#hero#").expectedBytes == Approx(4.5));
+    REQUIRE(!compiled.getRule("origin")->isRecursive);
+    REQUIRE(compiled.getRule("origin")->size.maxBytes == 5 + 5 + 8);
+  }
+
+  SECTION("Recursive rules are unbounded") {
+    auto rec = compiled.getRule("rec");
+    REQUIRE(rec->isRecursive);
+    REQUIRE(rec->size.minBytes == 1);
+    REQUIRE(rec->size.expectedBytes == Approx(2));
+    REQUIRE(rec->size.maxBytes == unbounded);
+    REQUIRE(rec->size.maxNodes == unbounded);
+
+    // E = (3 + 2E) / 3 + 2 / 3
+    REQUIRE(compiled.getRule("tree")->size.expectedBytes == Approx(5));
+
+    auto loop = compiled.getRule("loop");
+    REQUIRE(loop->size.minBytes == unbounded);
+    REQUIRE(std::isinf(loop->size.expectedNodes));
+    REQUIRE(std::isinf(compiled.getRule("critical")->size.expectedBytes));
+    REQUIRE(compiled.getDivergingRules() == std::vector<std::string>{"critical", "loop", "ping", "pong"});
+  }
+
+  SECTION("Divergence is found from the references within a cycle") {
+    // Every alternative of the cycle re-enters it
+    REQUIRE(std::isinf(compiled.getRule("ping")->size.expectedBytes));
+    REQUIRE(std::isinf(compiled.getRule("pong")->size.expectedNodes));
+
+    // E = 0.49995 (3 + 2E) + 0.50005, which converges too slowly to be found by iterating
+    auto slow = compiled.getRule("slow")->size;
+    REQUIRE(slow.expectedBytes == Approx(19999));
+    REQUIRE(!std::isinf(slow.expectedNodes));
+    REQUIRE(compiled.estimateSize("#slow#").expectedBytes == Approx(19999));
+  }
+
+  SECTION("Estimates match the average expansion") {
+    tracerz::Grammar zgr(grammar, std::mt19937(3));
+    for (std::string input : {"#tree#", "#weighted#", "#rec# #name#"}) {
+      double total = 0;
+      for (int i = 0; i < 4000; i++) total += static_cast<double>(zgr.generate(input).size());
+      double expected = zgr.getCompiledGrammar()->estimateSize(input).expectedBytes;
+      REQUIRE(std::abs(total / 4000 - expected) < 0.1 * expected);
+    }
+  }
+
+  SECTION("Output is reserved for the expected size") {
+    tracerz::Grammar zgr(grammar, std::mt19937(3));
+    std::string output;
+    zgr.generate("#tree#", output);
+    REQUIRE(output.capacity() >= tracerz::details::getOutputReserve(compiled.estimateSize("#tree#")));
+    REQUIRE(zgr.getExpandedTree("#tree#")->flatten(zgr.getModifierFunctions()).capacity() >= 10);
+  }
+}
+
+TEST_CASE("Parallel breadth-first expansion", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"name",   {"Arjun", "Yuuma", "Darcy", "Mia"}},
+      {"animal", {"dog", "cat", "owl", "eel", "yak"}},
+      {"mood",   {"glum", "merry", "sly"}},
+      {"setup",  "[hero:#name#][pet:#animal#]"},
+      {"story",  {"#hero# met #pet.a# and #name#. [pet:#animal#]#pet.capitalize# left",
+                  "#mood.capitalize#, #hero# and the #pet# saw #animal.a#",
+                  "#hero.capitalize# and #name# #[hero:#name#]story#"}},
+      {"line",   {"#animal# and #animal.s#", "#name# the #mood# #animal#", "#[#setup#]story#"}}
+  };
+  std::string input;
+  for (int i = 0; i < 600; i++) input += "#line# ";
+  typedef tracerz::Grammar<>::rng_t rng_t;
+  typedef tracerz::Grammar<>::uniform_distribution_t dist_t;
+
+  SECTION("The output doesn't depend on the number of threads") {
+    for (auto storage : {tracerz::NodeStorage::Heap, tracerz::NodeStorage::Arena}) {
+      for (std::uint64_t seed = 0; seed < 3; seed++) {
+        tracerz::Grammar zgr(grammar);
+        zgr.addModifiers(tracerz::getBaseEngModifiers());
+        zgr.setNodeStorage(storage);
+        const auto& mods = zgr.getModifierFunctions();
+        std::string expected;
+        for (unsigned numThreads : {1u, 2u, 4u}) {
+          rng_t rng(seed);
+          auto tree = zgr.getTree(input);
+          while (tree->expandBFParallel<rng_t, dist_t>(rng, numThreads));
+          std::string output = tree->flatten(mods);
+          REQUIRE(output.find('#') == std::string::npos);
+          if (expected.empty()) expected = output;
+          REQUIRE(output == expected);
+
+          // Reusing the tree reuses its arenas
+          rng_t sameRng(seed);
+          tree->reset(input);
+          while (tree->expandBFParallel<rng_t, dist_t>(sameRng, numThreads));
+          REQUIRE(tree->flatten(mods) == expected);
+        }
+      }
+    }
+  }
+
+  SECTION("A level expands as expandBF would with the same draws") {
+    // Every draw is the same, so the draws of each block are those of the tree
+    tracerz::Grammar<TestRNG<0, 1>, TestDistribution> zgr(grammar, TestRNG<0, 1>(0));
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    const auto& mods = zgr.getModifierFunctions();
+    TestRNG<0, 1> rng(0);
+    auto expected = zgr.getTree(input);
+    while (expected->expandBF<TestRNG<0, 1>, TestDistribution>(rng));
+    auto tree = zgr.getTree(input);
+    while (tree->expandBFParallel<TestRNG<0, 1>, TestDistribution>(rng, 4));
+    REQUIRE(tree->flatten(mods) == expected->flatten(mods));
+  }
+
+  SECTION("Trees with expansion limits expand level by level on the calling thread") {
+    tracerz::Grammar zgr(grammar);
+    zgr.addModifiers(tracerz::getBaseEngModifiers());
+    tracerz::ExpansionLimits limits;
+    limits.maxNodes = 2000;
+    zgr.setExpansionLimits(limits);
+    const auto& mods = zgr.getModifierFunctions();
+    rng_t rng(7);
+    rng_t sameRng(7);
+    auto expected = zgr.getTree(input);
+    while (expected->expandBF<rng_t, dist_t>(rng));
+    auto tree = zgr.getTree(input);
+    while (tree->expandBFParallel<rng_t, dist_t>(sameRng, 4));
+    REQUIRE(tree->flatten(mods) == expected->flatten(mods));
+  }
+
+  SECTION("Forks expand in parallel from where the tree was") {
+    for (auto storage : {tracerz::NodeStorage::Heap, tracerz::NodeStorage::Arena}) {
+      tracerz::Grammar zgr(grammar);
+      zgr.addModifiers(tracerz::getBaseEngModifiers());
+      zgr.setNodeStorage(storage);
+      const auto& mods = zgr.getModifierFunctions();
+      rng_t rng(3);
+      auto tree = zgr.getTree(input);
+      tree->expandBFParallel<rng_t, dist_t>(rng, 4);
+      tree->expandBFParallel<rng_t, dist_t>(rng, 4);
+      auto forked = tree->fork();
+      rng_t forkRng = rng;
+      while (tree->expandBFParallel<rng_t, dist_t>(rng, 4));
+      std::string expected = tree->flatten(mods);
+      tree.reset();
+      while (forked->expandBFParallel<rng_t, dist_t>(forkRng, 2));
+      REQUIRE(forked->flatten(mods) == expected);
+    }
+  }
+}
+
+TEST_CASE("Unique samples and enumeration", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"animal",  {"dog", "cat", "owl"}},
+      {"size",    {"big", "small"}},
+      {"same",    {"x", "x"}},
+      {"weighted", {{"options", {"rare", "never", "often"}}, {"weights", {1, 0, 3}}}},
+      {"pair",    "the #size# #animal.s# and #animal.a#"},
+      {"fixed",   "#pair# #pair#"},
+      {"story",   "#[pet:#animal#]tell#"},
+      {"tell",    "#pet# and #pet#"},
+      {"forever", {"end", "#forever#!"}}
+  };
+  tracerz::Grammar zgr(grammar, tracerz::Xoshiro256StarStar(1));
+  zgr.addModifiers(tracerz::getBaseEngModifiers());
+
+  SECTION("Expansions are counted from the compiled rules") {
+    REQUIRE(zgr.countExpansions("plain") == 1);
+    REQUIRE(zgr.countExpansions("#animal#") == 3);
+    REQUIRE(zgr.countExpansions("#pair#") == 18);
+    REQUIRE(zgr.countExpansions("#fixed# #size#") == 18 * 18 * 2);
+    REQUIRE(zgr.countExpansions("#missing#") == 1);
+
+    // Alternatives that can't be drawn aren't counted, and equal alternatives are
+    REQUIRE(zgr.countExpansions("#weighted#") == 2);
+    REQUIRE(zgr.countExpansions("#same#") == 2);
+
+    // Recursion is unbounded, and actions can't be counted
+    REQUIRE(zgr.countExpansions("#forever#") == std::numeric_limits<std::uint64_t>::max());
+    REQUIRE(zgr.countExpansions("#story#") == 0);
+    REQUIRE(zgr.countExpansions("[k:v]#animal#") == 0);
+  }
+
+  SECTION("Every expansion is enumerated once") {
+    auto enumerator = zgr.getEnumerator("#pair# #weighted#");
+    REQUIRE(enumerator.size() == 36);
+    std::set<std::string> outputs;
+    for (std::uint64_t i = 0; i < enumerator.size(); i++) outputs.insert(enumerator.generate(i));
+    REQUIRE(outputs.size() == 36);
+    REQUIRE(outputs.count("the small owls and an owl often") == 1);
+    for (auto& output : outputs) REQUIRE(output.find("never") == std::string::npos);
+
+    // Indices are stable, and out of range ones are rejected
+    REQUIRE(enumerator.generate(7) == zgr.getEnumerator("#pair# #weighted#").generate(7));
+    REQUIRE_THROWS_AS(enumerator.generate(36), std::out_of_range);
+
+    REQUIRE_THROWS_AS(zgr.getEnumerator("#story#"), std::invalid_argument);
+    REQUIRE_THROWS_AS(zgr.getEnumerator("#forever#"), std::length_error);
+  }
+
+  SECTION("Unique samples have distinct output") {
+    // More samples than expansions returns every expansion
+    auto all = zgr.generateUnique("#pair#", 100);
+    REQUIRE(all.size() == 18);
+    REQUIRE(std::set<std::string>(all.begin(), all.end()).size() == 18);
+
+    // Fewer are sampled
+    auto some = zgr.generateUnique("#fixed#", 50);
+    REQUIRE(some.size() == 50);
+    REQUIRE(std::set<std::string>(some.begin(), some.end()).size() == 50);
+
+    // Inputs that can't be counted stop once they run out of expansions
+    tracerz::Generator<> generator(zgr.share(), tracerz::Xoshiro256StarStar(2));
+    auto stories = generator.generateUnique("#story#", 10, 200);
+    REQUIRE(stories.size() == 3);
+    REQUIRE(std::set<std::string>(stories.begin(), stories.end()).size() == 3);
+
+    // Asking for as many as there are doesn't reserve room for the count up front
+    constexpr std::size_t asManyAsThereAre = std::numeric_limits<std::size_t>::max();
+    REQUIRE(zgr.generateUnique("#pair#", asManyAsThereAre).size() == 18);
+    REQUIRE(generator.generateUnique("#story#", asManyAsThereAre, 200).size() == 3);
+    auto endings = generator.generateUnique("#forever#", 5);
+    REQUIRE(std::set<std::string>(endings.begin(), endings.end()).size() == 5);
+
+    // Alternatives adding up to the same text give a single sample, whether enumerated or sampled
+    REQUIRE(zgr.generateUnique("#same#", 10) == std::vector<std::string>{"x"});
+    REQUIRE(generator.generateUnique("[k:v]#same#", 10) == std::vector<std::string>{"x"});
+    auto weighted = generator.generateUnique("[k:v]#same# #weighted# #size#", 10);
+    REQUIRE(std::set<std::string>(weighted.begin(), weighted.end()) ==
+            std::set<std::string>{"x rare big", "x rare small", "x often big", "x often small"});
+
+    // Once every path has been seen, sampling stops without waiting for the duplicates
+    constexpr std::size_t unlimited = std::numeric_limits<std::size_t>::max();
+    REQUIRE(generator.generateUnique("#story#", 10, unlimited).size() == 3);
+    REQUIRE(generator.generateUnique("[k:v]#weighted# #pair#", asManyAsThereAre, unlimited).size() == 36);
+
+    // Inputs expanded into trees are told apart by their output too
+    tracerz::Grammar treeGrammar(grammar, tracerz::Xoshiro256StarStar(3));
+    treeGrammar.addModifiers(tracerz::getBaseEngModifiers());
+    treeGrammar.addModifiers(tracerz::getBaseExtendedModifiers());
+    auto popped = treeGrammar.generateUnique("#[pet:#animal#]same##pet.pop!!#", 10, 200);
+    REQUIRE(popped == std::vector<std::string>{"x"});
+  }
+}
+
+namespace {
+constexpr std::string_view staticNames[] = {"Arjun", "Yuuma", "Darcy", "Mia"};
+constexpr std::string_view staticAnimals[] = {"dog", "cat", "owl"};
+constexpr double staticAnimalWeights[] = {1, 0, 3};
+constexpr std::string_view staticStories[] = {"#hero# met #animal.a#", "#[pet:#animal#]tell#[k:v,w]#k#"};
+constexpr tracerz::StaticRule staticRules[] = {
+    {"name",   staticNames},
+    {"animal", staticAnimals, staticAnimalWeights},
+    {"story",  staticStories},
+    {"tell",   "#hero# and the #pet.capitalize#"},
+    {"origin", "#[hero:#name#]story#"}
+};
+static_assert(tracerz::checkStaticGrammar(staticRules), "the static grammar is valid");
+
+constexpr tracerz::StaticRule undefinedRule[] = {{"origin", "#name# and #[k:v]other#"}};
+constexpr tracerz::StaticRule duplicateRule[] = {{"origin", "a"}, {"name", "b"}, {"origin", "c"}};
+constexpr double zeroWeights[] = {0, 0, 0};
+constexpr tracerz::StaticRule zeroWeightRule[] = {{"animal", staticAnimals, zeroWeights}};
+constexpr tracerz::StaticGrammarCheck undefinedCheck = tracerz::checkStaticGrammar(undefinedRule);
+static_assert(!undefinedCheck && undefinedCheck.name == "name", "undefined rules are found at compile time");
+static_assert(!tracerz::checkStaticGrammar(duplicateRule), "duplicate rules are found at compile time");
+static_assert(tracerz::checkStaticGrammar(duplicateRule).rule == 2, "the duplicate is the second definition");
+static_assert(!tracerz::checkStaticGrammar(zeroWeightRule), "invalid weights are found at compile time");
+}
+
+TEST_CASE("Static grammars", "[tracerz]") {
+  nlohmann::json grammar = {
+      {"name",   {"Arjun", "Yuuma", "Darcy", "Mia"}},
+      {"animal", {{"options", {"dog", "cat", "owl"}}, {"weights", {1, 0, 3}}}},
+      {"story",  {"#hero# met #animal.a#", "#[pet:#animal#]tell#[k:v,w]#k#"}},
+      {"tell",   "#hero# and the #pet.capitalize#"},
+      {"origin", "#[hero:#name#]story#"}
+  };
+
+  SECTION("A static grammar expands like the same grammar in json") {
+    tracerz::Grammar fromJson(grammar, tracerz::Xoshiro256StarStar(5));
+    tracerz::Grammar fromStatic(tracerz::StaticGrammarSource(staticRules), tracerz::Xoshiro256StarStar(5));
+    fromJson.addModifiers(tracerz::getBaseEngModifiers());
+    fromStatic.addModifiers(tracerz::getBaseEngModifiers());
+    for (int i = 0; i < 50; i++) {
+      REQUIRE(fromStatic.flatten("#origin#") == fromJson.flatten("#origin#"));
+    }
+    REQUIRE(fromStatic.getCompiledGrammar()->toBinary() == fromJson.getCompiledGrammar()->toBinary());
+  }
+
+  SECTION("The compile time classifier agrees with the compiled nodes") {
+    std::vector<std::string> inputs = {
+        "plain text", "#rule.s#", "#[key:value]rule.a#", "[#rule.pop!!#]", "[key:#rule.s#]", "[key:a,b,,c,]",
+        "[k1:a][k2:#b#][#c#]", "a #b [c:d] #e#f #.g# ## [] [k:v]#x#", "#[x:#y#]z.w(1.2,3)# and #q#"
+    };
+    for (auto& input : inputs) {
+      INFO(input);
+      REQUIRE(tracerz::details::scanNodeType(input) == tracerz::details::compileNode(input)->type);
+    }
+
+    std::vector<std::string_view> rules, keys;
+    auto onRule = [&rules](std::string_view name) { rules.push_back(name); };
+    auto onKey = [&keys](std::string_view name) { keys.push_back(name); };
+    tracerz::details::scanReferences("#[a:#b#][c:d]e#[f:g]#h.s# and more", onRule, onKey);
+    REQUIRE(rules == std::vector<std::string_view>{"b", "e", "h"});
+    REQUIRE(keys == std::vector<std::string_view>{"a", "c", "f"});
+  }
+}
+
+TEST_CASE("In place modifiers", "[tracerz]") {
+  // The capitalizeAll modifier as it was written before it worked in place
+  auto reference = [](const std::string& input) {
+    std::string ret;
+    bool capNext = true;
+    for (char chr : input) {
+      if (tracerz::details::isAlphaNumChar(chr)) {
+        ret += capNext ? static_cast<char>(toupper(static_cast<unsigned char>(chr))) : chr;
+        capNext = false;
+      } else {
+        capNext = true;
+        ret += chr;
+      }
+    }
+    return ret;
+  };
+
+  // Lengths around the block size, with word boundaries, digits, and characters outside of ASCII at every position
+  const char alphabet[] = {'a', 'z', 'A', 'Z', 'm', '0', '9', ' ', '-', '`', '{', '@', '[', '/', ':',
+                           '\x80', '\xe9', '\xff'};
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<std::size_t> pick(0, sizeof(alphabet) - 1);
+  for (std::size_t length = 0; length < 70; ++length) {
+    for (int sample = 0; sample < 20; ++sample) {
+      std::string input;
+      for (std::size_t i = 0; i < length; ++i) input += alphabet[pick(rng)];
+      std::string output = input;
+      tracerz::details::capitalizeWords(output);
+      REQUIRE(output == reference(input));
+    }
+  }
+
+  // Calling in place gives the same output as calling with a copy, including on short and empty inputs
+  const auto& mods = tracerz::getBaseEngModifiers();
+  for (const char* name : {"a", "capitalize", "capitalizeAll", "s", "ed", "replaceLiteral"}) {
+    tracerz::details::IModifierFn* modFun = mods.get(tracerz::details::internModifierName(name));
+    REQUIRE(modFun != nullptr);
+    for (const char* word : {"", "y", "ay", "by", "s", "e", "unicorn", "umbrella", "quick brown fox jumps over"}) {
+      std::string buffer = word;
+      modFun->callInPlace(buffer, {"o", "0"});
+      REQUIRE(buffer == modFun->callVec(word, {"o", "0"}));
+    }
+  }
+
+  // Chained modifiers give the same output from the streaming expander and from a tree
+  nlohmann::json grammar = {
+      {"animal", {"pony", "fox", "owl", "moth"}},
+      {"words", "#animal# and #animal# on a long day out"},
+      {"origin", "#words.capitalizeAll.s# #animal.a.capitalize.ed# #words.replaceLiteral(o,0).capitalizeAll#"}
+  };
+  tracerz::Grammar zgr(grammar, tracerz::Xoshiro256StarStar(3));
+  zgr.addModifiers(tracerz::getBaseEngModifiers());
+  tracerz::Grammar tgr(grammar, tracerz::Xoshiro256StarStar(3));
+  tgr.addModifiers(tracerz::getBaseEngModifiers());
+  for (int i = 0; i < 20; ++i) {
+    auto tree = tgr.getExpandedTree("#origin#");
+    REQUIRE(zgr.flatten("#origin#") == tree->flatten(tgr.getModifierFunctions()));
+  }
+  REQUIRE(zgr.flatten("[w:the quick fox]#w.capitalizeAll.s#") == "The Quick Foxes");
 }
 
 TEST_CASE("Basic substitution", "[tracerz]") {
@@ -128,11 +1815,17 @@ TEST_CASE("Basic modifiers", "[tracerz]") {
       {"sOrigin3",             "people drive #vehicle.s#"},
       {"edOrigin",             "#verbS.ed# #verbE.ed# #verbH.ed# #verbX.ed# #verbConsonantY.ed# #verbVowelY.ed# #verb.ed#"},
       {"replaceOrigin",        "#anOrigin.replace(a,b)#"},
+      {"sum",                  "1+2+3"},
+      {"replaceLiteralOrigin", "#anOrigin.replaceLiteral(a,b)# #sum.replaceLiteral(+, plus )# #sum.replaceLiteral(,-)#"},
       {"capAllNumStartOrigin", "#numStart.capitalizeAll#"},
-      {"chainedOrigin",        "#verbH.a.ed.capitalize# out"}
+      {"chainedOrigin",        "#verbH.a.ed.capitalize# out"},
+      {"unknownOrigin",        "#food.shout.a.whisper(x)#"}
   };
   tracerz::Grammar zgr(mods);
+  REQUIRE(zgr.getUnknownModifiers().size() == 9);
   zgr.addModifiers(tracerz::getBaseEngModifiers());
+  REQUIRE(zgr.getUnknownModifiers() == std::vector<std::string>{"shout", "whisper"});
+  REQUIRE(zgr.flatten("#unknownOrigin#") == "a fish");
   REQUIRE(zgr.flatten("#anOrigin#") == "an albatross ate a fish");
   REQUIRE(zgr.flatten("#anOrigin2#") == "the iww is a union");
   REQUIRE(zgr.flatten("#capAllOrigin#") == "An Albatross Ate A Fish");
@@ -142,6 +1835,7 @@ TEST_CASE("Basic modifiers", "[tracerz]") {
   REQUIRE(zgr.flatten("#sOrigin3#") == "people drive cars");
   REQUIRE(zgr.flatten("#edOrigin#") == "passed replaced cashed boxed carried monkeyd handed");
   REQUIRE(zgr.flatten("#replaceOrigin#") == "bn blbbtross bte b fish");
+  REQUIRE(zgr.flatten("#replaceLiteralOrigin#") == "bn blbbtross bte b fish 1 plus 2 plus 3 1+2+3");
   REQUIRE(zgr.flatten("#capAllNumStartOrigin#") == "00flour From Italy");
   REQUIRE(zgr.flatten("#chainedOrigin#") == "A cashed out");
 
@@ -208,6 +1902,16 @@ TEST_CASE("Custom modifiers", "[tracerz]") {
     REQUIRE(zgr.flatten("#rule.eris(no1,yes,output,no4)#") == "yes");
     REQUIRE(zgr.flatten("#rule.eris(no1,no2,no3,output)#") == "output");
     REQUIRE(zgr.flatten("#rule.eris(yes,no2,no3,no4)#") == "yes");
+
+    // Missing parameters are passed as empty strings
+    REQUIRE(zgr.flatten("#rule.eris(output)#").empty());
+  }
+
+  SECTION("Custom in place modifier") {
+    zgr.addInPlaceModifier("eris", [](std::string& input) { input.insert(0, "hail "); });
+    REQUIRE(zgr.flatten("#rule.eris#") == "hail output");
+    REQUIRE(zgr.flatten("#rule.eris.eris#") == "hail hail output");
+    REQUIRE(zgr.getModifierFunctions()["eris"]->callVec("eris", {}) == "hail eris");
   }
 }
 
@@ -4,17 +4,50 @@
  * @file tracerz.h tracerz.h: a single-header, modern C++ port/extension of @galaxykate's tracery tool
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
 #include <functional>
+#include <initializer_list>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <random>
 #include <regex>
+#include <set>
+#include <shared_mutex>
+#include <sstream>
 #include <stack>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#ifndef TRACERZ_NO_JSON
 #include "json.hpp"
+#endif
+
+// The base english modifiers handle blocks of ASCII text with SSE2 where available. Define TRACERZ_NO_SIMD to always
+// use the scalar code.
+#ifndef TRACERZ_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TRACERZ_HAS_SSE2
+#include <emmintrin.h>
+#endif
+#endif
 
 namespace tracerz {
 // Forward declaration
@@ -69,6 +102,18 @@ public:
    */
   virtual bool isStringModifier() const = 0;
 
+  /**
+   * Calls a string modifier on the given buffer, replacing its contents with the modified string. Modifiers that work
+   * in place modify the buffer without copying it, so chained modifiers share one buffer; others are called with
+   * callVec.
+   *
+   * @param buffer the input string, replaced by the output
+   * @param params the additional params to pass into the function
+   */
+  virtual void callInPlace(std::string& buffer, const std::vector<std::string>& params) {
+    buffer = this->callVec(buffer, params);
+  }
+
   /**
    * Returns true if this modifier takes a Tree as its input.
    *
@@ -90,59 +135,23 @@ public:
 };
 
 /**
- * Given a function that accepts an input and at least one additional parameter, the static function of this class
- * recursively unpacks a vector into a parameter pack, and then calls the given function on the input and the parameter
- * pack.
+ * Returns the parameter at the given index of the parameter vector, or an empty string if there are too few parameters
  *
- * @tparam N the number of items remaining in the vector
- * @tparam F the type of the function to call on the unpacked parameters
- * @tparam I the type of the input
- * @tparam PTs a parameter pack of the types of the items already unpacked from the vector
+ * @param params the parameter vector
+ * @param index the index of the parameter
+ * @return the parameter
  */
-template<int N,
-    typename F,
-    typename I,
-    typename... PTs>
-class CallVector_R {
-public:
-  /**
-   * Unpacks the first parameter from the parameter vector, moves it to the parameter pack, and then recurses. When it
-   * is fully unpacked, calls the function on the parameter pack.
-   *
-   * @param fun the function to ultimately call on the input and list of parameters
-   * @param input the input to pass to `fun`
-   * @param paramVec the remaining parameters
-   * @param params the parameter pack of parameters that have been unpacked from the vector so far
-   * @return the result of calling `fun` on the input string with all parameters
-   */
-  static decltype(auto) callVec(F fun,
-                                I input,
-                                std::vector<std::string> paramVec,
-                                PTs... params) {
-    if constexpr (N > 0) {
-      // Unpack the first parameter from the vector
-      std::string param = paramVec[0];
-
-      // Create a vector containing the rest of the parameters
-      std::vector<std::string> restOfVec(++paramVec.begin(), paramVec.end());
-
-      // Recurse, placing `param` at the end of the parameter pack
-      return CallVector_R<N - 1, F, I, const std::string&, PTs...>::callVec(fun,
-                                                                            input,
-                                                                            restOfVec,
-                                                                            params...,
-                                                                            param);
-    } else {
-      return fun(input, params...);
-    }
-  }
-};
+inline const std::string& getParam(const std::vector<std::string>& params, std::size_t index) {
+  static const std::string empty;
+  return index < params.size() ? params[index] : empty;
+}
 
 /**
- * This class provides a static function to call a given function with the given input and the contents of a given
- * parameter vector as parameters to the function
+ * This class provides static functions to call a given function with the given input and the contents of a given
+ * parameter vector as parameters to the function. The vector is unpacked with an index sequence, so the parameters are
+ * passed by reference straight from the vector, without copying.
  *
- * @tparam N the number of parameters F takes, excluding the input string
+ * @tparam N the number of parameters F takes, excluding the input
  * @tparam F the type of the function to be called on the supplied parameters
  * @tparam I the type of the input
  */
@@ -157,24 +166,51 @@ public:
    * @param params the remaining parameters
    * @return the result of calling `fun(input, params...)`
    */
-  static decltype(auto) callVec(F fun,
+  static decltype(auto) callVec(const F& fun,
                                 I input,
                                 const std::vector<std::string>& params) {
-    if constexpr (N > 0) {
-      // Peel off the first parameter
-      std::string param = params[0];
-
-      // Create a vector of the remaining parameters
-      std::vector<std::string> restOfParams(++params.begin(), params.end());
-
-      // Use CallVector_R to recurse over the remaining parameters
-      return CallVector_R<N - 1, F, I, const std::string&>::callVec(fun,
-                                                                    input,
-                                                                    restOfParams,
-                                                                    param);
-    } else {
-      return fun(input);
-    }
+    return CallVector<N, F, I>::unpack(fun, input, params, std::make_index_sequence<N>());
+  }
+
+  /**
+   * Calls function `fun` with `input`, `ruleName`, and the contents of `params` as parameters, as is done for tree and
+   * tree node modifiers
+   *
+   * @param fun the function to call
+   * @param input the input
+   * @param ruleName the name of the rule the modifier was called on
+   * @param params the remaining parameters
+   * @return the result of calling `fun(input, ruleName, params...)`
+   */
+  static decltype(auto) callVec(const F& fun,
+                                I input,
+                                const std::string& ruleName,
+                                const std::vector<std::string>& params) {
+    return CallVector<N, F, I>::unpack(fun, input, ruleName, params, std::make_index_sequence<N - 1>());
+  }
+
+private:
+  /**
+   * Calls `fun` with the input and the parameters at the indices in the index sequence
+   */
+  template<std::size_t... Is>
+  static decltype(auto) unpack(const F& fun,
+                               I input,
+                               const std::vector<std::string>& params,
+                               std::index_sequence<Is...>) {
+    return fun(input, getParam(params, Is)...);
+  }
+
+  /**
+   * Calls `fun` with the input, the rule name, and the parameters at the indices in the index sequence
+   */
+  template<std::size_t... Is>
+  static decltype(auto) unpack(const F& fun,
+                               I input,
+                               const std::string& ruleName,
+                               const std::vector<std::string>& params,
+                               std::index_sequence<Is...>) {
+    return fun(input, ruleName, getParam(params, Is)...);
   }
 };
 
@@ -216,7 +252,7 @@ public:
    */
   template<typename... PTs>
   std::string call(PTs... params) {
-    return callf(this->callback, params...);
+    return this->callback(params...);
   }
 
   /**
@@ -241,12 +277,10 @@ public:
                       const std::string& ruleName,
                       const std::vector<std::string>& params) override {
     if constexpr (ModifierFn<I, Ts...>::is_tree_modifier) {
-      std::vector<std::string> ruleNameWithParams;
-      ruleNameWithParams.push_back(ruleName);
-      std::copy(params.begin(), params.end(), std::back_inserter(ruleNameWithParams));
       return CallVector<sizeof...(Ts), decltype(this->callback), const std::shared_ptr<Tree>&>::callVec(this->callback,
                                                                                                         input,
-                                                                                                        ruleNameWithParams);
+                                                                                                        ruleName,
+                                                                                                        params);
     } else {
       return "";
     }
@@ -256,13 +290,11 @@ public:
                       const std::string& ruleName,
                       const std::vector<std::string>& params) override {
     if constexpr (ModifierFn<I, Ts...>::is_tree_node_modifier) {
-      std::vector<std::string> ruleNameWithParams;
-      ruleNameWithParams.push_back(ruleName);
-      std::copy(params.begin(), params.end(), std::back_inserter(ruleNameWithParams));
       return CallVector<sizeof...(Ts), decltype(this->callback), const std::shared_ptr<TreeNode>&>::callVec(
           this->callback,
           input,
-          ruleNameWithParams);
+          ruleName,
+          params);
     } else {
       return "";
     }
@@ -285,1389 +317,8509 @@ private:
   std::function<std::string(I, Ts...)> callback;
 };
 
-/** Represents a mapping of modifier names to modifier functions */
-typedef std::map<std::string, std::shared_ptr<IModifierFn>> callback_map_t;
-
-/** Represents a map of rule names to ruleset stacks */
-typedef std::map<std::string, std::stack<nlohmann::json>> runtime_dictionary_t;
-
 /**
- * Returns the action regular expression
- *
- * An action is defined as follows:
- *   An open bracket: [
- *   Followed by zero or more non-close bracket characters
- *   A close bracket: ]
- *
- * It has one capture group: the entire contents of the bracketed characters
+ * Encapsulates a string modifier function object that takes only the input string. The function object is called
+ * directly, rather than through a std::function, and no parameters are unpacked.
  *
- * @return the regex
+ * @tparam F the type of the function object
  */
-const std::regex& getActionRegex() {
-  static const std::regex rgx(R"(\[([^\]]*)\])");
-  return rgx;
-}
+template<typename F>
+class StringModifierFn : public IModifierFn {
+public:
+  /**
+   * Construct a StringModifierFn for the given function object
+   *
+   * @param fun the function object
+   */
+  explicit StringModifierFn(F fun)
+      : callback(std::move(fun)) {
+  }
+
+  std::string callVec(const std::string& input, const std::vector<std::string>&) override {
+    return this->callback(input);
+  }
+
+  std::string callVec(const std::shared_ptr<Tree>&, const std::string&, const std::vector<std::string>&) override {
+    return "";
+  }
+
+  std::string callVec(const std::shared_ptr<TreeNode>&, const std::string&, const std::vector<std::string>&) override {
+    return "";
+  }
+
+  bool isStringModifier() const override { return true; }
+
+  bool isTreeModifier() const override { return false; }
+
+  bool isTreeNodeModifier() const override { return false; }
+
+private:
+  /** The encapsulated function object */
+  F callback;
+};
 
 /**
- * Gets a comma regex (to make splitting on commas into a container with iterators easy)
- *
- * It's literally just a comma
- *
- * It contains no capture group.
+ * Creates a modifier from a function object taking the input string and returning the modified string
  *
- * @return the regex
+ * @tparam F the type of the function object
+ * @param fun the function object
+ * @return the modifier
  */
-const std::regex& getCommaRegex() {
-  static const std::regex rgx(",");
-  return rgx;
+template<typename F>
+std::shared_ptr<IModifierFn> makeStringModifier(F fun) {
+  return std::make_shared<StringModifierFn<F>>(std::move(fun));
 }
 
 /**
- * Gets a basic modifier regex.
- *
- * It consists of the following:
- *   A dot: .
- *   Followed by one or more not dots
+ * Encapsulates a string modifier function object that modifies its input string in place, and takes no parameters.
+ * Called with callInPlace, it modifies the buffer it is given; called with callVec, it modifies a copy of the input.
  *
- * It has one capture group: the non-dot matching characters
- *
- * @return the regex
+ * @tparam F the type of the function object, taking a `std::string&`
  */
-const std::regex& getModifierRegex() {
-  static const std::regex rgx(R"(\.([^\.]+))");
-  return rgx;
-}
+template<typename F>
+class InPlaceStringModifierFn : public IModifierFn {
+public:
+  /**
+   * Construct an InPlaceStringModifierFn for the given function object
+   *
+   * @param fun the function object
+   */
+  explicit InPlaceStringModifierFn(F fun)
+      : callback(std::move(fun)) {
+  }
+
+  std::string callVec(const std::string& input, const std::vector<std::string>&) override {
+    std::string output = input;
+    this->callback(output);
+    return output;
+  }
+
+  std::string callVec(const std::shared_ptr<Tree>&, const std::string&, const std::vector<std::string>&) override {
+    return "";
+  }
+
+  std::string callVec(const std::shared_ptr<TreeNode>&, const std::string&, const std::vector<std::string>&) override {
+    return "";
+  }
+
+  void callInPlace(std::string& buffer, const std::vector<std::string>&) override {
+    this->callback(buffer);
+  }
+
+  bool isStringModifier() const override { return true; }
+
+  bool isTreeModifier() const override { return false; }
+
+  bool isTreeNodeModifier() const override { return false; }
+
+private:
+  /** The encapsulated function object */
+  F callback;
+};
 
 /**
- * Gets a regex that will match iff the input contains only tracery action groups
- *
- * It consists of the following:
- *   The beginning of a line
- *   One or more of the non-capturing group:
- *     An opening bracket: [
- *     Zero or more non-close brackets
- *     A closing bracket: ]
- *   The end of a line
- *
- * It contains no capture group.
+ * Creates a modifier from a function object that modifies the input string in place
  *
- * @return the regex
+ * @tparam F the type of the function object
+ * @param fun the function object
+ * @return the modifier
  */
-const std::regex& getOnlyActionsRegex() {
-  // (?: ... ) is a non-capturing group
-  static const std::regex rgx(R"(^(?:\[[^\]]*\])+$)");
-  return rgx;
+template<typename F>
+std::shared_ptr<IModifierFn> makeInPlaceStringModifier(F fun) {
+  return std::make_shared<InPlaceStringModifierFn<F>>(std::move(fun));
 }
 
 /**
- * Gets a regex that will match iff the input contains only an action that sets a key to plain text
- *
- * It consists of the following:
- *   The beginning of a line
- *   An opening bracket: [
- *   One or more alpha numeric characters (representing a key name)
- *   A colon: :
- *   One or more non-# and non-] characters
- *   A closing bracket: ]
- *   The end of a line
- *
- * It contains two capture groups:
- *   The key name (the alphanumeric characters before the colon)
- *   The plain text value (the characters between the colon and the closing bracket)
- *
- * @return the regex
+ * A table of interned names, giving each name a small integer id. Names are never removed, so an id stays valid for
+ * the life of the process. The table may be used from several threads at once.
  */
-const std::regex& getOnlyKeyWithTextActionRegex() {
-  static const std::regex rgx(R"(^\[([[:alnum:]]+):([^#\]]+)\]$)");
-  return rgx;
-}
+class NameTable {
+public:
+  /** The id of a name that has not been interned */
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+  /**
+   * Creates a table with the given names already interned, in order from id 0
+   *
+   * @param names the names to intern
+   */
+  explicit NameTable(std::initializer_list<std::string> names = {}) {
+    for (const std::string& name : names) this->ids.emplace(name, this->ids.size());
+  }
+
+  /**
+   * Interns the given name
+   *
+   * @param name the name
+   * @return the id of the name, added to the table if it has none yet
+   */
+  std::size_t intern(const std::string& name) {
+    // Most names are already interned, which only needs a shared lock
+    std::size_t id = this->find(name);
+    if (id != npos) return id;
+    std::unique_lock<std::shared_mutex> lock(this->mutex);
+    return this->ids.emplace(name, this->ids.size()).first->second;
+  }
+
+  /**
+   * Finds the id of the given name, without interning it
+   *
+   * @param name the name
+   * @return the id of the name, or npos if it has not been interned
+   */
+  std::size_t find(const std::string& name) const {
+    std::shared_lock<std::shared_mutex> lock(this->mutex);
+    auto iter = this->ids.find(name);
+    return iter == this->ids.end() ? npos : iter->second;
+  }
+
+private:
+  /** Guards the ids */
+  mutable std::shared_mutex mutex;
+
+  /** The id of each interned name */
+  std::map<std::string, std::size_t> ids;
+};
 
 /**
- * Gets a regex that will match iff the input contains only an action group that sets a key to the result of a rule with
- * zero or more modifiers
- *
- * It consists of the following:
- *   The beginning of a line
- *   An opening bracket: [
- *   One or more alphanumeric characters, representing a key name
- *   A colon: :
- *   An octothorpe: #
- *   One or more alphanumeric characters, representing a rule name
- *   Zero or more of the non-capturing group, each representing a modifier:
- *     A dot: .
- *     One or more non-#, non-. characters
- *   An octothorpe: #
- *   A closing bracket: ]
- *   The end of a line
- *
- * It contains two capture groups:
- *   The key name
- *   The rule and optional modifiers, including surrounding octothorpes
+ * Gets the table of interned modifier names. Ids are shared by every grammar in the process, so that modifier names
+ * compiled into grammars can be looked up in any tracerz::details::ModifierTable by id.
  *
- * @return the regex
+ * @return the table of modifier names
  */
-const std::regex& getOnlyKeyWithRuleActionRegex() {
-  static const std::regex rgx(R"(^\[([[:alnum:]]+):(#[[:alnum:]]+(?:\.[^.#]+)*#)\]$)");
-  return rgx;
+inline NameTable& getModifierNames() {
+  static NameTable names;
+  return names;
 }
 
 /**
- * Gets a regex that will match iff the input contains only an action group that does not set a key. These action groups
- * contain one rule, possibly with modifiers. Usually these rules create keys themselves, acting as a kind of
- * function within the language.
- *
- * It consists of the following:
- *   The beginning of a line
- *   An opening bracket: [
- *   An octothorpe: #
- *   One or more alphanumeric characters, representing a rule name
- *   Zero or more of the non-capturing group, each representing a modifier:
- *     A dot: .
- *     One or more non-#, non-. characters
- *   An octothorpe: #
- *   A closing bracket: ]
- *   The end of a line
+ * Gets the table of interned rule names. Ids are shared by every grammar in the process, so that rule and key names
+ * compiled into grammars can be looked up in any tracerz::details::RuntimeDictionary by id. The empty name has the
+ * id 0, which compiled nodes without a name keep.
  *
- * It contains one capture groups: the rule and optional modifiers, including surrounding octothorpes
- *
- * @return the regex
+ * @return the table of rule names
  */
-const std::regex& getOnlyKeylessRuleActionRegex() {
-  static const std::regex rgx(R"(^\[(#[[:alnum:]]+(?:\.[^.#]+)*#)\]$)");
-  return rgx;
+inline NameTable& getRuleNames() {
+  static NameTable names{""};
+  return names;
 }
 
 /**
- * Gets a regex that will match iff the input contains only a rule with an optional set of modifiers
- *
- * It consists of the following:
- *   The beginning of a line
- *   An octothorpe: #
- *   One or more alphanumeric characters, representing a rule name
- *   Zero or more of the non-capturing group, each representing a modifier:
- *     A dot: .
- *     One or more non-#, non-. characters
- *   An octothorpe: #
- *   The end of a line
+ * Interns the given modifier name, returning a small integer id that identifies it, see getModifierNames
  *
- * It contains two capture groups:
- *   The rule name
- *   The string of all characters representing zero or more modifiers (possibly empty)
- *
- * @return the regex
+ * @param name the modifier name
+ * @return the id of the modifier name
  */
-const std::regex& getOnlyRuleRegex() {
-  static const std::regex rgx(R"(^#([[:alnum:]]+)((?:\.[^.#]+)*)#$)");
-  return rgx;
+inline std::size_t internModifierName(const std::string& name) {
+  return getModifierNames().intern(name);
 }
 
 /**
- * Gets a regex that will match iff the input contains only a rule with at least one action and an optional set of
- * modifiers
- *
- * It consists of the following:
- *   The beginning of a line
- *   An octothorpe: #
- *   One or more of the non-capturing group, each representing an action group:
- *     An opening bracket: [
- *     Zero or more characters
- *     A closing bracket: ]
- *   One or more alphanumeric characters, representing a rule name
- *   Zero or more of the non-capturing group, each representing a modifier:
- *     A dot: .
- *     One or more non-#, non-. characters
- *   An octothorpe: #
- *   The end of a line
- *
- * It contains three capture groups:
- *   The string of all characters representing the one or more action groups
- *   The rule name
- *   The string of all characters representing zero or more modifiers (possibly empty)
+ * Interns the given rule name, returning a small integer id that identifies it, see getRuleNames
  *
- * @return the regex
+ * @param name the rule name
+ * @return the id of the rule name
  */
-const std::regex& getOnlyRuleWithActionsRegex() {
-  static const std::regex rgx(R"(^#((?:\[.*\])+)([[:alnum:]]+)((?:\.[^.#]+)*)#$)");
-  return rgx;
+inline std::size_t internRuleName(const std::string& name) {
+  return getRuleNames().intern(name);
 }
 
 /**
- * Gets a regex that will match if the input contains a rule with an optional action and an optional set of modifiers.
+ * A map from interned ids to values, kept in an open addressing hash table. Its size follows the number of ids it
+ * holds, rather than the largest id interned in the process, which grows with every grammar and name any of them uses.
+ * Values are never removed, only changed by their owner. Adding a value may move the others.
  *
- * It consists of the following:
- *   An octothorpe: #
- *   Zero or more of the non-capturing group, each representing an action group:
- *     An opening bracket: [
- *     Zero or more characters
- *     A closing bracket: ]
- *   One or more alphanumeric characters, representing a rule name
- *   Zero or more of the non-capturing group, each representing a modifier:
- *     A dot: .
- *     One or more non-#, non-. characters
- *   An octothorpe: #
- *
- * It contains three capture groups:
- *   The string of all characters representing the one or more action groups
- *   The rule name
- *   The string of all characters representing zero or more modifiers (possibly empty)
- *
- * @return the regex
+ * @tparam T the type of the values, which must be default constructible
  */
-const std::regex& getRuleRegex() {
-  static const std::regex rgx(R"(#(?:\[[^\]]*\])*([[:alnum:]]+)((?:\.[^.#]+)*)#)");
-  return rgx;
-}
+template<typename T>
+class IdMap {
+public:
+  /** An id no value has, which also marks an empty slot */
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+  /**
+   * Finds the value with the given id
+   *
+   * @param id the id, or npos to find nothing
+   * @return the value, or nullptr if the map has none
+   */
+  const T* find(std::size_t id) const {
+    if (this->slots.empty() || id == npos) return nullptr;
+    for (std::size_t i = this->index(id);; i = (i + 1) & (this->slots.size() - 1)) {
+      const Slot& slot = this->slots[i];
+      if (slot.id == id) return &slot.value;
+      if (slot.id == npos) return nullptr;
+    }
+  }
+
+  /**
+   * Finds the value with the given id
+   *
+   * @param id the id
+   * @return the value, or nullptr if the map has none
+   */
+  T* find(std::size_t id) {
+    return const_cast<T*>(static_cast<const IdMap&>(*this).find(id));
+  }
+
+  /**
+   * Gets the value with the given id, adding a default constructed one if the map has none
+   *
+   * @param id the id, which must not be npos
+   * @return the value
+   */
+  T& operator[](std::size_t id) {
+    // Make room first, so that the id is found or added in a single probe
+    if ((this->count + 1) * 2 > this->slots.size()) this->grow();
+    std::size_t i = this->index(id);
+    while (this->slots[i].id != id) {
+      if (this->slots[i].id == npos) {
+        this->slots[i].id = id;
+        ++this->count;
+        break;
+      }
+      i = (i + 1) & (this->slots.size() - 1);
+    }
+    return this->slots[i].value;
+  }
+
+  /**
+   * Gets the number of ids in the map
+   *
+   * @return the number of ids
+   */
+  std::size_t size() const { return this->count; }
+
+  /**
+   * Removes every id from the map
+   */
+  void clear() {
+    this->slots.clear();
+    this->count = 0;
+  }
+
+private:
+  /** The smallest number of slots of a map that isn't empty */
+  static constexpr std::size_t minSlots = 8;
+
+  /** An id and its value, or an empty slot */
+  struct Slot {
+    /** The id, or npos if the slot is empty */
+    std::size_t id = npos;
+
+    /** The value */
+    T value{};
+  };
+
+  /**
+   * Gets the slot to start looking for an id from, spreading the ids over the table by Fibonacci hashing
+   */
+  std::size_t index(std::size_t id) const {
+    return static_cast<std::size_t>((static_cast<std::uint64_t>(id) * 0x9E3779B97F4A7C15ull) >> this->shift);
+  }
+
+  /**
+   * Finds the empty slot an id which isn't in the map goes in, and gives it the id
+   */
+  Slot& insertSlot(std::size_t id) {
+    std::size_t i = this->index(id);
+    while (this->slots[i].id != npos) i = (i + 1) & (this->slots.size() - 1);
+    this->slots[i].id = id;
+    return this->slots[i];
+  }
+
+  /**
+   * Doubles the number of slots, moving the values into the new ones
+   */
+  void grow() {
+    std::vector<Slot> old(std::max(minSlots, this->slots.size() * 2));
+    old.swap(this->slots);
+    this->shift = 64;
+    for (std::size_t size = this->slots.size(); size > 1; size /= 2) --this->shift;
+    for (Slot& slot : old) {
+      if (slot.id != npos) this->insertSlot(slot.id).value = std::move(slot.value);
+    }
+  }
+
+  /** The slots, whose number is a power of two */
+  std::vector<Slot> slots;
+
+  /** The number of ids in the map */
+  std::size_t count = 0;
+
+  /** The number of bits to shift a hashed id by to get its slot: 64 less the base 2 logarithm of the slot count */
+  unsigned shift = 64;
+};
 
 /**
- * Gets a regex that will match if the string contains
- *
- * It consists of the following:
- *   One or more non-opening parentheses characters
- *   An open parentheses: (
- *   Zero or more non-closing parentheses
- *   A close parentheses: )
- *
- * It contains two capture groups:
- *   The characters before the open parentheses, representing the modifier name
- *   The characters between the parentheses, representing the parameter list
- *
- * @return the regex
+ * A mapping of modifier names to modifier functions, indexed by the interned ids of the names so that modifiers can be
+ * looked up by id without comparing strings.
  */
-const std::regex& getParametricModifierRegex() {
-  static const std::regex rgx(R"(([^\(]+)\(([^\)]*)\))");
-  return rgx;
-}
+class ModifierTable {
+public:
+  /** The name and function of a single modifier */
+  typedef std::pair<std::string, std::shared_ptr<IModifierFn>> value_type;
+
+  /** Iterates over the modifiers in the order they were added */
+  typedef std::vector<value_type>::const_iterator const_iterator;
+
+  /**
+   * Refers to the modifier function with a given name, as returned by operator[]. Assigning to it adds or replaces the
+   * modifier function, and so changes the revision of the table; reading through it doesn't add anything.
+   */
+  class Reference {
+  public:
+    /**
+     * Sets the modifier function with the referenced name
+     *
+     * @param fn the modifier function
+     * @return this reference
+     */
+    Reference& operator=(std::shared_ptr<IModifierFn> fn) {
+      this->table.insert_or_assign(this->name, std::move(fn));
+      return *this;
+    }
+
+    /**
+     * Gets the modifier function with the referenced name
+     *
+     * @return the modifier function, or nullptr if there is none
+     */
+    std::shared_ptr<IModifierFn> get() const {
+      auto iter = static_cast<const ModifierTable&>(this->table).find(this->name);
+      return iter == this->table.cend() ? nullptr : iter->second;
+    }
+
+    operator std::shared_ptr<IModifierFn>() const { return this->get(); }
+
+    std::shared_ptr<IModifierFn> operator->() const { return this->get(); }
+
+  private:
+    friend class ModifierTable;
+
+    Reference(ModifierTable& table, std::string name)
+        : table(table)
+        , name(std::move(name)) {
+    }
+
+    /** The table the modifier function is in */
+    ModifierTable& table;
+
+    /** The modifier name */
+    std::string name;
+  };
+
+  ModifierTable() : revision(ModifierTable::nextRevision()) {}
+
+  ModifierTable(const ModifierTable&) = default;
+
+  ModifierTable& operator=(const ModifierTable&) = default;
+
+  ModifierTable(ModifierTable&& other) noexcept
+      : entries(std::move(other.entries))
+      , slots(std::move(other.slots))
+      , revision(other.revision) {
+    other.revision = ModifierTable::nextRevision();
+  }
+
+  ModifierTable& operator=(ModifierTable&& other) noexcept {
+    this->entries = std::move(other.entries);
+    this->slots = std::move(other.slots);
+    this->revision = other.revision;
+    other.revision = ModifierTable::nextRevision();
+    return *this;
+  }
+
+  /**
+   * Refers to the modifier function with the given name, which assigning to the reference sets
+   *
+   * @param name the modifier name
+   * @return a reference to the modifier function with that name
+   */
+  Reference operator[](const std::string& name) {
+    return Reference(*this, name);
+  }
+
+  /**
+   * Sets the modifier function with the given name, adding it after the others if the table has none with that name
+   *
+   * @param name the modifier name
+   * @param fn the modifier function
+   */
+  void insert_or_assign(const std::string& name, std::shared_ptr<IModifierFn> fn) {
+    this->revision = ModifierTable::nextRevision();
+    std::size_t id = internModifierName(name);
+    if (const std::size_t* slot = this->slots.find(id)) {
+      this->entries[*slot].second = std::move(fn);
+    } else {
+      this->slots[id] = this->entries.size();
+      this->entries.emplace_back(name, std::move(fn));
+    }
+  }
+
+  /**
+   * Gets the modifier function with the given interned id
+   *
+   * @param id the interned id of the modifier name
+   * @return the modifier function, or nullptr if there is none
+   */
+  IModifierFn* get(std::size_t id) const {
+    const std::size_t* slot = this->slots.find(id);
+    return slot ? this->entries[*slot].second.get() : nullptr;
+  }
+
+  /**
+   * Finds the modifier with the given name. Modifiers are only changed through insert_or_assign, so there is no
+   * mutable iterator.
+   *
+   * @param name the modifier name
+   * @return an iterator to the modifier, or end() if there is none
+   */
+  const_iterator find(const std::string& name) const {
+    const std::size_t* slot = this->slots.find(getModifierNames().find(name));
+    return slot ? this->entries.begin() + *slot : this->entries.end();
+  }
+
+  const_iterator begin() const { return this->entries.begin(); }
+  const_iterator end() const { return this->entries.end(); }
+  const_iterator cbegin() const { return this->entries.cbegin(); }
+  const_iterator cend() const { return this->entries.cend(); }
+
+  /**
+   * Returns true if there are no modifiers
+   *
+   * @return true if there are no modifiers
+   */
+  bool empty() const { return this->entries.empty(); }
+
+  /**
+   * Returns the number of modifiers
+   *
+   * @return the number of modifiers
+   */
+  std::size_t size() const { return this->entries.size(); }
+
+  /**
+   * Gets the revision of the table. Revisions are unique in the process, and the revision of a table changes whenever
+   * a modifier function is set, so output flattened with one revision of a table can be reused while
+   * the table has the same revision. Copies of a table have the same revision until either is changed.
+   *
+   * @return the revision of the table
+   */
+  std::size_t getRevision() const { return this->revision; }
+
+private:
+  /**
+   * Gets a revision no table has had before
+   */
+  static std::size_t nextRevision() {
+    static std::atomic<std::size_t> last(0);
+    return last.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  /** The modifiers, in the order they were added */
+  std::vector<value_type> entries;
+
+  /** The index into entries of the modifier with each interned id */
+  IdMap<std::size_t> slots;
+
+  /** The revision of the table */
+  std::size_t revision;
+};
+
+/** Represents a mapping of modifier names to modifier functions */
+typedef ModifierTable callback_map_t;
 
 /**
- * True if the input contains a match for the regex returned by @see tracerz::details::getRuleRegex()
- *
- * @param input the input string to test
- * @return true if the input contains a match
+ * A bounded cache of compiled regular expressions, keyed by their pattern. Once the cache is full, the least recently
+ * used pattern is dropped to make room for a new one. The cache may be used from several threads at once.
  */
-bool containsRule(const std::string& input) {
-  return std::regex_search(input, details::getRuleRegex());
-}
+class RegexCache {
+public:
+  /**
+   * Creates an empty cache
+   *
+   * @param capacity the greatest number of patterns kept
+   */
+  explicit RegexCache(std::size_t capacity)
+      : capacity(std::max<std::size_t>(capacity, 1)) {
+  }
+
+  RegexCache(const RegexCache&) = delete;
+
+  RegexCache& operator=(const RegexCache&) = delete;
+
+  /**
+   * Gets the compiled regular expression for the given pattern, compiling it if it isn't in the cache
+   *
+   * @param pattern the pattern
+   * @return the compiled regular expression, which stays valid after it is dropped from the cache
+   * @throws std::regex_error if the pattern is not a valid regular expression
+   */
+  std::shared_ptr<const std::regex> get(const std::string& pattern) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      auto iter = this->index.find(pattern);
+      if (iter != this->index.end()) {
+        // Move the pattern to the front of the list, as the most recently used
+        this->entries.splice(this->entries.begin(), this->entries, iter->second);
+        return iter->second->second;
+      }
+    }
+
+    // Compiling is slower than anything else the cache does, so other threads aren't kept waiting for it. If two
+    // threads compile the same pattern at once, the first one to finish is kept.
+    auto compiled = std::make_shared<const std::regex>(pattern);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto iter = this->index.find(pattern);
+    if (iter != this->index.end()) return iter->second->second;
+    this->entries.emplace_front(pattern, compiled);
+    this->index.emplace(pattern, this->entries.begin());
+    if (this->entries.size() > this->capacity) {
+      this->index.erase(this->entries.back().first);
+      this->entries.pop_back();
+    }
+    return compiled;
+  }
+
+  /**
+   * Gets the number of patterns in the cache
+   *
+   * @return the number of patterns
+   */
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->entries.size();
+  }
+
+  /**
+   * Gets the greatest number of patterns kept
+   *
+   * @return the capacity of the cache
+   */
+  std::size_t getCapacity() const { return this->capacity; }
+
+private:
+  /** The greatest number of patterns kept */
+  const std::size_t capacity;
+
+  /** Guards the entries and the index */
+  mutable std::mutex mutex;
+
+  /** The patterns and their compiled regular expressions, most recently used first */
+  std::list<std::pair<std::string, std::shared_ptr<const std::regex>>> entries;
+
+  /** The entry of each pattern */
+  std::unordered_map<std::string, std::list<std::pair<std::string, std::shared_ptr<const std::regex>>>::iterator> index;
+};
 
 /**
- * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyActionsRegex()
+ * Gets the cache of compiled regular expressions shared by the "replace" modifier and grammars precompiling its
+ * patterns
  *
- * @param input the input string to test
- * @return true if the input contains a match
+ * @return the regex cache
  */
-bool containsOnlyActions(const std::string& input) {
-  return std::regex_match(input, details::getOnlyActionsRegex());
+inline RegexCache& getRegexCache() {
+  static RegexCache cache(256);
+  return cache;
 }
 
 /**
- * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyKeylessRuleActionRegex()
+ * Replaces every occurrence of the given target in the input with the replacement. The target is matched literally,
+ * and an empty target matches nothing.
  *
- * @param input the input string to test
- * @return true if the input contains a match
+ * @param input the input string
+ * @param target the substring to replace
+ * @param replacement the string to replace it with
+ * @return the input with each occurrence of target replaced
  */
-bool containsOnlyKeylessRuleAction(const std::string& input) {
-  return std::regex_match(input, details::getOnlyKeylessRuleActionRegex());
+inline std::string replaceLiteral(const std::string& input, const std::string& target, const std::string& replacement) {
+  if (target.empty()) return input;
+
+  std::string output;
+  std::size_t copied = 0;
+  for (std::size_t found = input.find(target); found != std::string::npos; found = input.find(target, copied)) {
+    // Reserve once something is known to be replaced
+    if (copied == 0) output.reserve(input.size());
+    output.append(input, copied, found - copied);
+    output += replacement;
+    copied = found + target.size();
+  }
+  if (copied == 0) return input;
+  output.append(input, copied, std::string::npos);
+  return output;
 }
 
 /**
- * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyKeyWithTextActionRegex()
+ * Returns the action regular expression
  *
- * @param input the input string to test
- * @return true if the input contains a match
+ * An action is defined as follows:
+ *   An open bracket: [
+ *   Followed by zero or more non-close bracket characters
+ *   A close bracket: ]
+ *
+ * It has one capture group: the entire contents of the bracketed characters
+ *
+ * @return the regex
  */
-bool containsOnlyKeyWithTextAction(const std::string& input) {
-  return std::regex_match(input, details::getOnlyKeyWithTextActionRegex());
+inline const std::regex& getActionRegex() {
+  static const std::regex rgx(R"(\[([^\]]*)\])");
+  return rgx;
 }
 
 /**
- * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyKeyWithRuleActionRegex()
+ * Gets a comma regex (to make splitting on commas into a container with iterators easy)
  *
- * @param input the input string to test
- * @return true if the input contains a match
+ * It's literally just a comma
+ *
+ * It contains no capture group.
+ *
+ * @return the regex
  */
-bool containsOnlyKeyWithRuleAction(const std::string& input) {
-  return std::regex_match(input, details::getOnlyKeyWithRuleActionRegex());
+inline const std::regex& getCommaRegex() {
+  static const std::regex rgx(",");
+  return rgx;
 }
 
 /**
- * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyRuleRegex()
+ * Gets a basic modifier regex.
  *
- * @param input the input string to test
- * @return true if the input contains a match
+ * It consists of the following:
+ *   A dot: .
+ *   Followed by one or more not dots
+ *
+ * It has one capture group: the non-dot matching characters
+ *
+ * @return the regex
  */
-bool containsOnlyRule(const std::string& input) {
-  return std::regex_match(input, details::getOnlyRuleRegex());
+inline const std::regex& getModifierRegex() {
+  static const std::regex rgx(R"(\.([^\.]+))");
+  return rgx;
 }
 
 /**
- * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyRuleWithActionsRegex()
+ * Gets a regex that will match iff the input contains only tracery action groups
  *
- * @param input the input string to test
- * @return true if the input contains a match
- */
-bool containsOnlyRuleWithActions(const std::string& input) {
-  return std::regex_match(input, details::getOnlyRuleWithActionsRegex());
-}
+ * It consists of the following:
+ *   The beginning of a line
+ *   One or more of the non-capturing group:
+ *     An opening bracket: [
+ *     Zero or more non-close brackets
+ *     A closing bracket: ]
+ *   The end of a line
+ *
+ * It contains no capture group.
+ *
+ * @return the regex
+ */
+inline const std::regex& getOnlyActionsRegex() {
+  // (?: ... ) is a non-capturing group
+  static const std::regex rgx(R"(^(?:\[[^\]]*\])+$)");
+  return rgx;
+}
+
+/**
+ * Gets a regex that will match iff the input contains only an action that sets a key to plain text
+ *
+ * It consists of the following:
+ *   The beginning of a line
+ *   An opening bracket: [
+ *   One or more alpha numeric characters (representing a key name)
+ *   A colon: :
+ *   One or more non-# and non-] characters
+ *   A closing bracket: ]
+ *   The end of a line
+ *
+ * It contains two capture groups:
+ *   The key name (the alphanumeric characters before the colon)
+ *   The plain text value (the characters between the colon and the closing bracket)
+ *
+ * @return the regex
+ */
+inline const std::regex& getOnlyKeyWithTextActionRegex() {
+  static const std::regex rgx(R"(^\[([[:alnum:]]+):([^#\]]+)\]$)");
+  return rgx;
+}
+
+/**
+ * Gets a regex that will match iff the input contains only an action group that sets a key to the result of a rule with
+ * zero or more modifiers
+ *
+ * It consists of the following:
+ *   The beginning of a line
+ *   An opening bracket: [
+ *   One or more alphanumeric characters, representing a key name
+ *   A colon: :
+ *   An octothorpe: #
+ *   One or more alphanumeric characters, representing a rule name
+ *   Zero or more of the non-capturing group, each representing a modifier:
+ *     A dot: .
+ *     One or more non-#, non-. characters
+ *   An octothorpe: #
+ *   A closing bracket: ]
+ *   The end of a line
+ *
+ * It contains two capture groups:
+ *   The key name
+ *   The rule and optional modifiers, including surrounding octothorpes
+ *
+ * @return the regex
+ */
+inline const std::regex& getOnlyKeyWithRuleActionRegex() {
+  static const std::regex rgx(R"(^\[([[:alnum:]]+):(#[[:alnum:]]+(?:\.[^.#]+)*#)\]$)");
+  return rgx;
+}
+
+/**
+ * Gets a regex that will match iff the input contains only an action group that does not set a key. These action groups
+ * contain one rule, possibly with modifiers. Usually these rules create keys themselves, acting as a kind of
+ * function within the language.
+ *
+ * It consists of the following:
+ *   The beginning of a line
+ *   An opening bracket: [
+ *   An octothorpe: #
+ *   One or more alphanumeric characters, representing a rule name
+ *   Zero or more of the non-capturing group, each representing a modifier:
+ *     A dot: .
+ *     One or more non-#, non-. characters
+ *   An octothorpe: #
+ *   A closing bracket: ]
+ *   The end of a line
+ *
+ * It contains one capture groups: the rule and optional modifiers, including surrounding octothorpes
+ *
+ * @return the regex
+ */
+inline const std::regex& getOnlyKeylessRuleActionRegex() {
+  static const std::regex rgx(R"(^\[(#[[:alnum:]]+(?:\.[^.#]+)*#)\]$)");
+  return rgx;
+}
+
+/**
+ * Gets a regex that will match iff the input contains only a rule with an optional set of modifiers
+ *
+ * It consists of the following:
+ *   The beginning of a line
+ *   An octothorpe: #
+ *   One or more alphanumeric characters, representing a rule name
+ *   Zero or more of the non-capturing group, each representing a modifier:
+ *     A dot: .
+ *     One or more non-#, non-. characters
+ *   An octothorpe: #
+ *   The end of a line
+ *
+ * It contains two capture groups:
+ *   The rule name
+ *   The string of all characters representing zero or more modifiers (possibly empty)
+ *
+ * @return the regex
+ */
+inline const std::regex& getOnlyRuleRegex() {
+  static const std::regex rgx(R"(^#([[:alnum:]]+)((?:\.[^.#]+)*)#$)");
+  return rgx;
+}
+
+/**
+ * Gets a regex that will match iff the input contains only a rule with at least one action and an optional set of
+ * modifiers
+ *
+ * It consists of the following:
+ *   The beginning of a line
+ *   An octothorpe: #
+ *   One or more of the non-capturing group, each representing an action group:
+ *     An opening bracket: [
+ *     Zero or more characters
+ *     A closing bracket: ]
+ *   One or more alphanumeric characters, representing a rule name
+ *   Zero or more of the non-capturing group, each representing a modifier:
+ *     A dot: .
+ *     One or more non-#, non-. characters
+ *   An octothorpe: #
+ *   The end of a line
+ *
+ * It contains three capture groups:
+ *   The string of all characters representing the one or more action groups
+ *   The rule name
+ *   The string of all characters representing zero or more modifiers (possibly empty)
+ *
+ * @return the regex
+ */
+inline const std::regex& getOnlyRuleWithActionsRegex() {
+  static const std::regex rgx(R"(^#((?:\[.*\])+)([[:alnum:]]+)((?:\.[^.#]+)*)#$)");
+  return rgx;
+}
+
+/**
+ * Gets a regex that will match if the input contains a rule with an optional action and an optional set of modifiers.
+ *
+ * It consists of the following:
+ *   An octothorpe: #
+ *   Zero or more of the non-capturing group, each representing an action group:
+ *     An opening bracket: [
+ *     Zero or more characters
+ *     A closing bracket: ]
+ *   One or more alphanumeric characters, representing a rule name
+ *   Zero or more of the non-capturing group, each representing a modifier:
+ *     A dot: .
+ *     One or more non-#, non-. characters
+ *   An octothorpe: #
+ *
+ * It contains three capture groups:
+ *   The string of all characters representing the one or more action groups
+ *   The rule name
+ *   The string of all characters representing zero or more modifiers (possibly empty)
+ *
+ * @return the regex
+ */
+inline const std::regex& getRuleRegex() {
+  static const std::regex rgx(R"(#(?:\[[^\]]*\])*([[:alnum:]]+)((?:\.[^.#]+)*)#)");
+  return rgx;
+}
+
+/**
+ * Gets a regex that will match if the string contains
+ *
+ * It consists of the following:
+ *   One or more non-opening parentheses characters
+ *   An open parentheses: (
+ *   Zero or more non-closing parentheses
+ *   A close parentheses: )
+ *
+ * It contains two capture groups:
+ *   The characters before the open parentheses, representing the modifier name
+ *   The characters between the parentheses, representing the parameter list
+ *
+ * @return the regex
+ */
+inline const std::regex& getParametricModifierRegex() {
+  static const std::regex rgx(R"(([^\(]+)\(([^\)]*)\))");
+  return rgx;
+}
+
+/**
+ * True if the input contains a match for the regex returned by @see tracerz::details::getRuleRegex()
+ *
+ * @param input the input string to test
+ * @return true if the input contains a match
+ */
+inline bool containsRule(const std::string& input) {
+  return std::regex_search(input, details::getRuleRegex());
+}
+
+/**
+ * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyActionsRegex()
+ *
+ * @param input the input string to test
+ * @return true if the input contains a match
+ */
+inline bool containsOnlyActions(const std::string& input) {
+  return std::regex_match(input, details::getOnlyActionsRegex());
+}
+
+/**
+ * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyKeylessRuleActionRegex()
+ *
+ * @param input the input string to test
+ * @return true if the input contains a match
+ */
+inline bool containsOnlyKeylessRuleAction(const std::string& input) {
+  return std::regex_match(input, details::getOnlyKeylessRuleActionRegex());
+}
+
+/**
+ * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyKeyWithTextActionRegex()
+ *
+ * @param input the input string to test
+ * @return true if the input contains a match
+ */
+inline bool containsOnlyKeyWithTextAction(const std::string& input) {
+  return std::regex_match(input, details::getOnlyKeyWithTextActionRegex());
+}
+
+/**
+ * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyKeyWithRuleActionRegex()
+ *
+ * @param input the input string to test
+ * @return true if the input contains a match
+ */
+inline bool containsOnlyKeyWithRuleAction(const std::string& input) {
+  return std::regex_match(input, details::getOnlyKeyWithRuleActionRegex());
+}
+
+/**
+ * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyRuleRegex()
+ *
+ * @param input the input string to test
+ * @return true if the input contains a match
+ */
+inline bool containsOnlyRule(const std::string& input) {
+  return std::regex_match(input, details::getOnlyRuleRegex());
+}
+
+/**
+ * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyRuleWithActionsRegex()
+ *
+ * @param input the input string to test
+ * @return true if the input contains a match
+ */
+inline bool containsOnlyRuleWithActions(const std::string& input) {
+  return std::regex_match(input, details::getOnlyRuleWithActionsRegex());
+}
+
+/**
+ * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyParametricModifierRegex()
+ *
+ * @param input the input string to test
+ * @return true if the input contains a match
+ */
+inline bool containsParametricModifier(const std::string& input) {
+  return std::regex_match(input, details::getParametricModifierRegex());
+}
+
+/**
+ * Returns true if the character is alphanumeric, matching the `[[:alnum:]]` class used by the regular expressions above
+ *
+ * @param chr the character to test
+ * @return true if the character is alphanumeric
+ */
+constexpr bool isAlphaNumChar(char chr) {
+  return ((chr >= 'a' && chr <= 'z') ||
+          (chr >= 'A' && chr <= 'Z') ||
+          (chr >= '0' && chr <= '9'));
+}
+
+/**
+ * The parts of a rule found by the scanner. Each part is a view into the scanned string.
+ */
+struct RuleToken {
+  /** The position of the opening octothorpe */
+  std::size_t begin = 0;
+
+  /** The position one past the closing octothorpe */
+  std::size_t end = 0;
+
+  /** The action groups preceding the rule name, e.g. `[key:value]` (possibly empty) */
+  std::string_view actions;
+
+  /** The rule name */
+  std::string_view name;
+
+  /** The modifiers, each including its leading dot, e.g. `.s.replace(a,b)` (possibly empty) */
+  std::string_view modifiers;
+};
+
+/**
+ * Scans a single action group, equivalent to `\[[^\]]*\]`, starting at the given position
+ *
+ * @param input the string to scan
+ * @param pos the position of the opening bracket
+ * @return the position one past the closing bracket, or std::string_view::npos if there is no action group at pos
+ */
+constexpr std::size_t scanActionGroup(std::string_view input, std::size_t pos) {
+  if (pos >= input.size() || input[pos] != '[') return std::string_view::npos;
+  std::size_t close = input.find(']', pos + 1);
+  return close == std::string_view::npos ? close : close + 1;
+}
+
+/**
+ * Scans the end of a rule, equivalent to `([[:alnum:]]+)((?:\.[^.#]+)*)#`, starting at the given position, filling in
+ * the name, modifiers, and end of the given token.
+ *
+ * @param input the string to scan
+ * @param pos the position of the first character of the rule name
+ * @param token the token to fill in
+ * @return true if the end of a rule was found at pos
+ */
+constexpr bool scanRuleTail(std::string_view input, std::size_t pos, RuleToken& token) {
+  // One or more alphanumeric characters for the name
+  std::size_t cur = pos;
+  while (cur < input.size() && isAlphaNumChar(input[cur])) cur++;
+  if (cur == pos) return false;
+  token.name = input.substr(pos, cur - pos);
+
+  // Zero or more modifiers, each a dot followed by one or more non-dot, non-octothorpe characters
+  std::size_t modsBegin = cur;
+  while (cur < input.size() && input[cur] == '.') {
+    std::size_t next = cur + 1;
+    while (next < input.size() && input[next] != '.' && input[next] != '#') next++;
+    if (next == cur + 1) break;
+    cur = next;
+  }
+  token.modifiers = input.substr(modsBegin, cur - modsBegin);
+
+  // The closing octothorpe
+  if (cur >= input.size() || input[cur] != '#') return false;
+  token.end = cur + 1;
+  return true;
+}
+
+/**
+ * Scans a rule, equivalent to the regex returned by tracerz::details::getRuleRegex(), starting exactly at the given
+ * position.
+ *
+ * @param input the string to scan
+ * @param pos the position of the opening octothorpe
+ * @param allowActions if false, the rule may not contain action groups
+ * @return the rule found at pos, if any
+ */
+constexpr std::optional<RuleToken> scanRule(std::string_view input, std::size_t pos, bool allowActions = true) {
+  if (pos >= input.size() || input[pos] != '#') return std::nullopt;
+
+  RuleToken token;
+  token.begin = pos;
+
+  // Zero or more action groups. Because the rule name can't start with a bracket, consuming as many groups as possible
+  // never prevents a match.
+  std::size_t cur = pos + 1;
+  if (allowActions) {
+    for (std::size_t next = scanActionGroup(input, cur);
+         next != std::string_view::npos;
+         next = scanActionGroup(input, cur)) {
+      cur = next;
+    }
+  }
+  token.actions = input.substr(pos + 1, cur - pos - 1);
+
+  if (!scanRuleTail(input, cur, token)) return std::nullopt;
+  return token;
+}
+
+/**
+ * Finds the leftmost rule at or after the given position, equivalent to searching with the regex returned by
+ * tracerz::details::getRuleRegex()
+ *
+ * @param input the string to scan
+ * @param pos the position to start searching at
+ * @return the leftmost rule, if any
+ */
+constexpr std::optional<RuleToken> findRule(std::string_view input, std::size_t pos = 0) {
+  for (pos = input.find('#', pos); pos != std::string_view::npos; pos = input.find('#', pos + 1)) {
+    if (auto token = scanRule(input, pos)) return token;
+  }
+  return std::nullopt;
+}
+
+/**
+ * Scans the entire input as a rule with at least one action, equivalent to the regex returned by
+ * tracerz::details::getOnlyRuleWithActionsRegex()
+ *
+ * @param input the string to scan
+ * @return the rule, if the input contains only a rule with actions
+ */
+constexpr std::optional<RuleToken> scanOnlyRuleWithActions(std::string_view input) {
+  if (input.size() < 2 || input[0] != '#' || input[1] != '[' || input.back() != '#') return std::nullopt;
+
+  // The actions are matched by `(?:\[.*\])+`, and `.` doesn't match line breaks
+  std::size_t limit = std::min(input.find_first_of("\n\r"), input.size());
+
+  // Like the greedy `.*`, prefer the rightmost closing bracket that leaves a valid rule name and modifiers after it
+  for (std::size_t close = input.rfind(']', limit - 1);
+       close != std::string_view::npos && close > 1;
+       close = input.rfind(']', close - 1)) {
+    RuleToken token;
+    if (scanRuleTail(input, close + 1, token) && token.end == input.size()) {
+      token.begin = 0;
+      token.actions = input.substr(1, close);
+      return token;
+    }
+  }
+  return std::nullopt;
+}
+
+/**
+ * Scans the entire input as one or more action groups, equivalent to the regex returned by
+ * tracerz::details::getOnlyActionsRegex()
+ *
+ * @param input the string to scan
+ * @param actions if not null, filled with each action group
+ * @return true if the input contains only actions
+ */
+constexpr bool scanOnlyActions(std::string_view input, std::vector<std::string_view>* actions = nullptr) {
+  if (input.empty()) return false;
+
+  std::size_t pos = 0;
+  while (pos < input.size()) {
+    std::size_t next = scanActionGroup(input, pos);
+    if (next == std::string_view::npos) return false;
+    if (actions) actions->push_back(input.substr(pos, next - pos));
+    pos = next;
+  }
+  return true;
+}
+
+/**
+ * Scans the key name and colon at the start of an action, equivalent to `\[([[:alnum:]]+):`
+ *
+ * @param input the string to scan
+ * @return the position after the colon, or std::string_view::npos if the input doesn't start with a key
+ */
+constexpr std::size_t scanActionKey(std::string_view input) {
+  if (input.empty() || input[0] != '[') return std::string_view::npos;
+
+  std::size_t cur = 1;
+  while (cur < input.size() && isAlphaNumChar(input[cur])) cur++;
+  if (cur == 1 || cur >= input.size() || input[cur] != ':') return std::string_view::npos;
+  return cur + 1;
+}
+
+/**
+ * Splits the input on commas, the same way as a std::sregex_token_iterator over the regex returned by
+ * tracerz::details::getCommaRegex(): an empty input produces one empty token, and an empty token after the last comma
+ * is dropped.
+ *
+ * @param input the string to split
+ * @return the tokens
+ */
+inline std::vector<std::string> splitCommas(std::string_view input) {
+  std::vector<std::string> ret;
+  std::size_t pos = 0;
+  for (std::size_t comma = input.find(','); comma != std::string_view::npos; comma = input.find(',', pos)) {
+    ret.emplace_back(input.substr(pos, comma - pos));
+    pos = comma + 1;
+  }
+  if (pos < input.size() || ret.empty()) ret.emplace_back(input.substr(pos));
+  return ret;
+}
+
+/**
+ * The kinds of input a tree node can contain. Each input string is classified exactly once, when it is compiled into a
+ * tracerz::details::CompiledNode.
+ */
+enum class NodeType {
+  /** Plain text containing no rules or actions. Nodes of this type are complete. */
+  Text,
+
+  /** Only a rule with optional modifiers: `#rule.mod#` */
+  Rule,
+
+  /** Only a rule with one or more actions and optional modifiers: `#[action]rule.mod#` */
+  RuleWithActions,
+
+  /** Only an action expanding a rule without setting a key: `[#rule.mod#]` */
+  KeylessRuleAction,
+
+  /** Only an action setting a key to the expansion of a rule: `[key:#rule.mod#]` */
+  KeyWithRuleAction,
+
+  /** Only an action setting a key to plain text or a list of plain text: `[key:a,b,c]` */
+  KeyWithTextAction,
+
+  /** One or more actions: `[action][action]` */
+  Actions,
+
+  /** Some mix of rules and plain text */
+  Mixed
+};
+
+/**
+ * A single modifier application, split into the modifier name and its parameters (if any)
+ */
+struct ModifierCall {
+  /** The full text of the modifier, e.g. `replace(a,b)` */
+  std::string text;
+
+  /** The name of the modifier, e.g. `replace` */
+  std::string name;
+
+  /** The parameters passed to the modifier, e.g. `a` and `b` */
+  std::vector<std::string> params;
+
+  /** The interned id of the modifier name, see tracerz::details::internModifierName */
+  std::size_t id = 0;
+};
+
+#ifdef TRACERZ_USE_REGEX
+/** If true, input strings are classified with the regular expressions above instead of the scanner */
+constexpr bool useRegexClassifier = true;
+#else
+/** If true, input strings are classified with the regular expressions above instead of the scanner */
+constexpr bool useRegexClassifier = false;
+#endif
+
+/**
+ * Splits the text of a single modifier into its name and parameter list
+ *
+ * @param mod the modifier text, without the leading dot
+ * @param useRegex if true, use the regular expressions above instead of the scanner
+ * @return the parsed modifier
+ */
+inline ModifierCall parseModifier(const std::string& mod, bool useRegex = useRegexClassifier) {
+  ModifierCall call{mod, mod, {}, 0};
+
+  if (useRegex) {
+    if (details::containsParametricModifier(mod)) {
+      // If it contains a modifier that takes parameters, extract the modifier name from the first capture group
+      call.name = std::regex_replace(mod, details::getParametricModifierRegex(), "$1");
+
+      // Get the string representing the list of params from the second capture group
+      std::string paramsStr = std::regex_replace(mod, details::getParametricModifierRegex(), "$2");
+
+      // Use comma regex to separate params and fill params vector
+      std::copy(std::sregex_token_iterator(paramsStr.begin(),
+                                           paramsStr.end(),
+                                           details::getCommaRegex(),
+                                           -1),
+                std::sregex_token_iterator(),
+                std::back_inserter(call.params));
+    }
+  } else {
+    // A parametric modifier is one or more non-open parentheses, then the parameter list in parentheses, containing no
+    // close parentheses
+    std::size_t open = mod.find('(');
+    if (open != std::string::npos && open > 0 && mod.find(')', open + 1) == mod.size() - 1) {
+      call.name = mod.substr(0, open);
+      call.params = details::splitCommas(std::string_view(mod).substr(open + 1, mod.size() - open - 2));
+    }
+  }
+
+  call.id = internModifierName(call.name);
+  return call;
+}
+
+/**
+ * The compiled form of a single input string. The string is classified into a tracerz::details::NodeType and split
+ * into its component parts once, so that expanding a node never needs to inspect its input string again.
+ */
+struct CompiledNode {
+  /** The classification of the input */
+  NodeType type = NodeType::Text;
+
+  /** The input string this was compiled from */
+  std::string input;
+
+  /** The rule name for rules, or the key name for actions setting a key */
+  std::string name;
+
+  /** The interned id of the name, see tracerz::details::internRuleName */
+  std::size_t nameId = 0;
+
+  /** The modifiers applied to a rule */
+  std::vector<ModifierCall> modifiers;
+
+  /** The plain text values assigned by a tracerz::details::NodeType::KeyWithTextAction */
+  std::vector<std::string> values;
+
+  /** The compiled parts this input is split into when it is expanded */
+  std::vector<std::shared_ptr<const CompiledNode>> children;
+
+  /**
+   * Returns true if a node with this input is complete (cannot be expanded)
+   *
+   * @return true if a node with this input is complete
+   */
+  bool isComplete() const { return this->type == NodeType::Text; }
+};
+
+/**
+ * Classifies the given node's input string using the regular expressions above. Fills in the node, and the list of
+ * input strings its children will be compiled from.
+ *
+ * @param node the node to classify
+ * @param childInputs the list of child input strings to fill
+ */
+inline void classifyWithRegex(CompiledNode& node, std::vector<std::string>& childInputs) {
+  const std::string& input = node.input;
+
+  // Splits a string of zero or more modifiers into the node's list of modifiers
+  auto addModifiers = [&node](const std::string& modsStr) {
+    std::for_each(std::sregex_token_iterator(modsStr.begin(),
+                                             modsStr.end(),
+                                             details::getModifierRegex(),
+                                             1),
+                  std::sregex_token_iterator(),
+                  [&node](auto& mtch) {
+                    node.modifiers.push_back(parseModifier(mtch.str(), true));
+                  });
+  };
+
+  if (!details::containsRule(input) && !details::containsOnlyActions(input)) {
+    node.type = NodeType::Text;
+  } else if (details::containsOnlyRule(input)) {
+    // Rule name from the first capture group, modifiers from the second
+    node.type = NodeType::Rule;
+    node.name = std::regex_replace(input, details::getOnlyRuleRegex(), "$1");
+    addModifiers(std::regex_replace(input, details::getOnlyRuleRegex(), "$2"));
+  } else if (details::containsOnlyRuleWithActions(input)) {
+    // Split into the list of actions and the rule. The rule has been stripped of surrounding octothorpes, so add them
+    // back in.
+    node.type = NodeType::RuleWithActions;
+    childInputs.push_back(std::regex_replace(input, details::getOnlyRuleWithActionsRegex(), "$1"));
+    childInputs.push_back("#" + std::regex_replace(input, details::getOnlyRuleWithActionsRegex(), "$2$3") + "#");
+  } else if (details::containsOnlyKeylessRuleAction(input)) {
+    node.type = NodeType::KeylessRuleAction;
+    childInputs.push_back(std::regex_replace(input, details::getOnlyKeylessRuleActionRegex(), "$1"));
+  } else if (details::containsOnlyKeyWithRuleAction(input)) {
+    node.type = NodeType::KeyWithRuleAction;
+    node.name = std::regex_replace(input, details::getOnlyKeyWithRuleActionRegex(), "$1");
+    childInputs.push_back(std::regex_replace(input, details::getOnlyKeyWithRuleActionRegex(), "$2"));
+  } else if (details::containsOnlyKeyWithTextAction(input)) {
+    node.type = NodeType::KeyWithTextAction;
+    node.name = std::regex_replace(input, details::getOnlyKeyWithTextActionRegex(), "$1");
+
+    // Split the text on commas. Note that because a single item will contain no commas, this will produce one value
+    // even if no list is present.
+    std::string txt = std::regex_replace(input, details::getOnlyKeyWithTextActionRegex(), "$2");
+    std::copy(std::sregex_token_iterator(txt.begin(),
+                                         txt.end(),
+                                         details::getCommaRegex(),
+                                         -1),
+              std::sregex_token_iterator(),
+              std::back_inserter(node.values));
+  } else if (details::containsOnlyActions(input)) {
+    node.type = NodeType::Actions;
+    std::for_each(std::sregex_token_iterator(input.begin(),
+                                             input.end(),
+                                             details::getActionRegex(),
+                                             0),
+                  std::sregex_token_iterator(),
+                  [&childInputs](auto& mtch) {
+                    childInputs.push_back(mtch.str());
+                  });
+  } else {
+    // Some mix of strings, use the rule regex to separate it into strings representing rules and strings representing
+    // non-rules.
+    node.type = NodeType::Mixed;
+    std::for_each(std::sregex_token_iterator(input.begin(),
+                                             input.end(),
+                                             details::getRuleRegex(),
+                                             {-1, 0}),
+                  std::sregex_token_iterator(),
+                  [&childInputs](auto& mtch) {
+                    childInputs.push_back(mtch.str());
+                  });
+  }
+}
+
+/**
+ * Classifies the given input string with the scanner, as tracerz::details::compileNode does. Needs no allocation, so it
+ * can classify input strings at compile time, see tracerz::checkStaticGrammar.
+ *
+ * @param input the input string
+ * @return the type of node the input compiles to
+ */
+constexpr NodeType scanNodeType(std::string_view input) {
+  // Scans a rule with no actions that spans from pos to the given end of the input
+  auto isBareRule = [input](std::size_t pos, std::size_t end) {
+    auto token = details::scanRule(input, pos, false);
+    return token && token->end == end;
+  };
+
+  bool onlyActions = details::scanOnlyActions(input);
+  std::size_t keyEnd = details::scanActionKey(input);
+  bool isBracketed = input.size() > 2 && input.front() == '[' && input.back() == ']';
+
+  if (!details::findRule(input) && !onlyActions) return NodeType::Text;
+  if (isBareRule(0, input.size())) return NodeType::Rule;
+  if (details::scanOnlyRuleWithActions(input)) return NodeType::RuleWithActions;
+  if (isBracketed && isBareRule(1, input.size() - 1)) return NodeType::KeylessRuleAction;
+  if (isBracketed && keyEnd != std::string_view::npos && isBareRule(keyEnd, input.size() - 1)) {
+    return NodeType::KeyWithRuleAction;
+  }
+  if (isBracketed && keyEnd != std::string_view::npos && keyEnd < input.size() - 1
+      && input.substr(keyEnd, input.size() - 1 - keyEnd).find_first_of("#]") == std::string_view::npos) {
+    return NodeType::KeyWithTextAction;
+  }
+  if (onlyActions) return NodeType::Actions;
+  return NodeType::Mixed;
+}
+
+/**
+ * Calls `onRule(name)` for each rule the given input string references, and `onKey(name)` for each key its actions set,
+ * splitting it into parts as tracerz::details::compileNode does. Needs no allocation, so it can walk input strings at
+ * compile time.
+ *
+ * @tparam OnRule the type of the rule callback
+ * @tparam OnKey the type of the key callback
+ * @param input the input string
+ * @param onRule the rule callback
+ * @param onKey the key callback
+ */
+template<typename OnRule, typename OnKey>
+constexpr void scanReferences(std::string_view input, OnRule& onRule, OnKey& onKey) {
+  switch (scanNodeType(input)) {
+    case NodeType::Text:
+      break;
+    case NodeType::Rule:
+      onRule(details::scanRule(input, 0, false)->name);
+      break;
+    case NodeType::RuleWithActions: {
+      auto ruleWithActions = details::scanOnlyRuleWithActions(input);
+      scanReferences(ruleWithActions->actions, onRule, onKey);
+      onRule(ruleWithActions->name);
+      break;
+    }
+    case NodeType::KeylessRuleAction:
+      scanReferences(input.substr(1, input.size() - 2), onRule, onKey);
+      break;
+    case NodeType::KeyWithRuleAction: {
+      std::size_t keyEnd = details::scanActionKey(input);
+      onKey(input.substr(1, keyEnd - 2));
+      scanReferences(input.substr(keyEnd, input.size() - 1 - keyEnd), onRule, onKey);
+      break;
+    }
+    case NodeType::KeyWithTextAction:
+      onKey(input.substr(1, details::scanActionKey(input) - 2));
+      break;
+    case NodeType::Actions:
+      for (std::size_t pos = 0; pos < input.size();) {
+        std::size_t next = details::scanActionGroup(input, pos);
+        scanReferences(input.substr(pos, next - pos), onRule, onKey);
+        pos = next;
+      }
+      break;
+    case NodeType::Mixed: {
+      std::size_t pos = 0;
+      for (auto rule = details::findRule(input); rule; rule = details::findRule(input, pos)) {
+        scanReferences(input.substr(pos, rule->begin - pos), onRule, onKey);
+        scanReferences(input.substr(rule->begin, rule->end - rule->begin), onRule, onKey);
+        pos = rule->end;
+      }
+      scanReferences(input.substr(pos), onRule, onKey);
+      break;
+    }
+  }
+}
+
+/**
+ * Classifies the given node's input string in a single pass using the scanner, producing exactly the same result as
+ * tracerz::details::classifyWithRegex(). Fills in the node, and the list of input strings its children will be
+ * compiled from.
+ *
+ * @param node the node to classify
+ * @param childInputs the list of child input strings to fill
+ */
+inline void classifyWithScanner(CompiledNode& node, std::vector<std::string>& childInputs) {
+  std::string_view input = node.input;
+
+  // Splits a string of zero or more modifiers, each starting with a dot, into the node's list of modifiers
+  auto addModifiers = [&node](std::string_view modsStr) {
+    for (std::size_t pos = 0; pos < modsStr.size();) {
+      std::size_t next = std::min(modsStr.find('.', pos + 1), modsStr.size());
+      node.modifiers.push_back(parseModifier(std::string(modsStr.substr(pos + 1, next - pos - 1)), false));
+      pos = next;
+    }
+  };
+
+  node.type = details::scanNodeType(input);
+  switch (node.type) {
+    case NodeType::Text:
+      break;
+    case NodeType::Rule: {
+      auto rule = details::scanRule(input, 0, false);
+      node.name = rule->name;
+      addModifiers(rule->modifiers);
+      break;
+    }
+    case NodeType::RuleWithActions: {
+      auto ruleWithActions = details::scanOnlyRuleWithActions(input);
+      childInputs.emplace_back(ruleWithActions->actions);
+      childInputs.push_back("#" + std::string(ruleWithActions->name) + std::string(ruleWithActions->modifiers) + "#");
+      break;
+    }
+    case NodeType::KeylessRuleAction:
+      childInputs.emplace_back(input.substr(1, input.size() - 2));
+      break;
+    case NodeType::KeyWithRuleAction: {
+      std::size_t keyEnd = details::scanActionKey(input);
+      node.name = input.substr(1, keyEnd - 2);
+      childInputs.emplace_back(input.substr(keyEnd, input.size() - 1 - keyEnd));
+      break;
+    }
+    case NodeType::KeyWithTextAction: {
+      std::size_t keyEnd = details::scanActionKey(input);
+      node.name = input.substr(1, keyEnd - 2);
+      node.values = details::splitCommas(input.substr(keyEnd, input.size() - 1 - keyEnd));
+      break;
+    }
+    case NodeType::Actions: {
+      std::vector<std::string_view> actions;
+      details::scanOnlyActions(input, &actions);
+      for (auto action : actions) {
+        childInputs.emplace_back(action);
+      }
+      break;
+    }
+    case NodeType::Mixed: {
+      // Some mix of strings, separate it into strings representing rules and strings representing non-rules.
+      std::size_t pos = 0;
+      for (auto rule = details::findRule(input); rule; rule = details::findRule(input, pos)) {
+        childInputs.emplace_back(input.substr(pos, rule->begin - pos));
+        childInputs.emplace_back(input.substr(rule->begin, rule->end - rule->begin));
+        pos = rule->end;
+      }
+      childInputs.emplace_back(input.substr(pos));
+      break;
+    }
+  }
+}
+
+/**
+ * Compiles the given input string, classifying it and recursively compiling each of the parts it will be split into
+ * when expanded.
+ *
+ * @param input the input string
+ * @param useRegex if true, classify using the regular expressions above instead of the scanner
+ * @return the compiled input
+ */
+inline std::shared_ptr<const CompiledNode> compileNode(const std::string& input, bool useRegex = useRegexClassifier) {
+  std::shared_ptr<CompiledNode> node(new CompiledNode);
+  node->input = input;
+
+  std::vector<std::string> childInputs;
+  if (useRegex) {
+    details::classifyWithRegex(*node, childInputs);
+  } else {
+    details::classifyWithScanner(*node, childInputs);
+  }
+
+  // Compile each child, skipping empty strings. An input that isn't recognized as any other type can split into itself
+  // (e.g. a single action with no key, or a rule whose actions contain a line break); leave it without that child
+  // instead of recursing forever.
+  for (auto& childInput : childInputs) {
+    if (!childInput.empty() && childInput != input) node->children.push_back(compileNode(childInput, useRegex));
+  }
+
+  if (!node->name.empty()) node->nameId = internRuleName(node->name);
+  return node;
+}
+
+/**
+ * The rulesets pushed onto rule names while expanding, each of which is either a single string or a list of strings to
+ * select from. Rule names are looked up by their interned ids, in a map of ruleset stacks. The strings are kept
+ * in a pool along with their compiled form, which is only compiled once they are expanded. Clearing the dictionary
+ * keeps the memory of the stacks and the pool, so that it can be reused from one expansion to the next.
+ *
+ * Forking a dictionary freezes its contents into an immutable snapshot, shared by the dictionary and the fork. Each rule
+ * stack of the snapshot is copied into the dictionary the first time the dictionary pushes onto it or pops it, so a
+ * fork only pays for the stacks it changes.
+ */
+class RuntimeDictionary {
+public:
+  /** A ruleset: a range of strings in the pool */
+  struct Ruleset {
+    /** The index of the first string */
+    std::size_t first;
+
+    /** The number of strings */
+    std::size_t count;
+
+    /** True if one of the strings is selected at random, false for a single string */
+    bool isList;
+  };
+
+  /**
+   * Pushes a single string onto the rule stack with the given id
+   *
+   * @param id the interned id of the rule name
+   * @param value the string
+   */
+  void push(std::size_t id, std::string_view value) {
+    std::size_t first = this->addValue(value);
+    this->pushRuleset(id, Ruleset{first, 1, false});
+  }
+
+  /**
+   * Pushes a list of strings onto the rule stack with the given id
+   *
+   * @param id the interned id of the rule name
+   * @param values the strings
+   */
+  void pushList(std::size_t id, const std::vector<std::string>& values) {
+    std::size_t first = this->snapshotValues + this->usedValues;
+    for (auto& value : values) this->addValue(value);
+    this->pushRuleset(id, Ruleset{first, values.size(), true});
+  }
+
+  /**
+   * Pops the top ruleset off the rule stack with the given id, if there is one
+   *
+   * @param id the interned id of the rule name
+   */
+  void pop(std::size_t id) {
+    if (!this->contains(id)) return;
+    ++this->pops;
+    if (this->snapshot && !this->isCopied(id)) this->copyStack(id);
+    std::vector<Ruleset>& stack = this->stacks[id];
+    stack.pop_back();
+    if (stack.empty()) --this->definedRules;
+  }
+
+  /**
+   * Gets the top ruleset of the rule stack with the given id
+   *
+   * @param id the interned id of the rule name
+   * @return the ruleset, or nullptr if the stack is empty
+   */
+  const Ruleset* top(std::size_t id) const {
+    const std::vector<Ruleset>* stack = this->findStack(id);
+    return stack && !stack->empty() ? &stack->back() : nullptr;
+  }
+
+  /**
+   * Gets a string of the pool
+   *
+   * @param index the index of the string
+   * @return the string
+   */
+  std::string_view getValue(std::size_t index) const {
+    if (index < this->snapshotValues) return this->snapshot->values[index].text;
+    return this->values[index - this->snapshotValues].text;
+  }
+
+  /**
+   * Gets the compiled form of a string of the pool, compiling it the first time
+   *
+   * @param index the index of the string
+   * @return the compiled string
+   */
+  const std::shared_ptr<const CompiledNode>& getCompiledValue(std::size_t index) {
+    // Strings of the snapshot were compiled when it was taken
+    if (index < this->snapshotValues) return this->snapshot->values[index].compiled;
+    Value& value = this->values[index - this->snapshotValues];
+    if (!value.compiled) {
+      // Captured strings tend to repeat from one expansion to the next, so the strings compiled since the last clear
+      // are kept around to be used again, up to a limit
+      auto found = this->compiledTexts.find(value.text);
+      if (found != this->compiledTexts.end()) {
+        value.compiled = found->second;
+      } else {
+        if (this->compiledTexts.size() >= maxCompiledTexts) this->compiledTexts.clear();
+        value.compiled = compileNode(value.text);
+        this->compiledTexts.emplace(value.text, value.compiled);
+      }
+    }
+    return value.compiled;
+  }
+
+  /**
+   * Returns true if the rule stack with the given id is not empty
+   *
+   * @param id the interned id of the rule name
+   * @return true if the rule is defined
+   */
+  bool contains(std::size_t id) const {
+    const std::vector<Ruleset>* stack = this->findStack(id);
+    return stack && !stack->empty();
+  }
+
+  /**
+   * Returns true if every rule stack is empty
+   *
+   * @return true if no rule is defined
+   */
+  bool empty() const {
+    return this->definedRules == 0;
+  }
+
+  /**
+   * Empties every rule stack, keeping the memory for reuse
+   */
+  void clear() {
+    if (this->snapshot) {
+      for (std::size_t id : this->usedStacks) {
+        if (bool* copiedStack = this->copied.find(id)) *copiedStack = false;
+      }
+      this->snapshot = nullptr;
+      this->snapshotValues = 0;
+    }
+    for (std::size_t id : this->usedStacks) this->stacks[id].clear();
+    this->usedStacks.clear();
+    this->usedValues = 0;
+    this->definedRules = 0;
+    this->pushes = 0;
+    this->pops = 0;
+  }
+
+  /**
+   * Creates a dictionary with the same contents as this one, which can then be changed independently of it. The
+   * contents are frozen into a snapshot shared by both dictionaries, and the strings of the pool are compiled, so that
+   * neither dictionary changes the snapshot; each copies a rule stack of it the first time it changes the stack. If
+   * nothing has changed since this dictionary was last forked, the same snapshot is shared again.
+   *
+   * @return the new dictionary
+   */
+  RuntimeDictionary fork() {
+    if (!this->usedStacks.empty() || this->usedValues > 0) this->freeze();
+    RuntimeDictionary forked;
+    forked.snapshot = this->snapshot;
+    forked.snapshotValues = this->snapshotValues;
+    forked.definedRules = this->definedRules;
+    forked.pushes = this->pushes;
+    forked.pops = this->pops;
+    return forked;
+  }
+
+  /**
+   * Gets the number of rulesets pushed since the last clear
+   *
+   * @return the number of pushes
+   */
+  std::size_t getPushCount() const { return this->pushes; }
+
+  /**
+   * Gets the number of rulesets popped since the last clear
+   *
+   * @return the number of pops
+   */
+  std::size_t getPopCount() const { return this->pops; }
+
+  /**
+   * Pushes a single string onto the rule stack with the given name
+   *
+   * @param name the rule name
+   * @param value the string
+   */
+  void push(const std::string& name, std::string_view value) {
+    this->push(internRuleName(name), value);
+  }
+
+  /**
+   * Pops the top ruleset off the rule stack with the given name, if there is one
+   *
+   * @param name the rule name
+   */
+  void pop(const std::string& name) {
+    this->pop(getRuleNames().find(name));
+  }
+
+  /**
+   * Returns true if the rule stack with the given name is not empty
+   *
+   * @param name the rule name
+   * @return true if the rule is defined
+   */
+  bool contains(const std::string& name) const {
+    return this->contains(getRuleNames().find(name));
+  }
+
+private:
+  /** A string of the pool */
+  struct Value {
+    /** The string */
+    std::string text;
+
+    /** The compiled string, or nullptr if it has not been compiled yet */
+    std::shared_ptr<const CompiledNode> compiled;
+  };
+
+  /** The frozen contents of a dictionary that has been forked, shared by the dictionary and its forks */
+  struct Snapshot {
+    /** The rule stack of each interned rule name */
+    IdMap<std::vector<Ruleset>> stacks;
+
+    /** The strings of the pool, all of them compiled */
+    std::vector<Value> values;
+  };
+
+  /**
+   * Finds the rule stack with the given id: this dictionary's own, if it has one or there is no snapshot, otherwise the
+   * snapshot's
+   *
+   * @param id the interned id of the rule name
+   * @return the stack, or nullptr if there is none
+   */
+  const std::vector<Ruleset>* findStack(std::size_t id) const {
+    if (this->snapshot && !this->isCopied(id)) return this->snapshot->stacks.find(id);
+    return this->stacks.find(id);
+  }
+
+  /**
+   * Returns true if the rule stack with the given id has been copied from the snapshot
+   *
+   * @param id the interned id of the rule name
+   * @return true if the stack has been copied
+   */
+  bool isCopied(std::size_t id) const {
+    const bool* copiedStack = this->copied.find(id);
+    return copiedStack && *copiedStack;
+  }
+
+  /**
+   * Copies the snapshot's rule stack with the given id into this dictionary, which has not copied it yet
+   *
+   * @param id the interned id of the rule name
+   */
+  void copyStack(std::size_t id) {
+    this->copied[id] = true;
+    if (const std::vector<Ruleset>* stack = this->snapshot->stacks.find(id)) this->stacks[id] = *stack;
+    this->usedStacks.push_back(id);
+  }
+
+  /**
+   * Replaces the snapshot with one holding the current contents of this dictionary, and empties its own stacks and
+   * pool. The indices of the strings don't change, since the snapshot's pool is the old snapshot's followed by this
+   * dictionary's.
+   */
+  void freeze() {
+    std::shared_ptr<Snapshot> frozen(new Snapshot);
+    if (this->snapshot) {
+      frozen->stacks = this->snapshot->stacks;
+      frozen->values = this->snapshot->values;
+    }
+    for (std::size_t id : this->usedStacks) {
+      frozen->stacks[id] = this->stacks[id];
+    }
+    frozen->values.reserve(frozen->values.size() + this->usedValues);
+    for (std::size_t i = 0; i < this->usedValues; i++) {
+      this->getCompiledValue(this->snapshotValues + i);
+      frozen->values.push_back(this->values[i]);
+    }
+
+    // Empty this dictionary's own contents, as clear does, but keep the counts
+    for (std::size_t id : this->usedStacks) {
+      this->stacks[id].clear();
+      if (bool* copiedStack = this->copied.find(id)) *copiedStack = false;
+    }
+    this->usedStacks.clear();
+    this->usedValues = 0;
+    this->snapshotValues = frozen->values.size();
+    this->snapshot = std::move(frozen);
+  }
+
+  /**
+   * Adds a string to the pool, reusing the memory of a string left over from before the last clear if there is one
+   *
+   * @return the index of the string
+   */
+  std::size_t addValue(std::string_view text) {
+    if (this->usedValues == this->values.size()) this->values.emplace_back();
+    Value& value = this->values[this->usedValues];
+    // Keep the compiled value if the string is the same as before, as when expanding the same input over and over
+    if (value.text != text) {
+      value.text.assign(text.data(), text.size());
+      value.compiled = nullptr;
+    }
+    return this->snapshotValues + this->usedValues++;
+  }
+
+  /**
+   * Pushes a ruleset onto the rule stack with the given id
+   */
+  void pushRuleset(std::size_t id, const Ruleset& ruleset) {
+    if (this->snapshot && !this->isCopied(id)) this->copyStack(id);
+    std::vector<Ruleset>& stack = this->stacks[id];
+    if (stack.empty()) {
+      ++this->definedRules;
+      this->usedStacks.push_back(id);
+    }
+    stack.push_back(ruleset);
+    ++this->pushes;
+  }
+
+  /** The rule stack of each interned rule name, with the top of each stack last */
+  IdMap<std::vector<Ruleset>> stacks;
+
+  /** The ids of this dictionary's own stacks that may not be empty or were copied, possibly more than once */
+  std::vector<std::size_t> usedStacks;
+
+  /** The frozen contents shared with forks of this dictionary, or nullptr if it hasn't been forked since cleared */
+  std::shared_ptr<const Snapshot> snapshot;
+
+  /** For each interned rule name, true if its stack has been copied from the snapshot */
+  IdMap<bool> copied;
+
+  /** The number of strings of the snapshot's pool, whose indices come before those of this dictionary's pool */
+  std::size_t snapshotValues = 0;
+
+  /** The pool of strings, of which the first usedValues are in use */
+  std::vector<Value> values;
+
+  /** The number of strings of the pool in use */
+  std::size_t usedValues = 0;
+
+  /** The number of rule stacks that are not empty */
+  std::size_t definedRules = 0;
+
+  /** The number of rulesets pushed since the last clear */
+  std::size_t pushes = 0;
+
+  /** The number of rulesets popped since the last clear */
+  std::size_t pops = 0;
+
+  /** The maximum number of compiled strings kept for reuse */
+  static constexpr std::size_t maxCompiledTexts = 1024;
+
+  /** The compiled forms of strings of the pool, kept across clears */
+  std::unordered_map<std::string, std::shared_ptr<const CompiledNode>> compiledTexts;
+};
+
+/** Represents a map of rule names to ruleset stacks */
+typedef RuntimeDictionary runtime_dictionary_t;
+/**
+ * A bump allocator. Memory is handed out from large blocks owned by the arena, and is only released, all at once, when
+ * the arena is reset or destroyed.
+ */
+class NodeArena {
+public:
+  /**
+   * Creates an empty arena
+   *
+   * @param initialBlockSize the size of the first block to allocate. Each subsequent block is twice as large.
+   */
+  explicit NodeArena(std::size_t initialBlockSize = 16 * 1024)
+      : blockSize(0)
+      , used(0)
+      , nextBlockSize(initialBlockSize) {
+  }
+
+  NodeArena(const NodeArena&) = delete;
+
+  NodeArena& operator=(const NodeArena&) = delete;
+
+  /**
+   * Allocates memory from the arena
+   *
+   * @param size the number of bytes to allocate
+   * @param alignment the required alignment, which must be no stricter than that of std::max_align_t
+   * @return the allocated memory
+   */
+  void* allocate(std::size_t size, std::size_t alignment) {
+    std::size_t offset = (this->used + alignment - 1) & ~(alignment - 1);
+    if (this->blocks.empty() || offset + size > this->blockSize) {
+      // Start a new block, large enough for this allocation
+      this->blockSize = std::max(this->nextBlockSize, size);
+      this->nextBlockSize *= 2;
+      this->blocks.emplace_back(new unsigned char[this->blockSize]);
+      offset = 0;
+    }
+    this->used = offset + size;
+    return this->blocks.back().get() + offset;
+  }
+
+  /**
+   * Makes the memory of the arena available to be allocated again, keeping only the current block, which is the
+   * largest. Everything allocated from the arena must have been destroyed.
+   */
+  void reset() {
+    if (this->blocks.size() > 1) {
+      std::unique_ptr<unsigned char[]> last = std::move(this->blocks.back());
+      this->blocks.clear();
+      this->blocks.push_back(std::move(last));
+    }
+    this->used = 0;
+  }
+
+  /**
+   * Gets the number of blocks allocated by this arena
+   *
+   * @return the number of blocks
+   */
+  std::size_t getBlockCount() const { return this->blocks.size(); }
+
+private:
+  /** The blocks of memory owned by the arena */
+  std::vector<std::unique_ptr<unsigned char[]>> blocks;
+
+  /** The size of the current (last) block */
+  std::size_t blockSize;
+
+  /** The number of bytes used in the current block */
+  std::size_t used;
+
+  /** The size of the next block to allocate */
+  std::size_t nextBlockSize;
+};
+
+/**
+ * A standard allocator handing out memory from a tracerz::details::NodeArena. Deallocation does nothing, the memory is
+ * released when the arena is destroyed. The allocator shares ownership of the arena, so the control block of every
+ * std::allocate_shared object keeps the arena alive for as long as the object or a weak pointer to it is.
+ *
+ * @tparam T the type to allocate
+ */
+template<typename T>
+class ArenaAllocator {
+public:
+  typedef T value_type;
+
+  /**
+   * Creates an allocator using the given arena
+   *
+   * @param arena the arena to allocate from
+   */
+  explicit ArenaAllocator(std::shared_ptr<NodeArena> arena)
+      : arena(std::move(arena)) {
+  }
+
+  /**
+   * Creates an allocator using the same arena as the given allocator
+   *
+   * @param other the allocator to copy the arena from
+   */
+  template<typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other)
+      : arena(other.getArena()) {
+  }
+
+  T* allocate(std::size_t n) {
+    return static_cast<T*>(this->arena->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T*, std::size_t) {
+  }
+
+  /**
+   * Gets the arena this allocator allocates from
+   *
+   * @return the arena
+   */
+  const std::shared_ptr<NodeArena>& getArena() const { return this->arena; }
+
+  template<typename U>
+  bool operator==(const ArenaAllocator<U>& other) const { return this->arena == other.getArena(); }
+
+  template<typename U>
+  bool operator!=(const ArenaAllocator<U>& other) const { return this->arena != other.getArena(); }
+
+private:
+  /** The arena to allocate from */
+  std::shared_ptr<NodeArena> arena;
+};
+
+/**
+ * A Walker alias table, for selecting an index with probability proportional to its weight from a single uniformly
+ * distributed draw. The draw, in `[0, range())`, is split into a column and a position within the column. The column
+ * is selected if the position is below its threshold, otherwise the column's alias is.
+ */
+class AliasTable {
+public:
+  /**
+   * Creates an empty table
+   */
+  AliasTable() = default;
+
+  /**
+   * Creates a table for the given weights
+   *
+   * @param weights the weight of each index, none of which may be negative, with a positive sum
+   * @throws std::invalid_argument if the weights are invalid
+   */
+  explicit AliasTable(const std::vector<double>& weights)
+      : weights(weights) {
+    double total = 0;
+    for (double weight : weights) {
+      if (!(weight >= 0) || weight == std::numeric_limits<double>::infinity()) {
+        throw std::invalid_argument("tracerz: rule weights must be finite and not negative");
+      }
+      total += weight;
+    }
+    if (!(total > 0)) throw std::invalid_argument("tracerz: rule weights must not all be zero");
+
+    // The resolution is chosen so that every draw fits in an int, the result type of the default distribution
+    std::size_t count = weights.size();
+    this->resolution = std::max<std::size_t>(1, static_cast<std::size_t>(std::numeric_limits<int>::max()) / count);
+    this->thresholds.assign(count, this->resolution);
+    this->aliases.resize(count);
+
+    // Scale the weights so that they average 1, and sort them into those below and above average
+    std::vector<double> scaled(count);
+    std::vector<std::size_t> small;
+    std::vector<std::size_t> large;
+    for (std::size_t i = 0; i < count; i++) {
+      scaled[i] = weights[i] * count / total;
+      this->aliases[i] = i;
+      (scaled[i] < 1 ? small : large).push_back(i);
+    }
+
+    // Fill each column below average with the remainder from one above average. Columns left over are full, within
+    // rounding error.
+    while (!small.empty() && !large.empty()) {
+      std::size_t below = small.back();
+      small.pop_back();
+      std::size_t above = large.back();
+
+      this->thresholds[below] = std::min(this->resolution,
+                                         static_cast<std::size_t>(std::llround(scaled[below] * this->resolution)));
+      this->aliases[below] = above;
+
+      scaled[above] = (scaled[above] + scaled[below]) - 1;
+      if (scaled[above] < 1) {
+        large.pop_back();
+        small.push_back(above);
+      }
+    }
+
+    for (std::size_t draw : this->getFirstDraws()) {
+      if (draw < this->range()) ++this->selectable;
+    }
+  }
+
+  /**
+   * Returns true if the table has no entries
+   *
+   * @return true if the table has no entries
+   */
+  bool empty() const { return this->thresholds.empty(); }
+
+  /**
+   * Gets the number of distinct draws
+   *
+   * @return the number of distinct draws
+   */
+  std::size_t range() const { return this->thresholds.size() * this->resolution; }
+
+  /**
+   * Selects the index of the given draw
+   *
+   * @param draw a uniformly distributed draw in `[0, range())`
+   * @return the selected index
+   */
+  std::size_t select(std::size_t draw) const {
+    std::size_t column = draw / this->resolution;
+    return draw % this->resolution < this->thresholds[column] ? column : this->aliases[column];
+  }
+
+  /**
+   * Gets the first draw selecting each index, the inverse of select. An index whose weight is too small for any draw to
+   * select it has range() instead.
+   *
+   * @return the first draw selecting each index
+   */
+  std::vector<std::size_t> getFirstDraws() const {
+    std::vector<std::size_t> draws(this->thresholds.size(), this->range());
+    for (std::size_t column = 0; column < this->thresholds.size(); column++) {
+      if (this->thresholds[column] > 0) draws[column] = std::min(draws[column], column * this->resolution);
+      if (this->thresholds[column] < this->resolution) {
+        std::size_t& draw = draws[this->aliases[column]];
+        draw = std::min(draw, column * this->resolution + this->thresholds[column]);
+      }
+    }
+    return draws;
+  }
+
+  /**
+   * Gets the weights the table was created for
+   *
+   * @return the weights
+   */
+  const std::vector<double>& getWeights() const { return this->weights; }
+
+  /**
+   * Gets the number of indices some draw selects, leaving out those whose weight is zero or too small to be selected
+   *
+   * @return the number of selectable indices
+   */
+  std::size_t getSelectableCount() const { return this->selectable; }
+
+private:
+  /** The weights the table was created for */
+  std::vector<double> weights;
+
+  /** The number of indices some draw selects */
+  std::size_t selectable = 0;
+
+  /** The number of draws per column */
+  std::size_t resolution = 0;
+
+  /** The number of draws of each column that select the column itself, out of the resolution */
+  std::vector<std::size_t> thresholds;
+
+  /** The index each column selects for the rest of its draws */
+  std::vector<std::size_t> aliases;
+};
+
+/** The magic number at the start of a binary grammar, "TRZG" */
+constexpr std::uint32_t binaryGrammarMagic = 0x475a5254;
+
+/** The version of the binary grammar format */
+constexpr std::uint32_t binaryGrammarVersion = 1;
+
+/** The number of 32 bit fields in the header of a binary grammar, including the magic number */
+constexpr std::size_t binaryHeaderFields = 8;
+
+/** The number of 32 bit fields of a compiled node record */
+constexpr std::size_t binaryNodeFields = 9;
+
+/** The number of 32 bit fields of a modifier record */
+constexpr std::size_t binaryModifierFields = 4;
+
+/** The number of 32 bit fields of a rule record */
+constexpr std::size_t binaryRuleFields = 6;
+
+/**
+ * Writes the binary form of a compiled grammar, see tracerz::CompiledGrammar::toBinary. Strings and compiled nodes
+ * shared by several rules are only written once.
+ */
+class BinaryGrammarWriter {
+public:
+  /**
+   * Adds a rule
+   *
+   * @param name the name of the rule
+   * @param isList true if the rule is a list
+   * @param alternatives the compiled alternatives of the rule
+   * @param weights the weights of the alternatives, or an empty list
+   */
+  void addRule(const std::string& name,
+               bool isList,
+               const std::vector<std::shared_ptr<const CompiledNode>>& alternatives,
+               const std::vector<double>& weights) {
+    std::vector<std::uint32_t> ids;
+    for (auto& alternative : alternatives) ids.push_back(this->addNode(*alternative));
+
+    this->ruleRecords.insert(this->ruleRecords.end(), {
+        this->addString(name),
+        isList ? 1u : 0u,
+        this->addIndices(ids),
+        static_cast<std::uint32_t>(ids.size()),
+        static_cast<std::uint32_t>(this->weights.size()),
+        static_cast<std::uint32_t>(weights.size())
+    });
+    this->weights.insert(this->weights.end(), weights.begin(), weights.end());
+  }
+
+  /**
+   * Writes out every rule added
+   *
+   * @return the binary form of the grammar
+   */
+  std::string finish() const {
+    std::string output;
+    auto write = [&output](const void* data, std::size_t size) {
+      output.append(static_cast<const char*>(data), size);
+    };
+    auto writeAll = [&write](const std::vector<std::uint32_t>& values) {
+      if (!values.empty()) write(values.data(), values.size() * sizeof(std::uint32_t));
+    };
+
+    // Offsets of the strings, relative to the start of the string contents
+    std::vector<std::uint32_t> offsets;
+    std::uint32_t offset = 0;
+    for (auto& str : this->strings) {
+      offsets.push_back(offset);
+      offset += static_cast<std::uint32_t>(str.size());
+    }
+    offsets.push_back(offset);
+
+    writeAll({
+        binaryGrammarMagic,
+        binaryGrammarVersion,
+        static_cast<std::uint32_t>(this->strings.size()),
+        static_cast<std::uint32_t>(this->nodeRecords.size() / binaryNodeFields),
+        static_cast<std::uint32_t>(this->modifierRecords.size() / binaryModifierFields),
+        static_cast<std::uint32_t>(this->indices.size()),
+        static_cast<std::uint32_t>(this->ruleRecords.size() / binaryRuleFields),
+        static_cast<std::uint32_t>(this->weights.size())
+    });
+    writeAll(offsets);
+    writeAll(this->nodeRecords);
+    writeAll(this->modifierRecords);
+    writeAll(this->indices);
+    writeAll(this->ruleRecords);
+    if (!this->weights.empty()) write(this->weights.data(), this->weights.size() * sizeof(double));
+    for (auto& str : this->strings) output.append(str);
+    return output;
+  }
+
+private:
+  /**
+   * Adds a string to the string table, if it is not already there
+   *
+   * @return the index of the string
+   */
+  std::uint32_t addString(const std::string& str) {
+    auto iter = this->stringIds.find(str);
+    if (iter != this->stringIds.end()) return iter->second;
+
+    auto id = static_cast<std::uint32_t>(this->strings.size());
+    this->strings.push_back(str);
+    this->stringIds.emplace(str, id);
+    return id;
+  }
+
+  /**
+   * Adds a list of indices to the pool
+   *
+   * @return the position of the first index in the pool
+   */
+  std::uint32_t addIndices(const std::vector<std::uint32_t>& ids) {
+    auto first = static_cast<std::uint32_t>(this->indices.size());
+    this->indices.insert(this->indices.end(), ids.begin(), ids.end());
+    return first;
+  }
+
+  /**
+   * Adds a compiled node and its children, if it is not already written. Children are always written before their
+   * parents.
+   *
+   * @return the index of the node
+   */
+  std::uint32_t addNode(const CompiledNode& node) {
+    auto iter = this->nodeIds.find(&node);
+    if (iter != this->nodeIds.end()) return iter->second;
+
+    std::vector<std::uint32_t> children;
+    for (auto& child : node.children) children.push_back(this->addNode(*child));
+
+    auto firstModifier = static_cast<std::uint32_t>(this->modifierRecords.size() / binaryModifierFields);
+    for (auto& modifier : node.modifiers) {
+      std::vector<std::uint32_t> params;
+      for (auto& param : modifier.params) params.push_back(this->addString(param));
+      this->modifierRecords.insert(this->modifierRecords.end(), {
+          this->addString(modifier.text),
+          this->addString(modifier.name),
+          this->addIndices(params),
+          static_cast<std::uint32_t>(params.size())
+      });
+    }
+
+    std::vector<std::uint32_t> values;
+    for (auto& value : node.values) values.push_back(this->addString(value));
+
+    this->nodeRecords.insert(this->nodeRecords.end(), {
+        static_cast<std::uint32_t>(node.type),
+        this->addString(node.input),
+        this->addString(node.name),
+        firstModifier,
+        static_cast<std::uint32_t>(node.modifiers.size()),
+        this->addIndices(values),
+        static_cast<std::uint32_t>(values.size()),
+        this->addIndices(children),
+        static_cast<std::uint32_t>(children.size())
+    });
+
+    auto id = static_cast<std::uint32_t>(this->nodeRecords.size() / binaryNodeFields - 1);
+    this->nodeIds.emplace(&node, id);
+    return id;
+  }
+
+  /** The string table */
+  std::vector<std::string> strings;
+
+  /** The index of each string in the string table */
+  std::map<std::string, std::uint32_t> stringIds;
+
+  /** The index of each compiled node already written */
+  std::map<const CompiledNode*, std::uint32_t> nodeIds;
+
+  /** The fields of the compiled node records */
+  std::vector<std::uint32_t> nodeRecords;
+
+  /** The fields of the modifier records */
+  std::vector<std::uint32_t> modifierRecords;
+
+  /** The pool of indices of strings and nodes, referred to by the records */
+  std::vector<std::uint32_t> indices;
+
+  /** The fields of the rule records */
+  std::vector<std::uint32_t> ruleRecords;
+
+  /** The weights of every rule */
+  std::vector<double> weights;
+};
+
+/**
+ * Reads the binary form of a compiled grammar, see tracerz::CompiledGrammar::toBinary. Every index and size is checked
+ * against the size of the data before it is used.
+ */
+class BinaryGrammarReader {
+public:
+  /**
+   * Checks the header and the layout of the given data
+   *
+   * @param _data the binary form of the grammar
+   * @param _size the size of the data, in bytes
+   * @throws std::invalid_argument if the data is not a valid binary grammar
+   */
+  BinaryGrammarReader(const void* _data, std::size_t _size)
+      : data(static_cast<const unsigned char*>(_data))
+      , size(_size) {
+    if (this->size < binaryHeaderFields * sizeof(std::uint32_t)) fail();
+    if (this->field(0) != binaryGrammarMagic || this->field(1) != binaryGrammarVersion) fail();
+
+    this->stringCount = this->field(2);
+    this->nodeCount = this->field(3);
+    this->modifierCount = this->field(4);
+    this->indexCount = this->field(5);
+    this->ruleCount = this->field(6);
+    this->weightCount = this->field(7);
+
+    // Lay out the sections in 64 bits, so that no count can overflow the offsets
+    std::uint64_t offset = binaryHeaderFields * sizeof(std::uint32_t);
+    this->offsetsStart = offset;
+    offset += (std::uint64_t(this->stringCount) + 1) * sizeof(std::uint32_t);
+    this->nodesStart = offset;
+    offset += std::uint64_t(this->nodeCount) * binaryNodeFields * sizeof(std::uint32_t);
+    this->modifiersStart = offset;
+    offset += std::uint64_t(this->modifierCount) * binaryModifierFields * sizeof(std::uint32_t);
+    this->indicesStart = offset;
+    offset += std::uint64_t(this->indexCount) * sizeof(std::uint32_t);
+    this->rulesStart = offset;
+    offset += std::uint64_t(this->ruleCount) * binaryRuleFields * sizeof(std::uint32_t);
+    this->weightsStart = offset;
+    offset += std::uint64_t(this->weightCount) * sizeof(double);
+    this->stringsStart = offset;
+    if (offset > this->size) fail();
+
+    // The last string offset is the end of the string contents, and the offsets must not decrease
+    std::uint32_t previous = 0;
+    for (std::uint32_t i = 0; i <= this->stringCount; i++) {
+      std::uint32_t next = this->read32(this->offsetsStart + std::uint64_t(i) * sizeof(std::uint32_t));
+      if (next < previous) fail();
+      previous = next;
+    }
+    if (this->stringsStart + previous > this->size) fail();
+  }
+
+  /**
+   * Reads every rule and its compiled alternatives, calling
+   * `visitor(name, isList, alternatives, weights)` for each
+   *
+   * @tparam Visitor the type of the visitor
+   * @param visitor the visitor
+   * @throws std::invalid_argument if the data is not a valid binary grammar
+   */
+  template<typename Visitor>
+  void forEachRule(Visitor&& visitor) const {
+    // Children are written before their parents, so each node only refers to nodes already read
+    std::vector<std::shared_ptr<const CompiledNode>> nodes;
+    nodes.reserve(this->nodeCount);
+    for (std::uint32_t i = 0; i < this->nodeCount; i++) {
+      std::uint64_t record = this->nodesStart + std::uint64_t(i) * binaryNodeFields * sizeof(std::uint32_t);
+      auto fieldAt = [&](std::size_t index) { return this->read32(record + index * sizeof(std::uint32_t)); };
+
+      std::shared_ptr<CompiledNode> node(new CompiledNode);
+      if (fieldAt(0) > static_cast<std::uint32_t>(NodeType::Mixed)) fail();
+      node->type = static_cast<NodeType>(fieldAt(0));
+      node->input = this->string(fieldAt(1));
+      node->name = this->string(fieldAt(2));
+      if (!node->name.empty()) node->nameId = internRuleName(node->name);
+
+      std::uint32_t firstModifier = fieldAt(3);
+      std::uint32_t modifiers = fieldAt(4);
+      if (std::uint64_t(firstModifier) + modifiers > this->modifierCount) fail();
+      for (std::uint32_t m = firstModifier; m < firstModifier + modifiers; m++) {
+        std::uint64_t modifier = this->modifiersStart + std::uint64_t(m) * binaryModifierFields * sizeof(std::uint32_t);
+        ModifierCall call;
+        call.text = this->string(this->read32(modifier));
+        call.name = this->string(this->read32(modifier + sizeof(std::uint32_t)));
+        call.id = internModifierName(call.name);
+        for (std::uint32_t param : this->indicesOf(this->read32(modifier + 2 * sizeof(std::uint32_t)),
+                                                   this->read32(modifier + 3 * sizeof(std::uint32_t)))) {
+          call.params.push_back(this->string(param));
+        }
+        node->modifiers.push_back(std::move(call));
+      }
+
+      for (std::uint32_t value : this->indicesOf(fieldAt(5), fieldAt(6))) {
+        node->values.push_back(this->string(value));
+      }
+
+      for (std::uint32_t child : this->indicesOf(fieldAt(7), fieldAt(8))) {
+        if (child >= i) fail();
+        node->children.push_back(nodes[child]);
+      }
+
+      nodes.push_back(std::move(node));
+    }
+
+    for (std::uint32_t i = 0; i < this->ruleCount; i++) {
+      std::uint64_t record = this->rulesStart + std::uint64_t(i) * binaryRuleFields * sizeof(std::uint32_t);
+      auto fieldAt = [&](std::size_t index) { return this->read32(record + index * sizeof(std::uint32_t)); };
+
+      std::vector<std::shared_ptr<const CompiledNode>> alternatives;
+      for (std::uint32_t alternative : this->indicesOf(fieldAt(2), fieldAt(3))) {
+        if (alternative >= this->nodeCount) fail();
+        alternatives.push_back(nodes[alternative]);
+      }
+
+      std::uint32_t firstWeight = fieldAt(4);
+      std::uint32_t weights = fieldAt(5);
+      if (std::uint64_t(firstWeight) + weights > this->weightCount) fail();
+      std::vector<double> ruleWeights(weights);
+      for (std::uint32_t w = 0; w < weights; w++) {
+        std::memcpy(&ruleWeights[w], this->data + this->weightsStart + (std::uint64_t(firstWeight) + w) * sizeof(double),
+                    sizeof(double));
+      }
+
+      visitor(this->string(fieldAt(0)), fieldAt(1) != 0, std::move(alternatives), ruleWeights);
+    }
+  }
+
+private:
+  /**
+   * Throws the exception for invalid data
+   */
+  [[noreturn]] static void fail() {
+    throw std::invalid_argument("tracerz: invalid binary grammar");
+  }
+
+  /**
+   * Reads the 32 bit number at the given offset
+   */
+  std::uint32_t read32(std::uint64_t offset) const {
+    if (offset + sizeof(std::uint32_t) > this->size) fail();
+    std::uint32_t value;
+    std::memcpy(&value, this->data + offset, sizeof(value));
+    return value;
+  }
+
+  /**
+   * Reads the given field of the header
+   */
+  std::uint32_t field(std::size_t index) const {
+    return this->read32(index * sizeof(std::uint32_t));
+  }
+
+  /**
+   * Reads the string with the given index
+   */
+  std::string string(std::uint32_t index) const {
+    if (index >= this->stringCount) fail();
+    std::uint32_t begin = this->read32(this->offsetsStart + std::uint64_t(index) * sizeof(std::uint32_t));
+    std::uint32_t end = this->read32(this->offsetsStart + (std::uint64_t(index) + 1) * sizeof(std::uint32_t));
+    return std::string(reinterpret_cast<const char*>(this->data + this->stringsStart + begin), end - begin);
+  }
+
+  /**
+   * Reads a range of the pool of indices
+   */
+  std::vector<std::uint32_t> indicesOf(std::uint32_t first, std::uint32_t count) const {
+    if (std::uint64_t(first) + count > this->indexCount) fail();
+    std::vector<std::uint32_t> ids(count);
+    for (std::uint32_t i = 0; i < count; i++) {
+      ids[i] = this->read32(this->indicesStart + (std::uint64_t(first) + i) * sizeof(std::uint32_t));
+    }
+    return ids;
+  }
+
+  /** The binary form of the grammar */
+  const unsigned char* data;
+
+  /** The size of the data, in bytes */
+  std::size_t size;
+
+  /** The number of records of each kind */
+  std::uint32_t stringCount, nodeCount, modifierCount, indexCount, ruleCount, weightCount;
+
+  /** The offset of each section */
+  std::uint64_t offsetsStart, nodesStart, modifiersStart, indicesStart, rulesStart, weightsStart, stringsStart;
+};
+} // End namespace details
+
+/**
+ * The definition of a single rule, as provided by a grammar source to tracerz::CompiledGrammar
+ */
+struct RuleDefinition {
+  /** The input strings of the rule's alternatives */
+  std::vector<std::string> options;
+
+  /** True if one of the alternatives is selected at random, otherwise the first one is always used */
+  bool isList = false;
+
+  /** The weight of each alternative, or an empty list if they are equally likely */
+  std::vector<double> weights;
+};
+
+#ifndef TRACERZ_NO_JSON
+/**
+ * A grammar source reading the rules of an input grammar in json.
+ *
+ * Rules defined as strings have a single alternative. Rules defined as lists have one alternative per item, and every
+ * item must be a string. Rules defined as objects with an `options` list are lists, which may be given a list of
+ * `weights` of the same length, making each option's probability proportional to its weight. Rules defined as any
+ * other type expand to the empty string.
+ */
+class JsonGrammarSource {
+public:
+  /**
+   * Creates a source reading from the given input grammar, which must outlive the source
+   *
+   * @param _grammar the input grammar
+   */
+  explicit JsonGrammarSource(const nlohmann::json& _grammar)
+      : grammar(_grammar) {
+  }
+
+  /**
+   * Calls `visitor(name, definition)` for each rule of the input grammar
+   *
+   * @tparam Visitor the type of the visitor
+   * @param visitor the visitor
+   */
+  template<typename Visitor>
+  void forEachRule(Visitor&& visitor) const {
+    if (!this->grammar.is_object()) return;
+
+    for (auto iter = this->grammar.begin(); iter != this->grammar.end(); iter++) {
+      const nlohmann::json& ruleContents = iter.value();
+      RuleDefinition definition;
+      if (ruleContents.is_string()) {
+        definition.options.push_back(ruleContents.get<std::string>());
+      } else if (ruleContents.is_array()) {
+        definition.isList = true;
+        for (auto& alternative : ruleContents) {
+          definition.options.push_back(alternative.get<std::string>());
+        }
+      } else if (ruleContents.is_object() && ruleContents.find("options") != ruleContents.end()) {
+        definition.isList = true;
+        for (auto& alternative : *ruleContents.find("options")) {
+          definition.options.push_back(alternative.get<std::string>());
+        }
+
+        auto weights = ruleContents.find("weights");
+        if (weights != ruleContents.end()) definition.weights = weights->get<std::vector<double>>();
+      }
+      visitor(iter.key(), definition);
+    }
+  }
+
+private:
+  /** The input grammar */
+  const nlohmann::json& grammar;
+};
+#endif
+
+/**
+ * A rule of a grammar declared in C++ as constant data, see tracerz::StaticGrammarSource. The rule refers to its options
+ * and weights, which must outlive it, and is usually declared `constexpr` along with them:
+ *
+ * ```
+ * constexpr std::string_view animals[] = {"dog", "cat"};
+ * constexpr tracerz::StaticRule rules[] = {{"animal", animals}, {"origin", "the #animal#"}};
+ * ```
+ */
+struct StaticRule {
+  /**
+   * Creates a rule with a single alternative
+   *
+   * @param _name the name of the rule
+   * @param option the input string of its alternative
+   */
+  constexpr StaticRule(std::string_view _name, std::string_view option)
+      : name(_name)
+      , single(option)
+      , optionCount(1) {
+  }
+
+  /**
+   * Creates a rule selecting one of the given alternatives at random, with equal probability
+   *
+   * @tparam N the number of alternatives
+   * @param _name the name of the rule
+   * @param _options the input strings of its alternatives
+   */
+  template<std::size_t N>
+  constexpr StaticRule(std::string_view _name, const std::string_view (&_options)[N])
+      : name(_name)
+      , options(_options)
+      , optionCount(N)
+      , isList(true) {
+  }
+
+  /**
+   * Creates a rule selecting one of the given alternatives at random, with a probability proportional to its weight
+   *
+   * @tparam N the number of alternatives
+   * @param _name the name of the rule
+   * @param _options the input strings of its alternatives
+   * @param _weights the weight of each alternative
+   */
+  template<std::size_t N>
+  constexpr StaticRule(std::string_view _name, const std::string_view (&_options)[N], const double (&_weights)[N])
+      : name(_name)
+      , options(_options)
+      , optionCount(N)
+      , isList(true)
+      , weights(_weights) {
+  }
+
+  /**
+   * Gets the input string of the given alternative
+   *
+   * @param index the index of the alternative, less than optionCount
+   * @return the input string
+   */
+  constexpr std::string_view getOption(std::size_t index) const {
+    return this->options != nullptr ? this->options[index] : this->single;
+  }
+
+  /** The name of the rule */
+  std::string_view name;
+
+  /** The input string of a rule with a single alternative */
+  std::string_view single;
+
+  /** The input strings of the rule's alternatives, or nullptr if it has a single one */
+  const std::string_view* options = nullptr;
+
+  /** The number of alternatives */
+  std::size_t optionCount;
+
+  /** True if one of the alternatives is selected at random, otherwise the first one is always used */
+  bool isList = false;
+
+  /** The weight of each alternative, or nullptr if they are equally likely */
+  const double* weights = nullptr;
+};
+
+/**
+ * What is wrong with a static grammar, if anything, as found by tracerz::checkStaticGrammar
+ */
+struct StaticGrammarCheck {
+  /** A description of the first problem found, or nullptr if there is none */
+  const char* problem = nullptr;
+
+  /** The index of the rule the problem was found in */
+  std::size_t rule = 0;
+
+  /** The name the problem is about, if any */
+  std::string_view name;
+
+  /**
+   * Returns true if no problem was found
+   */
+  constexpr explicit operator bool() const { return this->problem == nullptr; }
+};
+
+/**
+ * Checks the given static grammar, classifying each of its input strings the way tracerz::CompiledGrammar does, so
+ * that mistakes in a grammar built into a program can be caught when the program is compiled:
+ *
+ * ```
+ * static_assert(tracerz::checkStaticGrammar(rules), "invalid grammar");
+ * ```
+ *
+ * A grammar is invalid if two rules have the same name, a rule has no options, its weights would make
+ * tracerz::CompiledGrammar throw, or an input string references a rule that the grammar neither defines nor sets as a
+ * key with an action. Undefined rules expand to the empty string, which isn't an error otherwise.
+ *
+ * @tparam N the number of rules
+ * @param rules the rules of the grammar
+ * @return the first problem found, if any
+ */
+template<std::size_t N>
+constexpr StaticGrammarCheck checkStaticGrammar(const StaticRule (&rules)[N]) {
+  // Returns true if the grammar defines the given name as a rule, or sets it as a key anywhere
+  auto isDefined = [&rules](std::string_view name) {
+    bool found = false;
+    auto ignore = [](std::string_view) {};
+    auto onKey = [&found, name](std::string_view key) { found |= key == name; };
+    for (const StaticRule& rule : rules) {
+      found |= rule.name == name;
+      for (std::size_t i = 0; i < rule.optionCount && !found; i++) {
+        details::scanReferences(rule.getOption(i), ignore, onKey);
+      }
+      if (found) break;
+    }
+    return found;
+  };
+
+  StaticGrammarCheck check;
+  for (std::size_t r = 0; r < N && check; r++) {
+    const StaticRule& rule = rules[r];
+    auto fail = [&check, r](const char* problem, std::string_view name) {
+      check.problem = problem;
+      check.rule = r;
+      check.name = name;
+    };
+    for (std::size_t other = 0; other < r; other++) {
+      if (rules[other].name == rule.name) fail("rule defined more than once", rule.name);
+    }
+    if (rule.optionCount == 0) fail("rule has no options", rule.name);
+    if (rule.weights != nullptr) {
+      double total = 0;
+      for (std::size_t i = 0; i < rule.optionCount; i++) {
+        if (!(rule.weights[i] >= 0) || rule.weights[i] == std::numeric_limits<double>::infinity()) {
+          fail("rule weights must be finite and not negative", rule.name);
+        }
+        total += rule.weights[i];
+      }
+      if (!(total > 0)) fail("rule weights must not all be zero", rule.name);
+    }
+
+    auto onRule = [&check, &fail, &isDefined](std::string_view name) {
+      if (check && !isDefined(name)) fail("undefined rule", name);
+    };
+    auto ignore = [](std::string_view) {};
+    for (std::size_t i = 0; i < rule.optionCount && check; i++) {
+      details::scanReferences(rule.getOption(i), onRule, ignore);
+    }
+  }
+  return check;
+}
+
+/**
+ * A grammar source reading the rules of a grammar declared in C++ as an array of tracerz::StaticRule. Unlike
+ * tracerz::JsonGrammarSource, it doesn't need json, so it can be used with `TRACERZ_NO_JSON` defined. The rules can be
+ * validated at compile time with tracerz::checkStaticGrammar, but are compiled when a grammar is constructed from the
+ * source, as with any other source.
+ */
+class StaticGrammarSource {
+public:
+  /**
+   * Creates a source reading from the given rules, which must outlive the source
+   *
+   * @tparam N the number of rules
+   * @param _rules the rules
+   */
+  template<std::size_t N>
+  constexpr explicit StaticGrammarSource(const StaticRule (&_rules)[N])
+      : rules(_rules)
+      , ruleCount(N) {
+  }
+
+  /**
+   * Calls `visitor(name, definition)` for each rule
+   *
+   * @tparam Visitor the type of the visitor
+   * @param visitor the visitor
+   */
+  template<typename Visitor>
+  void forEachRule(Visitor&& visitor) const {
+    for (std::size_t r = 0; r < this->ruleCount; r++) {
+      const StaticRule& rule = this->rules[r];
+      RuleDefinition definition;
+      definition.isList = rule.isList;
+      for (std::size_t i = 0; i < rule.optionCount; i++) definition.options.emplace_back(rule.getOption(i));
+      if (rule.weights != nullptr) definition.weights.assign(rule.weights, rule.weights + rule.optionCount);
+      visitor(std::string(rule.name), definition);
+    }
+  }
+
+private:
+  /** The rules */
+  const StaticRule* rules;
+
+  /** The number of rules */
+  std::size_t ruleCount;
+};
+
+/**
+ * Estimates of the size of an expansion, worked out from the grammar alone when it is compiled. Bytes are the bytes of
+ * plain text output, counted as tracerz::ExpansionLimits counts them: before modifiers, and including text captured by
+ * actions. Nodes are the nodes a tracerz::Tree creates for the expansion. Alternatives are combined by their selection
+ * probabilities. A key set by actions counts as the average of the values it is set to anywhere in the grammar, and a
+ * rule that is neither defined nor set by actions as the empty string it expands to.
+ */
+struct ExpansionSize {
+  /** The fewest bytes of any expansion, or `SIZE_MAX` if no expansion ever finishes */
+  std::size_t minBytes = 0;
+
+  /** The expected number of bytes, or infinity if it diverges */
+  double expectedBytes = 0;
+
+  /** The most bytes of any expansion, or `SIZE_MAX` if an expansion can recurse without bound */
+  std::size_t maxBytes = 0;
+
+  /** The fewest nodes of any expansion, or `SIZE_MAX` if no expansion ever finishes */
+  std::size_t minNodes = 0;
+
+  /** The expected number of nodes, or infinity if it diverges */
+  double expectedNodes = 0;
+
+  /** The most nodes of any expansion, or `SIZE_MAX` if an expansion can recurse without bound */
+  std::size_t maxNodes = 0;
+};
+
+namespace details {
+/**
+ * Gets the number of bytes to reserve for the output of an expansion of the given size: twice the expected size, to
+ * leave room for modifiers, but no more than half again the most bytes or 1 MiB. Nothing is reserved for an expansion
+ * whose expected size diverges.
+ *
+ * @param size the estimated size of the expansion
+ * @return the number of bytes to reserve
+ */
+inline std::size_t getOutputReserve(const ExpansionSize& size) {
+  const double maxReserve = 1024 * 1024;
+  if (std::isinf(size.expectedBytes)) return 0;
+  double reserve = std::min(2 * size.expectedBytes, 1.5 * static_cast<double>(size.maxBytes)) + 16;
+  return static_cast<std::size_t>(std::min(reserve, maxReserve));
+}
+} // End namespace details
+
+/**
+ * A single rule of a compiled grammar: the compiled form of each of its alternatives
+ */
+struct CompiledRule {
+  /** The compiled alternatives of the rule */
+  std::vector<std::shared_ptr<const details::CompiledNode>> alternatives;
+
+  /** True if the rule was defined as a list, in which case one alternative is selected at random */
+  bool isList = false;
+
+  /** The alias table selecting an alternative by weight, or an empty table if they are equally likely */
+  details::AliasTable weights;
+
+  /** The ids of every modifier that can be applied while expanding this rule, including through other rules */
+  std::set<std::size_t> reachableModifiers;
+
+  /**
+   * The names of every rule that can be expanded while expanding this rule, including itself and rules with no
+   * definition in the grammar. The expansion of any of them can be replaced by keys in the runtime dictionary.
+   */
+  std::set<std::string> reachableRules;
+
+  /** The interned ids of the reachable rules, see tracerz::details::internRuleName */
+  std::vector<std::size_t> reachableRuleIds;
+
+  /**
+   * True if the rule always expands to the same text, as long as none of its reachable rules are in the runtime
+   * dictionary. That is the case if the rule is not a list, contains no actions, and every rule it references is also
+   * deterministic. Expanding it draws nothing from the random number generator.
+   */
+  bool isDeterministic = false;
+
+  /**
+   * The greatest nesting of rules, counting this one, in the expansion of this rule that finishes soonest, or
+   * `SIZE_MAX` if no expansion of the rule ever finishes. A rule with no definition in the grammar has a height of 1.
+   */
+  std::size_t height = std::numeric_limits<std::size_t>::max();
+
+  /** The index of the alternative the expansion that finishes soonest starts with, see height */
+  std::size_t shortestAlternative = 0;
+
+  /** True if the expansion of the rule can expand the rule again */
+  bool isRecursive = false;
+
+  /** The estimated size of the expansion of the rule */
+  ExpansionSize size;
+
+  /** The number of distinct expansions of the rule, see tracerz::CompiledGrammar::countExpansions */
+  std::uint64_t expansions = 0;
+};
+
+/**
+ * The compiled form of an input grammar. Every rule alternative is classified and split into its literal text, rules
+ * (with their modifiers), and actions once, when the grammar is compiled, rather than every time a node is expanded.
+ */
+class CompiledGrammar {
+public:
+#ifndef TRACERZ_NO_JSON
+  /**
+   * Compiles the given input grammar, read as described by tracerz::JsonGrammarSource
+   *
+   * @param grammar the input grammar
+   * @throws std::invalid_argument if a rule's weights are invalid
+   */
+  explicit CompiledGrammar(const nlohmann::json& grammar)
+      : CompiledGrammar(JsonGrammarSource(grammar)) {
+  }
+#endif
+
+  /**
+   * Compiles the rules of the given grammar source. A grammar source is any type with a `forEachRule(visitor)` member
+   * function, which calls `visitor(const std::string& name, const RuleDefinition& definition)` once for each rule, such
+   * as tracerz::JsonGrammarSource.
+   *
+   * @tparam GrammarSource the type of the grammar source
+   * @param source the grammar source
+   * @throws std::invalid_argument if a rule's weights are invalid
+   */
+  template<typename GrammarSource,
+           typename = decltype(std::declval<const GrammarSource&>().forEachRule(
+               std::declval<void (*)(const std::string&, const RuleDefinition&)>()))>
+  explicit CompiledGrammar(const GrammarSource& source) {
+    source.forEachRule([this](const std::string& name, const RuleDefinition& definition) {
+      CompiledRule& rule = this->rules[name];
+      rule.isList = definition.isList;
+      for (auto& option : definition.options) {
+        rule.alternatives.push_back(details::compileNode(option));
+      }
+
+      if (!definition.weights.empty()) {
+        if (definition.weights.size() != rule.alternatives.size()) {
+          throw std::invalid_argument("tracerz: rule " + name + " must have one weight per option");
+        }
+        rule.weights = details::AliasTable(definition.weights);
+      }
+    });
+
+    this->analyze();
+  }
+
+  /**
+   * Serializes this grammar into a compact binary form, which fromBinary() loads without parsing json or classifying
+   * any input strings. The binary form starts with a header holding a magic number, the format version, and the number
+   * of each kind of record. It is followed by the offsets of every distinct string, then fixed size records for each
+   * compiled node, modifier and rule referring to strings and to each other by index, then a pool of indices, the rule
+   * weights, and finally the contents of the strings. Numbers are stored in the byte order of the machine writing them.
+   *
+   * @return the binary form of this grammar
+   */
+  std::string toBinary() const {
+    details::BinaryGrammarWriter writer;
+    for (auto& [name, rule] : this->rules) {
+      writer.addRule(name, rule.isList, rule.alternatives, rule.weights.getWeights());
+    }
+    return writer.finish();
+  }
+
+  /**
+   * Loads a grammar from the binary form written by toBinary(). This is a full deserialization: every string, node and
+   * rule is copied out of the data into a new grammar, which is then analyzed, so loading still allocates the whole
+   * grammar. It only skips parsing json and classifying the input strings. The data isn't referred to once loaded.
+   *
+   * @param data the binary form of the grammar
+   * @param size the size of the data, in bytes
+   * @return the grammar
+   * @throws std::invalid_argument if the data is not a valid binary grammar
+   */
+  static CompiledGrammar fromBinary(const void* data, std::size_t size) {
+    CompiledGrammar grammar;
+    details::BinaryGrammarReader reader(data, size);
+    reader.forEachRule([&grammar](const std::string& name,
+                                  bool isList,
+                                  std::vector<std::shared_ptr<const details::CompiledNode>> alternatives,
+                                  const std::vector<double>& weights) {
+      CompiledRule& rule = grammar.rules[name];
+      rule.isList = isList;
+      rule.alternatives = std::move(alternatives);
+      if (!weights.empty()) {
+        if (weights.size() != rule.alternatives.size()) throw std::invalid_argument("tracerz: invalid binary grammar");
+        rule.weights = details::AliasTable(weights);
+      }
+    });
+
+    grammar.analyze();
+    return grammar;
+  }
+
+  /**
+   * Gets the interned ids of every modifier that can be applied while expanding the given compiled input with this
+   * grammar
+   *
+   * @param node the compiled input
+   * @return the ids of the reachable modifiers
+   */
+  std::set<std::size_t> getReachableModifiers(const details::CompiledNode& node) const {
+    std::set<std::string> ruleNames;
+    std::set<std::size_t> modifiers;
+    std::map<std::size_t, std::string> names;
+    collectReferences(node, ruleNames, modifiers, names);
+    for (auto& ruleName : ruleNames) {
+      if (const CompiledRule* rule = this->getRule(ruleName)) {
+        modifiers.insert(rule->reachableModifiers.begin(), rule->reachableModifiers.end());
+      }
+    }
+    return modifiers;
+  }
+
+  /**
+   * Gets the compiled rule with the given name
+   *
+   * @param ruleName the name of the rule
+   * @return the compiled rule, or nullptr if there is no such rule
+   */
+  const CompiledRule* getRule(const std::string& ruleName) const {
+    auto iter = this->rules.find(ruleName);
+    return iter == this->rules.end() ? nullptr : &iter->second;
+  }
+
+  /**
+   * Gets the compiled rule with the given interned name, as compiled nodes refer to rules
+   *
+   * @param ruleId the interned id of the rule name, see tracerz::details::internRuleName
+   * @return the compiled rule, or nullptr if there is no such rule
+   */
+  const CompiledRule* getRule(std::size_t ruleId) const {
+    const CompiledRule* const* rule = this->rulesById.find(ruleId);
+    return rule ? *rule : nullptr;
+  }
+
+  /**
+   * Gets the names of every modifier applied anywhere in this grammar, by interned id
+   *
+   * @return the names of the modifiers used by this grammar
+   */
+  const std::map<std::size_t, std::string>& getModifierNames() const {
+    return this->modifierNames;
+  }
+
+  /**
+   * Estimates the size of the expansion of the given compiled input with this grammar, see tracerz::ExpansionSize
+   *
+   * @param node the compiled input
+   * @return the estimated size of its expansion
+   */
+  ExpansionSize estimateSize(const details::CompiledNode& node) const {
+    ExpansionSize size;
+    SizeTerms terms;
+    measure(node, terms, [this, &size, &terms](const std::string& name) {
+      const ExpansionSize* other = this->findSize(name);
+      if (other == nullptr) {
+        // The rule expands to an empty string in a node of its own
+        ++terms.nodes;
+        return;
+      }
+      size.minBytes = saturatingAdd(size.minBytes, other->minBytes);
+      size.expectedBytes += other->expectedBytes;
+      size.maxBytes = saturatingAdd(size.maxBytes, other->maxBytes);
+      size.minNodes = saturatingAdd(size.minNodes, other->minNodes);
+      size.expectedNodes += other->expectedNodes;
+      size.maxNodes = saturatingAdd(size.maxNodes, other->maxNodes);
+    });
+
+    size.minBytes = saturatingAdd(size.minBytes, terms.minBytes);
+    size.expectedBytes += terms.expectedBytes;
+    size.maxBytes = saturatingAdd(size.maxBytes, terms.maxBytes);
+    size.minNodes = saturatingAdd(size.minNodes, terms.nodes);
+    size.expectedNodes += static_cast<double>(terms.nodes);
+    size.maxNodes = saturatingAdd(size.maxNodes, terms.nodes);
+    return size;
+  }
+
+  /**
+   * Estimates the size of the expansion of the given input string with this grammar, see tracerz::ExpansionSize
+   *
+   * @param input the input string
+   * @return the estimated size of its expansion
+   */
+  ExpansionSize estimateSize(const std::string& input) const {
+    return this->estimateSize(*details::compileNode(input));
+  }
+
+  /**
+   * Gets the names of the rules whose expected expansion size diverges: on average, each expansion of such a rule
+   * expands the rule again at least once, so its expansions grow without bound unless limited by
+   * tracerz::ExpansionLimits. This is worked out when the grammar is compiled, so that such rules can be reported when
+   * the grammar is loaded.
+   *
+   * @return the names of the diverging rules, in alphabetical order
+   */
+  const std::vector<std::string>& getDivergingRules() const {
+    return this->divergingRules;
+  }
+
+  /**
+   * Counts the distinct expansions of the given compiled input with this grammar: the number of ways to pick the
+   * alternatives of the rules it expands, each of which gives one expansion. Alternatives that can't be drawn, such as
+   * those with no weight, are not counted, and neither are expansion limits. Actions make the expansions depend on the
+   * runtime dictionary, so an input that can reach one isn't counted.
+   *
+   * @param node the compiled input
+   * @return the number of expansions, `UINT64_MAX` if there are at least as many or the input can recurse, or 0 if
+   *         the input can reach an action
+   */
+  std::uint64_t countExpansions(const details::CompiledNode& node) const {
+    switch (node.type) {
+      case details::NodeType::Text:
+        return 1;
+      case details::NodeType::Rule: {
+        const CompiledRule* rule = this->getRule(node.nameId);
+        return rule == nullptr ? 1 : rule->expansions;
+      }
+      case details::NodeType::Mixed: {
+        std::uint64_t count = 1;
+        for (auto& child : node.children) {
+          std::uint64_t childCount = this->countExpansions(*child);
+          if (childCount == 0) return 0;
+          count = count > std::numeric_limits<std::uint64_t>::max() / childCount
+                  ? std::numeric_limits<std::uint64_t>::max()
+                  : count * childCount;
+        }
+        return count;
+      }
+      default:
+        return 0;
+    }
+  }
+
+  /**
+   * Counts the distinct expansions of the given input string with this grammar, see the overload taking a compiled input
+   *
+   * @param input the input string
+   * @return the number of expansions, `UINT64_MAX` if there are at least as many or the input can recurse, or 0 if
+   *         the input can reach an action
+   */
+  std::uint64_t countExpansions(const std::string& input) const {
+    return this->countExpansions(*details::compileNode(input));
+  }
+
+private:
+  /** The part of the size of an alternative that doesn't depend on the rules it references */
+  struct SizeTerms {
+    /** The probability of the alternative being selected */
+    double probability = 1;
+
+    /** The fewest bytes of its plain text */
+    std::size_t minBytes = 0;
+
+    /** The expected number of bytes of its plain text */
+    double expectedBytes = 0;
+
+    /** The most bytes of its plain text */
+    std::size_t maxBytes = 0;
+
+    /** The number of its nodes */
+    std::size_t nodes = 0;
+
+    /** True if the nodes of the referenced rules are added to its own */
+    bool addsReferencedNodes = true;
+
+    /** The rules and keys it references, see SizedEntry, once per reference */
+    std::vector<std::size_t> references;
+  };
+
+  /** A rule of the grammar or a key set by actions, while the sizes of their expansions are worked out */
+  struct SizedEntry {
+    /** The compiled rule, or nullptr for a key */
+    CompiledRule* rule = nullptr;
+
+    /** The alternatives it can expand to */
+    std::vector<SizeTerms> alternatives;
+
+    /** The estimated size of its expansion */
+    ExpansionSize size;
+  };
+  /**
+   * Creates an empty grammar, which the rules are added to before it is analyzed
+   */
+  CompiledGrammar() = default;
+
+public:
+  /**
+   * Copies the given grammar, indexing the copied rules
+   *
+   * @param other the grammar to copy
+   */
+  CompiledGrammar(const CompiledGrammar& other)
+      : rules(other.rules)
+      , modifierNames(other.modifierNames)
+      , keySizes(other.keySizes)
+      , divergingRules(other.divergingRules) {
+    this->indexRules();
+  }
+
+  /**
+   * Moves the given grammar. The rules keep their addresses, so the index stays valid.
+   */
+  CompiledGrammar(CompiledGrammar&&) noexcept = default;
+
+  /**
+   * Copies the given grammar, indexing the copied rules
+   *
+   * @param other the grammar to copy
+   * @return this grammar
+   */
+  CompiledGrammar& operator=(const CompiledGrammar& other) {
+    if (this != &other) {
+      this->rules = other.rules;
+      this->modifierNames = other.modifierNames;
+      this->keySizes = other.keySizes;
+      this->divergingRules = other.divergingRules;
+      this->indexRules();
+    }
+    return *this;
+  }
+
+  /**
+   * Moves the given grammar. The rules keep their addresses, so the index stays valid.
+   *
+   * @return this grammar
+   */
+  CompiledGrammar& operator=(CompiledGrammar&&) noexcept = default;
+
+private:
+  /**
+   * Indexes the rules by the interned ids of their names, see getRule(std::size_t)
+   */
+  void indexRules() {
+    this->rulesById.clear();
+    for (auto& [name, rule] : this->rules) {
+      this->rulesById[details::internRuleName(name)] = &rule;
+    }
+  }
+
+  /**
+   * Works out the modifiers and rules that can be reached from each rule, and which rules are deterministic
+   */
+  void analyze() {
+    this->indexRules();
+
+    // Collect the rules and modifiers each rule references directly
+    std::map<std::string, std::set<std::string>> referencedRules;
+    for (auto& [name, rule] : this->rules) {
+      for (auto& alternative : rule.alternatives) {
+        collectReferences(*alternative, referencedRules[name], rule.reachableModifiers, this->modifierNames);
+      }
+      rule.reachableRules = referencedRules[name];
+      rule.reachableRules.insert(name);
+    }
+
+    // Propagate the rules and modifiers of referenced rules until nothing changes, so that cycles in the grammar are
+    // handled
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto& [name, rule] : this->rules) {
+        for (auto& referenced : referencedRules[name]) {
+          const CompiledRule* other = this->getRule(referenced);
+          if (other == nullptr || other == &rule) continue;
+          for (auto& modifier : other->reachableModifiers) {
+            changed |= rule.reachableModifiers.insert(modifier).second;
+          }
+          for (auto& reachable : other->reachableRules) {
+            changed |= rule.reachableRules.insert(reachable).second;
+          }
+        }
+      }
+    }
+
+    // A rule is deterministic once every rule it references is known to be. Rules in a cycle never are, since their
+    // expansion would never finish.
+    changed = true;
+    while (changed) {
+      changed = false;
+      for (auto& [name, rule] : this->rules) {
+        if (rule.isDeterministic || (rule.isList && !rule.alternatives.empty())) continue;
+        if (!rule.alternatives.empty() && containsActions(*rule.alternatives.front())) continue;
+
+        bool deterministic = true;
+        for (auto& referenced : referencedRules[name]) {
+          const CompiledRule* other = this->getRule(referenced);
+          if (other != nullptr && !other->isDeterministic) deterministic = false;
+        }
+        if (deterministic) rule.isDeterministic = changed = true;
+      }
+    }
+
+    for (auto& [name, rule] : this->rules) {
+      for (auto& reachable : rule.reachableRules) {
+        rule.reachableRuleIds.push_back(details::internRuleName(reachable));
+      }
+      for (auto& alternative : rule.alternatives) {
+        precompilePatterns(*alternative);
+      }
+    }
+
+    // The height of an alternative is one more than the greatest height of the rules it references. Heights only go
+    // down from unknown until nothing changes, so rules that can only recurse keep no height.
+    std::map<std::string, std::vector<std::set<std::string>>> alternativeRules;
+    for (auto& [name, rule] : this->rules) {
+      std::set<std::size_t> modifiers;
+      for (auto& alternative : rule.alternatives) {
+        collectReferences(*alternative, alternativeRules[name].emplace_back(), modifiers, this->modifierNames);
+      }
+    }
+    changed = true;
+    while (changed) {
+      changed = false;
+      for (auto& [name, rule] : this->rules) {
+        std::vector<std::set<std::string>>& referenced = alternativeRules[name];
+        for (std::size_t i = 0; i < referenced.size(); i++) {
+          std::size_t height = 1;
+          for (auto& other : referenced[i]) {
+            const CompiledRule* otherRule = this->getRule(other);
+            if (otherRule == nullptr) {
+              height = std::max<std::size_t>(height, 2);
+              continue;
+            }
+            height = otherRule->height == std::numeric_limits<std::size_t>::max()
+                     ? otherRule->height
+                     : std::max(height, otherRule->height + 1);
+            if (height == std::numeric_limits<std::size_t>::max()) break;
+          }
+          if (height < rule.height) {
+            rule.height = height;
+            rule.shortestAlternative = i;
+            changed = true;
+          }
+        }
+      }
+    }
+
+    this->analyzeSizes();
+  }
+
+  /**
+   * Works out the estimated size of the expansion of each rule, and of each key set by actions that is not a rule. The
+   * rules and keys referencing each other are split into strongly connected components, which are sized with every
+   * rule they reference already sized. The expansions of the rules of a component with a cycle can recurse without
+   * bound. Their expected sizes are solved for from the expected number of times the component's entries reference
+   * each other, which shows exactly when they diverge: when the expansions re-enter the component at least once on
+   * average. Components too large to solve outright are iterated instead, and diverge if they don't settle.
+   */
+  void analyzeSizes() {
+    // Number the rules, and the keys set by actions that aren't rules
+    std::vector<SizedEntry> entries;
+    std::map<std::string, std::size_t> entryIds;
+    std::map<std::string, std::vector<const details::CompiledNode*>> keySites;
+    for (auto& [name, rule] : this->rules) {
+      entryIds[name] = entries.size();
+      entries.emplace_back().rule = &rule;
+      for (auto& alternative : rule.alternatives) collectKeySites(*alternative, keySites);
+    }
+    for (auto& [name, sites] : keySites) {
+      if (entryIds.emplace(name, entries.size()).second) entries.emplace_back();
+    }
+
+    // Measures an alternative, referring to rules and keys by their numbers. A rule that is neither expands to an
+    // empty string in a node of its own.
+    auto measureAlternative = [&entryIds](const details::CompiledNode& node) {
+      SizeTerms terms;
+      measure(node, terms, [&entryIds, &terms](const std::string& name) {
+        auto iter = entryIds.find(name);
+        if (iter == entryIds.end()) {
+          ++terms.nodes;
+        } else {
+          terms.references.push_back(iter->second);
+        }
+      });
+      return terms;
+    };
+
+    // A rule expands to one of its alternatives if it is a list, otherwise to its first alternative. A key expands to
+    // one of the values it is set to, as plain text in a single node.
+    for (auto& [name, id] : entryIds) {
+      SizedEntry& entry = entries[id];
+      if (entry.rule != nullptr) {
+        const CompiledRule& rule = *entry.rule;
+        std::size_t count = rule.isList ? rule.alternatives.size() : std::min<std::size_t>(rule.alternatives.size(), 1);
+        const std::vector<double>& weights = rule.weights.getWeights();
+        double total = 0;
+        for (double weight : weights) total += weight;
+        for (std::size_t i = 0; i < count; i++) {
+          double probability = weights.empty() ? 1.0 / static_cast<double>(count) : weights[i] / total;
+          if (!(probability > 0)) continue;
+          SizeTerms& terms = entry.alternatives.emplace_back(measureAlternative(*rule.alternatives[i]));
+          terms.probability = probability;
+        }
+        if (entry.alternatives.empty()) entry.alternatives.emplace_back().nodes = 1;
+        continue;
+      }
+
+      const std::vector<const details::CompiledNode*>& sites = keySites[name];
+      for (const details::CompiledNode* site : sites) {
+        SizeTerms terms;
+        if (site->type == details::NodeType::KeyWithRuleAction) {
+          terms = measureAlternative(*site->children.front());
+        } else if (!site->values.empty()) {
+          terms.minBytes = std::numeric_limits<std::size_t>::max();
+          for (auto& value : site->values) {
+            terms.minBytes = std::min(terms.minBytes, value.size());
+            terms.maxBytes = std::max(terms.maxBytes, value.size());
+            terms.expectedBytes += static_cast<double>(value.size()) / static_cast<double>(site->values.size());
+          }
+        }
+        terms.probability = 1.0 / static_cast<double>(sites.size());
+        terms.nodes = 1;
+        terms.addsReferencedNodes = false;
+        entry.alternatives.push_back(std::move(terms));
+      }
+    }
+
+    // Size each quantity of an alternative from the current sizes of the entries it references
+    auto fewestBytes = [&entries](const SizeTerms& terms) {
+      std::size_t bytes = terms.minBytes;
+      for (std::size_t id : terms.references) bytes = saturatingAdd(bytes, entries[id].size.minBytes);
+      return bytes;
+    };
+    auto mostBytes = [&entries](const SizeTerms& terms) {
+      std::size_t bytes = terms.maxBytes;
+      for (std::size_t id : terms.references) bytes = saturatingAdd(bytes, entries[id].size.maxBytes);
+      return bytes;
+    };
+    auto expectedBytesOf = [&entries](const SizeTerms& terms) {
+      double bytes = terms.expectedBytes;
+      for (std::size_t id : terms.references) bytes += entries[id].size.expectedBytes;
+      return bytes;
+    };
+    auto fewestNodes = [&entries](const SizeTerms& terms) {
+      std::size_t nodes = terms.nodes;
+      if (!terms.addsReferencedNodes) return nodes;
+      for (std::size_t id : terms.references) nodes = saturatingAdd(nodes, entries[id].size.minNodes);
+      return nodes;
+    };
+    auto mostNodes = [&entries](const SizeTerms& terms) {
+      std::size_t nodes = terms.nodes;
+      if (!terms.addsReferencedNodes) return nodes;
+      for (std::size_t id : terms.references) nodes = saturatingAdd(nodes, entries[id].size.maxNodes);
+      return nodes;
+    };
+    auto expectedNodesOf = [&entries](const SizeTerms& terms) {
+      double nodes = static_cast<double>(terms.nodes);
+      if (!terms.addsReferencedNodes) return nodes;
+      for (std::size_t id : terms.references) nodes += entries[id].size.expectedNodes;
+      return nodes;
+    };
+
+    // The position of each entry in the component being sized, while its expected sizes are solved for
+    std::vector<std::size_t> positions(entries.size(), std::numeric_limits<std::size_t>::max());
+
+    for (auto& component : findComponents(entries)) {
+      bool recursive = component.size() > 1;
+      for (std::size_t id : component) {
+        for (auto& terms : entries[id].alternatives) {
+          for (std::size_t other : terms.references) recursive |= other == id;
+        }
+        if (entries[id].rule != nullptr) entries[id].rule->isRecursive = recursive;
+      }
+
+      // The rules of a recursive component have unbounded expansions, unless one of them can reach an action, which
+      // all of them then can
+      for (std::size_t id : component) {
+        if (entries[id].rule != nullptr) entries[id].rule->expansions = std::numeric_limits<std::uint64_t>::max();
+      }
+      bool countable = true;
+      for (std::size_t id : component) {
+        if (entries[id].rule == nullptr) continue;
+        std::uint64_t expansions = this->countRule(*entries[id].rule);
+        countable &= expansions != 0;
+        if (!recursive) entries[id].rule->expansions = expansions;
+      }
+      for (std::size_t id : component) {
+        if (!countable && entries[id].rule != nullptr) entries[id].rule->expansions = 0;
+      }
+
+      // The fewest bytes and nodes only go down from unknown until nothing changes
+      for (std::size_t id : component) {
+        entries[id].size.minBytes = entries[id].size.minNodes = std::numeric_limits<std::size_t>::max();
+      }
+      bool changed = true;
+      while (changed) {
+        changed = false;
+        for (std::size_t id : component) {
+          ExpansionSize& size = entries[id].size;
+          for (auto& terms : entries[id].alternatives) {
+            std::size_t bytes = fewestBytes(terms);
+            std::size_t nodes = fewestNodes(terms);
+            if (bytes < size.minBytes) {
+              size.minBytes = bytes;
+              changed = true;
+            }
+            if (nodes < size.minNodes) {
+              size.minNodes = nodes;
+              changed = true;
+            }
+          }
+        }
+      }
+
+      // Recursive expansions have no most bytes. Only rules have nodes of their own to add on each recursion.
+      for (std::size_t id : component) {
+        ExpansionSize& size = entries[id].size;
+        for (auto& terms : entries[id].alternatives) {
+          size.maxBytes = recursive ? std::numeric_limits<std::size_t>::max() : std::max(size.maxBytes, mostBytes(terms));
+          size.maxNodes = recursive && entries[id].rule != nullptr ? std::numeric_limits<std::size_t>::max()
+                                                                   : std::max(size.maxNodes, mostNodes(terms));
+        }
+      }
+
+      // The expected sizes x solve (I - M)x = c, where M holds the probabilities of the alternatives times their
+      // references within the component, and c the rest of their sizes. Keys don't add the nodes they reference.
+      if (component.size() <= maxSolvedComponentSize) {
+        std::size_t count = component.size();
+        for (std::size_t i = 0; i < count; i++) positions[component[i]] = i;
+        std::vector<double> bytesMatrix(count * count), bytes(count), nodesMatrix(count * count), nodes(count);
+        for (std::size_t i = 0; i < count; i++) {
+          bytesMatrix[i * count + i] = nodesMatrix[i * count + i] = 1;
+          for (auto& terms : entries[component[i]].alternatives) {
+            bytes[i] += terms.probability * terms.expectedBytes;
+            nodes[i] += terms.probability * static_cast<double>(terms.nodes);
+            for (std::size_t other : terms.references) {
+              std::size_t position = positions[other];
+              if (position < count) {
+                bytesMatrix[i * count + position] -= terms.probability;
+                if (terms.addsReferencedNodes) nodesMatrix[i * count + position] -= terms.probability;
+              } else {
+                bytes[i] += terms.probability * entries[other].size.expectedBytes;
+                if (terms.addsReferencedNodes) nodes[i] += terms.probability * entries[other].size.expectedNodes;
+              }
+            }
+          }
+        }
+        bool bytesConverge = solveExpectedSizes(bytesMatrix, bytes);
+        bool nodesConverge = solveExpectedSizes(nodesMatrix, nodes);
+        for (std::size_t i = 0; i < count; i++) {
+          SizedEntry& entry = entries[component[i]];
+          entry.size.expectedBytes = bytesConverge ? bytes[i] : std::numeric_limits<double>::infinity();
+          if (nodesConverge) {
+            entry.size.expectedNodes = nodes[i];
+          } else if (entry.rule != nullptr) {
+            entry.size.expectedNodes = std::numeric_limits<double>::infinity();
+          } else {
+            entry.size.expectedNodes = 0;
+            for (auto& terms : entry.alternatives) entry.size.expectedNodes += terms.probability * expectedNodesOf(terms);
+          }
+        }
+        for (std::size_t id : component) positions[id] = std::numeric_limits<std::size_t>::max();
+        continue;
+      }
+
+      // Larger components are iterated from 0, settling on the least solution if the expansion finishes on average
+      bool settled = false;
+      for (std::size_t iteration = 0; iteration < maxSizeIterations && !settled; iteration++) {
+        settled = true;
+        for (std::size_t id : component) {
+          ExpansionSize& size = entries[id].size;
+          double bytes = 0, nodes = 0;
+          for (auto& terms : entries[id].alternatives) {
+            bytes += terms.probability * expectedBytesOf(terms);
+            nodes += terms.probability * expectedNodesOf(terms);
+          }
+          settled &= hasSettled(size.expectedBytes, bytes) && hasSettled(size.expectedNodes, nodes);
+          size.expectedBytes = bytes;
+          size.expectedNodes = nodes;
+        }
+      }
+      if (!settled) {
+        for (std::size_t id : component) {
+          entries[id].size.expectedBytes = std::numeric_limits<double>::infinity();
+          if (entries[id].rule != nullptr) entries[id].size.expectedNodes = std::numeric_limits<double>::infinity();
+        }
+      }
+    }
+
+    for (auto& [name, id] : entryIds) {
+      const SizedEntry& entry = entries[id];
+      if (entry.rule == nullptr) {
+        this->keySizes[name] = entry.size;
+        continue;
+      }
+      entry.rule->size = entry.size;
+      if (std::isinf(entry.size.expectedBytes) || std::isinf(entry.size.expectedNodes)) {
+        this->divergingRules.push_back(name);
+      }
+    }
+  }
+
+  /**
+   * Splits the given entries into strongly connected components by the references of their alternatives, with
+   * Tarjan's algorithm. Every entry referenced by a component is in the same component or one before it.
+   *
+   * @param entries the entries
+   * @return the components, as lists of entry numbers
+   */
+  static std::vector<std::vector<std::size_t>> findComponents(const std::vector<SizedEntry>& entries) {
+    const std::size_t unvisited = std::numeric_limits<std::size_t>::max();
+    std::vector<std::vector<std::size_t>> references(entries.size());
+    for (std::size_t id = 0; id < entries.size(); id++) {
+      for (auto& terms : entries[id].alternatives) {
+        references[id].insert(references[id].end(), terms.references.begin(), terms.references.end());
+      }
+      std::sort(references[id].begin(), references[id].end());
+      references[id].erase(std::unique(references[id].begin(), references[id].end()), references[id].end());
+    }
+
+    // Walk depth-first with an explicit stack of entries and their next references to visit
+    std::vector<std::vector<std::size_t>> components;
+    std::vector<std::size_t> order(entries.size(), unvisited);
+    std::vector<std::size_t> lowest(entries.size());
+    std::vector<bool> onStack(entries.size(), false);
+    std::vector<std::size_t> stack;
+    std::vector<std::pair<std::size_t, std::size_t>> walk;
+    std::size_t visited = 0;
+    auto visit = [&](std::size_t id) {
+      order[id] = lowest[id] = visited++;
+      stack.push_back(id);
+      onStack[id] = true;
+      walk.emplace_back(id, 0);
+    };
+    for (std::size_t root = 0; root < entries.size(); root++) {
+      if (order[root] != unvisited) continue;
+      visit(root);
+      while (!walk.empty()) {
+        std::size_t id = walk.back().first;
+        if (walk.back().second < references[id].size()) {
+          std::size_t other = references[id][walk.back().second++];
+          if (order[other] == unvisited) {
+            visit(other);
+          } else if (onStack[other]) {
+            lowest[id] = std::min(lowest[id], order[other]);
+          }
+          continue;
+        }
+
+        walk.pop_back();
+        if (!walk.empty()) lowest[walk.back().first] = std::min(lowest[walk.back().first], lowest[id]);
+        if (lowest[id] == order[id]) {
+          std::vector<std::size_t>& component = components.emplace_back();
+          std::size_t member;
+          do {
+            member = stack.back();
+            stack.pop_back();
+            onStack[member] = false;
+            component.push_back(member);
+          } while (member != id);
+        }
+      }
+    }
+    return components;
+  }
+
+  /**
+   * Adds the plain text and nodes of the given compiled node and its parts to the given size terms, and calls
+   * `onRule(name)` for each rule they reference
+   *
+   * @tparam OnRule the type of the callback
+   * @param node the compiled node
+   * @param terms the size terms
+   * @param onRule the callback, called once per reference
+   */
+  template<typename OnRule>
+  static void measure(const details::CompiledNode& node, SizeTerms& terms, OnRule&& onRule) {
+    ++terms.nodes;
+    switch (node.type) {
+      case details::NodeType::Rule:
+        onRule(node.name);
+        return;
+      case details::NodeType::KeyWithTextAction:
+        return;
+      default:
+        break;
+    }
+    if (node.children.empty()) {
+      terms.minBytes += node.input.size();
+      terms.expectedBytes += static_cast<double>(node.input.size());
+      terms.maxBytes += node.input.size();
+    }
+    for (auto& child : node.children) {
+      measure(*child, terms, onRule);
+    }
+  }
+
+  /**
+   * Adds the actions setting keys in the given compiled node and its parts to the lists of actions setting each key
+   *
+   * @param node the compiled node
+   * @param sites the actions setting each key, by key name
+   */
+  static void collectKeySites(const details::CompiledNode& node,
+                              std::map<std::string, std::vector<const details::CompiledNode*>>& sites) {
+    if (node.type == details::NodeType::KeyWithRuleAction || node.type == details::NodeType::KeyWithTextAction) {
+      sites[node.name].push_back(&node);
+    }
+    for (auto& child : node.children) {
+      collectKeySites(*child, sites);
+    }
+  }
+
+  /**
+   * Finds the estimated size of the expansion of the rule or key with the given name
+   *
+   * @param name the name of the rule or key
+   * @return the estimated size, or nullptr if there is no such rule or key
+   */
+  const ExpansionSize* findSize(const std::string& name) const {
+    if (const CompiledRule* rule = this->getRule(name)) return &rule->size;
+    auto iter = this->keySizes.find(name);
+    return iter == this->keySizes.end() ? nullptr : &iter->second;
+  }
+
+  /**
+   * Returns true if an expected size iterated from the old value to the new one has settled
+   */
+  static bool hasSettled(double oldValue, double newValue) {
+    if (std::isinf(newValue)) return std::isinf(oldValue);
+    return newValue - oldValue <= 1e-12 * std::max(newValue, 1.0);
+  }
+
+  /**
+   * Adds two sizes, saturating at `SIZE_MAX`
+   */
+  static std::size_t saturatingAdd(std::size_t a, std::size_t b) {
+    return a > std::numeric_limits<std::size_t>::max() - b ? std::numeric_limits<std::size_t>::max() : a + b;
+  }
+
+  /**
+   * Solves (I - M)x = c for the expected sizes x of a component by Gaussian elimination, where M holds the expected
+   * number of times each of its entries references each other and c the rest of their sizes. Every pivot is positive
+   * exactly when the spectral radius of M is below 1. A pivot that isn't shows the expansions re-enter the component
+   * at least once on average, so their expected sizes diverge.
+   *
+   * @param matrix I - M, row by row, which is overwritten
+   * @param sizes c, which is replaced by x
+   * @return false if the expected sizes diverge
+   */
+  static bool solveExpectedSizes(std::vector<double>& matrix, std::vector<double>& sizes) {
+    std::size_t count = sizes.size();
+    for (std::size_t k = 0; k < count; k++) {
+      double pivot = matrix[k * count + k];
+      if (!(pivot > minSizePivot)) return false;
+      for (std::size_t i = k + 1; i < count; i++) {
+        double factor = matrix[i * count + k] / pivot;
+        if (factor == 0) continue;
+        for (std::size_t j = k + 1; j < count; j++) matrix[i * count + j] -= factor * matrix[k * count + j];
+        sizes[i] -= factor * sizes[k];
+      }
+    }
+    for (std::size_t k = count; k-- > 0;) {
+      for (std::size_t j = k + 1; j < count; j++) {
+        if (matrix[k * count + j] != 0) sizes[k] -= matrix[k * count + j] * sizes[j];
+      }
+      sizes[k] /= matrix[k * count + k];
+    }
+    return true;
+  }
+
+  /** The smallest pivot of the expected sizes of a component that doesn't make them diverge, see solveExpectedSizes */
+  static constexpr double minSizePivot = 1e-12;
+
+  /** The most entries of a component whose expected sizes are solved for, rather than iterated */
+  static constexpr std::size_t maxSolvedComponentSize = 512;
+
+  /** The most iterations of the expected sizes of a component too large to solve before they are taken to diverge */
+  static constexpr std::size_t maxSizeIterations = 10000;
+
+  /**
+   * Counts the distinct expansions of the given rule from the counts of the rules it references: the sum of those of
+   * the alternatives that can be drawn if it is a list, otherwise those of its first alternative
+   *
+   * @param rule the rule
+   * @return the number of expansions, see countExpansions
+   */
+  std::uint64_t countRule(const CompiledRule& rule) const {
+    if (rule.alternatives.empty()) return 1;
+    if (!rule.isList) return this->countExpansions(*rule.alternatives.front());
+
+    std::vector<std::size_t> draws;
+    if (!rule.weights.empty()) draws = rule.weights.getFirstDraws();
+    std::uint64_t count = 0;
+    for (std::size_t i = 0; i < rule.alternatives.size(); i++) {
+      if (!draws.empty() && draws[i] == rule.weights.range()) continue;
+      std::uint64_t alternativeCount = this->countExpansions(*rule.alternatives[i]);
+      if (alternativeCount == 0) return 0;
+      count = count > std::numeric_limits<std::uint64_t>::max() - alternativeCount
+              ? std::numeric_limits<std::uint64_t>::max()
+              : count + alternativeCount;
+    }
+    return count;
+  }
+
+  /**
+   * Adds the names of the rules and modifiers referenced by the given compiled node and its parts to the given sets
+   *
+   * @param node the compiled node
+   * @param ruleNames the set of referenced rule names
+   * @param modifiers the set of referenced modifier ids
+   * @param names the names of the referenced modifiers, by id
+   */
+  static void collectReferences(const details::CompiledNode& node,
+                                std::set<std::string>& ruleNames,
+                                std::set<std::size_t>& modifiers,
+                                std::map<std::size_t, std::string>& names) {
+    if (node.type == details::NodeType::Rule) {
+      ruleNames.insert(node.name);
+      for (auto& modifier : node.modifiers) {
+        modifiers.insert(modifier.id);
+        names.emplace(modifier.id, modifier.name);
+      }
+    }
+    for (auto& child : node.children) {
+      collectReferences(*child, ruleNames, modifiers, names);
+    }
+  }
+
+  /**
+   * Compiles the patterns of the "replace" modifiers applied by the given compiled node and its parts into the shared
+   * regex cache, so that expanding them never has to. Patterns that aren't valid regular expressions are left to fail
+   * when the modifier is applied, as they would have without precompiling, in case "replace" is not the base modifier.
+   *
+   * @param node the compiled node
+   */
+  static void precompilePatterns(const details::CompiledNode& node) {
+    if (node.type == details::NodeType::Rule) {
+      for (auto& modifier : node.modifiers) {
+        if (modifier.name != "replace" || modifier.params.empty()) continue;
+        try {
+          details::getRegexCache().get(modifier.params.front());
+        } catch (const std::regex_error&) {
+        }
+      }
+    }
+    for (auto& child : node.children) {
+      precompilePatterns(*child);
+    }
+  }
+
+  /**
+   * Returns true if the given compiled node or any of its parts is an action
+   *
+   * @param node the compiled node
+   * @return true if the node contains an action
+   */
+  static bool containsActions(const details::CompiledNode& node) {
+    switch (node.type) {
+      case details::NodeType::Text:
+      case details::NodeType::Rule:
+      case details::NodeType::Mixed:
+        break;
+      default:
+        return true;
+    }
+    for (auto& child : node.children) {
+      if (containsActions(*child)) return true;
+    }
+    return false;
+  }
+
+  /** The compiled rules, by name */
+  std::map<std::string, CompiledRule> rules;
+
+  /** The compiled rules, by the interned ids of their names */
+  details::IdMap<const CompiledRule*> rulesById;
+
+  /** The names of every modifier used by the grammar, by interned id */
+  std::map<std::size_t, std::string> modifierNames;
+
+  /** The estimated sizes of the expansions of keys set by actions that are not rules, by key name */
+  std::map<std::string, ExpansionSize> keySizes;
+
+  /** The names of the rules whose expected expansion size diverges, in alphabetical order */
+  std::vector<std::string> divergingRules;
+};
+
+namespace details {
+/**
+ * Advances a splitmix64 state and returns its next output. splitmix64 is used to expand a single 64 bit seed into the
+ * state of a larger generator, so that similar seeds still give unrelated states.
+ *
+ * @param state the state, which is updated
+ * @return the next output
+ */
+inline std::uint64_t splitMix64(std::uint64_t& state) {
+  std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30u)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27u)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31u);
+}
+
+/**
+ * Multiplies two 64 bit integers into their full 128 bit product
+ *
+ * @param a the first factor
+ * @param b the second factor
+ * @param low set to the low 64 bits of the product
+ * @return the high 64 bits of the product
+ */
+inline std::uint64_t multiplyHigh64(std::uint64_t a, std::uint64_t b, std::uint64_t& low) {
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+  low = static_cast<std::uint64_t>(product);
+  return static_cast<std::uint64_t>(product >> 64u);
+#else
+  std::uint64_t aLow = a & 0xFFFFFFFFull, aHigh = a >> 32u;
+  std::uint64_t bLow = b & 0xFFFFFFFFull, bHigh = b >> 32u;
+  std::uint64_t lowLow = aLow * bLow;
+  std::uint64_t highLow = aHigh * bLow;
+  std::uint64_t lowHigh = aLow * bHigh;
+  std::uint64_t highHigh = aHigh * bHigh;
+  std::uint64_t middle = (lowLow >> 32u) + (highLow & 0xFFFFFFFFull) + lowHigh;
+  low = (middle << 32u) | (lowLow & 0xFFFFFFFFull);
+  return highHigh + (highLow >> 32u) + (middle >> 32u);
+#endif
+}
+} // End namespace details
+
+/**
+ * The xoshiro256** random number generator by David Blackman and Sebastiano Vigna, the default random number generator
+ * of tracerz::Grammar. It meets the UniformRandomBitGenerator requirements, has 32 bytes of state, so it is cheap to
+ * copy, and has a period of 2^256 - 1.
+ *
+ * Its sequence can be split into non-overlapping streams: jump() advances it by 2^128 outputs and longJump() by 2^192
+ * outputs, and split() returns a copy of it and then jumps it, so the streams of successive splits never overlap.
+ */
+class Xoshiro256StarStar {
+public:
+  /** The type of the generated numbers */
+  typedef std::uint64_t result_type;
+
+  /**
+   * Creates a new generator from the given seed, which is expanded into the state with splitmix64
+   *
+   * @param seed the seed
+   */
+  explicit Xoshiro256StarStar(std::uint64_t seed = 0) {
+    this->seed(seed);
+  }
+
+  /**
+   * Reseeds this generator, as if it had been created from the given seed
+   *
+   * @param seed the seed
+   */
+  void seed(std::uint64_t seed) {
+    for (auto& word : this->state) word = details::splitMix64(seed);
+  }
+
+  /**
+   * Gets the smallest number this generator returns
+   *
+   * @return 0
+   */
+  static constexpr result_type min() { return 0; }
+
+  /**
+   * Gets the largest number this generator returns
+   *
+   * @return 2^64 - 1
+   */
+  static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+  /**
+   * Advances this generator and returns its next output
+   *
+   * @return the next output
+   */
+  result_type operator()() {
+    const std::uint64_t result = rotateLeft(this->state[1] * 5, 7) * 9;
+    const std::uint64_t shifted = this->state[1] << 17u;
+    this->state[2] ^= this->state[0];
+    this->state[3] ^= this->state[1];
+    this->state[1] ^= this->state[2];
+    this->state[0] ^= this->state[3];
+    this->state[2] ^= shifted;
+    this->state[3] = rotateLeft(this->state[3], 45);
+    return result;
+  }
+
+  /**
+   * Advances this generator by the given number of outputs
+   *
+   * @param count the number of outputs to skip
+   */
+  void discard(unsigned long long count) {
+    for (; count > 0; count--) (*this)();
+  }
+
+  /**
+   * Advances this generator by 2^128 outputs, as if it had been called that many times
+   */
+  void jump() {
+    static constexpr std::uint64_t polynomial[] = {
+        0x180EC6D33CFD0ABAull, 0xD5A61266F0C9392Cull, 0xA9582618E03FC9AAull, 0x39ABDC4529B1661Cull};
+    this->jumpBy(polynomial);
+  }
+
+  /**
+   * Advances this generator by 2^192 outputs, as if it had been called that many times
+   */
+  void longJump() {
+    static constexpr std::uint64_t polynomial[] = {
+        0x76E15D3EFEFDCBBFull, 0xC5004E441C522FB3ull, 0x77710069854EE241ull, 0x39109BB02ACBE635ull};
+    this->jumpBy(polynomial);
+  }
+
+  /**
+   * Splits off a stream of 2^128 outputs: returns a copy of this generator, then jumps this generator past it
+   *
+   * @return a generator for the split off stream
+   */
+  Xoshiro256StarStar split() {
+    Xoshiro256StarStar stream = *this;
+    this->jump();
+    return stream;
+  }
+
+  /**
+   * Compares the states of two generators
+   *
+   * @param lhs the first generator
+   * @param rhs the second generator
+   * @return true if both generators will produce the same outputs
+   */
+  friend bool operator==(const Xoshiro256StarStar& lhs, const Xoshiro256StarStar& rhs) {
+    return std::equal(std::begin(lhs.state), std::end(lhs.state), std::begin(rhs.state));
+  }
+
+  /**
+   * Compares the states of two generators
+   *
+   * @param lhs the first generator
+   * @param rhs the second generator
+   * @return true if the generators will produce different outputs
+   */
+  friend bool operator!=(const Xoshiro256StarStar& lhs, const Xoshiro256StarStar& rhs) {
+    return !(lhs == rhs);
+  }
+
+private:
+  /**
+   * Rotates the bits of a word to the left
+   *
+   * @param word the word
+   * @param count the number of bits to rotate by, in `(0, 64)`
+   * @return the rotated word
+   */
+  static std::uint64_t rotateLeft(std::uint64_t word, unsigned count) {
+    return (word << count) | (word >> (64u - count));
+  }
+
+  /**
+   * Advances this generator by applying a jump polynomial to its state
+   *
+   * @param polynomial the jump polynomial
+   */
+  void jumpBy(const std::uint64_t (&polynomial)[4]) {
+    std::uint64_t jumped[4] = {0, 0, 0, 0};
+    for (std::uint64_t word : polynomial) {
+      for (unsigned bit = 0; bit < 64; bit++) {
+        if (word & (std::uint64_t(1) << bit)) {
+          for (std::size_t i = 0; i < 4; i++) jumped[i] ^= this->state[i];
+        }
+        (*this)();
+      }
+    }
+    std::copy(std::begin(jumped), std::end(jumped), std::begin(this->state));
+  }
+
+  /** The state, which must not be all zeroes */
+  std::uint64_t state[4];
+};
+
+/**
+ * A uniform integer distribution, drop in compatible with std::uniform_int_distribution and the default distribution of
+ * tracerz::Grammar. With a generator whose range is all 64 or all 32 bit integers, such as
+ * tracerz::Xoshiro256StarStar or std::mt19937, it maps one output to the range with a multiplication, using Daniel
+ * Lemire's nearly divisionless method; a division is only needed for the rare outputs that would bias the result, and
+ * another output is only drawn then. With any other generator it falls back to std::uniform_int_distribution.
+ *
+ * @tparam IntType the type of the generated integers
+ */
+template<typename IntType = int>
+class BoundedIntDistribution {
+public:
+  static_assert(std::is_integral_v<IntType>, "tracerz: BoundedIntDistribution requires an integral type");
+
+  /** The type of the generated integers */
+  typedef IntType result_type;
+
+  /** The range of a distribution */
+  class param_type {
+  public:
+    /** Make the owning distribution type accessible */
+    typedef BoundedIntDistribution distribution_type;
+
+    /**
+     * Creates the range `[a, b]`
+     *
+     * @param _a the smallest integer in the range
+     * @param _b the largest integer in the range, which must not be less than `_a`
+     */
+    explicit param_type(IntType _a = 0, IntType _b = std::numeric_limits<IntType>::max()) : lower(_a), upper(_b) {}
+
+    /**
+     * Gets the smallest integer in the range
+     *
+     * @return the smallest integer in the range
+     */
+    IntType a() const { return this->lower; }
+
+    /**
+     * Gets the largest integer in the range
+     *
+     * @return the largest integer in the range
+     */
+    IntType b() const { return this->upper; }
+
+    /**
+     * Compares two ranges
+     *
+     * @param lhs the first range
+     * @param rhs the second range
+     * @return true if the ranges are the same
+     */
+    friend bool operator==(const param_type& lhs, const param_type& rhs) {
+      return lhs.lower == rhs.lower && lhs.upper == rhs.upper;
+    }
+
+    /**
+     * Compares two ranges
+     *
+     * @param lhs the first range
+     * @param rhs the second range
+     * @return true if the ranges differ
+     */
+    friend bool operator!=(const param_type& lhs, const param_type& rhs) { return !(lhs == rhs); }
+
+  private:
+    /** The smallest integer in the range */
+    IntType lower;
+
+    /** The largest integer in the range */
+    IntType upper;
+  };
+
+  /**
+   * Creates a distribution of the integers in `[_a, _b]`
+   *
+   * @param _a the smallest integer in the range
+   * @param _b the largest integer in the range, which must not be less than `_a`
+   */
+  explicit BoundedIntDistribution(IntType _a = 0, IntType _b = std::numeric_limits<IntType>::max())
+      : range(_a, _b) {}
+
+  /**
+   * Creates a distribution of the integers in the given range
+   *
+   * @param _range the range
+   */
+  explicit BoundedIntDistribution(const param_type& _range) : range(_range) {}
+
+  /**
+   * Does nothing, as this distribution keeps no state between calls
+   */
+  void reset() {}
+
+  /**
+   * Gets the range of this distribution
+   *
+   * @return the range
+   */
+  param_type param() const { return this->range; }
+
+  /**
+   * Sets the range of this distribution
+   *
+   * @param _range the range
+   */
+  void param(const param_type& _range) { this->range = _range; }
+
+  /**
+   * Gets the smallest integer in the range of this distribution
+   *
+   * @return the smallest integer in the range
+   */
+  IntType a() const { return this->range.a(); }
+
+  /**
+   * Gets the largest integer in the range of this distribution
+   *
+   * @return the largest integer in the range
+   */
+  IntType b() const { return this->range.b(); }
+
+  /**
+   * Gets the smallest integer this distribution returns
+   *
+   * @return the smallest integer in the range
+   */
+  IntType min() const { return this->a(); }
+
+  /**
+   * Gets the largest integer this distribution returns
+   *
+   * @return the largest integer in the range
+   */
+  IntType max() const { return this->b(); }
+
+  /**
+   * Generates an integer in the range of this distribution
+   *
+   * @tparam URBG the type of the generator
+   * @param urbg the generator
+   * @return the integer
+   */
+  template<typename URBG>
+  IntType operator()(URBG& urbg) {
+    return (*this)(urbg, this->range);
+  }
+
+  /**
+   * Generates an integer in the given range
+   *
+   * @tparam URBG the type of the generator
+   * @param urbg the generator
+   * @param _range the range
+   * @return the integer
+   */
+  template<typename URBG>
+  IntType operator()(URBG& urbg, const param_type& _range) {
+    typedef std::make_unsigned_t<IntType> unsigned_t;
+    constexpr bool full64 = URBG::min() == 0 && std::uint64_t(URBG::max()) == UINT64_MAX;
+    constexpr bool full32 = URBG::min() == 0 && std::uint64_t(URBG::max()) == UINT32_MAX;
+
+    // The number of integers in the range, minus one, which wraps around correctly for signed types
+    const std::uint64_t span = static_cast<unsigned_t>(static_cast<unsigned_t>(_range.b()) -
+                                                       static_cast<unsigned_t>(_range.a()));
+    if constexpr (full64) {
+      return offset(_range.a(), boundedFrom64(urbg, span));
+    } else if constexpr (full32) {
+      if (span <= UINT32_MAX) return offset(_range.a(), boundedFrom32(urbg, static_cast<std::uint32_t>(span)));
+      // Combine two outputs into the 64 bits a wider range needs
+      auto combined = [&urbg]() {
+        std::uint64_t high = static_cast<std::uint32_t>(urbg());
+        return (high << 32u) | static_cast<std::uint32_t>(urbg());
+      };
+      return offset(_range.a(), boundedFrom64(combined, span));
+    } else {
+      std::uniform_int_distribution<IntType> fallback(_range.a(), _range.b());
+      return fallback(urbg);
+    }
+  }
+
+  /**
+   * Compares two distributions
+   *
+   * @param lhs the first distribution
+   * @param rhs the second distribution
+   * @return true if the distributions have the same range
+   */
+  friend bool operator==(const BoundedIntDistribution& lhs, const BoundedIntDistribution& rhs) {
+    return lhs.range == rhs.range;
+  }
+
+  /**
+   * Compares two distributions
+   *
+   * @param lhs the first distribution
+   * @param rhs the second distribution
+   * @return true if the distributions have different ranges
+   */
+  friend bool operator!=(const BoundedIntDistribution& lhs, const BoundedIntDistribution& rhs) {
+    return !(lhs == rhs);
+  }
+
+private:
+  /**
+   * Adds an unsigned offset to the smallest integer of a range
+   *
+   * @param a the smallest integer of the range
+   * @param value the offset, no greater than the size of the range minus one
+   * @return the integer
+   */
+  static IntType offset(IntType a, std::uint64_t value) {
+    typedef std::make_unsigned_t<IntType> unsigned_t;
+    return static_cast<IntType>(static_cast<unsigned_t>(static_cast<unsigned_t>(a) + static_cast<unsigned_t>(value)));
+  }
+
+  /**
+   * Maps 64 bit outputs of a generator to `[0, span]`, drawing another output only to avoid bias
+   *
+   * @tparam Source the type of the source of uniformly distributed 64 bit integers
+   * @param source the source
+   * @param span the largest integer to return
+   * @return the integer
+   */
+  template<typename Source>
+  static std::uint64_t boundedFrom64(Source& source, std::uint64_t span) {
+    if (span == UINT64_MAX) return static_cast<std::uint64_t>(source());
+    const std::uint64_t size = span + 1;
+    std::uint64_t low;
+    std::uint64_t high = details::multiplyHigh64(static_cast<std::uint64_t>(source()), size, low);
+    if (low < size) {
+      // Outputs whose low half falls below 2^64 mod size would make some results more likely than others
+      const std::uint64_t threshold = (0 - size) % size;
+      while (low < threshold) high = details::multiplyHigh64(static_cast<std::uint64_t>(source()), size, low);
+    }
+    return high;
+  }
+
+  /**
+   * Maps 32 bit outputs of a generator to `[0, span]`, drawing another output only to avoid bias
+   *
+   * @tparam Source the type of the source of uniformly distributed 32 bit integers
+   * @param source the source
+   * @param span the largest integer to return
+   * @return the integer
+   */
+  template<typename Source>
+  static std::uint64_t boundedFrom32(Source& source, std::uint32_t span) {
+    if (span == UINT32_MAX) return static_cast<std::uint32_t>(source());
+    const std::uint32_t size = span + 1;
+    std::uint64_t product = std::uint64_t(static_cast<std::uint32_t>(source())) * size;
+    if (static_cast<std::uint32_t>(product) < size) {
+      const std::uint32_t threshold = (0 - size) % size;
+      while (static_cast<std::uint32_t>(product) < threshold) {
+        product = std::uint64_t(static_cast<std::uint32_t>(source())) * size;
+      }
+    }
+    return product >> 32u;
+  }
+
+  /** The range of this distribution */
+  param_type range;
+};
+
+namespace details {
+/**
+ * Creates a seed that differs between calls, even ones made at the same time from different threads, by mixing a draw
+ * from std::random_device, the time and a counter
+ *
+ * @return the seed
+ */
+inline std::uint64_t makeDefaultSeed() {
+  static std::atomic<std::uint64_t> counter(0);
+  std::uint64_t state = static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+  state ^= static_cast<std::uint64_t>(std::chrono::system_clock::now().time_since_epoch().count()) << 1u;
+  state ^= counter.fetch_add(1, std::memory_order_relaxed) * 0x9E3779B97F4A7C15ull;
+  try {
+    std::random_device device;
+    state ^= (std::uint64_t(device()) << 32u) | device();
+  } catch (const std::exception&) {
+    // Some platforms have no source of entropy, in which case the time and counter have to do
+  }
+  return splitMix64(state);
+}
+
+/**
+ * Creates a random number generator of the given type seeded with tracerz::details::makeDefaultSeed. If the generator
+ * type can be seeded from a seed sequence, all 64 bits of the seed are fed through std::seed_seq; otherwise the
+ * generator is constructed from the seed.
+ *
+ * @tparam RNG the type of the random number generator
+ * @return the random number generator
+ */
+template<typename RNG>
+RNG makeDefaultRNG() {
+  std::uint64_t seed = makeDefaultSeed();
+  if constexpr (std::is_constructible_v<RNG, std::seed_seq&>) {
+    std::seed_seq sequence{static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32u)};
+    return RNG(sequence);
+  } else {
+    return RNG(static_cast<typename RNG::result_type>(seed));
+  }
+}
+
+/** Checks whether a random number generator type has a `jump()` member function, like tracerz::Xoshiro256StarStar */
+template<typename RNG, typename = void>
+struct IsJumpable : std::false_type {};
+
+/** Checks whether a random number generator type has a `jump()` member function, like tracerz::Xoshiro256StarStar */
+template<typename RNG>
+struct IsJumpable<RNG, std::void_t<decltype(std::declval<RNG&>().jump())>> : std::true_type {};
+
+/** Checks whether a random number generator type has a `split()` member function, like tracerz::Xoshiro256StarStar */
+template<typename RNG, typename = void>
+struct IsSplittable : std::false_type {};
+
+/** Checks whether a random number generator type has a `split()` member function, like tracerz::Xoshiro256StarStar */
+template<typename RNG>
+struct IsSplittable<RNG, std::void_t<decltype(std::declval<RNG&>().split())>> : std::true_type {};
+
+/**
+ * Splits off an independent random number generator from the given one. Generators with a `split()` member function,
+ * such as tracerz::Xoshiro256StarStar, give a non-overlapping stream; others are seeded from outputs of the given one.
+ *
+ * @tparam RNG the type of the random number generator
+ * @param rng the random number generator to split, which is advanced
+ * @return the new random number generator
+ */
+template<typename RNG>
+RNG splitRNG(RNG& rng) {
+  if constexpr (IsSplittable<RNG>::value) {
+    return rng.split();
+  } else if constexpr (std::is_constructible_v<RNG, std::seed_seq&>) {
+    std::seed_seq sequence{static_cast<std::uint32_t>(rng()), static_cast<std::uint32_t>(rng()),
+                           static_cast<std::uint32_t>(rng()), static_cast<std::uint32_t>(rng())};
+    return RNG(sequence);
+  } else {
+    return RNG(rng());
+  }
+}
+} // End namespace details
+
+namespace details {
+/**
+ * The paths of the expansions of an input seen so far, as a trie of the alternatives they picked. The picks of an
+ * expansion decide everything it expands to, and every expansion reaching a node of the trie picks from the same number
+ * of alternatives there. Once each alternative of a node has been followed to the end of an expansion, the node is
+ * exhausted: any expansion reaching it can only repeat one seen before.
+ */
+class PickTrie {
+public:
+  /**
+   * Starts following a new path from the root
+   */
+  void startPath() { this->current = 0; }
+
+  /**
+   * Follows the pick of an alternative from the current node
+   *
+   * @param index the picked alternative, in `[0, count)`
+   * @param count the number of alternatives
+   * @param pickable the number of alternatives that can be picked, see tracerz::details::PickTracker::record
+   * @return false if the node reached is exhausted
+   */
+  bool advance(std::size_t index, std::size_t count, std::size_t pickable) {
+    Node& node = this->nodes[this->current];
+    if (node.pickable == 0) {
+      node.pickable = pickable;
+      node.firstEdge = this->edgeCount;
+      this->edgeCount += count;
+    }
+    std::size_t& child = this->children[node.firstEdge + index];
+    if (child == 0) {
+      child = this->nodes.size();
+      this->nodes.push_back(Node{this->current});
+    }
+    this->current = child;
+    return !this->nodes[this->current].exhausted;
+  }
+
+  /**
+   * Ends the current path, at the end of its expansion
+   *
+   * @return true if no path seen before ended there
+   */
+  bool finishPath() {
+    std::size_t id = this->current;
+    if (this->nodes[id].exhausted) return false;
+
+    // The end of the path is exhausted, and so is each ancestor whose alternatives have all been exhausted
+    this->nodes[id].exhausted = true;
+    while (id != 0) {
+      id = this->nodes[id].parent;
+      Node& parent = this->nodes[id];
+      if (++parent.exhaustedChildren < parent.pickable) break;
+      parent.exhausted = true;
+    }
+    return true;
+  }
+
+  /**
+   * Returns true if every expansion has been seen
+   *
+   * @return true if the root is exhausted
+   */
+  bool isExhausted() const { return this->nodes.front().exhausted; }
+
+private:
+  /** A node of the trie, reached by the picks on the path from the root */
+  struct Node {
+    /** The index of the parent node, 0 for the root */
+    std::size_t parent = 0;
+
+    /** The number of alternatives that can be picked at the node, or 0 if no path has picked from it yet */
+    std::size_t pickable = 0;
+
+    /** The id of the edge picking the first alternative from the node, followed by those of the others */
+    std::size_t firstEdge = 0;
+
+    /** The number of children that are exhausted */
+    std::size_t exhaustedChildren = 0;
+
+    /** True if every expansion reaching the node has been seen */
+    bool exhausted = false;
+  };
+
+  /** The nodes, starting with the root */
+  std::vector<Node> nodes = std::vector<Node>(1);
+
+  /**
+   * The index of the node each pick leads to, by the id of its edge. Only the edges that have been followed are kept;
+   * the root, 0, is no node's child.
+   */
+  IdMap<std::size_t> children;
+
+  /** The number of edge ids given to the nodes so far */
+  std::size_t edgeCount = 0;
+
+  /** The index of the node the current path has reached */
+  std::size_t current = 0;
+};
+
+/**
+ * Follows the alternatives picked by a tracerz::details::IndexPicker through a tracerz::details::PickTrie, if it is
+ * given one, so that an expansion which can only repeat one seen before is caught as soon as it makes the pick that
+ * decides so
+ */
+class PickTracker {
+public:
+  /**
+   * Starts following a new path of picks
+   *
+   * @param trie the trie to follow the picks through, or nullptr not to follow them
+   */
+  void startPath(PickTrie* trie) {
+    this->trie = trie;
+    this->repeated = false;
+    if (trie != nullptr) trie->startPath();
+  }
+
+  /**
+   * Returns true if the picks since the path started reached an exhausted node of the trie
+   *
+   * @return true if the expansion can only repeat one seen before
+   */
+  bool isPathRepeated() const { return this->repeated; }
+
+  /**
+   * Records the pick of an alternative
+   *
+   * @param index the picked alternative, in `[0, count)`
+   * @param count the number of alternatives
+   * @param pickable the number of alternatives any pick could have picked, less than count if some of them have no
+   *     chance of being picked
+   * @return the index
+   */
+  std::size_t record(std::size_t index, std::size_t count, std::size_t pickable) {
+    if (this->trie != nullptr && !this->repeated && !this->trie->advance(index, count, pickable)) {
+      this->repeated = true;
+    }
+    return index;
+  }
+
+private:
+  /** The trie the picks are followed through, or nullptr */
+  PickTrie* trie = nullptr;
+
+  /** True if the picks reached an exhausted node of the trie */
+  bool repeated = false;
+};
+
+/**
+ * Picks uniformly distributed indices using the uniform distribution type, constructing a distribution for each pick.
+ * Distribution types with a `param_type`, such as the standard ones, have a specialization reusing one distribution.
+ *
+ * @tparam RNG the type of the random number generator
+ * @tparam UniformIntDistributionT the type of the uniform distribution
+ */
+template<typename RNG, typename UniformIntDistributionT, typename = void>
+class IndexPicker : public PickTracker {
+public:
+  /**
+   * Picks an index in `[0, count)`, recording the pick
+   *
+   * @param rng the random number generator
+   * @param count the number of indices, which must not be 0
+   * @return the index
+   */
+  std::size_t operator()(RNG& rng, std::size_t count) {
+    return this->record(this->draw(rng, count), count, count);
+  }
+
+  /**
+   * Draws an index in `[0, count)` without recording it
+   *
+   * @param rng the random number generator
+   * @param count the number of indices, which must not be 0
+   * @return the index
+   */
+  std::size_t draw(RNG& rng, std::size_t count) {
+    UniformIntDistributionT dist(0, count - 1);
+    return static_cast<std::size_t>(dist(rng));
+  }
+};
+
+/**
+ * Picks uniformly distributed indices using a single distribution, which is given the range of each pick as a
+ * parameter
+ *
+ * @tparam RNG the type of the random number generator
+ * @tparam UniformIntDistributionT the type of the uniform distribution
+ */
+template<typename RNG, typename UniformIntDistributionT>
+class IndexPicker<RNG,
+                  UniformIntDistributionT,
+                  std::void_t<decltype(std::declval<UniformIntDistributionT&>()(
+                      std::declval<RNG&>(),
+                      std::declval<const typename UniformIntDistributionT::param_type&>()))>> : public PickTracker {
+public:
+  /**
+   * Picks an index in `[0, count)`, recording the pick
+   *
+   * @param rng the random number generator
+   * @param count the number of indices, which must not be 0
+   * @return the index
+   */
+  std::size_t operator()(RNG& rng, std::size_t count) {
+    return this->record(this->draw(rng, count), count, count);
+  }
+
+  /**
+   * Draws an index in `[0, count)` without recording it
+   *
+   * @param rng the random number generator
+   * @param count the number of indices, which must not be 0
+   * @return the index
+   */
+  std::size_t draw(RNG& rng, std::size_t count) {
+    typedef typename UniformIntDistributionT::result_type result_type;
+    typename UniformIntDistributionT::param_type range(0, static_cast<result_type>(count - 1));
+    return static_cast<std::size_t>(this->dist(rng, range));
+  }
+
+private:
+  /** The distribution, reused for every pick */
+  UniformIntDistributionT dist;
+};
+
+/**
+ * Holds an index picker whose type is only known to the code using it, so that a class which isn't a template over the
+ * random number generator can keep one between calls, see tracerz::Tree
+ */
+class PickerSlot {
+public:
+  /**
+   * Gets the index picker held by this slot, replacing the held one if it has a different type
+   *
+   * @tparam RNG the type of the random number generator
+   * @tparam UniformIntDistributionT the type of the uniform distribution
+   * @return the index picker
+   */
+  template<typename RNG, typename UniformIntDistributionT>
+  IndexPicker<RNG, UniformIntDistributionT>& get() {
+    typedef Holder<IndexPicker<RNG, UniformIntDistributionT>> HolderT;
+    if (this->type != &HolderT::type) {
+      this->holder.reset(new HolderT);
+      this->type = &HolderT::type;
+    }
+    return static_cast<HolderT*>(this->holder.get())->picker;
+  }
+
+private:
+  /** The base of the holders of each type of index picker */
+  struct HolderBase {
+    virtual ~HolderBase() = default;
+  };
+
+  /** Holds an index picker of the given type */
+  template<typename Picker>
+  struct Holder : HolderBase {
+    /** Identifies the type of the holder by its address */
+    static constexpr char type = 0;
+
+    /** The index picker */
+    Picker picker;
+  };
+
+  /** The held index picker, or nullptr if there is none yet */
+  std::unique_ptr<HolderBase> holder;
+
+  /** The address of the type tag of the held picker's holder, or nullptr if there is none */
+  const char* type = nullptr;
+};
+
+/**
+ * Picks an alternative of the given rule, which must have at least one: by weight if the rule has weights, otherwise
+ * with equal probability. Either way, it takes a single draw from the picker, and records the alternative picked.
+ *
+ * @tparam RNG the type of the random number generator
+ * @tparam UniformIntDistributionT the type of the uniform distribution
+ * @param rule the rule
+ * @param rng the random number generator
+ * @param picker the index picker
+ * @return the index of the alternative
+ */
+template<typename RNG, typename UniformIntDistributionT>
+std::size_t pickAlternative(const CompiledRule& rule, RNG& rng, IndexPicker<RNG, UniformIntDistributionT>& picker) {
+  if (rule.weights.empty()) return picker(rng, rule.alternatives.size());
+  return picker.record(rule.weights.select(picker.draw(rng, rule.weights.range())),
+                       rule.alternatives.size(),
+                       rule.weights.getSelectableCount());
+}
+
+/**
+ * Selects the expansion of a rule node, whose rule has already been looked up in the input grammar. A definition in the
+ * runtime dictionary takes precedence over the input grammar. If the definition is a list, one item is selected at
+ * random. A rule with no definition expands to the empty string.
+ *
+ * @tparam RNG the type of the random number generator
+ * @tparam UniformIntDistributionT the type of the uniform distribution
+ * @param node the compiled rule node
+ * @param rule the rule of the input grammar with the node's name, or nullptr if there is none
+ * @param rng the random number generator
+ * @param picker the index picker
+ * @param runtimeDictionary the runtime dictionary
+ * @return the compiled expansion of the rule
+ */
+template<typename RNG, typename UniformIntDistributionT>
+std::shared_ptr<const CompiledNode> selectExpansion(const CompiledNode& node,
+                                                    const CompiledRule* rule,
+                                                    RNG& rng,
+                                                    IndexPicker<RNG, UniformIntDistributionT>& picker,
+                                                    runtime_dictionary_t& runtimeDictionary) {
+  // Attempt to get an expansion of the rule from the runtime grammar
+  if (const RuntimeDictionary::Ruleset* ruleset = runtimeDictionary.top(node.nameId)) {
+    // If the ruleset is a single string, use it. If it is a list, select a single string from it with equal
+    // probability
+    if (!ruleset->isList) {
+      return runtimeDictionary.getCompiledValue(ruleset->first);
+    } else if (ruleset->count > 0) {
+      return runtimeDictionary.getCompiledValue(ruleset->first + picker(rng, ruleset->count));
+    }
+  } else if (rule != nullptr) {
+    // There is no runtime definition for this rule name, get it from the input grammar instead
+    if (rule->isList && !rule->alternatives.empty()) {
+      return rule->alternatives[pickAlternative(*rule, rng, picker)];
+    } else if (!rule->alternatives.empty()) {
+      return rule->alternatives.front();
+    }
+  }
+
+  // A rule with no definition expands to the empty string
+  static const std::shared_ptr<const CompiledNode> empty = compileNode("");
+  return empty;
+}
+
+/**
+ * Selects the expansion of a rule node. See the overload taking the rule of the input grammar.
+ *
+ * @tparam RNG the type of the random number generator
+ * @tparam UniformIntDistributionT the type of the uniform distribution
+ * @param node the compiled rule node
+ * @param grammar the compiled input grammar
+ * @param rng the random number generator
+ * @param picker the index picker
+ * @param runtimeDictionary the runtime dictionary
+ * @return the compiled expansion of the rule
+ */
+template<typename RNG, typename UniformIntDistributionT>
+std::shared_ptr<const CompiledNode> selectExpansion(const CompiledNode& node,
+                                                    const CompiledGrammar& grammar,
+                                                    RNG& rng,
+                                                    IndexPicker<RNG, UniformIntDistributionT>& picker,
+                                                    runtime_dictionary_t& runtimeDictionary) {
+  return selectExpansion<RNG, UniformIntDistributionT>(node, grammar.getRule(node.nameId), rng, picker,
+                                                       runtimeDictionary);
+}
+} // End namespace details
+
+/**
+ * What an expansion does once it reaches one of its tracerz::ExpansionLimits
+ */
+enum class LimitPolicy {
+  /** Every rule expanded from then on expands to the empty string, and plain text is cut at the output limit */
+  Truncate,
+
+  /**
+   * Every rule expanded from then on expands to the alternative that finishes soonest, so the expansion stops as soon
+   * as the grammar allows. A rule whose expansion never finishes, or that is defined in the runtime dictionary by
+   * anything but plain text, expands to the empty string.
+   */
+  Shortest,
+
+  /** The expansion throws std::length_error */
+  Error
+};
+
+/**
+ * Limits on the size of a single expansion, checked as it goes so that self-recursive grammars stop early instead of
+ * growing without bound. No limit is set by default.
+ */
+struct ExpansionLimits {
+  /** The greatest nesting of rules, where a rule in the input has depth 1 */
+  std::size_t maxDepth = std::numeric_limits<std::size_t>::max();
+
+  /** The greatest number of rules to expand */
+  std::size_t maxNodes = std::numeric_limits<std::size_t>::max();
+
+  /** The greatest number of bytes of plain text to produce, counted before modifiers and including captured keys */
+  std::size_t maxOutputBytes = std::numeric_limits<std::size_t>::max();
+
+  /** What happens once a limit is reached */
+  LimitPolicy policy = LimitPolicy::Truncate;
+};
+
+namespace details {
+/**
+ * Counts the rules and plain text of an expansion against its tracerz::ExpansionLimits
+ */
+class ExpansionBudget {
+public:
+  /** The part of the budget used so far */
+  struct Usage {
+    /** The number of rules expanded as usual */
+    std::size_t rules = 0;
+
+    /** The number of bytes of plain text produced */
+    std::size_t bytes = 0;
+
+    /** The number of rules and plain text that were expanded or cut by the limit policy */
+    std::size_t fallbacks = 0;
+  };
+
+  /**
+   * Creates a budget with nothing used yet
+   *
+   * @param _limits the limits of the expansion
+   */
+  explicit ExpansionBudget(const ExpansionLimits& _limits = ExpansionLimits())
+      : limits(_limits) {
+  }
+
+  /**
+   * Starts a new expansion with nothing used
+   */
+  void reset() { this->usage = Usage(); }
+
+  /**
+   * Gets the limits of the expansion
+   *
+   * @return the limits
+   */
+  const ExpansionLimits& getLimits() const { return this->limits; }
+
+  /**
+   * Gets the part of the budget used so far
+   *
+   * @return the usage
+   */
+  const Usage& getUsage() const { return this->usage; }
+
+  /**
+   * Returns true if any limit is set. Otherwise every rule is expanded as usual and no text is cut, whatever the order
+   * the expansion is counted in.
+   *
+   * @return true if any limit is set
+   */
+  bool hasLimits() const {
+    return this->limits.maxDepth != std::numeric_limits<std::size_t>::max() ||
+           this->limits.maxNodes != std::numeric_limits<std::size_t>::max() ||
+           this->limits.maxOutputBytes != std::numeric_limits<std::size_t>::max();
+  }
+
+  /**
+   * Decides whether a rule about to be expanded at the given depth is expanded as usual, which counts it, or by the
+   * limit policy
+   *
+   * @param depth the depth of the rule
+   * @return true if the rule is expanded as usual, false if it is expanded by the limit policy
+   * @throws std::length_error if a limit is reached and the policy is tracerz::LimitPolicy::Error
+   */
+  bool expandRule(std::size_t depth) {
+    if (depth <= this->limits.maxDepth && this->usage.rules < this->limits.maxNodes &&
+        (this->usage.bytes < this->limits.maxOutputBytes || this->limits.policy == LimitPolicy::Error)) {
+      ++this->usage.rules;
+      return true;
+    }
+    if (this->limits.policy == LimitPolicy::Error) {
+      throw std::length_error(depth > this->limits.maxDepth ? "tracerz: expansion exceeded its depth limit"
+                                                            : "tracerz: expansion exceeded its node limit");
+    }
+    ++this->usage.fallbacks;
+    return false;
+  }
+
+  /**
+   * Counts plain text about to be produced
+   *
+   * @param size the size of the text, in bytes
+   * @return the number of bytes of the text to produce, which is less than its size if it is cut at the output limit
+   * @throws std::length_error if the text exceeds the output limit and the policy is tracerz::LimitPolicy::Error
+   */
+  std::size_t addText(std::size_t size) {
+    std::size_t room = this->limits.maxOutputBytes - std::min(this->usage.bytes, this->limits.maxOutputBytes);
+    if (size > room && this->limits.policy != LimitPolicy::Shortest) {
+      if (this->limits.policy == LimitPolicy::Error) {
+        throw std::length_error("tracerz: expansion exceeded its output limit");
+      }
+      ++this->usage.fallbacks;
+      size = room;
+    }
+    this->usage.bytes += size;
+    return size;
+  }
+
+  /**
+   * Counts an expansion that is already known, instead of expanding it, if it fits in the budget
+   *
+   * @param deepest the depth of the most deeply nested rule of the expansion
+   * @param used the part of a budget the expansion used
+   * @return true if the expansion fits and was counted
+   */
+  bool addExpansion(std::size_t deepest, const Usage& used) {
+    if (deepest > this->limits.maxDepth || used.rules > this->limits.maxNodes - this->usage.rules ||
+        used.bytes >= this->limits.maxOutputBytes - std::min(this->usage.bytes, this->limits.maxOutputBytes)) {
+      return false;
+    }
+    this->usage.rules += used.rules;
+    this->usage.bytes += used.bytes;
+    return true;
+  }
+
+private:
+  /** The limits of the expansion */
+  ExpansionLimits limits;
+
+  /** The part of the budget used so far */
+  Usage usage;
+};
+
+/**
+ * Selects the expansion of a rule node that is expanded by the limit policy, see tracerz::LimitPolicy. Draws nothing
+ * from the random number generator.
+ *
+ * @param node the compiled rule node
+ * @param rule the rule of the input grammar with the node's name, or nullptr if there is none
+ * @param policy the limit policy
+ * @param runtimeDictionary the runtime dictionary
+ * @return the compiled expansion of the rule
+ */
+inline std::shared_ptr<const CompiledNode> selectFallbackExpansion(const CompiledNode& node,
+                                                                   const CompiledRule* rule,
+                                                                   LimitPolicy policy,
+                                                                   runtime_dictionary_t& runtimeDictionary) {
+  static const std::shared_ptr<const CompiledNode> empty = compileNode("");
+  if (policy != LimitPolicy::Shortest) return empty;
+
+  if (const RuntimeDictionary::Ruleset* ruleset = runtimeDictionary.top(node.nameId)) {
+    // Only plain text can't expand any further. Use the shortest string of a list.
+    const std::shared_ptr<const CompiledNode>* shortest = nullptr;
+    for (std::size_t i = 0; i < ruleset->count; i++) {
+      const std::shared_ptr<const CompiledNode>& value = runtimeDictionary.getCompiledValue(ruleset->first + i);
+      if (value->type == NodeType::Text && (!shortest || value->input.size() < (*shortest)->input.size())) {
+        shortest = &value;
+      }
+    }
+    return shortest ? *shortest : empty;
+  } else if (rule != nullptr && rule->height != std::numeric_limits<std::size_t>::max()) {
+    return rule->alternatives[rule->shortestAlternative];
+  }
+  return empty;
+}
+
+/**
+ * Makes a copy of the given plain text, cut to the given number of bytes
+ *
+ * @param text the compiled plain text
+ * @param size the number of bytes to keep
+ * @return the cut text
+ */
+inline std::shared_ptr<const CompiledNode> cutText(const CompiledNode& text, std::size_t size) {
+  auto cut = std::make_shared<CompiledNode>(text);
+  cut->input.resize(size);
+  return cut;
+}
+} // End namespace details
+
+/**
+ * The instrumentation policy of grammars that record nothing. Instrumentation hooks are only called when the policy is
+ * enabled, so they are compiled out with this one.
+ */
+struct NoInstrumentation {
+  /** False, so no hook is ever called */
+  static constexpr bool enabled = false;
+};
+
+/**
+ * An instrumentation policy recording where the time of each sample goes: how often each rule is expanded and the time
+ * spent selecting its expansions, the time spent in each modifier, the pushes and pops of the runtime dictionary, and
+ * the nodes expanded and bytes output per sample. Give it as the Instrumentation parameter of tracerz::Grammar, then
+ * read it back with tracerz::Grammar::getInstrumentation.
+ */
+class Profiler {
+public:
+  /** True, so the hooks are called */
+  static constexpr bool enabled = true;
+
+  /** The calls of a single rule or modifier, and the time spent in them */
+  struct Timing {
+    /** The number of calls */
+    std::size_t calls = 0;
+
+    /** The total time spent in the calls, in nanoseconds */
+    std::uint64_t nanoseconds = 0;
+  };
+
+  /**
+   * Gets the current time of the clock the hooks are timed with
+   *
+   * @return the time, in nanoseconds
+   */
+  static std::uint64_t now() {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+
+  /**
+   * Records a single expansion of a rule
+   *
+   * @param rule the name of the rule
+   * @param nanoseconds the time spent selecting the expansion
+   */
+  void recordRule(const std::string& rule, std::uint64_t nanoseconds) {
+    Timing& timing = this->rules[rule];
+    timing.calls++;
+    timing.nanoseconds += nanoseconds;
+  }
+
+  /**
+   * Records a single application of a modifier
+   *
+   * @param modifier the name of the modifier
+   * @param nanoseconds the time spent in the modifier function
+   */
+  void recordModifier(const std::string& modifier, std::uint64_t nanoseconds) {
+    Timing& timing = this->modifiers[modifier];
+    timing.calls++;
+    timing.nanoseconds += nanoseconds;
+  }
+
+  /**
+   * Records the expansion of a single node of the current sample
+   */
+  void recordNode() {
+    this->sampleNodes++;
+  }
+
+  /**
+   * Finishes the current sample
+   *
+   * @param bytes the number of bytes output by the sample
+   * @param pushes the number of rulesets pushed onto the runtime dictionary by the sample
+   * @param pops the number of rulesets popped off the runtime dictionary by the sample
+   */
+  void finishSample(std::size_t bytes, std::size_t pushes, std::size_t pops) {
+    this->samples++;
+    this->nodes += this->sampleNodes;
+    this->bytes += bytes;
+    this->pushes += pushes;
+    this->pops += pops;
+    this->nodeHistogram[Profiler::bucket(this->sampleNodes)]++;
+    this->byteHistogram[Profiler::bucket(bytes)]++;
+    this->sampleNodes = 0;
+  }
+
+  /**
+   * Gets the calls and time of each rule expanded, by rule name
+   *
+   * @return the rule timings
+   */
+  const std::unordered_map<std::string, Timing>& getRules() const { return this->rules; }
+
+  /**
+   * Gets the calls and time of each modifier applied, by modifier name
+   *
+   * @return the modifier timings
+   */
+  const std::unordered_map<std::string, Timing>& getModifiers() const { return this->modifiers; }
+
+  /**
+   * Gets the number of samples finished
+   *
+   * @return the number of samples
+   */
+  std::size_t getSamples() const { return this->samples; }
+
+  /**
+   * Gets the total number of nodes expanded by the finished samples. A node is each part of an input string expanded,
+   * other than plain text. A deterministic rule output from memory (see tracerz::CompiledRule::isDeterministic) counts
+   * as a single node.
+   *
+   * @return the number of nodes
+   */
+  std::size_t getNodes() const { return this->nodes; }
+
+  /**
+   * Gets the total number of bytes output by the finished samples
+   *
+   * @return the number of bytes
+   */
+  std::size_t getBytes() const { return this->bytes; }
+
+  /**
+   * Gets the total number of rulesets pushed onto the runtime dictionary by the finished samples
+   *
+   * @return the number of pushes
+   */
+  std::size_t getPushes() const { return this->pushes; }
+
+  /**
+   * Gets the total number of rulesets popped off the runtime dictionary by the finished samples
+   *
+   * @return the number of pops
+   */
+  std::size_t getPops() const { return this->pops; }
+
+  /**
+   * Gets the number of samples by the number of nodes they expanded, in buckets of powers of two: bucket `b` counts
+   * the samples expanding from `b` to `2b - 1` nodes, and bucket 0 counts the samples expanding none
+   *
+   * @return the number of samples in each bucket
+   */
+  const std::map<std::size_t, std::size_t>& getNodeHistogram() const { return this->nodeHistogram; }
+
+  /**
+   * Gets the number of samples by the number of bytes they output, in buckets of powers of two, as getNodeHistogram
+   *
+   * @return the number of samples in each bucket
+   */
+  const std::map<std::size_t, std::size_t>& getByteHistogram() const { return this->byteHistogram; }
+
+  /**
+   * Writes a report of everything recorded: the totals, the rules and modifiers slowest in total first, and the
+   * histograms of nodes and bytes per sample
+   *
+   * @return the report
+   */
+  std::string report() const {
+    std::ostringstream out;
+    double perSample = this->samples == 0 ? 0.0 : 1.0 / static_cast<double>(this->samples);
+    out << std::fixed << std::setprecision(1);
+    out << "samples: " << this->samples << "\n";
+    out << "nodes: " << this->nodes << " (" << this->nodes * perSample << " per sample)\n";
+    out << "bytes: " << this->bytes << " (" << this->bytes * perSample << " per sample)\n";
+    out << "dictionary pushes: " << this->pushes << ", pops: " << this->pops << "\n";
+    Profiler::reportTimings(out, "rule", this->rules);
+    Profiler::reportTimings(out, "modifier", this->modifiers);
+    Profiler::reportHistogram(out, "nodes", this->nodeHistogram);
+    Profiler::reportHistogram(out, "bytes", this->byteHistogram);
+    return out.str();
+  }
+
+  /**
+   * Forgets everything recorded
+   */
+  void reset() {
+    *this = Profiler();
+  }
+
+private:
+  /**
+   * Gets the histogram bucket of the given value: the greatest power of two not above it, or 0
+   */
+  static std::size_t bucket(std::size_t value) {
+    std::size_t bucket = value == 0 ? 0 : 1;
+    while (bucket != 0 && bucket <= value / 2) bucket *= 2;
+    return bucket;
+  }
+
+  /**
+   * Writes a table of the given timings, slowest in total first
+   */
+  static void reportTimings(std::ostringstream& out,
+                            const char* title,
+                            const std::unordered_map<std::string, Timing>& timings) {
+    std::vector<std::pair<std::string, Timing>> sorted(timings.begin(), timings.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+      return a.second.nanoseconds != b.second.nanoseconds ? a.second.nanoseconds > b.second.nanoseconds
+                                                          : a.first < b.first;
+    });
+    out << "\n" << std::left << std::setw(32) << title << std::right << std::setw(12) << "calls" << std::setw(14)
+        << "total us" << std::setw(14) << "mean ns" << "\n";
+    for (auto& [name, timing] : sorted) {
+      out << std::left << std::setw(32) << name << std::right << std::setw(12) << timing.calls << std::setw(14)
+          << timing.nanoseconds / 1e3 << std::setw(14)
+          << static_cast<double>(timing.nanoseconds) / static_cast<double>(timing.calls) << "\n";
+    }
+  }
+
+  /**
+   * Writes the given histogram, one bucket per line
+   */
+  static void reportHistogram(std::ostringstream& out,
+                              const char* title,
+                              const std::map<std::size_t, std::size_t>& histogram) {
+    out << "\n" << title << " per sample\n";
+    for (auto& [bucket, samples] : histogram) {
+      std::size_t last = bucket == 0 ? 0 : bucket * 2 - 1;
+      out << std::setw(12) << bucket << " - " << std::left << std::setw(12) << last << std::right << std::setw(10)
+          << samples << "\n";
+    }
+  }
+
+  /** The calls and time of each rule, by name */
+  std::unordered_map<std::string, Timing> rules;
+
+  /** The calls and time of each modifier, by name */
+  std::unordered_map<std::string, Timing> modifiers;
+
+  /** The number of nodes expanded by the current sample */
+  std::size_t sampleNodes = 0;
+
+  /** The number of samples finished */
+  std::size_t samples = 0;
+
+  /** The number of nodes expanded by the finished samples */
+  std::size_t nodes = 0;
+
+  /** The number of bytes output by the finished samples */
+  std::size_t bytes = 0;
+
+  /** The number of rulesets pushed by the finished samples */
+  std::size_t pushes = 0;
+
+  /** The number of rulesets popped by the finished samples */
+  std::size_t pops = 0;
+
+  /** The number of samples by the nodes they expanded */
+  std::map<std::size_t, std::size_t> nodeHistogram;
+
+  /** The number of samples by the bytes they output */
+  std::map<std::size_t, std::size_t> byteHistogram;
+};
+
+/**
+ * Represents a single node in the parse tree
+ *
+ * TODO: enumerate node types
+ */
+class TreeNode : public std::enable_shared_from_this<TreeNode> {
+public:
+  /**
+   * Default constructor. Contains no input, used by the tree to point to certain nodes within the tree, from outside it
+   */
+  TreeNode()
+      : compiled(nullptr)
+      , isNodeComplete_(false)
+      , prevLeaf(nullptr)
+      , nextLeaf(nullptr)
+      , prevUnexpandedLeaf(nullptr)
+      , nextUnexpandedLeaf(nullptr)
+      , keyId(0)
+      , isNodeHidden_(false)
+      , lastIncompleteChild(nullptr)
+      , incompleteChildCount(0)
+      , ruleDepth(0)
+      , parent(nullptr)
+      , flattenedKey(0)
+      , isNodeShared_(false) {
+  }
+
+  /**
+   * Constructs a new tree node from the given parameters. The only required parameter is the input string, all others
+   * default to nullptr
+   *
+   * @param input the input string
+   * @param prev the leaf prior to this leaf
+   * @param next the next leaf from this leaf
+   * @param prevUnexpanded the unexpanded leaf prior to this unexpanded leaf
+   * @param nextUnexpanded the next unexpanded leaf from this unexpanded leaf
+   */
+  explicit TreeNode(const std::string& input,
+                    std::shared_ptr<TreeNode> prev = nullptr,
+                    std::shared_ptr<TreeNode> next = nullptr,
+                    std::shared_ptr<TreeNode> prevUnexpanded = nullptr,
+                    std::shared_ptr<TreeNode> nextUnexpanded = nullptr)
+      : TreeNode(details::compileNode(input),
+                 std::move(prev),
+                 std::move(next),
+                 std::move(prevUnexpanded),
+                 std::move(nextUnexpanded)) {
+  }
+
+  /**
+   * Constructs a new tree node from the given parameters. The only required parameter is the compiled input, all
+   * others default to nullptr
+   *
+   * @param compiledInput the compiled input string
+   * @param prev the leaf prior to this leaf
+   * @param next the next leaf from this leaf
+   * @param prevUnexpanded the unexpanded leaf prior to this unexpanded leaf
+   * @param nextUnexpanded the next unexpanded leaf from this unexpanded leaf
+   */
+  explicit TreeNode(std::shared_ptr<const details::CompiledNode> compiledInput,
+                    std::shared_ptr<TreeNode> prev = nullptr,
+                    std::shared_ptr<TreeNode> next = nullptr,
+                    std::shared_ptr<TreeNode> prevUnexpanded = nullptr,
+                    std::shared_ptr<TreeNode> nextUnexpanded = nullptr)
+      : compiled(std::move(compiledInput))
+      , isNodeComplete_(this->compiled->isComplete())
+      , prevLeaf(prev.get())
+      , nextLeaf(next.get())
+      , prevUnexpandedLeaf(prevUnexpanded.get())
+      , nextUnexpandedLeaf(nextUnexpanded.get())
+      , keyId(0)
+      , isNodeHidden_(false)
+      , lastIncompleteChild(nullptr)
+      , incompleteChildCount(0)
+      , ruleDepth(0)
+      , parent(nullptr)
+      , flattenedKey(0)
+      , isNodeShared_(false) {
+  }
+
+  /**
+   * Destroys the node. Its descendants are released iteratively, so the depth of the sub-tree doesn't limit the stack.
+   */
+  virtual ~TreeNode() {
+    if (this->children.empty()) return;
+    std::vector<std::shared_ptr<TreeNode>> pending(std::move(this->children));
+    while (!pending.empty()) {
+      std::shared_ptr<TreeNode> node = std::move(pending.back());
+      pending.pop_back();
+
+      // If this is the last reference to the node, take its children before it's destroyed so that destroying it
+      // doesn't recurse into them. Nodes still referenced from elsewhere keep their sub-trees.
+      if (node.use_count() == 1) {
+        for (auto& child : node->children) {
+          pending.push_back(std::move(child));
+        }
+        node->children.clear();
+      }
+    }
+  }
+
+  /**
+   * Creates a new tree node from the given compiled input. If an arena is given, the node is allocated from it, and
+   * its children will be too. The node keeps the arena alive.
+   *
+   * @param arena the arena to allocate the node from, or nullptr to allocate it on the heap
+   * @param compiledInput the compiled input string
+   * @return the new node
+   */
+  static std::shared_ptr<TreeNode> create(const std::shared_ptr<details::NodeArena>& arena,
+                                          std::shared_ptr<const details::CompiledNode> compiledInput) {
+    std::shared_ptr<TreeNode> node;
+    if (arena) {
+      node = std::allocate_shared<TreeNode>(details::ArenaAllocator<TreeNode>(arena), std::move(compiledInput));
+    } else {
+      node = std::make_shared<TreeNode>(std::move(compiledInput));
+    }
+    node->arena = arena;
+    return node;
+  }
+
+  /**
+   * Creates a new TreeNode from the given input string and adds it as a child to this node.
+   *
+   * @param inputStr the input string
+   */
+  void addChild(const std::string& inputStr) {
+    this->addChild(details::compileNode(inputStr));
+  }
+
+  /**
+   * Creates a new TreeNode from the given compiled input and adds it as a child to this node.
+   *
+   * @param compiledInput the compiled input string
+   */
+  void addChild(std::shared_ptr<const details::CompiledNode> compiledInput) {
+    // Create the child with the input string, in this node's arena if it has one
+    this->attachChild(TreeNode::create(this->arena, std::move(compiledInput)));
+  }
+
+  /**
+   * Returns true if this node has children nodes
+   *
+   * @return true if this node has children nodes
+   */
+  bool hasChildren() const {
+    return !this->children.empty();
+  }
+
+  /**
+   * Returns true if every child of this node is complete, or there are no children
+   *
+   * @return true if every child of this node is complete, or there are no children
+   */
+  bool areChildrenComplete() const {
+    return this->incompleteChildCount == 0;
+  }
+
+  /**
+   * Gets the last child of this node that is unexpanded
+   *
+   * @return the last child of this node that is unexpanded
+   */
+  std::shared_ptr<TreeNode> getLastExpandableChild() const {
+    // No expandable child, return nullptr
+    if (!this->lastIncompleteChild) return nullptr;
+
+    return this->lastIncompleteChild->shared_from_this();
+  }
+
+  /**
+   * Flattens the sub-tree represented by this node and its descendents into a single string representation, using the
+   * given modifier map to handle any modifiers (if applicable).
+   *
+   * @param modFuns the modifier function map
+   * @param tree the tree this node belongs to, passed to tree modifiers
+   * @param ignoreHidden exclude hidden subtrees from the flattened string
+   * @param ignoreModifiers if true, modifier functions will not be called
+   * @return the flattened string representation
+   */
+  std::string flatten(const details::callback_map_t& modFuns,
+                      const std::shared_ptr<Tree>& tree,
+                      bool ignoreHidden = true,
+                      bool ignoreModifiers = false) {
+    std::string output;
+    this->flattenInto(output, modFuns, tree, ignoreHidden, ignoreModifiers);
+    return output;
+  }
+
+  /**
+   * Flattens the sub-tree represented by this node and its descendents, appending the string representation to the
+   * given output string rather than building a string per node. Sub-trees whose output was kept by an earlier flatten
+   * of their tree, and which haven't changed since, are not flattened again.
+   *
+   * @param output the string to append the flattened string representation to
+   * @param modFuns the modifier function map
+   * @param tree the tree this node belongs to, passed to tree modifiers
+   * @param ignoreHidden exclude hidden subtrees from the flattened string
+   * @param ignoreModifiers if true, modifier functions will not be called
+   */
+  void flattenInto(std::string& output,
+                   const details::callback_map_t& modFuns,
+                   const std::shared_ptr<Tree>& tree,
+                   bool ignoreHidden = true,
+                   bool ignoreModifiers = false) {
+    this->flattenInto<NoInstrumentation>(output, modFuns, tree, ignoreHidden, ignoreModifiers, false, nullptr);
+  }
+
+  template<typename RNG, typename UniformIntDistributionT>
+  void expandNode(const CompiledGrammar&,
+                  RNG&,
+                  details::IndexPicker<RNG, UniformIntDistributionT>&,
+                  details::runtime_dictionary_t&,
+                  details::ExpansionBudget* = nullptr);
+
+  /**
+   * Expands this node, as above, with an index picker of its own
+   *
+   * @tparam RNG the type of the random number generator in use
+   * @tparam UniformIntDistributionT the type to use to perform equal probability expansion of rules
+   * @param grammar the compiled input grammar for the tree containing this node
+   * @param rng the random number generator to use
+   * @param runtimeDictionary the runtime dictionary in use by the tree containing this node
+   * @param budget the budget of the tree's expansion, or nullptr for no limits
+   */
+  template<typename RNG, typename UniformIntDistributionT>
+  void expandNode(const CompiledGrammar& grammar,
+                  RNG& rng,
+                  details::runtime_dictionary_t& runtimeDictionary,
+                  details::ExpansionBudget* budget = nullptr) {
+    details::IndexPicker<RNG, UniformIntDistributionT> picker;
+    this->expandNode<RNG, UniformIntDistributionT>(grammar, rng, picker, runtimeDictionary, budget);
+  }
+
+  /**
+   * Gets the input string for this node
+   *
+   * @return the input string for this node
+   */
+  const std::string& getInput() const {
+    static const std::string empty;
+    return this->compiled ? this->compiled->input : empty;
+  }
+
+  /**
+   * Gets the name of the rule this node expands. Because of the way the parse tree is built, a node with modifiers
+   * always contains only a rule.
+   *
+   * @return the rule name, or the empty string if this node does not contain only a rule
+   */
+  const std::string& getRuleName() const {
+    static const std::string empty;
+    return (this->compiled && this->compiled->type == details::NodeType::Rule) ? this->compiled->name : empty;
+  }
+
+  /**
+   * Gets the compiled form of the input string for this node
+   *
+   * @return the compiled input, or nullptr for nodes with no input
+   */
+  const std::shared_ptr<const details::CompiledNode>& getCompiledInput() const { return this->compiled; }
+
+  /**
+   * Gets the next leaf (if applicable). If this is the last leaf or if this node is not a leaf, will return nullptr.
+   *
+   * @return the next leaf (if applicable)
+   */
+  std::shared_ptr<TreeNode> getNextLeaf() const {
+    return this->nextLeaf ? this->nextLeaf->shared_from_this() : nullptr;
+  }
+
+  /**
+   * Gets the next unexpanded leaf (if applicable). If this is the last unexpanded leaf, is partiall or fully expanded,
+   * or is not a leaf, will return nullptr.
+   *
+   * @return the next unexpanded leaf (if applicable)
+   */
+  std::shared_ptr<TreeNode> getNextUnexpandedLeaf() const {
+    return this->nextUnexpandedLeaf ? this->nextUnexpandedLeaf->shared_from_this() : nullptr;
+  }
+
+  /**
+   * Gets the previous leaf (if applicable). If this node is not a leaf, will return nullptr.
+   *
+   * @return the previous leaf (if applicable)
+   */
+  std::shared_ptr<TreeNode> getPrevLeaf() const {
+    return this->prevLeaf ? this->prevLeaf->shared_from_this() : nullptr;
+  }
+
+  /**
+   * Gets the previous unexpanded leaf (if applicable). If this is partially or fully expanded, or is not a leaf, this
+   * will return nullptr.
+   *
+   * @return the previous unexpanded leaf (if applicable)
+   */
+  std::shared_ptr<TreeNode> getPrevUnexpandedLeaf() const {
+    return this->prevUnexpandedLeaf ? this->prevUnexpandedLeaf->shared_from_this() : nullptr;
+  }
+
+  /**
+   * Returns true if this node has a next unexpanded leaf
+   *
+   * @return true if this node has a next unexpanded leaf
+   */
+  bool hasNextUnexpandedLeaf() const {
+    return this->nextUnexpandedLeaf ? true : false;
+  }
+
+  /**
+   * Returns true if this node has a previous unexpanded leaf
+   *
+   * @return true if this node has a previous unexpanded leaf
+   */
+  bool hasPrevUnexpandedLeaf() const {
+    return this->prevUnexpandedLeaf ? true : false;
+  }
+
+  /**
+   * Returns true if this node is complete (cannot be expanded)
+   *
+   * @return true if this node is complete (cannot be expanded)
+   */
+  bool isNodeComplete() const { return this->isNodeComplete_; }
+
+  /**
+   * Returns true if this node is part of a fully expanded sub-tree shared between a tree and its forks, see
+   * tracerz::Tree::fork
+   *
+   * @return true if this node is shared
+   */
+  bool isNodeShared() const { return this->isNodeShared_; }
+
+  /**
+   * Sets the next leaf
+   *
+   * @param next the next leaf
+   */
+  void setNextLeaf(const std::shared_ptr<TreeNode>& next) {
+    this->nextLeaf = next.get();
+  }
+
+  /**
+   * Sets the next unexpanded leaf
+   *
+   * @param next the next unexpanded leaf
+   */
+  void setNextUnexpandedLeaf(const std::shared_ptr<TreeNode>& next) {
+    this->nextUnexpandedLeaf = next.get();
+  }
+
+  /**
+   * Sets the previous leaf
+   *
+   * @param next the previous leaf
+   */
+  void setPrevLeaf(const std::shared_ptr<TreeNode>& prev) {
+    this->prevLeaf = prev.get();
+  }
+
+  /**
+   * Sets the previous unexpanded leaf
+   *
+   * @param next the previous unexpanded leaf
+   */
+  void setPrevUnexpandedLeaf(const std::shared_ptr<TreeNode>& prev) {
+    this->prevUnexpandedLeaf = prev.get();
+  }
+
+  /**
+   * Marks this node has having a key with the given name, which will be set to the result of flattening this node and
+   * stored in the runtime grammar.
+   *
+   * @param next the key name
+   */
+  void setKeyName(std::optional<std::string> key) {
+    this->keyId = key ? details::internRuleName(*key) : 0;
+    this->keyName = std::move(key);
+  }
+
+  /**
+   * Gets the key name or nothing, if it doesn't have one
+   *
+   * @return the key name or std::nullopt
+   */
+  std::optional<std::string> getKeyName() const {
+    return this->keyName;
+  }
+
+  /**
+   * Returns true if this node is hidden
+   *
+   * @return true if this node is hidden
+   */
+  bool isNodeHidden() const {
+    return this->isNodeHidden_;
+  }
+
+  /**
+   * Adds a modifier with the given name to this node's list of modifiers
+   *
+   * @param mod the name of the modifier to add
+   */
+  void addModifier(const std::string& mod) {
+    this->modifiers.push_back(details::parseModifier(mod));
+    this->markChanged();
+  }
+
+  /**
+   * Adds an already parsed modifier to this node's list of modifiers
+   *
+   * @param mod the modifier to add
+   */
+  void addModifier(const details::ModifierCall& mod) {
+    this->modifiers.push_back(mod);
+    this->markChanged();
+  }
+
+  /**
+   * Gets the list of modifiers to apply to this node
+   *
+   * @return the list of modifiers
+   */
+  std::vector<std::string> getModifiers() const {
+    std::vector<std::string> ret;
+    for (auto& mod : this->modifiers) {
+      ret.push_back(mod.text);
+    }
+    return ret;
+  }
+
+private:
+  /**
+   * Adds the given new node as the last child of this node, linking it into the chains of leaves and unexpanded leaves
+   *
+   * @param child the new node
+   */
+  void attachChild(std::shared_ptr<TreeNode> child) {
+    TreeNode* prev = nullptr;
+    TreeNode* next = nullptr;
+    if (this->children.empty()) {
+      // If there are no children, then the previous and next leaves are the ones of this node
+      prev = this->prevLeaf;
+      next = this->nextLeaf;
+    } else {
+      // If there are children, the new node's previous leaf is the last child and its next leaf is the one of this node
+      prev = this->children.back().get();
+      next = prev->nextLeaf;
+    }
+
+    // Set the child's previous and next leaves
+    child->ruleDepth = this->ruleDepth + (this->compiled && this->compiled->type == details::NodeType::Rule ? 1 : 0);
+    child->parent = this;
+    child->prevLeaf = prev;
+    child->nextLeaf = next;
+
+    // If the child's previous leaf is not null, set its next leaf to the new node
+    if (child->prevLeaf)
+      child->prevLeaf->nextLeaf = child.get();
+
+    // If the child's next leaf is not null, set its previous leaf to the new node
+    if (child->nextLeaf)
+      child->nextLeaf->prevLeaf = child.get();
+
+    // If this new child is not complete, set its previous and next unexpanded leaves
+    if (!child->isNodeComplete()) {
+      TreeNode* prevUnexpanded = nullptr;
+      TreeNode* nextUnexpanded = nullptr;
+
+      if (this->prevUnexpandedLeaf) {
+        // If this leaf has a previous unexpanded leaf, then this is its first expansion. Set the child's previous and
+        // next unexpanded leaves to this one's.
+        prevUnexpanded = this->prevUnexpandedLeaf;
+        nextUnexpanded = this->nextUnexpandedLeaf;
+      } else if (this->lastIncompleteChild && this->lastIncompleteChild->hasPrevUnexpandedLeaf()) {
+        // If this node already has an unexpanded child *C*, set the new child's previous unexpanded leaf to *C*, and
+        // set the new child's next unexpanded leaf to *C*'s next unexpanded node.
+        prevUnexpanded = this->lastIncompleteChild;
+        nextUnexpanded = this->lastIncompleteChild->nextUnexpandedLeaf;
+      }
+
+      // Set the child object's previous and next unexpanded leaves
+      child->prevUnexpandedLeaf = prevUnexpanded;
+      child->nextUnexpandedLeaf = nextUnexpanded;
+
+      // If the child's previous unexpanded leaf is not null, set its next unexpanded leaf to the new child
+      if (child->prevUnexpandedLeaf)
+        child->prevUnexpandedLeaf->nextUnexpandedLeaf = child.get();
+
+      // If the child's next unexpanded leaf is not null, set its previous unexpanded leaf to the new child
+      if (child->nextUnexpandedLeaf)
+        child->nextUnexpandedLeaf->prevUnexpandedLeaf = child.get();
+
+      // This node has been at least partially expanded and is no longer part of the chain of unexpanded leaves
+      this->prevUnexpandedLeaf = this->nextUnexpandedLeaf = nullptr;
+
+      // Keep track of the last incomplete child and how many there are, so neither needs a scan of the children
+      this->lastIncompleteChild = child.get();
+      this->incompleteChildCount++;
+    }
+
+    // If this is a hidden node, hide the child
+    child->isNodeHidden_ = this->isNodeHidden_;
+
+    // Add the child to the list of children
+    this->children.push_back(child);
+
+    // This is no longer a leaf, unset its previous and next leaves
+    this->prevLeaf = this->nextLeaf = nullptr;
+
+    // The flattened output of this node and its ancestors has changed
+    this->markChanged();
+  }
+
+  /**
+   * Finishes expanding this node once its children have been added: counts their plain text against the budget, and
+   * removes this node from the chain of unexpanded leaves
+   *
+   * @param budget the budget of the tree's expansion, or nullptr for no limits
+   * @throws std::length_error if the budget is exceeded and its policy is tracerz::LimitPolicy::Error
+   */
+  void finishExpansion(details::ExpansionBudget* budget);
+
+  /**
+   * The compiled input string for this node. This can be any combination or none of: rules, actions, and modifiers.
+   */
+  std::shared_ptr<const details::CompiledNode> compiled;
+
+  /** True if this node is complete - if it contains no rules, actions, or modifiers. */
+  bool isNodeComplete_;
+
+  /** A node being flattened by flattenInto */
+  struct FlattenFrame {
+    /** The node */
+    TreeNode* node;
+
+    /** The next child of the node to flatten */
+    const std::shared_ptr<TreeNode>* nextChild;
+
+    /** The size of the output before the node was flattened */
+    std::size_t start;
+
+    /** If true, the node's modifiers are not called */
+    bool ignoreModifiers;
+
+    /** True while the node's sub-tree is fully expanded and its output depends only on the sub-tree */
+    bool keepable;
+  };
+
+  /**
+   * The stack of a call to flattenInto. The memory of stacks is kept for the next call on the same thread, and since
+   * modifiers may flatten other nodes, each call takes a stack of its own.
+   */
+  class FlattenStack {
+  public:
+    FlattenStack() {
+      std::vector<std::vector<FlattenFrame>>& spare = FlattenStack::getSpare();
+      if (!spare.empty()) {
+        this->frames = std::move(spare.back());
+        spare.pop_back();
+      }
+    }
+
+    ~FlattenStack() {
+      this->frames.clear();
+      FlattenStack::getSpare().push_back(std::move(this->frames));
+    }
+
+    FlattenStack(const FlattenStack&) = delete;
+
+    FlattenStack& operator=(const FlattenStack&) = delete;
+
+    /** Gets the frames of the stack */
+    std::vector<FlattenFrame>& get() { return this->frames; }
+
+  private:
+    /** Gets the stacks of this thread not in use */
+    static std::vector<std::vector<FlattenFrame>>& getSpare() {
+      static thread_local std::vector<std::vector<FlattenFrame>> spare;
+      return spare;
+    }
+
+    /** The frames of the stack, innermost last */
+    std::vector<FlattenFrame> frames;
+  };
+
+  /**
+   * Flattens the sub-tree represented by this node and its descendents, appending the string representation to the
+   * given output string. If keepOutput is true, the output of each fully expanded sub-tree flattened is kept, to be
+   * reused until the sub-tree changes. The output of sub-trees still being expanded isn't kept, since they are about
+   * to change.
+   *
+   * @tparam Instrumentation the instrumentation policy
+   * @param output the string to append the flattened string representation to
+   * @param modFuns the modifier function map
+   * @param tree the tree this node belongs to, passed to tree modifiers
+   * @param ignoreHidden exclude hidden subtrees from the flattened string
+   * @param ignoreModifiers if true, modifier functions will not be called
+   * @param keepOutput if true, the output of each node flattened is kept
+   * @param instrumentation records the time spent in each modifier, if the policy is enabled
+   */
+  template<typename Instrumentation>
+  void flattenInto(std::string& output,
+                   const details::callback_map_t& modFuns,
+                   const std::shared_ptr<Tree>& tree,
+                   bool ignoreHidden,
+                   bool ignoreModifiers,
+                   bool keepOutput,
+                   Instrumentation* instrumentation) {
+    // A leaf without modifiers has nothing to walk
+    if (!this->hasChildren() && (this->modifiers.empty() || ignoreModifiers)) {
+      if (!(ignoreHidden && this->isNodeHidden())) output += this->getInput();
+      return;
+    }
+
+    // Kept output can only be reused with the same modifiers and the same treatment of hidden nodes. Since modifiers
+    // are never ignored below the node being flattened, ignoring them doesn't change the output of its descendents.
+    const std::size_t key = modFuns.getRevision() * 2 + (ignoreHidden ? 1 : 0);
+    if (this->flattenedKey == key && (this->modifiers.empty() || !ignoreModifiers)) {
+      output += this->flattened;
+      return;
+    }
+
+    // Walk the sub-tree in post-order with an explicit stack, so the depth of the tree doesn't limit the stack. Each
+    // node appends its input if it has no children, or the output of all of its children otherwise, then its modifiers
+    // are applied to what it appended.
+    FlattenStack stack;
+    std::vector<FlattenFrame>& frames = stack.get();
+    frames.push_back(FlattenFrame{this, this->children.data(), output.size(), ignoreModifiers, true});
+    while (!frames.empty()) {
+      FlattenFrame& frame = frames.back();
+      TreeNode* node = frame.node;
+
+      // Append the children whose output is known, either because they are leaves without modifiers or because their
+      // output was kept, up to the next one that has to be flattened in turn. We can't ignore modifiers, because we
+      // will get the wrong output from flattening our children if we do.
+      const std::shared_ptr<TreeNode>* end = node->children.data() + node->children.size();
+      TreeNode* next = nullptr;
+      while (frame.nextChild != end) {
+        TreeNode* child = (frame.nextChild++)->get();
+        if (child->flattenedKey == key) {
+          output += child->flattened;
+        } else if (child->hasChildren() || !child->modifiers.empty()) {
+          next = child;
+          break;
+        } else {
+          if (!(ignoreHidden && child->isNodeHidden())) output += child->getInput();
+          if (!child->isNodeComplete()) frame.keepable = false;
+        }
+      }
+      if (next != nullptr) {
+        frames.push_back(FlattenFrame{next, next->children.data(), output.size(), false, true});
+        continue;
+      }
+
+      // If this doesn't have children, then if the node isn't hidden or we are including hidden nodes, append its input
+      // string
+      if (!node->hasChildren()) {
+        if (!(ignoreHidden && node->isNodeHidden())) output += node->getInput();
+        if (!node->isNodeComplete()) frame.keepable = false;
+      }
+
+      // If nothing was appended, then there is nothing to modify
+      bool modify = !frame.ignoreModifiers && !node->modifiers.empty() && output.size() > frame.start;
+      bool keepable = frame.keepable;
+      bool ignoredModifiers = frame.ignoreModifiers && !node->modifiers.empty();
+      std::size_t start = frame.start;
+      frames.pop_back();
+      if (modify && !node->applyModifiers(output, start, modFuns, tree, instrumentation)) keepable = false;
+
+      // A sub-tree still being expanded, or whose output depends on more than the sub-tree, makes the output of the
+      // node's ancestors change too, so it is flattened again every time
+      if (!keepable) {
+        if (!frames.empty()) frames.back().keepable = false;
+      } else if (keepOutput && !ignoredModifiers && !node->isNodeShared_) {
+        node->flattened.assign(output, start, std::string::npos);
+        node->flattenedKey = key;
+      }
+    }
+  }
+
+  /**
+   * Applies this node's modifiers to the end of the output, from the given position
+   *
+   * @param output the output string
+   * @param start the position of this node's flattened string in the output
+   * @param modFuns the modifier function map
+   * @param tree the tree this node belongs to, passed to tree modifiers
+   * @param instrumentation records the time spent in each modifier, if the policy is enabled
+   * @return true if only string modifiers were called, so the output depends only on the input
+   */
+  template<typename Instrumentation>
+  bool applyModifiers(std::string& output,
+                      std::size_t start,
+                      const details::callback_map_t& modFuns,
+                      const std::shared_ptr<Tree>& tree,
+                      Instrumentation* instrumentation) {
+    // Loop over each modifier being applied to this node
+    bool onlyStringModifiers = true;
+    std::string modified = output.substr(start);
+    for (auto& mod : this->modifiers) {
+      if (details::IModifierFn* modFun = modFuns.get(mod.id)) {
+        std::uint64_t started = 0;
+        if constexpr (Instrumentation::enabled) started = Instrumentation::now();
+
+        // If the modifier name names a real modifier, call it with the appropriate input and parameters (if any), and
+        // update the output string.
+        if (modFun->isStringModifier()) {
+          modFun->callInPlace(modified, mod.params);
+        } else {
+          const std::string& ruleName = this->getRuleName();
+          onlyStringModifiers = false;
+
+          if (modFun->isTreeModifier()) {
+            modified = modFun->callVec(tree, ruleName, mod.params);
+          } else if (modFun->isTreeNodeModifier()) {
+            modified = modFun->callVec(this->shared_from_this(), ruleName, mod.params);
+          }
+        }
+        if constexpr (Instrumentation::enabled) {
+          instrumentation->recordModifier(mod.name, Instrumentation::now() - started);
+        }
+      }
+    }
+
+    // Replace the unmodified string with the modified string
+    output.replace(start, std::string::npos, modified);
+    return onlyStringModifiers;
+  }
+
+  /**
+   * Forgets the kept output of this node and its ancestors, after this node has changed. The output of leaves without
+   * modifiers isn't kept, but otherwise a node's output is only kept once the output of its children is, so the first
+   * ancestor without kept output ends the walk.
+   */
+  void markChanged() {
+    this->flattenedKey = 0;
+    for (TreeNode* node = this->parent; node != nullptr && node->flattenedKey != 0; node = node->parent) {
+      node->flattenedKey = 0;
+    }
+  }
+
+  /** The list of children this node has. */
+  std::vector<std::shared_ptr<TreeNode>> children;
+
+  /**
+   * A pointer to the previous leaf if this is a leaf and one exists. The links between leaves don't own the nodes
+   * they point to, the tree keeps them alive through its children.
+   */
+  TreeNode* prevLeaf;
+
+  /** A pointer to the next leaf if this is a leaf and one exists. */
+  TreeNode* nextLeaf;
+
+  /**  A pointer to the previous unexpanded leaf if this is an unexpanded leaf and one exists. */
+  TreeNode* prevUnexpandedLeaf;
+
+  /** A pointer to the next unexpanded leaf if this is an unexpanded leaf and one exists. */
+  TreeNode* nextUnexpandedLeaf;
+
+  /** A key name if one has been set on this node. */
+  std::optional<std::string> keyName;
+
+  /** The interned id of the key name, if one has been set */
+  std::size_t keyId;
+
+  /** True if this node is hidden. */
+  bool isNodeHidden_;
+
+  /** The list of modifiers that have been added to this node. */
+  std::vector<details::ModifierCall> modifiers;
+
+  /** The last child of this node that is not complete, or nullptr if there is none */
+  TreeNode* lastIncompleteChild;
+
+  /** The number of children of this node that are not complete */
+  std::size_t incompleteChildCount;
+
+  /** The number of rules this node is nested in */
+  std::size_t ruleDepth;
+
+  /** The node this is a child of, or nullptr for the root */
+  TreeNode* parent;
+
+  /** The output of this node kept by the last flatten of its tree, valid while flattenedKey isn't 0 */
+  std::string flattened;
+
+  /** Identifies the modifiers and treatment of hidden nodes flattened was flattened with, or 0 if it isn't valid */
+  std::size_t flattenedKey;
+
+  /** The arena this node and its children are allocated from, or nullptr if they are allocated on the heap */
+  std::shared_ptr<details::NodeArena> arena;
+
+  /**
+   * True if this node is part of a fully expanded sub-tree shared between a tree and its forks. Shared nodes are only
+   * read by the trees sharing them, and their flattened output is no longer kept, so that the trees can be used on
+   * different threads. Only the tree that expanded them still links them into its chain of leaves.
+   */
+  bool isNodeShared_;
+
+  friend class Tree;
+};
+
+/**
+ * Expands this node, processing any rules, actions, and modifiers in it, and creating child nodes for each. If the node
+ * contains no such expandable elements, does nothing.
+ *
+ * @tparam RNG the type of the random number generator in use
+ * @tparam UniformIntDistributionT the type to use to perform equal probability expansion of rules
+ * @param grammar the compiled input grammar for the tree containing this node
+ * @param rng the random number generator to use
+ * @param picker picks the alternatives of rules, reused across nodes
+ * @param runtimeDictionary the runtime dictionary in use by the tree containing this node
+ * @param budget the budget of the tree's expansion, or nullptr for no limits
+ * @throws std::length_error if the budget is exceeded and its policy is tracerz::LimitPolicy::Error
+ */
+template<typename RNG, typename UniformIntDistributionT>
+void TreeNode::expandNode(const CompiledGrammar& grammar,
+                          RNG& rng,
+                          details::IndexPicker<RNG, UniformIntDistributionT>& picker,
+                          details::runtime_dictionary_t& runtimeDictionary,
+                          details::ExpansionBudget* budget) {
+  // If the node is complete, nothing to do
+  if (this->isNodeComplete()) return;
+
+  // Expanding the node changes its flattened output, even if it gets no children
+  this->markChanged();
+
+  switch (this->compiled->type) {
+    case details::NodeType::Rule: {
+      // Select the expansion of the rule, or the one the limit policy selects once the budget is used up
+      const CompiledRule* rule = grammar.getRule(this->compiled->nameId);
+      std::shared_ptr<const details::CompiledNode> output;
+      if (budget == nullptr || budget->expandRule(this->ruleDepth + 1)) {
+        output = details::selectExpansion<RNG, UniformIntDistributionT>(*this->compiled,
+                                                                        rule,
+                                                                        rng,
+                                                                        picker,
+                                                                        runtimeDictionary);
+      } else {
+        output = details::selectFallbackExpansion(*this->compiled, rule, budget->getLimits().policy,
+                                                  runtimeDictionary);
+      }
+
+      // For each modifier in the list of modifiers, add it to this node's list of modifiers
+      for (auto& modifier : this->compiled->modifiers) {
+        this->addModifier(modifier);
+      }
+
+      // Create the new child node from the output
+      this->addChild(output);
+      break;
+    }
+    case details::NodeType::RuleWithActions:
+      // Add a child for the actions and a child for the rule
+    case details::NodeType::Actions:
+      // For each action, add a child to this node representing a single action
+      // Action types:
+      //   [#text#] - calls a function, essentially, by expanding a rule
+      //   [key:#text#] - sets key to expansion of #text#
+      //   [key:text] - sets key to "text"
+      //   [key:a,b,c,...] - sets key to a list
+    case details::NodeType::Mixed:
+      // Add a child for each string representing a rule and each string representing a non-rule
+      for (auto& child : this->compiled->children) {
+        this->addChild(child);
+      }
+      break;
+    case details::NodeType::KeylessRuleAction:
+      // Add a child using the rule.
+      this->addChild(this->compiled->children.front());
+
+      // Set to empty string so modifiers will be applied, but no key will be set
+      this->children.back()->setKeyName(std::string());
+      break;
+    case details::NodeType::KeyWithRuleAction:
+      // Since this node is assigning to a key, its output must be suppressed. Set to hidden.
+      this->isNodeHidden_ = true;
+
+      // Create a child from the rule, and pass down the key name and its id
+      this->addChild(this->compiled->children.front());
+      this->children.back()->keyName = this->compiled->name;
+      this->children.back()->keyId = this->compiled->nameId;
+      break;
+    case details::NodeType::KeyWithTextAction: {
+      //   [key:text] - sets key to "text"
+      //   [key:a,b,c,...] - sets key to a list
+      // Since this is setting a key, this node is hidden
+      this->isNodeHidden_ = true;
+
+      // Set the key in the runtime dictionary to the list of values
+      runtimeDictionary.pushList(this->compiled->nameId, this->compiled->values);
+      break;
+    }
+    case details::NodeType::Text:
+      break;
+  }
+
+  this->finishExpansion(budget);
+}
+
+inline void TreeNode::finishExpansion(details::ExpansionBudget* budget) {
+  // Count the plain text of the new children, cutting it if it doesn't fit
+  if (budget != nullptr) {
+    for (auto& child : this->children) {
+      if (child->compiled->type != details::NodeType::Text) continue;
+      std::size_t size = budget->addText(child->compiled->input.size());
+      if (size < child->compiled->input.size()) child->compiled = details::cutText(*child->compiled, size);
+    }
+  }
+
+  // Remove this node from the linked list of unexpanded leaves, if applicable
+  if (this->prevUnexpandedLeaf)
+    this->prevUnexpandedLeaf->nextUnexpandedLeaf = this->nextUnexpandedLeaf;
+  if (this->nextUnexpandedLeaf)
+    this->nextUnexpandedLeaf->prevUnexpandedLeaf = this->prevUnexpandedLeaf;
+}
+
+/**
+ * How a tracerz::Tree allocates its nodes
+ */
+enum class NodeStorage {
+  /** Each node is allocated separately on the heap */
+  Heap,
+
+  /**
+   * Nodes are allocated from contiguous blocks owned by the tree, which are released all at once when the tree is
+   * destroyed. Nodes are still reference counted and own their children, so destroying a tree still destroys each of
+   * its nodes; only the allocations and frees of the individual nodes are saved. Every node shares ownership of its
+   * blocks, so nodes kept after their tree is reset or destroyed remain valid, and keep the blocks alive.
+   */
+  Arena
+};
+
+/**
+ * Represents a partially or fully constructed parse tree. Maintains two linked list heads for indexing into the tree:
+ * one for the first leaf and the other for the first unexpanded leaf. Also provides methods to expand nodes and flatten
+ * the tree into a single output string.
+ */
+class Tree : public std::enable_shared_from_this<Tree> {
+public:
+#ifndef TRACERZ_NO_JSON
+  /**
+   * Creates a new input tree rooted with the given input string, using the given grammar. The grammar is compiled for
+   * this tree alone; to create many trees from one grammar, compile it once and use the constructor taking a compiled
+   * grammar, as tracerz::Grammar does.
+   *
+   * @param input the input string to construct the tree from
+   * @param grammar the grammar to use to construct the tree
+   */
+  Tree(const std::string& input,
+       const nlohmann::json& grammar)
+      : Tree(input, std::make_shared<const CompiledGrammar>(grammar)) {
+  }
+#endif
+
+  /**
+   * Creates a new input tree rooted with the given input string, using the given compiled grammar.
+   *
+   * @param input the input string to construct the tree from
+   * @param grammar the compiled grammar to use to construct the tree
+   * @param storage how the tree allocates its nodes
+   * @param limits the limits on the size of the tree's expansion
+   */
+  Tree(const std::string& input,
+       std::shared_ptr<const CompiledGrammar> grammar,
+       NodeStorage storage = NodeStorage::Heap,
+       const ExpansionLimits& limits = ExpansionLimits())
+      : leafIndex(new TreeNode)
+      , unexpandedLeafIndex(new TreeNode)
+      , nextUnexpandedLeaf(nullptr)
+      , grammar(std::move(grammar))
+      , budget(limits) {
+    std::shared_ptr<const details::CompiledNode> compiledInput = details::compileNode(input);
+    this->estimateSize(*compiledInput);
+    if (storage == NodeStorage::Arena) this->arena = std::make_shared<details::NodeArena>(this->arenaBlockSize);
+    this->plant(std::move(compiledInput));
+  }
+
+  /**
+   * Destroys the tree. The nodes are released iteratively, so the depth of the tree doesn't limit the stack.
+   */
+  ~Tree() {
+    this->releaseNodes();
+  }
+
+  /**
+   * Resets the tree to a single unexpanded root node with the given input string, as if it had just been created with
+   * the same grammar and node storage. The memory of the node arena, the runtime dictionary and the expansion stack is
+   * kept, so expanding a tree over and over again stops allocating once it has grown to the largest expansion. Nodes
+   * of the tree still held elsewhere are left untouched, and the tree allocates its new nodes from a new arena.
+   *
+   * @param input the input string for the new root
+   */
+  void reset(const std::string& input) {
+    // An unchanged input doesn't need to be compiled or sized again
+    std::shared_ptr<const details::CompiledNode> compiledInput = this->root->compiled;
+    if (this->root->getInput() != input) {
+      compiledInput = details::compileNode(input);
+      this->estimateSize(*compiledInput);
+    }
+
+    this->releaseNodes();
+    if (this->arena) {
+      // Every node allocated from an arena keeps it alive, so an arena only the tree holds has no nodes left. Nodes
+      // still held elsewhere, by a fork or by the caller, keep theirs, and the tree starts a new one.
+      if (this->arena.use_count() == 1) {
+        this->arena->reset();
+      } else {
+        this->arena = std::make_shared<details::NodeArena>(this->arenaBlockSize);
+      }
+      for (auto& workerArena : this->workerArenas) {
+        if (workerArena.use_count() == 1) {
+          workerArena->reset();
+        } else {
+          workerArena = std::make_shared<details::NodeArena>();
+        }
+      }
+    }
+    this->unexpandedLeafIndex->nextUnexpandedLeaf = nullptr;
+    this->nextUnexpandedLeaf = nullptr;
+    this->runtimeDictionary.clear();
+    this->budget.reset();
+    while (!this->expandingNodes.empty()) this->expandingNodes.pop();
+    this->plant(std::move(compiledInput));
+  }
+
+  /**
+   * Forks the tree: creates a tree in the same state as this one, which is then expanded independently of it, with
+   * the same grammar, node storage and what is left of the expansion limits. Fully expanded sub-trees aren't copied but
+   * shared by both trees (see TreeNode::isNodeShared), so only the nodes still being expanded, on the paths from the
+   * unexpanded leaves to the root, are copied. The runtime dictionary is shared too, each tree copying a rule stack the
+   * first time it pushes onto it or pops it. Expanding a common prefix once, such as the actions setting up the
+   * characters of a story, and then forking the tree for each variation saves expanding the prefix again.
+   *
+   * Shared nodes are only linked into the chain of leaves of this tree, so the chain of leaves of the fork only links
+   * the nodes it copied or expanded itself. The tree and its forks may be used on different threads at once.
+   *
+   * @return the fork
+   */
+  std::shared_ptr<Tree> fork() {
+    std::shared_ptr<Tree> forked(new Tree(this->grammar, this->arena != nullptr, this->budget));
+    forked->outputReserve = this->outputReserve;
+    forked->arenaBlockSize = this->arenaBlockSize;
+
+    // Find the nodes still being expanded: the unexpanded leaves, the nodes on the depth-first expansion stack, and
+    // their ancestors. Every other node is part of a fully expanded sub-tree. The heads of the chains of leaves are
+    // mapped straight to the fork's.
+    std::unordered_map<const TreeNode*, TreeNode*> copies;
+    copies.emplace(this->leafIndex.get(), forked->leafIndex.get());
+    copies.emplace(this->unexpandedLeafIndex.get(), forked->unexpandedLeafIndex.get());
+    auto addPath = [&copies](TreeNode* node) {
+      while (node != nullptr && copies.emplace(node, nullptr).second) node = node->parent;
+    };
+    for (TreeNode* leaf = this->unexpandedLeafIndex->nextUnexpandedLeaf; leaf; leaf = leaf->nextUnexpandedLeaf) {
+      addPath(leaf);
+    }
+    std::vector<TreeNode*> expanding;
+    for (auto stack = this->expandingNodes; !stack.empty(); stack.pop()) {
+      expanding.push_back(stack.top());
+      addPath(stack.top());
+    }
+
+    // Copy the nodes still being expanded from the root down, sharing the fully expanded sub-trees hanging off them
+    if (copies.count(this->root.get()) == 0) {
+      Tree::share(this->root.get());
+      forked->root = this->root;
+    } else {
+      forked->root = Tree::copyNode(*this->root, forked->arena);
+      copies[this->root.get()] = forked->root.get();
+      std::vector<std::pair<const TreeNode*, TreeNode*>> pending{{this->root.get(), forked->root.get()}};
+      while (!pending.empty()) {
+        auto [original, copy] = pending.back();
+        pending.pop_back();
+        for (auto& child : original->children) {
+          auto found = copies.find(child.get());
+          if (found == copies.end()) {
+            Tree::share(child.get());
+            copy->children.push_back(child);
+          } else {
+            std::shared_ptr<TreeNode> childCopy = Tree::copyNode(*child, forked->arena);
+            childCopy->parent = copy;
+            found->second = childCopy.get();
+            pending.emplace_back(child.get(), childCopy.get());
+            copy->children.push_back(std::move(childCopy));
+          }
+        }
+      }
+    }
+
+    // Point the links of the copies at the other copies. Links to shared nodes are dropped, except for the last
+    // incomplete child, which is only compared with nodes of the fork.
+    auto copyOf = [&copies](const TreeNode* node) -> TreeNode* {
+      auto found = node ? copies.find(node) : copies.end();
+      return found == copies.end() ? nullptr : found->second;
+    };
+    for (auto& [original, copy] : copies) {
+      copy->prevLeaf = copyOf(original->prevLeaf);
+      copy->nextLeaf = copyOf(original->nextLeaf);
+      copy->prevUnexpandedLeaf = copyOf(original->prevUnexpandedLeaf);
+      copy->nextUnexpandedLeaf = copyOf(original->nextUnexpandedLeaf);
+      TreeNode* lastIncompleteChild = copyOf(original->lastIncompleteChild);
+      copy->lastIncompleteChild = lastIncompleteChild ? lastIncompleteChild : original->lastIncompleteChild;
+    }
+    forked->nextUnexpandedLeaf = copyOf(this->nextUnexpandedLeaf);
+    for (auto node = expanding.rbegin(); node != expanding.rend(); ++node) {
+      forked->expandingNodes.push(copies[*node]);
+    }
+
+    forked->runtimeDictionary = this->runtimeDictionary.fork();
+    return forked;
+  }
+
+  Tree(const Tree&) = delete;
+
+  Tree& operator=(const Tree&) = delete;
+
+  /**
+   * Expands the next unexpanded node, depth-first.
+   *
+   * @tparam RNG the type of the random number generator
+   * @tparam UniformIntDistributionT the type of the equal probability distribution
+   * @tparam Instrumentation the instrumentation policy, see tracerz::Profiler
+   * @param modFuns the map of modifier names to functions
+   * @param rng the random number generator
+   * @param instrumentation records the node, its rule and the modifiers of keys set, if the policy is enabled
+   * @return true if there is still at least one unexpanded node
+   */
+  template<typename RNG, typename UniformIntDistributionT, typename Instrumentation = NoInstrumentation>
+  bool expand(const details::callback_map_t& modFuns, RNG& rng, Instrumentation* instrumentation = nullptr) {
+    // Get the leftmost unexpanded leaf
+    TreeNode* next = this->unexpandedLeafIndex->nextUnexpandedLeaf;
+
+    // Return false if the tree is already fully expanded
+    if (!next) return false;
+
+    // Push it onto the stack of nodes currently being expanded
+    this->expandingNodes.push(next);
+
+    // Expand the node
+    this->expandNode<RNG, UniformIntDistributionT>(next, rng, instrumentation);
+
+    // If the node has no children awaiting expansion
+    if (next->areChildrenComplete()) {
+      // Save and pop the top node off the stack
+      auto poppedNode = this->expandingNodes.top();
+      this->expandingNodes.pop();
+
+      // Check if it has a key name
+      if (poppedNode->getKeyName()) {
+        // If so, get it
+        std::string key = *poppedNode->getKeyName();
+
+        // Flatten the subtree to get the value of the key
+        std::string value;
+        poppedNode->flattenInto(value, modFuns, this->shared_from_this(), false, false, false, instrumentation);
+
+        // Set the key in the runtime grammar
+        if (!key.empty()) this->runtimeDictionary.push(poppedNode->keyId, value);
+      }
+
+      // Keep going if there are other nodes we were expanding
+      bool shouldContinue = !this->expandingNodes.empty();
+      while (shouldContinue) {
+        // Peek at the top of the stack
+        auto newTop = this->expandingNodes.top();
+
+        // If newTop's last expandable child is equal to the previously popped node, then newTop is also finished
+        // expanding.
+        if (newTop->lastIncompleteChild == poppedNode) {
+          // Rotate newTop to poppedNode
+          poppedNode = newTop;
+
+          // Remove the top of the stack
+          this->expandingNodes.pop();
+
+          // If there are still nodes in the stack, keep looking
+          shouldContinue = !this->expandingNodes.empty();
+
+          // Check if the poppedNode has a key name
+          if (poppedNode->getKeyName()) {
+            // If so, get it.
+            std::string key = *poppedNode->getKeyName();
+
+            // Flatten the subtree to get the value of the key
+            std::string value;
+            poppedNode->flattenInto(value, modFuns, this->shared_from_this(), false, false, false, instrumentation);
+
+            // Set the key in the runtime grammar
+            this->runtimeDictionary.push(poppedNode->keyId, value);
+          }
+        } else {
+          // poppedNode is not the last expandable child of newTop. There are still more children to expand, so we can
+          // stop examining the stack.
+          shouldContinue = false;
+        }
+      }
+    }
+
+    // Return true if there are still nodes to expand
+    return this->unexpandedLeafIndex->hasNextUnexpandedLeaf();
+  }
+
+  /**
+   * Expand the tree in a breadth-first manner.
+   *
+   * @tparam RNG the type of the random number generator
+   * @tparam UniformIntDistributionT the type of the equal probability distribution
+   * @tparam Instrumentation the instrumentation policy, see tracerz::Profiler
+   * @param rng the random number generator
+   * @param instrumentation records the node and its rule, if the policy is enabled
+   * @return true if there are still unexpanded nodes
+   */
+  template<typename RNG,
+      typename UniformIntDistributionT = BoundedIntDistribution<>,
+      typename Instrumentation = NoInstrumentation>
+  bool expandBF(RNG& rng, Instrumentation* instrumentation = nullptr) {
+    // If the pointer to the next unexpanded leaf is null
+    if (!this->nextUnexpandedLeaf) {
+      // But the unexpanded leaf linked list is not empty
+      if (this->unexpandedLeafIndex->hasNextUnexpandedLeaf()) {
+        // Then start at the beginning of the linked list
+        this->nextUnexpandedLeaf = this->unexpandedLeafIndex->nextUnexpandedLeaf;
+      } else {
+        // If the linked list is also empty, the tree is fully expanded
+        return false;
+      }
+    }
+
+    // Get the next unexpanded leaf
+    TreeNode* next = this->nextUnexpandedLeaf->nextUnexpandedLeaf;
+
+    // Expand the current unexpanded leaf
+    this->expandNode<RNG, UniformIntDistributionT>(this->nextUnexpandedLeaf, rng, instrumentation);
+
+    // Update the cursor
+    this->nextUnexpandedLeaf = next;
+
+    // Return true since there are unexpanded leaves
+    return true;
+  }
+
+  /**
+   * Expands the rest of the current level of the tree breadth-first, in parallel: every unexpanded leaf from the one
+   * expandBF would expand next to the end of the chain of unexpanded leaves, as calling expandBF until it returns to
+   * the start of the chain would, but with the draws of independent rules taken from other random number generators.
+   *
+   * A rule with no runtime definition, whose name no action on the level sets, expands to an alternative of the input
+   * grammar whatever the rest of the level expands to. Such rules are split into fixed blocks of parallelBlockSize,
+   * each expanded with a random number generator split off the given one by tracerz::details::splitRNG, by a pool of
+   * worker threads taking the next block until there are none left. Their expansions are then linked into the tree in
+   * order, along with the rest of the level, which is expanded on the calling thread with the given random number
+   * generator. So is the whole level of a tree with expansion limits, since the order of the expansions decides which
+   * of them reach the limits. The output only depends on the random number generator, never on the number of threads.
+   *
+   * @tparam RNG the type of the random number generator
+   * @tparam UniformIntDistributionT the type of the equal probability distribution
+   * @param rng the random number generator
+   * @param numThreads the number of worker threads, or 0 to use one per hardware thread
+   * @return true if there are still unexpanded nodes
+   */
+  template<typename RNG, typename UniformIntDistributionT = BoundedIntDistribution<>>
+  bool expandBFParallel(RNG& rng, unsigned numThreads = 0) {
+    // Collect the rest of the level
+    std::vector<TreeNode*> level;
+    TreeNode* first = this->nextUnexpandedLeaf ? this->nextUnexpandedLeaf : this->unexpandedLeafIndex->nextUnexpandedLeaf;
+    for (TreeNode* node = first; node != nullptr; node = node->nextUnexpandedLeaf) level.push_back(node);
+    this->nextUnexpandedLeaf = nullptr;
+    if (level.empty()) return false;
+
+    // Find the rules that expand independently of the rest of the level
+    std::vector<std::size_t> independent;
+    if (!this->budget.hasLimits()) {
+      std::vector<std::size_t> setKeys;
+      for (TreeNode* node : level) {
+        if (node->compiled->type == details::NodeType::KeyWithTextAction) setKeys.push_back(node->compiled->nameId);
+      }
+      std::sort(setKeys.begin(), setKeys.end());
+      for (std::size_t i = 0; i < level.size(); i++) {
+        const details::CompiledNode& compiled = *level[i]->compiled;
+        if (compiled.type == details::NodeType::Rule && !this->runtimeDictionary.contains(compiled.nameId) &&
+            !std::binary_search(setKeys.begin(), setKeys.end(), compiled.nameId)) {
+          independent.push_back(i);
+        }
+      }
+    }
+
+    // Expand them in parallel into new nodes, which aren't linked into the tree yet
+    std::vector<std::shared_ptr<TreeNode>> expansions(level.size());
+    std::size_t numBlocks = (independent.size() + parallelBlockSize - 1) / parallelBlockSize;
+    if (numBlocks > 0) {
+      std::vector<RNG> blockRNGs;
+      blockRNGs.reserve(numBlocks);
+      for (std::size_t block = 0; block < numBlocks; block++) blockRNGs.push_back(details::splitRNG(rng));
+      if (numThreads == 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+      numThreads = static_cast<unsigned>(std::min<std::size_t>(numThreads, numBlocks));
+
+      // Each worker picks with an index picker of its own, kept by the tree
+      if (this->pickers.size() < numThreads) this->pickers.resize(numThreads);
+      std::vector<details::IndexPicker<RNG, UniformIntDistributionT>*> workerPickers;
+      for (unsigned worker = 0; worker < numThreads; worker++) {
+        workerPickers.push_back(&this->pickers[worker].template get<RNG, UniformIntDistributionT>());
+      }
+
+      // The calling thread allocates from the tree's arena, and every other worker from one of its own
+      if (this->arena) {
+        while (this->workerArenas.size() + 1 < numThreads) {
+          this->workerArenas.push_back(std::make_shared<details::NodeArena>());
+        }
+      }
+
+      std::atomic<std::size_t> nextBlock(0);
+      std::vector<std::exception_ptr> errors(numThreads);
+      auto work = [&](unsigned worker) {
+        try {
+          const std::shared_ptr<details::NodeArena>& workerArena =
+              worker == 0 || !this->arena ? this->arena : this->workerArenas[worker - 1];
+          details::IndexPicker<RNG, UniformIntDistributionT>& picker = *workerPickers[worker];
+          for (std::size_t block = nextBlock++; block < numBlocks; block = nextBlock++) {
+            std::size_t end = std::min(independent.size(), (block + 1) * parallelBlockSize);
+            for (std::size_t i = block * parallelBlockSize; i < end; i++) {
+              std::shared_ptr<const details::CompiledNode> output =
+                  details::selectExpansion<RNG, UniformIntDistributionT>(*level[independent[i]]->compiled,
+                                                                         *this->grammar,
+                                                                         blockRNGs[block],
+                                                                         picker,
+                                                                         this->runtimeDictionary);
+              expansions[independent[i]] = TreeNode::create(workerArena, std::move(output));
+            }
+          }
+        } catch (...) {
+          errors[worker] = std::current_exception();
+          nextBlock = numBlocks;
+        }
+      };
+
+      std::vector<std::thread> threads;
+      for (unsigned worker = 1; worker < numThreads; worker++) {
+        threads.emplace_back(work, worker);
+      }
+      work(0);
+      for (auto& thread : threads) thread.join();
+
+      for (auto& error : errors) {
+        if (error) std::rethrow_exception(error);
+      }
+    }
+
+    // Link the level into the tree in order, expanding the rest of it as expandBF would
+    for (std::size_t i = 0; i < level.size(); i++) {
+      TreeNode* node = level[i];
+      if (!expansions[i]) {
+        this->expandNode<RNG, UniformIntDistributionT>(node, rng, static_cast<NoInstrumentation*>(nullptr));
+        continue;
+      }
+      node->markChanged();
+      this->budget.expandRule(node->ruleDepth + 1);
+      for (auto& modifier : node->compiled->modifiers) {
+        node->addModifier(modifier);
+      }
+      node->attachChild(std::move(expansions[i]));
+      node->finishExpansion(&this->budget);
+    }
+
+    return this->unexpandedLeafIndex->hasNextUnexpandedLeaf();
+  }
+
+  /**
+   * Gets the current leftmost leaf of the tree.
+   *
+   * @return the current leftmost leaf of the tree
+   */
+  std::shared_ptr<TreeNode> getFirstLeaf() const {
+    return this->leafIndex->getNextLeaf();
+  }
+
+  /**
+   * Gets the leftmost unexpanded leaf of the tree.
+   *
+   * @return the leftmost unexpanded leaf of the tree
+   */
+  std::shared_ptr<TreeNode> getFirstUnexpandedLeaf() const {
+    return this->unexpandedLeafIndex->getNextUnexpandedLeaf();
+  }
+
+  /**
+   * Gets the root of the tree.
+   *
+   * @return the root of the tree
+   */
+  std::shared_ptr<TreeNode> getRoot() const { return this->root; }
+
+  /**
+   * Gets the compiled input grammar the tree is expanded with, which is shared with the grammar that created the tree
+   *
+   * @return the compiled input grammar
+   */
+  const std::shared_ptr<const CompiledGrammar>& getCompiledGrammar() const { return this->grammar; }
+
+  /**
+   * Gets the limits on the size of the tree's expansion
+   *
+   * @return the expansion limits
+   */
+  const ExpansionLimits& getExpansionLimits() const { return this->budget.getLimits(); }
+
+  /**
+   * Flatten the tree into a single output string, based on the given input. While the tree is still being expanded,
+   * the output of each fully expanded sub-tree is kept until it changes, so flattening the tree after each depth-first
+   * expansion step only flattens again the nodes on the path from the expanded node to the root. Output of nodes with
+   * tree or tree node modifiers is never kept, since it depends on more than the node; string modifiers are expected
+   * to depend only on their input.
+   *
+   * @param modFuns the map of modifier names to functions to use
+   * @param ignoreHidden if true, hidden nodes will not be included in the output
+   * @param ignoreMods if true, no modifiers will be applied
+   * @return the flattened output string
+   */
+  std::string flatten(const details::callback_map_t& modFuns,
+                      bool ignoreHidden = true,
+                      bool ignoreMods = false) {
+    return this->flatten<NoInstrumentation>(modFuns, ignoreHidden, ignoreMods, nullptr);
+  }
+
+  /**
+   * Flatten the tree into a single output string, as the overload without instrumentation, recording the time spent in
+   * each modifier
+   *
+   * @tparam Instrumentation the instrumentation policy, see tracerz::Profiler
+   * @param modFuns the map of modifier names to functions to use
+   * @param ignoreHidden if true, hidden nodes will not be included in the output
+   * @param ignoreMods if true, no modifiers will be applied
+   * @param instrumentation records the time spent in each modifier, if the policy is enabled
+   * @return the flattened output string
+   */
+  template<typename Instrumentation>
+  std::string flatten(const details::callback_map_t& modFuns,
+                      bool ignoreHidden,
+                      bool ignoreMods,
+                      Instrumentation* instrumentation) {
+    // Forward the call to the root of the tree, keeping the output of nodes that may be flattened again
+    std::string output;
+    output.reserve(this->outputReserve);
+    this->root->flattenInto(output,
+                            modFuns,
+                            this->shared_from_this(),
+                            ignoreHidden,
+                            ignoreMods,
+                            this->unexpandedLeafIndex->hasNextUnexpandedLeaf(),
+                            instrumentation);
+    return output;
+  }
+
+  details::runtime_dictionary_t& getRuntimeDictionary() { return this->runtimeDictionary; }
+
+private:
+  /**
+   * The arena the nodes of the tree are allocated from, if the tree uses tracerz::NodeStorage::Arena. Each node
+   * allocated from it shares ownership of it too, so nodes outliving the tree, such as those shared with a fork, keep
+   * it alive.
+   */
+  std::shared_ptr<details::NodeArena> arena;
+
+  /** The arenas the worker threads of expandBFParallel allocate nodes from, other than the calling thread */
+  std::vector<std::shared_ptr<details::NodeArena>> workerArenas;
+
+  /**
+   * The index pickers of the tree's expansions, kept between them. The first is used by expand() and expandBF(), and
+   * by the calling thread of expandBFParallel(); the rest by its other workers.
+   */
+  std::vector<details::PickerSlot> pickers = std::vector<details::PickerSlot>(1);
+
+  /** The number of consecutive independent rules of a level expanded with the same random number generator */
+  static constexpr std::size_t parallelBlockSize = 256;
+
+  /** The number of bytes to reserve for the flattened output, see details::getOutputReserve */
+  std::size_t outputReserve = 0;
+
+  /** The size of the first block of a new node arena, large enough for the expected number of nodes */
+  std::size_t arenaBlockSize = 16 * 1024;
+
+  /** Points to the leftmost leaf of the tree */
+  std::shared_ptr<TreeNode> leafIndex;
+
+  /** Points to the leftmost unexpanded leaf */
+  std::shared_ptr<TreeNode> unexpandedLeafIndex;
+
+  /** The root of the tree */
+  std::shared_ptr<TreeNode> root;
+
+  /** Points to the current node to expand for breadth-first expansion */
+  TreeNode* nextUnexpandedLeaf;
+
+  /** The compiled input grammar */
+  std::shared_ptr<const CompiledGrammar> grammar;
+
+  /** The runtime grammar, consisting of keys created while expanding the tree with the input grammar. */
+  details::runtime_dictionary_t runtimeDictionary;
+
+  /** A stack of nodes currently being expanded by the depth-first expansion */
+  std::stack<TreeNode*, std::vector<TreeNode*>> expandingNodes;
+
+  /** Counts the expansion of the tree against its limits */
+  details::ExpansionBudget budget;
+
+  /**
+   * Expands the given node, recording it and the time spent on its rule if the instrumentation policy is enabled
+   *
+   * @tparam RNG the type of the random number generator
+   * @tparam UniformIntDistributionT the type of the equal probability distribution
+   * @tparam Instrumentation the instrumentation policy
+   * @param node the node to expand
+   * @param rng the random number generator
+   * @param instrumentation records the node and its rule, if the policy is enabled
+   */
+  template<typename RNG, typename UniformIntDistributionT, typename Instrumentation>
+  void expandNode(TreeNode* node, RNG& rng, Instrumentation* instrumentation) {
+    std::uint64_t started = 0;
+    if constexpr (Instrumentation::enabled) started = Instrumentation::now();
+    node->template expandNode<RNG, UniformIntDistributionT>(*this->grammar,
+                                                            rng,
+                                                            this->pickers[0].template get<RNG, UniformIntDistributionT>(),
+                                                            this->runtimeDictionary,
+                                                            &this->budget);
+    if constexpr (Instrumentation::enabled) {
+      instrumentation->recordNode();
+      if (node->compiled->type == details::NodeType::Rule) {
+        instrumentation->recordRule(node->compiled->name, Instrumentation::now() - started);
+      }
+    }
+  }
+
+  /**
+   * Creates a tree with no nodes, to be filled in by fork
+   *
+   * @param _grammar the compiled grammar to use to expand the tree
+   * @param useArena true if the tree allocates its nodes from an arena
+   * @param _budget the budget of the tree's expansion, as used so far
+   */
+  Tree(std::shared_ptr<const CompiledGrammar> _grammar, bool useArena, const details::ExpansionBudget& _budget)
+      : arena(useArena ? std::make_shared<details::NodeArena>() : nullptr)
+      , leafIndex(new TreeNode)
+      , unexpandedLeafIndex(new TreeNode)
+      , nextUnexpandedLeaf(nullptr)
+      , grammar(std::move(_grammar))
+      , budget(_budget) {
+  }
+
+  /**
+   * Copies a node still being expanded for a fork of the tree, without its children and links
+   *
+   * @param node the node to copy
+   * @param arena the arena of the fork, or nullptr if it allocates its nodes on the heap
+   * @return the copy
+   */
+  static std::shared_ptr<TreeNode> copyNode(const TreeNode& node, const std::shared_ptr<details::NodeArena>& arena) {
+    std::shared_ptr<TreeNode> copy = TreeNode::create(arena, node.compiled);
+    copy->isNodeComplete_ = node.isNodeComplete_;
+    copy->keyName = node.keyName;
+    copy->keyId = node.keyId;
+    copy->isNodeHidden_ = node.isNodeHidden_;
+    copy->modifiers = node.modifiers;
+    copy->incompleteChildCount = node.incompleteChildCount;
+    copy->ruleDepth = node.ruleDepth;
+    return copy;
+  }
+
+  /**
+   * Marks the nodes of a fully expanded sub-tree as shared between trees, see TreeNode::isNodeShared. Sub-trees
+   * already shared by an earlier fork aren't walked again.
+   *
+   * @param node the root of the sub-tree
+   */
+  static void share(TreeNode* node) {
+    if (node->isNodeShared_) return;
+    std::vector<TreeNode*> pending{node};
+    while (!pending.empty()) {
+      TreeNode* next = pending.back();
+      pending.pop_back();
+      next->isNodeShared_ = true;
+      for (auto& child : next->children) {
+        if (!child->isNodeShared_) pending.push_back(child.get());
+      }
+    }
+  }
+
+  /**
+   * Makes a root node from the given compiled input and links it into the leaf linked lists
+   *
+   * @param compiledInput the compiled input of the root
+   */
+  void plant(std::shared_ptr<const details::CompiledNode> compiledInput) {
+    this->root = TreeNode::create(this->arena, std::move(compiledInput));
+
+    // Insert the root at the beginning of the leaf linked list, after the head
+    this->root->setPrevLeaf(this->leafIndex);
+    this->leafIndex->setNextLeaf(this->root);
+
+    // If the node is not complete, add it after the head of the unexpanded leaf linked list
+    if (!this->root->isNodeComplete()) {
+      this->unexpandedLeafIndex->setNextUnexpandedLeaf(this->root);
+      this->root->setPrevUnexpandedLeaf(this->unexpandedLeafIndex);
+    }
+  }
+
+  /**
+   * Sizes the output and node arena of the tree for the expected expansion of the given compiled input
+   *
+   * @param compiledInput the compiled input of the root
+   */
+  void estimateSize(const details::CompiledNode& compiledInput) {
+    const ExpansionSize size = this->grammar->estimateSize(compiledInput);
+    this->outputReserve = details::getOutputReserve(size);
+
+    // Each node is allocated along with the control block of its shared pointer
+    const double nodeBytes = sizeof(TreeNode) + 4 * sizeof(void*);
+    const double minBlockSize = 16 * 1024, maxBlockSize = 16 * 1024 * 1024;
+    double blockSize = std::isinf(size.expectedNodes) ? minBlockSize : size.expectedNodes * nodeBytes * 1.25;
+    this->arenaBlockSize = static_cast<std::size_t>(std::clamp(blockSize, minBlockSize, maxBlockSize));
+  }
+
+  /**
+   * Releases the nodes of the tree. Nodes release their descendants iteratively, so the depth of the tree doesn't
+   * limit the stack.
+   */
+  void releaseNodes() {
+    this->root.reset();
+  }
+};
+
+namespace details {
+/**
+ * Returns true if the character is a vowel
+ *
+ * @param letter the character to test
+ * @return true if the character is a vowel, in either case
+ */
+constexpr bool isVowel(char letter) {
+  const char lower = static_cast<char>(letter | 0x20);
+  return (lower == 'a') || (lower == 'e') ||
+         (lower == 'i') || (lower == 'o') ||
+         (lower == 'u');
+}
+
+/**
+ * Returns true if the second to last character of the input is a vowel, as the "s" and "ed" modifiers check before a
+ * final y
+ *
+ * @param input the input string, which isn't empty
+ * @return true if the input has at least two characters, and the second to last is a vowel
+ */
+inline bool isVowelBeforeLast(const std::string& input) {
+  return input.size() > 1 && isVowel(input[input.size() - 2]);
+}
+
+/**
+ * Capitalizes the first character of every word of the given string, in place. Words are runs of ASCII letters and
+ * digits, so a character is capitalized if it is a lowercase ASCII letter and the character before it, if any, isn't
+ * alphanumeric.
+ *
+ * Blocks of 16 characters are handled with SSE2 where available: the block's alphanumeric mask, shifted by one
+ * character and carrying the last character of the previous block, gives the word starts, and the lowercase letters
+ * among them have their case bit flipped. The rest of the string is handled one character at a time.
+ *
+ * @param input the string to capitalize
+ */
+inline void capitalizeWords(std::string& input) {
+  char* data = input.data();
+  const std::size_t size = input.size();
+  std::size_t pos = 0;
+
+#if defined(TRACERZ_HAS_SSE2)
+  // Signed comparisons against the bounds of each range; characters outside of ASCII compare as negative
+  auto inRange = [](__m128i chars, char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(static_cast<char>(low - 1))),
+                         _mm_cmplt_epi8(chars, _mm_set1_epi8(static_cast<char>(high + 1))));
+  };
+  const __m128i caseBit = _mm_set1_epi8(0x20);
+  __m128i lastAlphaNum = _mm_setzero_si128();
+  for (; pos + 16 <= size; pos += 16) {
+    __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+    __m128i lower = inRange(chars, 'a', 'z');
+    __m128i alphaNum = _mm_or_si128(inRange(_mm_or_si128(chars, caseBit), 'a', 'z'), inRange(chars, '0', '9'));
+    __m128i afterAlphaNum = _mm_or_si128(_mm_slli_si128(alphaNum, 1), _mm_srli_si128(lastAlphaNum, 15));
+    __m128i starts = _mm_andnot_si128(afterAlphaNum, lower);
+    lastAlphaNum = alphaNum;
+    if (_mm_movemask_epi8(starts) != 0) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(data + pos), _mm_xor_si128(chars, _mm_and_si128(starts, caseBit)));
+    }
+  }
+#endif
+
+  bool capNext = pos == 0 || !isAlphaNumChar(data[pos - 1]);
+  for (; pos < size; ++pos) {
+    char& chr = data[pos];
+    if (isAlphaNumChar(chr)) {
+      if (capNext && chr >= 'a' && chr <= 'z') chr = static_cast<char>(chr - 'a' + 'A');
+      capNext = false;
+    } else {
+      capNext = true;
+    }
+  }
+}
+} // End namespace details
+
+/**
+ * Gets the base extended modifiers. Currently, this is only `pop!!`, a tree modifier that pops the top ruleset off of a
+ * given rule stack.
+ *
+ * @return the base extended modifiers
+ */
+inline const details::callback_map_t& getBaseExtendedModifiers() {
+  static auto wrap = [](const std::function<std::string(const std::shared_ptr<Tree>&, const std::string&)> fun) {
+    std::shared_ptr<details::IModifierFn> ptr(
+        new details::ModifierFn<const std::shared_ptr<Tree>&, const std::string&>(fun));
+    return ptr;
+  };
+
+  // Built the first time this is called. Initialization of a static local is thread safe, so this may be called from
+  // several threads at once
+  static const details::callback_map_t baseMods = [] {
+    details::callback_map_t mods;
+
+    // Pops the top rule off the rule stack for the given ruleName in the given tree's runtime dictionary
+    mods["pop!!"] = wrap([](const std::shared_ptr<Tree>& tree, const std::string& ruleName) {
+      // Pop the top ruleset off the rule stack, if there is one. Once the stack is empty, the rule is no longer defined
+      // in the runtime dictionary.
+      tree->getRuntimeDictionary().pop(ruleName);
+
+      // Return the empty string
+      return "";
+    });
+
+    return mods;
+  }();
+
+  return baseMods;
+}
+
+/**
+ * Gets the set of base english modifiers, as defined by galaxykate's tracery
+ *
+ * @return a map of the names of the modifiers to functions
+ */
+inline const details::callback_map_t& getBaseEngModifiers() {
+  // Wraps a function object modifying a string in place in a shared_ptr to an InPlaceStringModifierFn object and
+  // returns it
+  static auto wrap = [](auto fun) {
+    return details::makeInPlaceStringModifier(std::move(fun));
+  };
+
+  // Built the first time this is called. Initialization of a static local is thread safe, so this may be called from
+  // several threads at once
+  static const details::callback_map_t baseMods = [] {
+    details::callback_map_t mods;
+
+    // "a" adds an "a" or "an" to the beginning of a string, as appropriate
+    mods["a"] = wrap([](std::string& input) {
+      if (input.empty()) return;
+
+      if (input.size() > 2 && (input[0] | 0x20) == 'u' && (input[2] | 0x20) == 'i') {
+        input.insert(0, "a ");
+      } else if (details::isVowel(input[0])) {
+        input.insert(0, "an ");
+      } else {
+        input.insert(0, "a ");
+      }
+    });
+
+    // "capitalizeAll" capitalizes the first character of every word of a string
+    mods["capitalizeAll"] = wrap(&details::capitalizeWords);
+
+    // "capitalize" capitalizes the first character of the input string
+    mods["capitalize"] = wrap([](std::string& input) {
+      if (!input.empty()) input[0] = static_cast<char>(toupper(static_cast<unsigned char>(input[0])));
+    });
+
+    // "s" pluralizes the input string based on the end of the string
+    mods["s"] = wrap([](std::string& input) {
+      if (input.empty()) return;
+
+      switch (input.back()) {
+        case 's':
+        case 'h':
+        case 'x':
+          input += "es";
+          break;
+        case 'y':
+          if (details::isVowelBeforeLast(input)) {
+            input += 's';
+          } else {
+            input.pop_back();
+            input += "ies";
+          }
+          break;
+        default:
+          input += 's';
+      }
+    });
+
+    // "ed" makes a verb past tense based on the end of the input string
+    mods["ed"] = wrap([](std::string& input) {
+      if (input.empty()) return;
+
+      switch (input.back()) {
+        case 's':
+        case 'h':
+        case 'x':
+          input += "ed";
+          break;
+        case 'e':
+          input += 'd';
+          break;
+        case 'y':
+          if (details::isVowelBeforeLast(input)) {
+            input += 'd'; // TODO: this seems incorrect
+          } else {
+            input.pop_back();
+            input += "ied";
+          }
+          break;
+        default:
+          input += "ed";
+      }
+    });
+
+    // "replace" is a parametric modifier that takes two parameters when used: a & b. It replaces all ocurrences of a in
+    // the input string with b. a is a regular expression, compiled once and kept in the shared regex cache
+    mods["replace"] =
+        std::shared_ptr<details::IModifierFn>(new details::ModifierFn<const std::string&,
+            const std::string&, const std::string&>([](const std::string& input,
+                                                       const std::string& target,
+                                                       const std::string& replacement) {
+          return std::regex_replace(input,
+                                    *details::getRegexCache().get(target),
+                                    replacement);
+        }));
+
+    // "replaceLiteral" is like "replace", but a is matched as plain text rather than as a regular expression
+    mods["replaceLiteral"] =
+        std::shared_ptr<details::IModifierFn>(new details::ModifierFn<const std::string&,
+            const std::string&, const std::string&>(&details::replaceLiteral));
+
+    return mods;
+  }();
 
-/**
- * True if the input contains a match for the regex returned by @see tracerz::details::getOnlyParametricModifierRegex()
- *
- * @param input the input string to test
- * @return true if the input contains a match
- */
-bool containsParametricModifier(const std::string& input) {
-  return std::regex_match(input, details::getParametricModifierRegex());
+  return baseMods;
 }
-} // End namespace details
+
+namespace details {
+/** Checks whether a sink has the `size()`, `capacity()` and `reserve(n)` member functions of std::string */
+template<typename Sink, typename = void>
+struct IsReservable : std::false_type {};
+
+/** Checks whether a sink has the `size()`, `capacity()` and `reserve(n)` member functions of std::string */
+template<typename Sink>
+struct IsReservable<Sink, std::void_t<decltype(std::declval<Sink&>().reserve(std::declval<const Sink&>().size() +
+                                                                             std::declval<const Sink&>().capacity()))>>
+    : std::true_type {};
 
 /**
- * Represents a single node in the parse tree
+ * Expands compiled input depth-first with an explicit stack, appending the output directly into a sink instead of
+ * building a tracerz::Tree. Only string modifiers are applied by the stack; tree and tree node modifiers need a
+ * tracerz::Tree, so generate() falls back to building one when they can be reached from the input.
  *
- * TODO: enumerate node types
+ * Rules are expanded in the same order, and with the same random draws, as tracerz::Tree::expand, so for a given seed
+ * both produce the same output.
+ *
+ * The output of each deterministic rule (see tracerz::CompiledRule::isDeterministic) is kept once it has been expanded
+ * with a given chain of modifiers, and output as a single literal wherever the rule is referenced again with the same
+ * modifiers, for as long as the expander lives. String modifiers are therefore expected to be pure functions of their
+ * input and parameters.
+ *
+ * A sink is any object with an `append(std::string_view)` member function, such as std::string.
+ *
+ * @tparam RNG the type of the random number generator
+ * @tparam UniformIntDistributionT the type of the uniform distribution
+ * @tparam Instrumentation the instrumentation policy, see tracerz::Profiler
  */
-class TreeNode : public std::enable_shared_from_this<TreeNode> {
+template<typename RNG, typename UniformIntDistributionT, typename Instrumentation = NoInstrumentation>
+class StreamingExpander {
 public:
   /**
-   * Default constructor. Contains no input, used by the tree to point to certain nodes within the tree, from outside it
+   * Creates a new expander
+   *
+   * @param _grammar the compiled input grammar
+   * @param _modFuns the modifier functions
+   * @param _rng the random number generator
+   * @param _limits the limits on the size of each expansion
+   * @param _instrumentation records each sample generated, if the policy is enabled; must then not be nullptr
    */
-  TreeNode()
-      : input()
-      , isNodeComplete_(false)
-      , prevLeaf(nullptr)
-      , nextLeaf(nullptr)
-      , prevUnexpandedLeaf(nullptr)
-      , nextUnexpandedLeaf(nullptr)
-      , isNodeHidden_(false) {
+  StreamingExpander(std::shared_ptr<const CompiledGrammar> _grammar,
+                    const callback_map_t& _modFuns,
+                    RNG& _rng,
+                    const ExpansionLimits& _limits = ExpansionLimits(),
+                    Instrumentation* _instrumentation = nullptr)
+      : grammar(std::move(_grammar))
+      , modFuns(_modFuns)
+      , rng(_rng)
+      , bufferDepth(0)
+      , ruleDepth(0)
+      , budget(_limits)
+      , hasLimits(this->budget.hasLimits())
+      , instrumentation(_instrumentation) {
   }
 
   /**
-   * Constructs a new tree node from the given parameters. The only required parameter is the input string, all others
-   * default to nullptr
+   * Expands the given input string completely with a new runtime dictionary, appending the output to the sink. If a
+   * tree or tree node modifier can be reached from the input, the input is expanded into a tracerz::Tree using the
+   * given node storage and flattened instead.
    *
+   * @tparam Sink the type of the sink
    * @param input the input string
-   * @param prev the leaf prior to this leaf
-   * @param next the next leaf from this leaf
-   * @param prevUnexpanded the unexpanded leaf prior to this unexpanded leaf
-   * @param nextUnexpanded the next unexpanded leaf from this unexpanded leaf
+   * @param sink the sink to append the output to
+   * @param storage the node storage to use if a tree is needed
+   * @param paths the paths of the expansions seen before, which the picks are followed through and the expansion
+   *     abandoned as soon as it can only repeat one of them, see isPathRepeated(); or nullptr to expand in full
    */
-  explicit TreeNode(const std::string& input,
-                    std::shared_ptr<TreeNode> prev = nullptr,
-                    std::shared_ptr<TreeNode> next = nullptr,
-                    std::shared_ptr<TreeNode> prevUnexpanded = nullptr,
-                    std::shared_ptr<TreeNode> nextUnexpanded = nullptr)
-      : input(input)
-      , isNodeComplete_(!details::containsRule(input)
-                        && !details::containsOnlyActions(input))
-      , prevLeaf(std::move(prev))
-      , nextLeaf(std::move(next))
-      , prevUnexpandedLeaf(std::move(prevUnexpanded))
-      , nextUnexpandedLeaf(std::move(nextUnexpanded))
-      , isNodeHidden_(false) {
+  template<typename Sink>
+  void generate(const std::string& input, Sink& sink, NodeStorage storage, PickTrie* paths = nullptr) {
+    if (!this->startGenerating(input, sink, storage, paths)) return;
+
+    // Make room for the expected output up front, so that a string sink doesn't grow while it is appended to
+    if constexpr (IsReservable<Sink>::value) {
+      std::size_t needed = sink.size() + this->lastInputReserve;
+      if (sink.capacity() < needed) sink.reserve(needed);
+    }
+    while (this->advance(sink));
+    if constexpr (Instrumentation::enabled) {
+      this->instrumentation->finishSample(this->sampleBytes,
+                                          this->runtimeDictionary.getPushCount(),
+                                          this->runtimeDictionary.getPopCount());
+    }
   }
 
   /**
-   * Default virtual destructor
-   */
-  virtual ~TreeNode() = default;
-
-  /**
-   * Creates a new TreeNode from the given input string and adds it as a child to this node.
+   * Starts expanding the given input string with a new runtime dictionary, discarding any expansion in progress. The
+   * expansion is continued with advance(), unless a tree or tree node modifier can be reached from the input: the input
+   * is then expanded into a tracerz::Tree using the given node storage at once, and its output appended to the sink.
    *
-   * @param inputStr the input string
+   * @tparam Sink the type of the sink
+   * @param input the input string
+   * @param sink the sink to append the output to if a tree is needed
+   * @param storage the node storage to use if a tree is needed
+   * @param paths the paths to follow the picks through, see generate(), or nullptr; the picks of a tree are not
+   * @return true if the expansion is to be continued with advance(), false if it is already finished
    */
-  void addChild(const std::string& inputStr) {
-    std::shared_ptr<TreeNode> prev = nullptr;
-    std::shared_ptr<TreeNode> next = nullptr;
-    if (this->children.empty()) {
-      // If there are no children, then the previous and next leaves are the ones of this node
-      prev = this->prevLeaf;
-      next = this->nextLeaf;
-    } else {
-      // If there are children, the new node's previous leaf is the last child and its next leaf is the one of this node
-      prev = this->children.back();
-      next = prev->nextLeaf;
-    }
-
-    // Create the child with the input string, previous leaf, and next leaf
-    std::shared_ptr<TreeNode> child(new TreeNode(inputStr,
-                                                 prev,
-                                                 next));
-
-    // If the child's previous leaf is not null, set its next leaf to the new node
-    if (child->prevLeaf)
-      child->prevLeaf->nextLeaf = child;
-
-    // If the child's next leaf is not null, set its previous leaf to the new node
-    if (child->nextLeaf)
-      child->nextLeaf->prevLeaf = child;
-
-    // If this new child is not complete, set its previous and next unexpanded leaves
-    if (!child->isNodeComplete()) {
-      std::shared_ptr<TreeNode> prevUnexpanded = nullptr;
-      std::shared_ptr<TreeNode> nextUnexpanded = nullptr;
-
-      if (this->prevUnexpandedLeaf) {
-        // If this leaf has a previous unexpanded leaf, then this is its first expansion. Set the child's previous and
-        // next unexpanded leaves to this one's.
-        prevUnexpanded = this->prevUnexpandedLeaf;
-        nextUnexpanded = this->nextUnexpandedLeaf;
-      } else if (!this->children.empty()) {
-        // If this node has children, get the last child *C* with a previous unexpanded leaf, set the new child's
-        // previous unexpanded leaf to *C*, and set the new child's next unexpanded leaf to *C*'s next unexpanded node.
-        for (auto i = this->children.rbegin();
-             i != this->children.rend();
-             i++) {
-          if ((*i)->hasPrevUnexpandedLeaf()) {
-            prevUnexpanded = *i;
-            nextUnexpanded = (*i)->nextUnexpandedLeaf;
-            break;
-          }
+  template<typename Sink>
+  bool startGenerating(const std::string& input, Sink& sink, NodeStorage storage, PickTrie* paths = nullptr) {
+    this->picker.startPath(paths);
+
+    // The same input is usually expanded over and over, so keep it compiled along with whether it needs a tree
+    if (!this->lastInput || this->lastInput->input != input) {
+      this->lastInput = compileNode(input);
+      this->lastInputNeedsTree = false;
+      this->lastInputReserve = getOutputReserve(this->grammar->estimateSize(*this->lastInput));
+
+      // Tree and tree node modifiers operate on a tree, so build one if any of them could be applied
+      for (std::size_t modifier : this->grammar->getReachableModifiers(*this->lastInput)) {
+        IModifierFn* modFun = this->modFuns.get(modifier);
+        if (modFun != nullptr && !modFun->isStringModifier()) {
+          this->lastInputNeedsTree = true;
+          break;
         }
       }
-
-      // Set the child object's previous and next unexpanded leaves
-      child->prevUnexpandedLeaf = prevUnexpanded;
-      child->nextUnexpandedLeaf = nextUnexpanded;
-
-      // If the child's previous unexpanded leaf is not null, set its next unexpanded leaf to the new child
-      if (child->prevUnexpandedLeaf)
-        child->prevUnexpandedLeaf->nextUnexpandedLeaf = child;
-
-      // If the child's next unexpanded leaf is not null, set its previous unexpanded leaf to the new child
-      if (child->nextUnexpandedLeaf)
-        child->nextUnexpandedLeaf->prevUnexpandedLeaf = child;
-
-      // This node has been at least partially expanded and is no longer part of the chain of unexpanded leaves
-      this->prevUnexpandedLeaf = this->nextUnexpandedLeaf = nullptr;
     }
 
-    // If this is a hidden node, hide the child
-    child->isNodeHidden_ = this->isNodeHidden_;
-
-    // Add the child to the list of children
-    this->children.push_back(child);
+    if (this->lastInputNeedsTree) {
+      // Reuse the tree of the last expansion that needed one, if it has the same node storage
+      if (this->tree && this->treeStorage == storage) {
+        this->tree->reset(input);
+      } else {
+        this->tree.reset(new Tree(input, this->grammar, storage, this->budget.getLimits()));
+        this->treeStorage = storage;
+      }
+      while (this->tree->template expand<RNG, UniformIntDistributionT>(this->modFuns, this->rng,
+                                                                        this->instrumentation));
+      std::string output = this->tree->flatten(this->modFuns, true, false, this->instrumentation);
+      sink.append(output);
+      if constexpr (Instrumentation::enabled) {
+        const runtime_dictionary_t& dictionary = this->tree->getRuntimeDictionary();
+        this->instrumentation->finishSample(output.size(), dictionary.getPushCount(), dictionary.getPopCount());
+      }
+      return false;
+    }
 
-    // This is no longer a leaf, unset its previous and next leaves
-    this->prevLeaf = this->nextLeaf = nullptr;
+    this->runtimeDictionary.clear();
+    if constexpr (Instrumentation::enabled) this->sampleBytes = 0;
+    this->start(this->lastInput);
+    return true;
   }
 
   /**
-   * Returns true if this node has children nodes
+   * Returns true if the last expansion was abandoned because its picks reached an exhausted node of the paths it was
+   * started with, see tracerz::details::PickTrie. Its output is then incomplete.
    *
-   * @return true if this node has children nodes
+   * @return true if the last expansion can only repeat one seen before
    */
-  bool hasChildren() const {
-    return !this->children.empty();
+  bool isPathRepeated() const {
+    return this->picker.isPathRepeated();
   }
 
   /**
-   * Returns true if every child of this node is complete, or there are no children
+   * Returns true if the last input started with startGenerating was expanded into a tree
    *
-   * @return true if every child of this node is complete, or there are no children
+   * @return true if the last input needed a tree
    */
-  bool areChildrenComplete() const {
-    for (auto& child : this->children) {
-      if (!child->isNodeComplete()) return false;
-    }
-    return true;
+  bool lastNeededTree() const {
+    return this->lastInputNeedsTree;
   }
 
   /**
-   * Gets the last child of this node that is unexpanded
+   * Starts expanding the given compiled input, discarding any expansion in progress
    *
-   * @return the last child of this node that is unexpanded
+   * @param input the compiled input
    */
-  std::shared_ptr<TreeNode> getLastExpandableChild() const {
-    for (auto riter = this->children.rbegin();
-         riter != this->children.rend();
-         riter++) {
-      // If this child is not complete, return it
-      if (!(*riter)->isNodeComplete()) return *riter;
-    }
-
-    // No expandable child found, return nullptr
-    return nullptr;
+  void start(std::shared_ptr<const CompiledNode> input) {
+    this->frames.clear();
+    this->bufferDepth = 0;
+    this->ruleDepth = 0;
+    this->budget.reset();
+    this->memoStarts.clear();
+    const CompiledNode* node = input.get();
+    this->pushFrame(node, std::move(input), false, 0, nullptr, true);
   }
 
   /**
-   * Flattens the sub-tree represented by this node and its descendents into a single string representation, using the
-   * given modifier map to handle any modifiers (if applicable).
+   * Continues the expansion until some output has been appended to the sink, or the expansion is finished
    *
-   * @param modFuns the modifier function map
-   * @param ignoreHidden exclude hidden subtrees from the flattened string
-   * @param ignoreModifiers if true, modifier functions will not be called
-   * @return the flattened string representation
+   * @tparam Sink the type of the sink
+   * @param sink the sink to append the output to
+   * @return true if the expansion is not yet finished
    */
-  std::string flatten(details::callback_map_t modFuns,
-                      std::shared_ptr<Tree> tree,
-                      bool ignoreHidden = true,
-                      bool ignoreModifiers = false) {
-    if (!(this->modifiers.empty() || ignoreModifiers)) {
-      // If this node has modifiers and ignoreModifiers is not true, then we need to apply modifiers. First we get the
-      // flattened string representation without calling modifiers
-      std::string output = this->flatten(modFuns, tree, ignoreHidden, true);
-
-      // If the output is empty at this point, then return the empty string
-      if (output.empty()) return output;
-
-      // Loop over each modifier being applied to this node
-      for (auto& mod : this->modifiers) {
-        std::vector<std::string> params; // Starts empty, may be filled if this is a parametric modifier
-        std::string modName = mod;
-
-        if (details::containsParametricModifier(mod)) {
-          // If it contains a modifier that takes parameters, we need to handle those. First extract the modifier name
-          // from the first capture group of this regex
-          modName = std::regex_replace(mod,
-                                       details::getParametricModifierRegex(),
-                                       "$1");
-          // Get the string representing the list of params from the second capture group
-          std::string paramsStr = std::regex_replace(mod,
-                                                     details::getParametricModifierRegex(),
-                                                     "$2");
-
-          // Use comma regex to separate params and fill params vector
-          std::copy(std::sregex_token_iterator(paramsStr.begin(),
-                                               paramsStr.end(),
-                                               details::getCommaRegex(),
-                                               -1),
-                    std::sregex_token_iterator(),
-                    std::back_inserter(params));
-        }
+  template<typename Sink>
+  bool advance(Sink& sink) {
+    bool emitted = false;
+    while (!this->frames.empty() && !emitted) {
+      Frame& frame = this->frames.back();
+      const CompiledNode& node = *frame.node;
+
+      switch (node.type) {
+      case NodeType::Text:
+        emitted = this->append(sink, frame.target, std::string_view(node.input).substr(0, frame.textRoom));
+        this->frames.pop_back();
+        break;
+      case NodeType::KeyWithTextAction: {
+        // Hidden, so only part of the output when it is itself inside a key capture
+        this->runtimeDictionary.pushList(node.nameId, node.values);
+        if (frame.includeHidden) emitted = this->append(sink, frame.target, node.input);
+        this->frames.pop_back();
+        break;
+      }
+      case NodeType::Rule:
+        if (frame.nextChild++ == 0) {
+          const CompiledRule* rule = this->grammar->getRule(node.nameId);
+          bool memoize = rule != nullptr && rule->isDeterministic && !this->isShadowed(*rule);
+          if (memoize) {
+            // Output the rule as it was expanded before, if it has been and the expansion fits in the budget
+            if (const Memo* memo = this->findMemo(*rule, node.modifiers)) {
+              if (!this->hasLimits || this->budget.addExpansion(this->ruleDepth + rule->height, memo->usage)) {
+                if constexpr (Instrumentation::enabled) this->instrumentation->recordRule(node.name, 0);
+                emitted = this->finishMemoizedRule(sink, memo->output);
+                break;
+              }
+              memoize = false;
+            }
+          }
 
-        if (modFuns.find(modName) != modFuns.end()) {
-          // If the modifier name names a real modifier, call it with the appropriate input and parameters (if any), and
-          // update the output string.
-          auto& modFun = modFuns[modName];
-          if (modFun->isStringModifier()) {
-            output = modFun->callVec(output, params);
+          // Select the expansion of the rule, or the one the limit policy selects once the budget is used up
+          std::uint64_t started = 0;
+          if constexpr (Instrumentation::enabled) started = Instrumentation::now();
+          ExpansionBudget::Usage usage = this->budget.getUsage();
+          std::shared_ptr<const CompiledNode> expansion;
+          if (!this->hasLimits || this->budget.expandRule(this->ruleDepth + 1)) {
+            if (memoize) {
+              frame.memoRule = rule;
+              this->memoStarts.push_back(usage);
+            }
+            expansion = selectExpansion<RNG, UniformIntDistributionT>(node, rule, this->rng, this->picker,
+                                                                       this->runtimeDictionary);
+            if (this->picker.isPathRepeated()) {
+              // Every expansion on from this pick has been seen before
+              this->frames.clear();
+              break;
+            }
           } else {
-            // Because of the way the parse tree is built, this node will never have actions attached to the front of
-            // the input. Therefore, the first capture group from this regex will be the rule name.
-            std::string ruleName = std::regex_replace(this->input, details::getRuleRegex(), "$1");
-
-            if (modFun->isTreeModifier()) {
-              output = modFun->callVec(tree, ruleName, params);
-            } else if (modFun->isTreeNodeModifier()) {
-              output = modFun->callVec(this->shared_from_this(), ruleName, params);
+            expansion = selectFallbackExpansion(node, rule, this->budget.getLimits().policy,
+                                                this->runtimeDictionary);
+          }
+          std::size_t textRoom = std::numeric_limits<std::size_t>::max();
+          if (this->hasLimits && expansion->type == NodeType::Text) {
+            textRoom = this->budget.addText(expansion->input.size());
+          }
+          if constexpr (Instrumentation::enabled) {
+            this->instrumentation->recordRule(node.name, Instrumentation::now() - started);
+          }
+
+          // Modified, captured and memoized output is collected into a buffer of its own until the rule is finished
+          // expanding
+          if (!node.modifiers.empty() || frame.capture != nullptr || frame.memoRule != nullptr) {
+            frame.buffer = this->acquireBuffer();
+          }
+          std::size_t target = frame.buffer != 0 ? frame.buffer : frame.target;
+          const CompiledNode* child = expansion.get();
+          ++this->ruleDepth;
+          this->pushFrame(child, std::move(expansion), frame.includeHidden, target, nullptr, true, textRoom);
+        } else {
+          emitted = this->finishRule(sink);
+        }
+        break;
+      case NodeType::KeylessRuleAction:
+      case NodeType::KeyWithRuleAction:
+        if (frame.nextChild++ == 0) {
+          // The rule inside a key capture includes hidden output. When the key is set, the capture is hidden, and
+          // only part of the output when it is itself inside another capture
+          bool keyless = node.type == NodeType::KeylessRuleAction;
+          this->pushFrame(node.children.front().get(), nullptr, frame.includeHidden || !keyless, frame.target,
+                          &node, keyless || frame.includeHidden);
+        } else {
+          this->frames.pop_back();
+        }
+        break;
+      default:
+        if (node.children.empty()) {
+          // Inputs that cannot be split any further are output as is
+          emitted = this->append(sink, frame.target, node.input);
+          this->frames.pop_back();
+        } else if (frame.nextChild < node.children.size()) {
+          if (frame.nextChild == 0 && this->hasLimits) {
+            // Plain text is counted as soon as the node containing it is expanded
+            std::size_t size = 0;
+            for (auto& child : node.children) {
+              if (child->type == NodeType::Text) size += child->input.size();
             }
+            frame.textRoom = this->budget.addText(size);
+          }
+          const CompiledNode* child = node.children[frame.nextChild++].get();
+          std::size_t textRoom = std::numeric_limits<std::size_t>::max();
+          if (child->type == NodeType::Text) {
+            textRoom = std::min(child->input.size(), frame.textRoom);
+            frame.textRoom -= textRoom;
           }
+          this->pushFrame(child, nullptr, frame.includeHidden, frame.target, nullptr, true, textRoom);
+        } else {
+          this->frames.pop_back();
         }
+        break;
       }
-
-      // Return the modified string
-      return output;
     }
+    return !this->frames.empty();
+  }
 
-    // If this doesn't have children...
-    if (!this->hasChildren()) {
-      // Then if the node is hidden and we are ignoring hidden nodes...
-      if (ignoreHidden && this->isNodeHidden()) {
-        // Return an empty string, since it's ignored
-        return "";
-      }
+  /**
+   * Expands the given compiled input completely, appending the output to the sink
+   *
+   * @tparam Sink the type of the sink
+   * @param input the compiled input
+   * @param sink the sink to append the output to
+   */
+  template<typename Sink>
+  void run(std::shared_ptr<const CompiledNode> input, Sink& sink) {
+    this->picker.startPath(nullptr);
+    this->start(std::move(input));
+    while (this->advance(sink));
+  }
 
-      // Node isn't hidden, return its input string
-      return this->input;
-    }
+private:
+  /** The state of a single node being expanded */
+  struct Frame {
+    /** The compiled node */
+    const CompiledNode* node;
 
-    // This node has children and isn't hidden, flatten and assemble the output of all its children
-    std::string ret;
-    for (auto& child : this->children) {
-      // We can't ignore modifiers, because we will get the wrong output from flattening our children if we do.
-      ret += child->flatten(modFuns, tree, ignoreHidden, false);
-    }
+    /** Keeps the compiled node alive if the grammar does not own it, eg. when compiled from the runtime dictionary */
+    std::shared_ptr<const CompiledNode> owner;
 
-    // Return the flattened children's string
-    return ret;
-  }
+    /** The number of children of the node that have been expanded */
+    std::size_t nextChild;
 
-  template<typename RNG, typename UniformIntDistributionT>
-  void expandNode(const nlohmann::json&, RNG&, details::runtime_dictionary_t&);
+    /** True if hidden output is included, which is the case inside key captures */
+    bool includeHidden;
+
+    /** The buffer output is appended to, where 0 is the sink */
+    std::size_t target;
+
+    /** The buffer this rule collects its output in, or 0 if it appends straight to its target */
+    std::size_t buffer;
+
+    /**
+     * The action capturing the output of this rule, or nullptr for no capture. The output is only set as a key if the
+     * action has one.
+     */
+    const CompiledNode* capture;
+
+    /** True if the output of this rule is appended to its target once it has been modified and captured */
+    bool appendToTarget;
+
+    /** The deterministic rule whose output is memoized once this rule is finished, or nullptr */
+    const CompiledRule* memoRule;
+
+    /**
+     * The number of bytes of plain text the node may output: a plain text node's own, or that of the plain text
+     * children of other nodes
+     */
+    std::size_t textRoom;
+
+  };
+
+  /** The output of a deterministic rule, expanded with a chain of modifiers */
+  struct Memo {
+    /** The modifiers applied to the rule */
+    std::vector<ModifierCall> modifiers;
+
+    /** The output of the rule */
+    std::string output;
+
+    /** The part of the budget expanding the rule used */
+    ExpansionBudget::Usage usage;
+  };
 
   /**
-   * Gets the input string for this node
-   *
-   * @return the input string for this node
+   * Pushes a new frame for the given node
    */
-  const std::string& getInput() const { return this->input; }
+  void pushFrame(const CompiledNode* node,
+                 std::shared_ptr<const CompiledNode> owner,
+                 bool includeHidden,
+                 std::size_t target,
+                 const CompiledNode* capture,
+                 bool appendToTarget,
+                 std::size_t textRoom = std::numeric_limits<std::size_t>::max()) {
+    if constexpr (Instrumentation::enabled) {
+      if (node->type != NodeType::Text) this->instrumentation->recordNode();
+    }
+    this->frames.push_back(Frame{node, std::move(owner), 0, includeHidden, target, 0, capture, appendToTarget,
+                                 nullptr, textRoom});
+  }
 
   /**
-   * Gets the next leaf (if applicable). If this is the last leaf or if this node is not a leaf, will return nullptr.
+   * Finishes the rule on top of the stack: applies its modifiers, captures its output, and passes the output on to its
+   * target
    *
-   * @return the next leaf (if applicable)
+   * @return true if output was appended to the sink
    */
-  std::shared_ptr<TreeNode> getNextLeaf() const {
-    return this->nextLeaf;
+  template<typename Sink>
+  bool finishRule(Sink& sink) {
+    Frame frame = std::move(this->frames.back());
+    this->frames.pop_back();
+    --this->ruleDepth;
+    if (frame.buffer == 0) return false;
+
+    std::string& output = this->buffers[frame.buffer];
+    if (!output.empty()) {
+      for (auto& mod : frame.node->modifiers) {
+        IModifierFn* modFun = this->modFuns.get(mod.id);
+        if (modFun != nullptr && modFun->isStringModifier()) {
+          std::uint64_t started = 0;
+          if constexpr (Instrumentation::enabled) started = Instrumentation::now();
+          modFun->callInPlace(output, mod.params);
+          if constexpr (Instrumentation::enabled) {
+            this->instrumentation->recordModifier(mod.name, Instrumentation::now() - started);
+          }
+        }
+      }
+    }
+
+    if (frame.memoRule != nullptr) {
+      // The output is only the rule's usual one if the limit policy didn't change any of it
+      const ExpansionBudget::Usage& usage = this->budget.getUsage();
+      const ExpansionBudget::Usage& start = this->memoStarts.back();
+      if (usage.fallbacks == start.fallbacks) {
+        ExpansionBudget::Usage used;
+        used.rules = usage.rules - start.rules;
+        used.bytes = usage.bytes - start.bytes;
+        this->memos[frame.memoRule].push_back(Memo{frame.node->modifiers, output, used});
+      }
+      this->memoStarts.pop_back();
+    }
+
+    if (frame.capture != nullptr && frame.capture->type == NodeType::KeyWithRuleAction) {
+      this->runtimeDictionary.push(frame.capture->nameId, output);
+    }
+
+    bool emitted = frame.appendToTarget && this->append(sink, frame.target, output);
+    this->releaseBuffer();
+    return emitted;
   }
 
   /**
-   * Gets the next unexpanded leaf (if applicable). If this is the last unexpanded leaf, is partiall or fully expanded,
-   * or is not a leaf, will return nullptr.
+   * Finishes the rule on top of the stack with the memoized output of its rule: captures the output, and passes it on
+   * to its target
    *
-   * @return the next unexpanded leaf (if applicable)
+   * @return true if output was appended to the sink
    */
-  std::shared_ptr<TreeNode> getNextUnexpandedLeaf() const {
-    return this->nextUnexpandedLeaf;
+  template<typename Sink>
+  bool finishMemoizedRule(Sink& sink, std::string_view output) {
+    Frame frame = std::move(this->frames.back());
+    this->frames.pop_back();
+
+    if (frame.capture != nullptr && frame.capture->type == NodeType::KeyWithRuleAction) {
+      this->runtimeDictionary.push(frame.capture->nameId, output);
+    }
+
+    return frame.appendToTarget && this->append(sink, frame.target, output);
   }
 
   /**
-   * Gets the previous leaf (if applicable). If this node is not a leaf, will return nullptr.
-   *
-   * @return the previous leaf (if applicable)
+   * Returns true if the runtime dictionary defines any of the rules that can be reached from the given rule, which then
+   * no longer expands to its memoized output
    */
-  std::shared_ptr<TreeNode> getPrevLeaf() const {
-    return this->prevLeaf;
+  bool isShadowed(const CompiledRule& rule) const {
+    if (this->runtimeDictionary.empty()) return false;
+    for (std::size_t id : rule.reachableRuleIds) {
+      if (this->runtimeDictionary.contains(id)) return true;
+    }
+    return false;
   }
 
   /**
-   * Gets the previous unexpanded leaf (if applicable). If this is partially or fully expanded, or is not a leaf, this
-   * will return nullptr.
+   * Finds the memoized output of the given rule with the given modifiers
    *
-   * @return the previous unexpanded leaf (if applicable)
+   * @return the memo, or nullptr if the rule has not been expanded with those modifiers yet
    */
-  std::shared_ptr<TreeNode> getPrevUnexpandedLeaf() const {
-    return this->prevUnexpandedLeaf;
+  const Memo* findMemo(const CompiledRule& rule, const std::vector<ModifierCall>& modifiers) const {
+    auto iter = this->memos.find(&rule);
+    if (iter == this->memos.end()) return nullptr;
+
+    for (auto& memo : iter->second) {
+      bool same = memo.modifiers.size() == modifiers.size();
+      for (std::size_t i = 0; same && i < modifiers.size(); i++) {
+        same = memo.modifiers[i].id == modifiers[i].id && memo.modifiers[i].params == modifiers[i].params;
+      }
+      if (same) return &memo;
+    }
+    return nullptr;
   }
 
   /**
-   * Returns true if this node has a next unexpanded leaf
+   * Appends the given output to the given target
    *
-   * @return true if this node has a next unexpanded leaf
+   * @return true if the output was appended to the sink
    */
-  bool hasNextUnexpandedLeaf() const {
-    return this->nextUnexpandedLeaf ? true : false;
+  template<typename Sink>
+  bool append(Sink& sink, std::size_t target, std::string_view output) {
+    if (output.empty()) return false;
+    if (target != 0) {
+      this->buffers[target].append(output);
+      return false;
+    }
+    sink.append(output);
+    if constexpr (Instrumentation::enabled) this->sampleBytes += output.size();
+    return true;
   }
 
   /**
-   * Returns true if this node has a previous unexpanded leaf
+   * Takes the next free buffer. Buffers are used by nested rules, so they are taken and released in stack order, and
+   * their storage is reused between expansions.
    *
-   * @return true if this node has a previous unexpanded leaf
+   * @return the index of the buffer
    */
-  bool hasPrevUnexpandedLeaf() const {
-    return this->prevUnexpandedLeaf ? true : false;
+  std::size_t acquireBuffer() {
+    ++this->bufferDepth;
+    if (this->buffers.size() <= this->bufferDepth) this->buffers.resize(this->bufferDepth + 1);
+    this->buffers[this->bufferDepth].clear();
+    return this->bufferDepth;
   }
 
   /**
-   * Returns true if this node is complete (cannot be expanded)
-   *
-   * @return true if this node is complete (cannot be expanded)
+   * Releases the most recently taken buffer
    */
-  bool isNodeComplete() const { return this->isNodeComplete_; }
+  void releaseBuffer() {
+    --this->bufferDepth;
+  }
+
+  /** The compiled input grammar */
+  std::shared_ptr<const CompiledGrammar> grammar;
+
+  /** The modifier functions */
+  const callback_map_t& modFuns;
+
+  /** The random number generator */
+  RNG& rng;
+
+  /** Picks the alternatives of rules, reusing one distribution where the distribution type allows it */
+  IndexPicker<RNG, UniformIntDistributionT> picker;
+
+  /** The runtime dictionary, consisting of keys created while expanding */
+  runtime_dictionary_t runtimeDictionary;
+
+  /** The compiled input of the last call to generate */
+  std::shared_ptr<const CompiledNode> lastInput;
+
+  /** Whether a tree or tree node modifier can be reached from the last input, so it has to be expanded into a tree */
+  bool lastInputNeedsTree = false;
+
+  /** The number of bytes to reserve in a string sink for the output of the last input, see getOutputReserve */
+  std::size_t lastInputReserve = 0;
+
+  /** The tree of the last expansion that needed one, reset for the next */
+  std::shared_ptr<Tree> tree;
+
+  /** The node storage of the tree */
+  NodeStorage treeStorage = NodeStorage::Heap;
+
+  /** The nodes currently being expanded, innermost last */
+  std::vector<Frame> frames;
+
+  /** The output buffers of rules being modified or captured. Index 0 stands for the sink and is never used. */
+  std::vector<std::string> buffers;
+
+  /** The number of buffers currently in use */
+  std::size_t bufferDepth;
+
+  /** The number of rules the innermost frame is nested in */
+  std::size_t ruleDepth;
+
+  /** Counts each expansion against its limits */
+  ExpansionBudget budget;
+
+  /** True if any limit is set, otherwise the budget isn't used */
+  bool hasLimits;
+
+  /** The part of the budget used before each memoized rule being expanded was, innermost last */
+  std::vector<ExpansionBudget::Usage> memoStarts;
+
+  /** The memoized outputs of deterministic rules */
+  std::unordered_map<const CompiledRule*, std::vector<Memo>> memos;
+
+  /** Records each sample, if the instrumentation policy is enabled */
+  Instrumentation* instrumentation;
+
+  /** The number of bytes output by the current sample, counted if the instrumentation policy is enabled */
+  std::size_t sampleBytes = 0;
+};
+} // End namespace details
+
+namespace details {
+/** The number of consecutive samples of a batch expanded with the same random number generator */
+constexpr std::size_t batchBlockSize = 64;
+
+/**
+ * Creates the random number generator for a block of samples of a batch, seeded deterministically from the batch seed
+ * and the index of the block. If the generator type has a `jump()` member function, like tracerz::Xoshiro256StarStar,
+ * it is seeded with the batch seed and jumped once per block, so the streams of the blocks never overlap. Otherwise, if
+ * the generator type can be seeded from a seed sequence, both values are fed through std::seed_seq; failing that the
+ * generator is constructed from a single integer mixing the two.
+ *
+ * @tparam RNG the type of the random number generator
+ * @param seed the seed of the batch
+ * @param index the index of the block within the batch
+ * @return the random number generator for the block
+ */
+template<typename RNG>
+RNG makeBatchRNG(std::uint64_t seed, std::uint64_t index) {
+  if constexpr (IsJumpable<RNG>::value) {
+    RNG rng(seed);
+    for (std::uint64_t i = 0; i < index; i++) rng.jump();
+    return rng;
+  } else if constexpr (std::is_constructible_v<RNG, std::seed_seq&>) {
+    std::seed_seq sequence{static_cast<std::uint32_t>(seed),
+                           static_cast<std::uint32_t>(seed >> 32u),
+                           static_cast<std::uint32_t>(index),
+                           static_cast<std::uint32_t>(index >> 32u)};
+    return RNG(sequence);
+  } else {
+    // Spread consecutive indices apart with the golden ratio increment used by splitmix64
+    return RNG(static_cast<typename RNG::result_type>(seed ^ (index * 0x9E3779B97F4A7C15ull)));
+  }
+}
+
+/**
+ * Moves the random number generator of one block of a batch, as created by tracerz::details::makeBatchRNG and not used
+ * since, to a later block. Jumpable generators are jumped forward rather than jumped again from the batch seed, so a
+ * worker taking increasing blocks makes at most one jump per block of the batch.
+ *
+ * @tparam RNG the type of the random number generator
+ * @param rng the random number generator of block `from`, which is set to the one of block `to`
+ * @param seed the seed of the batch
+ * @param from the index of the block of the generator
+ * @param to the index of the block to move to, which must not be less than `from`
+ */
+template<typename RNG>
+void advanceBatchRNG(RNG& rng, std::uint64_t seed, std::uint64_t from, std::uint64_t to) {
+  if constexpr (IsJumpable<RNG>::value) {
+    for (; from < to; from++) rng.jump();
+  } else {
+    if (from != to) rng = makeBatchRNG<RNG>(seed, to);
+  }
+}
+} // End namespace details
 
+/**
+ * The immutable part of a tracerz::Grammar: the compiled input grammar and a frozen copy of its modifier functions.
+ * A core is shared, through a `std::shared_ptr<const GrammarCore>`, by any number of tracerz::Generator objects, which
+ * may expand from it on different threads at once without locking. The modifier functions themselves must be safe to
+ * call concurrently; the base modifiers are.
+ */
+class GrammarCore {
+public:
   /**
-   * Sets the next leaf
+   * Creates a new grammar core
    *
-   * @param next the next leaf
+   * @param grammar the compiled input grammar
+   * @param modFuns the modifier functions
+   * @param storage how trees expanded from this core allocate their nodes
+   * @param limits the limits on the size of each expansion
    */
-  void setNextLeaf(std::shared_ptr<TreeNode> next) {
-    this->nextLeaf = std::move(next);
+  GrammarCore(std::shared_ptr<const CompiledGrammar> grammar,
+              details::callback_map_t modFuns,
+              NodeStorage storage,
+              const ExpansionLimits& limits = ExpansionLimits())
+      : compiledGrammar(std::move(grammar))
+      , modifierFunctions(std::move(modFuns))
+      , nodeStorage(storage)
+      , expansionLimits(limits) {
   }
 
   /**
-   * Sets the next unexpanded leaf
+   * Gets the compiled input grammar
    *
-   * @param next the next unexpanded leaf
+   * @return the compiled input grammar
    */
-  void setNextUnexpandedLeaf(std::shared_ptr<TreeNode> next) {
-    this->nextUnexpandedLeaf = std::move(next);
+  const std::shared_ptr<const CompiledGrammar>& getCompiledGrammar() const {
+    return this->compiledGrammar;
   }
 
   /**
-   * Sets the previous leaf
+   * Returns the map of modifier names to functions
    *
-   * @param next the previous leaf
+   * @return the map of modifier names to functions
    */
-  void setPrevLeaf(std::shared_ptr<TreeNode> prev) {
-    this->prevLeaf = std::move(prev);
+  const details::callback_map_t& getModifierFunctions() const {
+    return this->modifierFunctions;
   }
 
   /**
-   * Sets the previous unexpanded leaf
+   * Gets how trees expanded from this core allocate their nodes
    *
-   * @param next the previous unexpanded leaf
+   * @return the node storage
    */
-  void setPrevUnexpandedLeaf(std::shared_ptr<TreeNode> prev) {
-    this->prevUnexpandedLeaf = std::move(prev);
+  NodeStorage getNodeStorage() const {
+    return this->nodeStorage;
   }
 
   /**
-   * Marks this node has having a key with the given name, which will be set to the result of flattening this node and
-   * stored in the runtime grammar.
+   * Gets the limits on the size of each expansion from this core
    *
-   * @param next the key name
+   * @return the expansion limits
    */
-  void setKeyName(std::optional<std::string> key) {
-    this->keyName = std::move(key);
+  const ExpansionLimits& getExpansionLimits() const {
+    return this->expansionLimits;
   }
 
+private:
+  /** The input grammar, compiled */
+  std::shared_ptr<const CompiledGrammar> compiledGrammar;
+
+  /** The map from modifier names to modifier functions */
+  details::callback_map_t modifierFunctions;
+
+  /** How trees expanded from this core allocate their nodes */
+  NodeStorage nodeStorage;
+
+  /** The limits on the size of each expansion */
+  ExpansionLimits expansionLimits;
+};
+
+namespace details {
+/**
+ * A random number generator replaying a given sequence of draws, so that an expansion picks the alternatives it is told
+ * to. Used with tracerz::details::ReplayDistribution, which passes each draw through unchanged.
+ */
+class ReplayRNG {
+public:
+  /** The type of each draw */
+  typedef std::size_t result_type;
+
   /**
-   * Gets the key name or nothing, if it doesn't have one
+   * Gets the smallest draw
    *
-   * @return the key name or std::nullopt
+   * @return the smallest draw
    */
-  std::optional<std::string> getKeyName() const {
-    return this->keyName;
-  }
+  static constexpr result_type min() { return 0; }
 
   /**
-   * Returns true if this node is hidden
+   * Gets the largest draw
    *
-   * @return true if this node is hidden
+   * @return the largest draw
    */
-  bool isNodeHidden() const {
-    return this->isNodeHidden_;
-  }
+  static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
 
   /**
-   * Adds a modifier with the given name to this node's list of modifiers
+   * Gets the next draw to replay, or 0 once they have all been replayed
    *
-   * @param mod the name of the modifier to add
+   * @return the draw
    */
-  void addModifier(const std::string& mod) {
-    this->modifiers.push_back(mod);
+  result_type operator()() {
+    return this->next < this->draws.size() ? this->draws[this->next++] : 0;
   }
 
   /**
-   * Gets the list of modifiers to apply to this node
+   * Replaces the draws to replay, starting again from the first
    *
-   * @return the list of modifiers
+   * @param _draws the draws
    */
-  std::vector<std::string> getModifiers() const {
-    return this->modifiers;
+  void replay(const std::vector<std::size_t>& _draws) {
+    this->draws = _draws;
+    this->next = 0;
   }
 
 private:
-  /** The input string for this node. This can be any combination or none of: rules, actions, and modifiers. */
-  std::string input;
-
-  /** True if this node is complete - if it contains no rules, actions, or modifiers. */
-  bool isNodeComplete_;
-
-  /** The list of children this node has. */
-  std::vector<std::shared_ptr<TreeNode>> children;
-
-  /** A pointer to the previous leaf if this is a leaf and one exists. */
-  std::shared_ptr<TreeNode> prevLeaf;
-
-  /** A pointer to the next leaf if this is a leaf and one exists. */
-  std::shared_ptr<TreeNode> nextLeaf;
-
-  /**  A pointer to the previous unexpanded leaf if this is an unexpanded leaf and one exists. */
-  std::shared_ptr<TreeNode> prevUnexpandedLeaf;
-
-  /** A pointer to the next unexpanded leaf if this is an unexpanded leaf and one exists. */
-  std::shared_ptr<TreeNode> nextUnexpandedLeaf;
-
-  /** A key name if one has been set on this node. */
-  std::optional<std::string> keyName;
-
-  /** True if this node is hidden. */
-  bool isNodeHidden_;
+  /** The draws to replay */
+  std::vector<std::size_t> draws;
 
-  /** The list of modifiers that have been added to this node. */
-  std::vector<std::string> modifiers;
+  /** The index of the next draw */
+  std::size_t next = 0;
 };
 
 /**
- * Expands this node, processing any rules, actions, and modifiers in it, and creating child nodes for each. If the node
- * contains no such expandable elements, does nothing.
- *
- * @tparam RNG the type of the random number generator in use
- * @tparam UniformIntDistributionT the type to use to perform equal probability expansion of rules
- * @param jsonGrammar the input grammar for the tree containing this node
- * @param rng the random number generator to use
- * @param runtimeDictionary the runtime dictionary in use by the tree containing this node
+ * A uniform distribution that returns the draws of a tracerz::details::ReplayRNG as they are, which are already in range
  */
-template<typename RNG, typename UniformIntDistributionT>
-void TreeNode::expandNode(const nlohmann::json& jsonGrammar,
-                          RNG& rng,
-                          details::runtime_dictionary_t& runtimeDictionary) {
-  // If the node is complete, nothing to do
-  if (this->isNodeComplete()) return;
-
-  if (details::containsOnlyRule(this->input)) {
-    // If this node contains only a rule, get the rule name from the first capture group and the list of modifiers from
-    // the second capture group.
-    std::string ruleName = std::regex_replace(this->input,
-                                              details::getOnlyRuleRegex(),
-                                              "$1");
-    std::string modsStr = std::regex_replace(this->input,
-                                             details::getOnlyRuleRegex(),
-                                             "$2");
-
-    std::vector<std::string> mods;
-    // Split the single string representing the list of modifiers into individual strings representing a single modifier
-    // each.
-    std::for_each(std::sregex_token_iterator(modsStr.begin(),
-                                             modsStr.end(),
-                                             details::getModifierRegex(),
-                                             0),
-                  std::sregex_token_iterator(),
-        // This lambda takes in a match object, gets the string representation of the match, removes the
-        // leading dot (.) from the modifier string, and adds it to the list of modifiers
-                  [&mods](auto& mtch) {
-                    std::string modifier = mtch.str().substr(1, mtch.str().size());
-                    mods.push_back(modifier);
-                  });
-
-    // Attempt to get an expansion of the rule from the runtime grammar
-    nlohmann::json ruleContents;
-    if (runtimeDictionary.find(ruleName) != runtimeDictionary.end())
-      ruleContents = runtimeDictionary[ruleName].top();
-
-    // This will be the output of expanding the rule
-    std::string output;
+class ReplayDistribution {
+public:
+  /** The type of each value */
+  typedef std::size_t result_type;
 
-    // If ruleContents doesn't contain anything, there is no runtime definition for this rule name, attempt to get it
-    // from the input grammar
-    if (ruleContents.is_null())
-      ruleContents = jsonGrammar[ruleName];
-
-    // If the rule contents are a string, assign the output
-    if (ruleContents.is_string()) {
-      output = ruleContents;
-    }
-
-    // If the rule contents are a list, create an instance of the uniform distribution type, and use it to select
-    // a single item from the array
-    if (ruleContents.is_array()) {
-      UniformIntDistributionT dist(0, ruleContents.size() - 1);
-      output = ruleContents[dist(rng)];
-    }
-
-    // For each modifier in the list of modifiers, add it to this node's list of modifiers
-    for (auto& modifier : mods) {
-      this->addModifier(modifier);
-    }
-
-    // Create the new child node from the output
-    this->addChild(output);
-  } else if (details::containsOnlyRuleWithActions(this->input)) {
-    // If this node contains only a rule with actions, split into actions and rule, emitting a child node for each.
-    // First, get the string representing the list of actions from the first capture group
-    std::string actions = std::regex_replace(this->input,
-                                             details::getOnlyRuleWithActionsRegex(),
-                                             "$1");
-
-    // Then, get the rule name and any modifiers from the second and third capture groups.
-    std::string ruleName = std::regex_replace(this->input,
-                                              details::getOnlyRuleWithActionsRegex(),
-                                              "$2$3");
-
-    // Add a child using the extracted actions
-    this->addChild(actions);
-
-    // Add a child using the extracted rule name. Since it's been stripped of surrounding octothorpes, add then back in.
-    this->addChild("#" + ruleName + "#");
-  } else if (details::containsOnlyKeylessRuleAction(this->input)) {
-    // This node contains only a rule action, with no key being assigned. Get the rule name from the first capture group
-    std::string rule = std::regex_replace(this->input,
-                                          details::getOnlyKeylessRuleActionRegex(),
-                                          "$1");
-
-    // Add a child using the rule.
-    this->addChild(rule);
-
-    // Set to empty string so modifiers will be applied, but no key will be set
-    this->getLastExpandableChild()->keyName = "";
-  } else if (details::containsOnlyKeyWithRuleAction(this->input)) {
-    // This node contains an action which expands a rule and assigns the output to a key. First, get the key name from
-    // the first capture group.
-    std::string key = std::regex_replace(this->input,
-                                         details::getOnlyKeyWithRuleActionRegex(),
-                                         "$1");
-
-    // Then get the rule name from the second capture group.
-    std::string rule = std::regex_replace(this->input,
-                                          details::getOnlyKeyWithRuleActionRegex(),
-                                          "$2");
-
-    // Since this node is assigning to a key, its output must be suppressed. Set to hidden.
-    this->isNodeHidden_ = true;
-
-    // Create a child from the extracted rule
-    this->addChild(rule);
-
-    // Get the newly added child, and pass down the key name
-    this->children.back()->setKeyName(key);
-  } else if (details::containsOnlyKeyWithTextAction(this->input)) {
-    //   [key:text] - sets key to "text"
-    //   [key:a,b,c,...] - sets key to a list
-    // Extract the key name using the first capture group.
-    std::string key = std::regex_replace(this->input,
-                                         details::getOnlyKeyWithTextActionRegex(),
-                                         "$1");
-
-    // Extract the text or key from the second capture group
-    std::string txt = std::regex_replace(this->input,
-                                         details::getOnlyKeyWithTextActionRegex(),
-                                         "$2");
-
-    // Since this is setting a key, this node is hidden
-    this->isNodeHidden_ = true;
-
-    // Create a json array
-    nlohmann::json arr = nlohmann::json::array();
-
-    // Split the txt using the comma regex, and call the given function on each token. Note that because a single item
-    // will contain no commas, this will be called once even if no list is present.
-    std::for_each(std::sregex_token_iterator(txt.begin(),
-                                             txt.end(),
-                                             details::getCommaRegex(),
-                                             -1),
-                  std::sregex_token_iterator(),
-        // This lambda extracts the string from each match object and adds it to the json list created above.
-                  [&arr](auto& mtch) {
-                    arr.push_back(mtch.str());
-                  });
+  /**
+   * Creates the distribution, ignoring its range
+   */
+  ReplayDistribution(std::size_t, std::size_t) {}
 
-    // Set the key in the runtime dictionary to the json array
-    runtimeDictionary[key].push(arr);
-  } else if (details::containsOnlyActions(this->input)) {
-    // This node contains only one or more actions.
-    // Action types:
-    //   [#text#] - calls a function, essentially, by expanding a rule
-    //   [key:#text#] - sets key to expansion of #text#
-    //   [key:text] - sets key to "text"
-    //   [key:a,b,c,...] - sets key to a list
-
-    // For each action string, add a child to this node representing a single action
-    std::for_each(std::sregex_token_iterator(this->input.begin(),
-                                             this->input.end(),
-                                             details::getActionRegex(),
-                                             0),
-                  std::sregex_token_iterator(),
-                  [this](auto& mtch) {
-                    auto action = mtch.str();
-                    // Ignore empty tokens, add action with []
-                    if (!action.empty()) {
-                      this->addChild(action);
-                    }
-                  });
-  } else {
-    // This node represents some mix of strings, use the rule regex to separate it into strings representing rules and
-    // strings representing non-rules. For each of those, add a child to this node with it as an input string.
-    std::for_each(std::sregex_token_iterator(this->input.begin(),
-                                             this->input.end(),
-                                             details::getRuleRegex(),
-                                             {-1, 0}),
-                  std::sregex_token_iterator(),
-                  [this](auto& mtch) {
-                    if (!mtch.str().empty()) {
-                      this->addChild(mtch.str());
-                    }
-                  });
+  /**
+   * Gets the next draw of the generator
+   *
+   * @tparam RNG the type of the random number generator
+   * @param rng the random number generator
+   * @return the draw
+   */
+  template<typename RNG>
+  result_type operator()(RNG& rng) {
+    return static_cast<result_type>(rng());
   }
-
-  // Remove this node from the linked list of unexpanded leaves, if applicable
-  if (this->prevUnexpandedLeaf)
-    this->prevUnexpandedLeaf->nextUnexpandedLeaf = this->nextUnexpandedLeaf;
-  if (this->nextUnexpandedLeaf)
-    this->nextUnexpandedLeaf->prevUnexpandedLeaf = this->prevUnexpandedLeaf;
-}
+};
+} // End namespace details
 
 /**
- * Represents a partially or fully constructed parse tree. Maintains two linked list heads for indexing into the tree:
- * one for the first leaf and the other for the first unexpanded leaf. Also provides methods to expand nodes and flatten
- * the tree into a single output string.
+ * The distinct expansions of an input string with a shared tracerz::GrammarCore, expanded by index. Every index in
+ * `[0, size())` stands for a different way to pick the alternatives of the rules the input expands, see
+ * tracerz::CompiledGrammar::countExpansions, so expanding each index once never repeats an expansion. Alternatives
+ * that are equal, or add up to the same text, still give equal output. Expansion limits are not applied.
+ *
+ * An index is turned into the draws picking its alternatives from the counts of the compiled rules, which are then
+ * replayed by a tracerz::details::StreamingExpander of its own. Enumerators are not thread safe; create one per thread.
  */
-class Tree : public std::enable_shared_from_this<Tree> {
+class Enumerator {
 public:
   /**
-   * Creates a new input tree rooted with the given input string, using the given grammar.
+   * Creates an enumerator of the expansions of the given input string
    *
-   * @param input the input string to construct the tree from
-   * @param grammar the grammar to use to construct the tree
+   * @param _core the grammar core to expand from
+   * @param _input the input string to expand
+   * @throws std::invalid_argument if an action can be reached from the input
+   * @throws std::length_error if the input can recurse, or has `UINT64_MAX` or more expansions
    */
-  Tree(const std::string& input,
-       const nlohmann::json& grammar)
-      : leafIndex(new TreeNode)
-      , unexpandedLeafIndex(new TreeNode)
-      , root(new TreeNode(input))
-      , nextUnexpandedLeaf(nullptr)
-      , jsonGrammar(grammar) {
-    // Insert the root at the beginning of the leaf linked list, after the head
-    this->root->setPrevLeaf(this->leafIndex);
-    this->leafIndex->setNextLeaf(this->root);
-
-    // If the node is not complete, add it after the head of the unexpanded leaf linked list
-    if (!this->root->isNodeComplete()) {
-      this->unexpandedLeafIndex->setNextUnexpandedLeaf(this->root);
-      this->root->setPrevUnexpandedLeaf(this->unexpandedLeafIndex);
+  Enumerator(std::shared_ptr<const GrammarCore> _core, std::string _input)
+      : core(std::move(_core))
+      , input(std::move(_input))
+      , compiledInput(details::compileNode(this->input))
+      , count(this->core->getCompiledGrammar()->countExpansions(*this->compiledInput))
+      , expander(this->core->getCompiledGrammar(), this->core->getModifierFunctions(), this->rng) {
+    if (this->count == 0) {
+      throw std::invalid_argument("tracerz: the expansions of an input that can reach an action can't be enumerated");
+    }
+    if (this->count == std::numeric_limits<std::uint64_t>::max()) {
+      throw std::length_error("tracerz: the input has too many expansions to enumerate");
     }
   }
 
+  /** The expander refers to this enumerator's members, so enumerators cannot be copied */
+  Enumerator(const Enumerator&) = delete;
+  Enumerator& operator=(const Enumerator&) = delete;
+
   /**
-   * Expands the next unexpanded node, depth-first.
+   * Gets the number of distinct expansions of the input
    *
-   * @tparam RNG the type of the random number generator
-   * @tparam UniformIntDistributionT the type of the equal probability distribution
-   * @param modFuns the map of modifier names to functions
-   * @param rng the random number generator
-   * @return true if there is still at least one unexpanded node
+   * @return the number of expansions
    */
-  template<typename RNG, typename UniformIntDistributionT>
-  bool expand(const details::callback_map_t& modFuns, RNG& rng) {
-    // Get the leftmost unexpanded leaf
-    auto next = this->unexpandedLeafIndex->getNextUnexpandedLeaf();
-
-    // Return false if the tree is already fully expanded
-    if (!next) return false;
-
-    // Push it onto the stack of nodes currently being expanded
-    this->expandingNodes.push(next);
-
-    // Expand the node
-    next->expandNode<RNG, UniformIntDistributionT>(this->jsonGrammar,
-                                                   rng,
-                                                   this->runtimeDictionary);
-
-    // If the node has no children awaiting expansion
-    if (next->areChildrenComplete()) {
-      // Save and pop the top node off the stack
-      auto poppedNode = this->expandingNodes.top();
-      this->expandingNodes.pop();
+  std::uint64_t size() const {
+    return this->count;
+  }
 
-      // Check if it has a key name
-      if (poppedNode->getKeyName()) {
-        // If so, get it
-        std::string key = *poppedNode->getKeyName();
+  /**
+   * Expands the input with the alternatives of the given index, appending the output to the given sink
+   *
+   * @tparam Sink the type of the sink
+   * @param index the index of the expansion, in `[0, size())`
+   * @param sink the sink to append the output to
+   * @throws std::out_of_range if the index is out of range
+   */
+  template<typename Sink>
+  void generate(std::uint64_t index, Sink& sink) {
+    if (index >= this->count) throw std::out_of_range("tracerz: expansion index out of range");
+    this->draws.clear();
+    this->unrank(*this->compiledInput, index);
+    this->rng.replay(this->draws);
+    this->expander.generate(this->input, sink, this->core->getNodeStorage());
+  }
 
-        // Flatten the subtree to get the value of the key
-        std::string value = poppedNode->flatten(modFuns, this->shared_from_this(), false);
+  /**
+   * Expands the input with the alternatives of the given index into a single output string
+   *
+   * @param index the index of the expansion, in `[0, size())`
+   * @return the output string
+   * @throws std::out_of_range if the index is out of range
+   */
+  std::string generate(std::uint64_t index) {
+    std::string output;
+    this->generate(index, output);
+    return output;
+  }
 
-        // Set the key in the runtime grammar
-        if (!key.empty()) this->runtimeDictionary[key].push(value);
+private:
+  /**
+   * Appends the draws picking the alternatives of the expansion of the given node with the given index, in the order
+   * they are drawn as the node is expanded leftmost first. The index of a node with several parts is split between them
+   * with the first part varying fastest.
+   *
+   * @param node the compiled node
+   * @param index the index of its expansion, less than its number of expansions
+   */
+  void unrank(const details::CompiledNode& node, std::uint64_t index) {
+    const CompiledGrammar& grammar = *this->core->getCompiledGrammar();
+    if (node.type == details::NodeType::Mixed) {
+      for (auto& child : node.children) {
+        std::uint64_t childCount = grammar.countExpansions(*child);
+        this->unrank(*child, index % childCount);
+        index /= childCount;
       }
+      return;
+    }
+    if (node.type != details::NodeType::Rule) return;
 
-      // Keep going if there are other nodes we were expanding
-      bool shouldContinue = !this->expandingNodes.empty();
-      while (shouldContinue) {
-        // Peek at the top of the stack
-        auto newTop = this->expandingNodes.top();
-
-        // If newTop's last expandable child is equal to the previously popped node, then newTop is also finished
-        // expanding.
-        if (newTop->getLastExpandableChild() == poppedNode) {
-          // Rotate newTop to poppedNode
-          poppedNode = newTop;
+    const CompiledRule* rule = grammar.getRule(node.nameId);
+    if (rule == nullptr || rule->alternatives.empty()) return;
+    if (!rule->isList) {
+      this->unrank(*rule->alternatives.front(), index);
+      return;
+    }
 
-          // Remove the top of the stack
-          this->expandingNodes.pop();
+    // Find the alternative the index falls in, and the first draw picking it
+    const std::vector<std::size_t>* firstDraws = nullptr;
+    if (!rule->weights.empty()) {
+      auto iter = this->firstDraws.find(rule);
+      if (iter == this->firstDraws.end()) iter = this->firstDraws.emplace(rule, rule->weights.getFirstDraws()).first;
+      firstDraws = &iter->second;
+    }
+    for (std::size_t i = 0; i < rule->alternatives.size(); i++) {
+      if (firstDraws != nullptr && (*firstDraws)[i] == rule->weights.range()) continue;
+      std::uint64_t alternativeCount = grammar.countExpansions(*rule->alternatives[i]);
+      if (index >= alternativeCount) {
+        index -= alternativeCount;
+        continue;
+      }
+      this->draws.push_back(firstDraws != nullptr ? (*firstDraws)[i] : i);
+      this->unrank(*rule->alternatives[i], index);
+      return;
+    }
+  }
 
-          // If there are still nodes in the stack, keep looking
-          shouldContinue = !this->expandingNodes.empty();
+  /** The shared grammar core */
+  std::shared_ptr<const GrammarCore> core;
 
-          // Check if the poppedNode has a key name
-          if (poppedNode->getKeyName()) {
-            // If so, get it.
-            std::string key = *poppedNode->getKeyName();
+  /** The input string */
+  std::string input;
 
-            // Flatten the subtree to get the value of the key
-            std::string value = poppedNode->flatten(modFuns, this->shared_from_this(), false);
+  /** The compiled input */
+  std::shared_ptr<const details::CompiledNode> compiledInput;
 
-            // Set the key in the runtime grammar
-            this->runtimeDictionary[key].push(value);
-          }
-        } else {
-          // poppedNode is not the last expandable child of newTop. There are still more children to expand, so we can
-          // stop examining the stack.
-          shouldContinue = false;
-        }
-      }
-    }
+  /** The number of distinct expansions of the input */
+  std::uint64_t count;
 
-    // Return true if there are still nodes to expand
-    return this->unexpandedLeafIndex->hasNextUnexpandedLeaf();
-  }
+  /** Replays the draws of the expansion being generated */
+  details::ReplayRNG rng;
 
-  /**
-   * Expand the tree in a breadth-first manner.
-   *
-   * @tparam RNG the type of the random number generator
-   * @param rng the random number generator
-   * @return true if there are still unexpanded nodes
-   */
-  template<typename RNG>
-  bool expandBF(RNG& rng) {
-    // If the pointer to the next unexpanded leaf is null
-    if (!this->nextUnexpandedLeaf) {
-      // But the unexpanded leaf linked list is not empty
-      if (this->unexpandedLeafIndex->hasNextUnexpandedLeaf()) {
-        // Then start at the beginning of the linked list
-        this->nextUnexpandedLeaf = this->unexpandedLeafIndex->getNextUnexpandedLeaf();
-      } else {
-        // If the linked list is also empty, the tree is fully expanded
-        return false;
-      }
-    }
+  /** The draws of the expansion being generated, reused between expansions */
+  std::vector<std::size_t> draws;
 
-    // Get the next unexpanded leaf
-    std::shared_ptr<TreeNode> next = this->nextUnexpandedLeaf->getNextUnexpandedLeaf();
+  /** The first draw picking each alternative of the weighted rules expanded so far, see details::AliasTable */
+  std::map<const CompiledRule*, std::vector<std::size_t>> firstDraws;
 
-    // Expand the current unexpanded leaf
-    this->nextUnexpandedLeaf->expandNode(this->jsonGrammar,
-                                         rng,
-                                         this->runtimeDictionary);
+  /** The expander, holding the scratch buffers reused between expansions */
+  details::StreamingExpander<details::ReplayRNG, details::ReplayDistribution> expander;
+};
 
-    // Update the cursor
-    this->nextUnexpandedLeaf = next;
+/**
+ * A lightweight handle for expanding input strings using a shared tracerz::GrammarCore. Each generator owns its random
+ * number generator and the scratch buffers used while expanding, which are reused from one expansion to the next.
+ * Generators are not thread safe themselves; create one per thread.
+ *
+ * @tparam RNG the type of the random number generator to use
+ * @tparam UniformIntDistributionT the type of the uniform distribution to use
+ */
+template<typename RNG = Xoshiro256StarStar,
+    typename UniformIntDistributionT = BoundedIntDistribution<>>
+class Generator {
+public:
+  /** Make the underlying RNG type accessible */
+  typedef RNG rng_t;
 
-    // Return true since there are unexpanded leaves
-    return true;
-  }
+  /** Make the underlying uniform distribution type accessible */
+  typedef UniformIntDistributionT uniform_distribution_t;
 
   /**
-   * Gets the current leftmost leaf of the tree.
+   * Creates a new generator from the given parameters
    *
-   * @return the current leftmost leaf of the tree
+   * @param _core the grammar core to expand from
+   * @param _rng the random number generator to use
    */
-  std::shared_ptr<TreeNode> getFirstLeaf() const {
-    return this->leafIndex->getNextLeaf();
+  Generator(std::shared_ptr<const GrammarCore> _core, RNG _rng)
+      : core(std::move(_core))
+      , rng(std::move(_rng))
+      , expander(this->core->getCompiledGrammar(),
+                 this->core->getModifierFunctions(),
+                 this->rng,
+                 this->core->getExpansionLimits()) {
   }
 
+  /** The expander refers to this generator's members, so generators cannot be copied */
+  Generator(const Generator&) = delete;
+  Generator& operator=(const Generator&) = delete;
+
   /**
-   * Gets the leftmost unexpanded leaf of the tree.
+   * Expands the given input string, appending the output straight to the given sink. See tracerz::Grammar::generate.
    *
-   * @return the leftmost unexpanded leaf of the tree
+   * @tparam Sink the type of the sink
+   * @param input the input string to expand
+   * @param sink the sink to append the output to
    */
-  std::shared_ptr<TreeNode> getFirstUnexpandedLeaf() const {
-    return this->unexpandedLeafIndex->getNextUnexpandedLeaf();
+  template<typename Sink>
+  void generate(const std::string& input, Sink& sink) {
+    this->expander.generate(input, sink, this->core->getNodeStorage());
   }
 
   /**
-   * Gets the root of the tree.
+   * Expands the given input string into a single output string
    *
-   * @return the root of the tree
+   * @param input the input string to expand
+   * @return the output string
    */
-  std::shared_ptr<TreeNode> getRoot() const { return this->root; }
+  std::string generate(const std::string& input) {
+    std::string output;
+    this->generate(input, output);
+    return output;
+  }
 
   /**
-   * Flatten the tree into a single output string, based on the given input.
+   * Expands the given input string into up to `count` samples with distinct output. Uniqueness is on the exact output:
+   * no two samples returned are equal strings, and hashes of the output only pick the samples it is compared with.
    *
-   * @param modFuns the map of modifier names to functions to use
-   * @param ignoreHidden if true, hidden nodes will not be included in the output
-   * @param ignoreMods if true, no modifiers will be applied
-   * @return the flattened output string
+   * The alternatives picked by the expansions are followed through a trie of those seen before, see
+   * tracerz::details::PickTrie. An expansion whose picks can only lead to an expansion seen before is abandoned as soon
+   * as it makes the pick that decides so, without expanding or comparing the rest of it, and sampling stops once every
+   * expansion has been seen. Expansions that picked different alternatives but add up to the same text are only told
+   * apart by their output. The output of an input expanded into a tree, for a tree or tree node modifier, is always
+   * expanded in full.
+   *
+   * If the expansions of the input can be counted and there are no more than `count`, and no expansion limits are set,
+   * every one of them is enumerated instead, see tracerz::Enumerator, and the distinct outputs returned in the order of
+   * their first indices. Otherwise sampling also stops early once `maxDuplicates` expansions in a row have all been seen
+   * before, since the input is then unlikely to have more.
+   *
+   * @param input the input string to expand
+   * @param count the number of samples
+   * @param maxDuplicates the number of duplicates in a row after which sampling stops
+   * @return the samples, fewer than `count` if the input ran out of expansions
    */
-  std::string flatten(details::callback_map_t modFuns,
-                      bool ignoreHidden = true,
-                      bool ignoreMods = false) {
-    // Forward the call to the root of the tree
-    return this->root->flatten(std::move(modFuns), this->shared_from_this(), ignoreHidden, ignoreMods);
+  std::vector<std::string> generateUnique(const std::string& input,
+                                          std::size_t count,
+                                          std::size_t maxDuplicates = 1000) {
+    std::vector<std::string> samples;
+    std::unordered_multimap<std::size_t, std::size_t> sampleHashes;
+
+    // Adds the output to the samples unless an equal sample is already there
+    auto addSample = [&samples, &sampleHashes](const std::string& output) {
+      std::size_t hash = std::hash<std::string>()(output);
+      auto [first, last] = sampleHashes.equal_range(hash);
+      for (auto iter = first; iter != last; ++iter) {
+        if (samples[iter->second] == output) return false;
+      }
+      sampleHashes.emplace(hash, samples.size());
+      samples.push_back(output);
+      return true;
+    };
+
+    std::uint64_t expansions = this->core->getCompiledGrammar()->countExpansions(input);
+    if (expansions != 0 && expansions <= count &&
+        !details::ExpansionBudget(this->core->getExpansionLimits()).hasLimits()) {
+      Enumerator enumerator(this->core, input);
+      std::size_t reserve = static_cast<std::size_t>(std::min<std::uint64_t>(expansions, uniqueReserveLimit));
+      samples.reserve(reserve);
+      sampleHashes.reserve(reserve);
+      for (std::uint64_t i = 0; i < expansions; i++) addSample(enumerator.generate(i));
+      return samples;
+    }
+
+    // The count may be far more than there are expansions, so only reserve what can be expected
+    std::size_t reserve = std::min(count, uniqueReserveLimit);
+    if (expansions != 0) reserve = static_cast<std::size_t>(std::min<std::uint64_t>(reserve, expansions));
+    samples.reserve(reserve);
+    sampleHashes.reserve(reserve);
+    details::PickTrie paths;
+    std::string& output = this->streamBuffer;
+    std::size_t duplicates = 0;
+    while (samples.size() < count && duplicates < maxDuplicates && !paths.isExhausted()) {
+      output.clear();
+      this->expander.generate(input, output, this->core->getNodeStorage(), &paths);
+
+      // An expansion that reached the end of a path seen before repeats it without its output being compared
+      bool isNew = !this->expander.isPathRepeated() &&
+                   (this->expander.lastNeededTree() || paths.finishPath()) &&
+                   addSample(output);
+      duplicates = isNew ? 0 : duplicates + 1;
+    }
+    return samples;
   }
 
-  details::runtime_dictionary_t& getRuntimeDictionary() { return this->runtimeDictionary; }
+  /**
+   * The output of one expansion by a generator, pulled a chunk at a time as the input is expanded leftmost first. A
+   * chunk is returned as soon as everything before it in the output is final, so only the output of a rule with
+   * modifiers, a key capture or a memoized expansion is held back, until the rule is finished. An input from which a
+   * tree or tree node modifier can be reached is expanded into a tree at once, and output as a single chunk.
+   *
+   * The stream expands with its generator's random number generator and scratch buffers, so the chunks add up to the
+   * same output as generate() would have given. The generator must not be used for anything else while the stream is
+   * being read, and must outlive it. Destroying a stream before its last chunk abandons the rest of the expansion.
+   */
+  class Stream {
+  public:
+    /** Iterates over the chunks of a stream, reading the next one each time it is incremented */
+    class iterator {
+    public:
+      /** Make the iterator usable with standard algorithms */
+      typedef std::input_iterator_tag iterator_category;
+      typedef std::string_view value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const std::string_view* pointer;
+      typedef const std::string_view& reference;
+
+      /**
+       * Creates the iterator past the last chunk of any stream
+       */
+      iterator() : stream(nullptr) {}
+
+      /**
+       * Gets the current chunk, valid until the iterator is incremented
+       *
+       * @return the current chunk
+       */
+      reference operator*() const { return this->chunk; }
+
+      /**
+       * Gets the current chunk, valid until the iterator is incremented
+       *
+       * @return a pointer to the current chunk
+       */
+      pointer operator->() const { return &this->chunk; }
+
+      /**
+       * Reads the next chunk of the stream
+       *
+       * @return this iterator
+       */
+      iterator& operator++() {
+        if (!this->stream->next(this->chunk)) this->stream = nullptr;
+        return *this;
+      }
 
-private:
-  /** Points to the leftmost leaf of the tree */
-  std::shared_ptr<TreeNode> leafIndex;
+      /**
+       * Compares two iterators, which are equal if both are past the last chunk or both iterate over the same stream
+       */
+      bool operator==(const iterator& other) const { return this->stream == other.stream; }
+
+      /**
+       * Compares two iterators, see operator==
+       */
+      bool operator!=(const iterator& other) const { return this->stream != other.stream; }
+
+    private:
+      friend class Stream;
+
+      /**
+       * Creates an iterator over the given stream, reading its next chunk
+       *
+       * @param _stream the stream
+       */
+      explicit iterator(Stream* _stream) : stream(_stream) { ++*this; }
+
+      /** The stream, or nullptr past its last chunk */
+      Stream* stream;
+
+      /** The current chunk */
+      std::string_view chunk;
+    };
+
+    /**
+     * Reads the next chunk of output, continuing the expansion until there is one
+     *
+     * @param chunk set to the next chunk, valid until the next call
+     * @return true if a chunk was read, false if the output is finished
+     */
+    bool next(std::string_view& chunk) {
+      if (this->pending) {
+        this->pending = false;
+        chunk = this->generator->streamBuffer;
+        return true;
+      }
+      std::string& buffer = this->generator->streamBuffer;
+      buffer.clear();
+      while (buffer.empty() && this->expanding) {
+        this->expanding = this->generator->expander.advance(buffer);
+      }
+      chunk = buffer;
+      return !buffer.empty();
+    }
 
-  /** Points to the leftmost unexpanded leaf */
-  std::shared_ptr<TreeNode> unexpandedLeafIndex;
+    /**
+     * Returns true once the expansion is finished. Chunks may remain to be read if the last was not read yet, see next.
+     *
+     * @return true if the expansion is finished
+     */
+    bool isFinished() const {
+      return !this->expanding;
+    }
 
-  /** The root of the tree */
-  std::shared_ptr<TreeNode> root;
+    /**
+     * Gets an iterator reading the next chunk of this stream
+     *
+     * @return the iterator
+     */
+    iterator begin() {
+      return iterator(this);
+    }
 
-  /** Points to the current node to expand for breadth-first expansion */
-  std::shared_ptr<TreeNode> nextUnexpandedLeaf;
+    /**
+     * Gets the iterator past the last chunk of this stream
+     *
+     * @return the iterator
+     */
+    iterator end() {
+      return iterator();
+    }
 
-  /** The input grammar */
-  const nlohmann::json& jsonGrammar;
+  private:
+    friend class Generator;
+
+    /**
+     * Starts expanding the given input with the given generator
+     *
+     * @param _generator the generator
+     * @param input the input string to expand
+     */
+    Stream(Generator& _generator, const std::string& input)
+        : generator(&_generator) {
+      std::string& buffer = this->generator->streamBuffer;
+      buffer.clear();
+      this->expanding = this->generator->expander.startGenerating(input, buffer,
+                                                                  this->generator->core->getNodeStorage());
+      this->pending = !buffer.empty();
+    }
 
-  /** The runtime grammar, consisting of keys created while expanding the tree with the input grammar. */
-  details::runtime_dictionary_t runtimeDictionary;
+    /** The generator expanding the input, which holds the current chunk */
+    Generator* generator;
 
-  /** A stack of nodes currently being expanded by the depth-first expansion */
-  std::stack<std::shared_ptr<TreeNode>> expandingNodes;
-};
+    /** True while the expansion is not finished */
+    bool expanding;
 
-/**
- * Gets the base extended modifiers. Currently, this is only `pop!!`, a tree modifier that pops the top ruleset off of a
- * given rule stack.
- *
- * @return the base extended modifiers
- */
-const details::callback_map_t& getBaseExtendedModifiers() {
-  static auto wrap = [](const std::function<std::string(const std::shared_ptr<Tree>&, const std::string&)> fun) {
-    std::shared_ptr<details::IModifierFn> ptr(
-        new details::ModifierFn<const std::shared_ptr<Tree>&, const std::string&>(fun));
-    return ptr;
+    /** True if the output of a tree was appended to the buffer when the stream started, and not read yet */
+    bool pending;
   };
 
-  static details::callback_map_t baseMods;
+  /**
+   * Starts expanding the given input string, returning a stream to read its output from chunk by chunk
+   *
+   * @param input the input string to expand
+   * @return the stream of output chunks
+   */
+  Stream stream(const std::string& input) {
+    return Stream(*this, input);
+  }
+
+  /**
+   * Gets this generator's random number generator
+   *
+   * @return this generator's random number generator
+   */
+  RNG& getRNG() {
+    return this->rng;
+  }
 
-  // Already initialized
-  if (!baseMods.empty()) return baseMods;
+  /**
+   * Gets the grammar core this generator expands from
+   *
+   * @return the grammar core
+   */
+  const std::shared_ptr<const GrammarCore>& getCore() const {
+    return this->core;
+  }
 
-  // Pops the top rule off the rule stack for the given ruleName in the given tree's runtime dictionary
-  baseMods["pop!!"] = wrap([](const std::shared_ptr<Tree>& tree, const std::string& ruleName) {
-    // Get the runtime dictionary
-    details::runtime_dictionary_t& runtimeDictionary = tree->getRuntimeDictionary();
+private:
+  /** The shared grammar core */
+  std::shared_ptr<const GrammarCore> core;
 
-    // If there's a matching rule and its stack isn't empty...
-    if (runtimeDictionary.find(ruleName) != runtimeDictionary.end() && !runtimeDictionary[ruleName].empty()) {
-      // Pop the top ruleset off the rulet stack
-      runtimeDictionary[ruleName].pop();
+  /** The random number generator */
+  RNG rng;
 
-      // If this causes the rule stack to become empty, delete the entry from the runtime dictionary
-      if (runtimeDictionary[ruleName].empty()) {
-        runtimeDictionary.erase(ruleName);
-      }
-    }
+  /** The expander, holding the scratch buffers reused between expansions */
+  details::StreamingExpander<RNG, UniformIntDistributionT> expander;
 
-    // Return the empty string
-    return "";
-  });
+  /** The current chunk of the stream being read, reused between streams */
+  std::string streamBuffer;
 
-  return baseMods;
-}
+  /** The greatest number of samples generateUnique() reserves room for up front */
+  static constexpr std::size_t uniqueReserveLimit = 4096;
+};
 
+namespace details {
 /**
- * Gets the set of base english modifiers, as defined by galaxykate's tracery
+ * Holds an object that refers to members of the object owning the holder, such as an expander referring to the random
+ * number generator of a grammar. Copying or moving the owner leaves the new holder empty, since the held object would
+ * still refer to the members of the original.
  *
- * @return a map of the names of the modifiers to functions
+ * @tparam T the type of the held object
  */
-const details::callback_map_t& getBaseEngModifiers() {
-  // Wraps a function in a shared_ptr to a ModifierFn object and returns it
-  static auto wrap = [](const std::function<std::string(const std::string&)>& fun) {
-    std::shared_ptr<details::IModifierFn> ptr(new details::ModifierFn<const std::string&>(fun));
-    return ptr;
-  };
-
-  // Defines the map
-  static details::callback_map_t baseMods;
-
-  // Helper function returning true if the character is a vowel
-  static auto isVowel = [](char letter) {
-    char lower = tolower(letter);
-    return (lower == 'a') || (lower == 'e') ||
-           (lower == 'i') || (lower == 'o') ||
-           (lower == 'u');
-  };
-
-  // Helper function returning true if the character is alphanumeric
-  static auto isAlphaNum = [](char chr) {
-    return ((chr >= 'a' && chr <= 'z') ||
-            (chr >= 'A' && chr <= 'Z') ||
-            (chr >= '0' && chr <= '9'));
-  };
-
-  // If baseMods isn't empty, then it's already been created. Return it.
-  if (!baseMods.empty()) return baseMods;
+template<typename T>
+class OwnerBound {
+public:
+  OwnerBound() = default;
 
-  // "a" adds an "a" or "an" to the beginning of a string, as appropriate
-  baseMods["a"] = wrap([](const std::string& input) {
-    if (input.empty()) return input;
+  OwnerBound(const OwnerBound&) {}
 
-    if (input.size() > 2) {
-      if (tolower(input[0]) == 'u' &&
-          tolower(input[2]) == 'i') {
-        return "a " + input;
-      }
-    }
+  OwnerBound(OwnerBound&&) noexcept {}
 
-    if (isVowel(input[0])) {
-      return "an " + input;
-    }
+  OwnerBound& operator=(const OwnerBound&) {
+    this->value.reset();
+    return *this;
+  }
 
-    return "a " + input;
-  });
+  OwnerBound& operator=(OwnerBound&&) noexcept {
+    this->value.reset();
+    return *this;
+  }
 
-  // "capitalizeAll" capitalizes the first character of every word of a string
-  baseMods["capitalizeAll"] = wrap([](const std::string& input) {
-    std::string ret;
-    bool capNext = true;
+  /**
+   * Gets the held object
+   *
+   * @return the held object, or nullptr if there is none
+   */
+  T* get() const { return this->value.get(); }
 
-    for (char chr : input) {
-      if (isAlphaNum(chr)) {
-        if (capNext) {
-          ret += (char) toupper(chr);
-          capNext = false;
-        } else {
-          ret += chr;
-        }
-      } else {
-        capNext = true;
-        ret += chr;
-      }
-    }
+  /**
+   * Replaces the held object with one constructed from the given arguments
+   *
+   * @param args the arguments to construct the object with
+   * @return the new object
+   */
+  template<typename... Args>
+  T& emplace(Args&&... args) {
+    this->value.reset(new T(std::forward<Args>(args)...));
+    return *this->value;
+  }
 
-    return ret;
-  });
+  /**
+   * Destroys the held object, if there is one
+   */
+  void reset() { this->value.reset(); }
 
-  // "capitalize" capitalizes the first character of the input string
-  baseMods["capitalize"] = wrap([](const std::string& input) {
-    std::string ret = input;
-    ret[0] = toupper(ret[0]);
-    return ret;
-  });
-
-  // "s" pluralizes the input string based on the end of the string
-  baseMods["s"] = wrap([](const std::string& input) {
-    switch (input.back()) {
-      case 's':
-        return input + "es";
-      case 'h':
-        return input + "es";
-      case 'x':
-        return input + "es";
-      case 'y':
-        if (isVowel(input[input.size() - 2]))
-          return input + "s";
-        else
-          return input.substr(0, input.size() - 1) + "ies";
-      default:
-        return input + "s";
-    }
-  });
-
-  // "ed" makes a verb past tense based on the end of the input string
-  baseMods["ed"] = wrap([](const std::string& input) {
-    switch (input.back()) {
-      case 's':
-        return input + "ed";
-      case 'e':
-        return input + "d";
-      case 'h':
-        return input + "ed";
-      case 'x':
-        return input + "ed";
-      case 'y':
-        if (isVowel(input[input.size() - 2]))
-          return input + "d"; // TODO: this seems incorrect
-        else
-          return input.substr(0, input.size() - 1) + "ied";
-      default:
-        return input + "ed";
-    }
-  });
-
-  // "replace" is a parametric modifier that takes two parameters when used: a & b. It replaces all ocurrences of a in
-  // the input string with b
-  baseMods["replace"] =
-      std::shared_ptr<details::IModifierFn>(new details::ModifierFn<const std::string&,
-          const std::string&, const std::string&>([](const std::string& input,
-                                                     const std::string& target,
-                                                     const std::string& replacement) {
-        return std::regex_replace(input,
-                                  std::regex(target),
-                                  replacement);
-      }));
-
-  // Return the map
-  return baseMods;
-}
+private:
+  /** The held object, or nullptr if there is none */
+  std::unique_ptr<T> value;
+};
+} // End namespace details
 
 /**
  * Represents a grammar, based on a given input grammar, using a given random number generator and uniform distribution
  * type.
  *
+ * The instrumentation policy records each sample generated by generate() and flatten(), see tracerz::Profiler. Trees,
+ * generators and batches created by the grammar are not instrumented. With the default tracerz::NoInstrumentation,
+ * nothing is recorded and the instrumentation is compiled out.
+ *
  * @tparam RNG the type of the random number generator to use
  * @tparam UniformIntDistributionT the type of the uniform distribution to use
+ * @tparam Instrumentation the instrumentation policy
  */
-template<typename RNG = std::mt19937,
-    typename UniformIntDistributionT = std::uniform_int_distribution<>>
+template<typename RNG = Xoshiro256StarStar,
+    typename UniformIntDistributionT = BoundedIntDistribution<>,
+    typename Instrumentation = NoInstrumentation>
 class Grammar {
 public:
   /** Make the underlying RNG type accessible */
@@ -1676,16 +8828,62 @@ public:
   /** Make the underlying uniform distribution type accessible */
   typedef UniformIntDistributionT uniform_distribution_t;
 
+  /** Make the instrumentation policy accessible */
+  typedef Instrumentation instrumentation_t;
+
+#ifndef TRACERZ_NO_JSON
   /**
    * Creates a new grammar from the given parameters.
    *
    * @param grammar the input grammar
    * @param _rng the random number generator to use
    */
-  explicit Grammar(nlohmann::json grammar = "{}"_json,
-                   RNG _rng = RNG(time(nullptr)))
-      : jsonGrammar(std::move(grammar))
-      , rng(_rng) {
+  explicit Grammar(const nlohmann::json& grammar = "{}"_json,
+                   RNG _rng = details::makeDefaultRNG<RNG>())
+      : compiledGrammar(std::make_shared<const CompiledGrammar>(grammar))
+      , rng(_rng)
+      , nodeStorage(NodeStorage::Heap) {
+  }
+#endif
+
+  /**
+   * Creates a new grammar from the given grammar source, see tracerz::CompiledGrammar
+   *
+   * @tparam GrammarSource the type of the grammar source
+   * @param source the grammar source
+   * @param _rng the random number generator to use
+   */
+  template<typename GrammarSource,
+           typename = decltype(std::declval<const GrammarSource&>().forEachRule(
+               std::declval<void (*)(const std::string&, const RuleDefinition&)>()))>
+  explicit Grammar(const GrammarSource& source,
+                   RNG _rng = details::makeDefaultRNG<RNG>())
+      : compiledGrammar(std::make_shared<const CompiledGrammar>(source))
+      , rng(_rng)
+      , nodeStorage(NodeStorage::Heap) {
+  }
+
+  /**
+   * Creates a new grammar from an already compiled grammar, eg. one loaded with tracerz::CompiledGrammar::fromBinary or
+   * compiled from another grammar source.
+   *
+   * @param grammar the compiled input grammar
+   * @param _rng the random number generator to use
+   */
+  explicit Grammar(std::shared_ptr<const CompiledGrammar> grammar,
+                   RNG _rng = details::makeDefaultRNG<RNG>())
+      : compiledGrammar(std::move(grammar))
+      , rng(_rng)
+      , nodeStorage(NodeStorage::Heap) {
+  }
+
+  /**
+   * Gets the compiled input grammar
+   *
+   * @return the compiled input grammar
+   */
+  const std::shared_ptr<const CompiledGrammar>& getCompiledGrammar() const {
+    return this->compiledGrammar;
   }
 
   /**
@@ -1695,7 +8893,7 @@ public:
    * @return the tree with that root
    */
   std::shared_ptr<Tree> getTree(const std::string& input) const {
-    std::shared_ptr<Tree> tree(new Tree(input, this->jsonGrammar));
+    std::shared_ptr<Tree> tree(new Tree(input, this->compiledGrammar, this->nodeStorage, this->expansionLimits));
     return tree;
   }
 
@@ -1729,7 +8927,8 @@ public:
    */
   void addModifier(const std::string& name,
                    std::shared_ptr<details::IModifierFn> mod) {
-    this->modifierFunctions[name] = std::move(mod);
+    this->modifierFunctions.insert_or_assign(name, std::move(mod));
+    this->expander.reset();
   }
 
   /**
@@ -1746,6 +8945,19 @@ public:
     this->addModifier(name, fptr);
   }
 
+  /**
+   * Adds a string modifier that modifies its input in place to this grammar. A rule's output is modified in one
+   * buffer, so chained in place modifiers don't copy it.
+   *
+   * @tparam F the type of the modifier function, taking a `std::string&`
+   * @param name the name of the modifier
+   * @param fun the modifier function
+   */
+  template<typename F>
+  void addInPlaceModifier(const std::string& name, F fun) {
+    this->addModifier(name, details::makeInPlaceStringModifier(std::move(fun)));
+  }
+
   /**
    * Returns the map of modifier names to functions
    *
@@ -1755,6 +8967,197 @@ public:
     return this->modifierFunctions;
   }
 
+  /**
+   * Returns the names of the modifiers used by the input grammar that have no modifier function. These modifiers are
+   * skipped when expanding rules.
+   *
+   * @return the names of the unknown modifiers, in alphabetical order
+   */
+  std::vector<std::string> getUnknownModifiers() const {
+    std::vector<std::string> unknown;
+    for (auto& [id, name] : this->compiledGrammar->getModifierNames()) {
+      if (this->modifierFunctions.get(id) == nullptr) unknown.push_back(name);
+    }
+    std::sort(unknown.begin(), unknown.end());
+    return unknown;
+  }
+
+  /**
+   * Sets how trees created by this grammar allocate their nodes
+   *
+   * @param storage the node storage to use for new trees
+   */
+  void setNodeStorage(NodeStorage storage) {
+    this->nodeStorage = storage;
+    this->expander.reset();
+  }
+
+  /**
+   * Sets the limits on the size of each expansion by this grammar, its trees and generators
+   *
+   * @param limits the expansion limits
+   */
+  void setExpansionLimits(const ExpansionLimits& limits) {
+    this->expansionLimits = limits;
+    this->expander.reset();
+  }
+
+  /**
+   * Creates an immutable snapshot of this grammar, with its current modifier functions, that can be shared between
+   * threads. Modifiers added to this grammar afterwards do not affect the snapshot.
+   *
+   * @return the grammar core
+   */
+  std::shared_ptr<const GrammarCore> share() const {
+    return std::make_shared<const GrammarCore>(this->compiledGrammar,
+                                               this->modifierFunctions,
+                                               this->nodeStorage,
+                                               this->expansionLimits);
+  }
+
+  /**
+   * Creates a generator expanding from a snapshot of this grammar, see share(). Create one generator per thread.
+   *
+   * @param _rng the random number generator for the generator to use
+   * @return the generator
+   */
+  Generator<RNG, UniformIntDistributionT> getGenerator(RNG _rng) const {
+    return Generator<RNG, UniformIntDistributionT>(this->share(), std::move(_rng));
+  }
+
+  /**
+   * Creates a generator expanding from a snapshot of this grammar, see share(), with a random number generator split
+   * off this grammar's by tracerz::details::splitRNG. With tracerz::Xoshiro256StarStar, the generators of successive
+   * calls, and this grammar, draw from non-overlapping streams. Create one generator per thread.
+   *
+   * @return the generator
+   */
+  Generator<RNG, UniformIntDistributionT> getGenerator() {
+    return Generator<RNG, UniformIntDistributionT>(this->share(), details::splitRNG(this->rng));
+  }
+
+  /**
+   * Expands the given input string once for each string in the range `[first, last)`, in parallel, writing sample `i`
+   * to `first[i]`. The samples are split into fixed blocks of tracerz::details::batchBlockSize, and the samples of
+   * block `b` are expanded one after another with a random number generator created by tracerz::details::makeBatchRNG
+   * from `seed` and `b`, so the output only depends on the seed, never on the number of threads. Each worker thread
+   * expands its blocks with one tracerz::Generator, reusing its scratch buffers between samples. This grammar's own
+   * random number generator is not used.
+   *
+   * @tparam RandomAccessIt the type of the random access iterators of the output range
+   * @param input the input string to expand
+   * @param first the beginning of the output range
+   * @param last the end of the output range
+   * @param seed the seed of the batch
+   * @param numThreads the number of worker threads, or 0 to use one per hardware thread
+   */
+  template<typename RandomAccessIt, typename = std::enable_if_t<!std::is_integral_v<RandomAccessIt>>>
+  void generateBatch(const std::string& input,
+                     RandomAccessIt first,
+                     RandomAccessIt last,
+                     std::uint64_t seed,
+                     unsigned numThreads = 0) const {
+    std::size_t count = static_cast<std::size_t>(last - first);
+    std::size_t numBlocks = (count + details::batchBlockSize - 1) / details::batchBlockSize;
+    if (numThreads == 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+    numThreads = static_cast<unsigned>(std::min<std::size_t>(numThreads, numBlocks));
+
+    auto core = this->share();
+    std::atomic<std::size_t> nextBlock(0);
+    std::vector<std::exception_ptr> errors(numThreads);
+
+    // Each worker takes the next block until there are none left
+    auto work = [&](unsigned worker) {
+      try {
+        RNG blockRNG = details::makeBatchRNG<RNG>(seed, 0);
+        std::size_t rngBlock = 0;
+        Generator<RNG, UniformIntDistributionT> generator(core, blockRNG);
+        for (std::size_t block = nextBlock++; block < numBlocks; block = nextBlock++) {
+          details::advanceBatchRNG(blockRNG, seed, rngBlock, block);
+          rngBlock = block;
+          generator.getRNG() = blockRNG;
+          std::size_t end = std::min(count, (block + 1) * details::batchBlockSize);
+          for (std::size_t i = block * details::batchBlockSize; i < end; i++) {
+            std::string& output = first[i];
+            output.clear();
+            generator.generate(input, output);
+          }
+        }
+      } catch (...) {
+        errors[worker] = std::current_exception();
+        nextBlock = numBlocks;
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned worker = 1; worker < numThreads; worker++) {
+      threads.emplace_back(work, worker);
+    }
+    if (numThreads > 0) work(0);
+    for (auto& thread : threads) thread.join();
+
+    for (auto& error : errors) {
+      if (error) std::rethrow_exception(error);
+    }
+  }
+
+  /**
+   * Expands the given input string `count` times in parallel. See the overload filling an output range.
+   *
+   * @param input the input string to expand
+   * @param count the number of samples
+   * @param seed the seed of the batch
+   * @param numThreads the number of worker threads, or 0 to use one per hardware thread
+   * @return the samples
+   */
+  std::vector<std::string> generateBatch(const std::string& input,
+                                         std::size_t count,
+                                         std::uint64_t seed,
+                                         unsigned numThreads = 0) const {
+    std::vector<std::string> samples(count);
+    this->generateBatch(input, samples.begin(), samples.end(), seed, numThreads);
+    return samples;
+  }
+
+  /**
+   * Expands the given input string into up to `count` samples that picked different alternatives, with a generator
+   * split off this grammar's random number generator, see getGenerator() and tracerz::Generator::generateUnique
+   *
+   * @param input the input string to expand
+   * @param count the number of samples
+   * @param maxDuplicates the number of duplicates in a row after which sampling stops
+   * @return the samples, fewer than `count` if the input ran out of expansions
+   */
+  std::vector<std::string> generateUnique(const std::string& input,
+                                          std::size_t count,
+                                          std::size_t maxDuplicates = 1000) {
+    return this->getGenerator().generateUnique(input, count, maxDuplicates);
+  }
+
+  /**
+   * Counts the distinct expansions of the given input string, see tracerz::CompiledGrammar::countExpansions
+   *
+   * @param input the input string
+   * @return the number of expansions, `UINT64_MAX` if there are at least as many or the input can recurse, or 0 if
+   *         the input can reach an action
+   */
+  std::uint64_t countExpansions(const std::string& input) const {
+    return this->compiledGrammar->countExpansions(input);
+  }
+
+  /**
+   * Creates an enumerator of the distinct expansions of the given input string, expanding from a snapshot of this
+   * grammar, see share() and tracerz::Enumerator
+   *
+   * @param input the input string to expand
+   * @return the enumerator
+   * @throws std::invalid_argument if an action can be reached from the input
+   * @throws std::length_error if the input can recurse, or has `UINT64_MAX` or more expansions
+   */
+  Enumerator getEnumerator(const std::string& input) const {
+    return Enumerator(this->share(), input);
+  }
+
   /**
    * Gets this grammar's random number generator
    *
@@ -1764,6 +9167,24 @@ public:
     return this->rng;
   }
 
+  /**
+   * Gets the instrumentation recording the samples generated by this grammar
+   *
+   * @return the instrumentation
+   */
+  Instrumentation& getInstrumentation() {
+    return this->instrumentation;
+  }
+
+  /**
+   * Gets the instrumentation recording the samples generated by this grammar
+   *
+   * @return the instrumentation
+   */
+  const Instrumentation& getInstrumentation() const {
+    return this->instrumentation;
+  }
+
   /**
    * Flattens the given input string into a single output string using this grammar.
    *
@@ -1771,22 +9192,88 @@ public:
    * @return the flattened output string
    */
   std::string flatten(const std::string& input) {
-    // Get a tree rooted with the given input string
-    auto tree = this->getExpandedTree(input);
+    return this->generate(input);
+  }
+
+  /**
+   * Expands the given input string using this grammar, appending the output straight to the given sink. A sink is any
+   * object with an `append(std::string_view)` member function, such as std::string.
+   *
+   * No tree is built unless a tree or tree node modifier can be reached from the input, in which case the input is
+   * expanded into a tree and flattened, as with getExpandedTree. Either way, the output is the same for a given seed.
+   *
+   * The grammar keeps one expander between calls, along with the last input compiled, the output of deterministic
+   * rules, and the scratch buffers, as a tracerz::Generator does. It is rebuilt once the modifiers, node storage or
+   * expansion limits change.
+   *
+   * @tparam Sink the type of the sink
+   * @param input the input string to expand
+   * @param sink the sink to append the output to
+   */
+  template<typename Sink>
+  void generate(const std::string& input, Sink& sink) {
+    this->getExpander().generate(input, sink, this->nodeStorage);
+  }
 
-    // Flatten the tree using this grammar's modifier functions
-    return tree->flatten(this->getModifierFunctions());
+  /**
+   * Expands the given input string into a single output string using this grammar, without building a tree unless a
+   * tree or tree node modifier needs one.
+   *
+   * @param input the input string to expand
+   * @return the output string
+   */
+  std::string generate(const std::string& input) {
+    std::string output;
+    this->generate(input, output);
+    return output;
   }
 
 private:
-  /** The input json grammar */
-  nlohmann::json jsonGrammar;
+  /** The type of the expander used by generate() */
+  typedef details::StreamingExpander<RNG, UniformIntDistributionT, Instrumentation> expander_t;
+
+  /**
+   * Gets the expander used by generate(), creating it if there is none, or if the modifier functions may have been
+   * changed through getModifierFunctions() since it was created
+   *
+   * @return the expander
+   */
+  expander_t& getExpander() {
+    const std::size_t revision = this->modifierFunctions.getRevision();
+    if (this->expander.get() == nullptr || this->expanderRevision != revision) {
+      this->expander.emplace(this->compiledGrammar,
+                             this->modifierFunctions,
+                             this->rng,
+                             this->expansionLimits,
+                             &this->instrumentation);
+      this->expanderRevision = revision;
+    }
+    return *this->expander.get();
+  }
+
+  /** The input grammar, compiled */
+  std::shared_ptr<const CompiledGrammar> compiledGrammar;
 
   /** The random number generator */
   RNG rng;
 
   /** The map from modifier names to modifier functions */
   details::callback_map_t modifierFunctions;
+
+  /** The expander used by generate(), kept between calls */
+  details::OwnerBound<expander_t> expander;
+
+  /** The revision of the modifier functions the expander was created with */
+  std::size_t expanderRevision = 0;
+
+  /** How trees created by this grammar allocate their nodes */
+  NodeStorage nodeStorage;
+
+  /** The limits on the size of each expansion */
+  ExpansionLimits expansionLimits;
+
+  /** Records the samples generated by this grammar */
+  Instrumentation instrumentation;
 };
 
 } // End namespace tracerz